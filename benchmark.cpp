@@ -0,0 +1,308 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "protoraw.hpp"
+
+// /////////////////////////////////////////////////////////////////// //
+// deterministic corpus generators
+
+namespace corpus {
+
+// xorshift64: same sequence on every platform and run
+class Random {
+public:
+    explicit Random(uint64_t seed = 0x9e3779b97f4a7c15ULL) : mState(seed) {}
+    uint64_t next() {
+        mState ^= mState << 13;
+        mState ^= mState >> 7;
+        mState ^= mState << 17;
+        return mState;
+    }
+    unsigned below(unsigned n) {
+        return static_cast<unsigned>(next() % n);
+    }
+private:
+    uint64_t mState;
+};
+
+// minimal protobuf encoder counting written fields
+class Writer {
+public:
+    Writer() : mFields(0) {}
+
+    void varint(unsigned idx, uint64_t value) {
+        tag(idx, 0);
+        raw(value);
+        ++mFields;
+    }
+    void fixed32(unsigned idx, uint32_t value) {
+        tag(idx, 5);
+        for (int i = 0; i < 4; ++i) mData.push_back((value >> (8 * i)) & 0xff);
+        ++mFields;
+    }
+    void bytes(unsigned idx, const std::string & value) {
+        tag(idx, 2);
+        raw(value.size());
+        mData.insert(mData.end(), value.begin(), value.end());
+        ++mFields;
+    }
+    void message(unsigned idx, const Writer & sub) {
+        tag(idx, 2);
+        raw(sub.mData.size());
+        mData.insert(mData.end(), sub.mData.begin(), sub.mData.end());
+        mFields += sub.mFields + 1;
+    }
+    void packed(unsigned idx, const std::vector<uint64_t> & values) {
+        Writer sub;
+        for (size_t i = 0; i < values.size(); ++i) sub.raw(values[i]);
+        tag(idx, 2);
+        raw(sub.mData.size());
+        mData.insert(mData.end(), sub.mData.begin(), sub.mData.end());
+        mFields += values.size();
+    }
+
+    const std::vector<unsigned char> & data() const { return mData; }
+    size_t fields() const { return mFields; }
+
+private:
+    void tag(unsigned idx, int type) {
+        raw((static_cast<uint64_t>(idx) << 3) | type);
+    }
+    void raw(uint64_t value) {
+        unsigned char buffer[10];
+        unsigned char * e = RawMessage::writeVarint(value, buffer, buffer + sizeof(buffer));
+        mData.insert(mData.end(), buffer, e);
+    }
+
+    std::vector<unsigned char> mData;
+    size_t mFields;
+};
+
+// tests/addressbook.proto: AddressBook with n persons
+inline Writer addressBook(unsigned persons) {
+    Random rnd;
+    Writer book;
+    for (unsigned i = 0; i < persons; ++i) {
+        Writer person, phone;
+        std::stringstream name, email;
+        name << "Person Number" << i;
+        email << "person" << rnd.below(100000) << "@example.com";
+        person.bytes(1, name.str());
+        person.varint(2, rnd.below(1 << 20));
+        person.bytes(3, email.str());
+        phone.bytes(1, "555-4321");
+        phone.varint(2, rnd.below(3));
+        person.message(4, phone);
+        book.message(1, person);
+    }
+    return book;
+}
+
+// submessages nested in field 1 up to given depth
+inline Writer deep(unsigned depth) {
+    Writer inner;
+    inner.varint(2, 42);
+    for (unsigned i = 0; i < depth; ++i) {
+        Writer outer;
+        outer.message(1, inner);
+        outer.varint(2, i);
+        inner = outer;
+    }
+    return inner;
+}
+
+// single message with many distinct fields
+inline Writer wide(unsigned fields) {
+    Random rnd;
+    Writer msg;
+    for (unsigned i = 1; i <= fields; ++i) {
+        switch (i % 3) {
+        case 0:  msg.varint(i, rnd.next() >> 20); break;
+        case 1:  msg.fixed32(i, static_cast<uint32_t>(rnd.next())); break;
+        default: msg.bytes(i, "value"); break;
+        }
+    }
+    return msg;
+}
+
+// tests/repeated.proto: RepeatedPacked with n values
+inline Writer packed(unsigned count) {
+    Random rnd;
+    std::vector<uint64_t> values(count);
+    for (unsigned i = 0; i < count; ++i) values[i] = rnd.next() >> (rnd.below(60) + 1);
+    Writer msg;
+    msg.packed(4, values);
+    return msg;
+}
+
+// a few huge printable strings
+inline Writer hugeStrings(unsigned count, unsigned length) {
+    Writer msg;
+    std::string value(length, ' ');
+    for (unsigned i = 0; i < length; ++i) value[i] = 'a' + i % 26;
+    for (unsigned i = 0; i < count; ++i) msg.bytes(1, value);
+    return msg;
+}
+
+// serialized FileDescriptorProto of tests/addressbook.proto
+inline std::string addressBookDescriptor() {
+    static const char data[] = "\n\x11\x61\x64\x64ressbook.proto\x12\x08tutorial\"\xda\x01\n\x06Person\x12\x0c\n\x04name\x18\x01 \x02(\t\x12\n\n\x02id\x18\x02 \x02(\x05\x12\r\n\x05\x65mail\x18\x03 \x01(\t\x12+\n\x05phone\x18\x04 \x03(\x0b\x32\x1c.tutorial.Person.PhoneNumber\x1aM\n\x0bPhoneNumber\x12\x0e\n\x06number\x18\x01 \x02(\t\x12.\n\x04type\x18\x02 \x01(\x0e\x32\x1a.tutorial.Person.PhoneType:\x04HOME\"+\n\tPhoneType\x12\n\n\x06MOBILE\x10\x00\x12\x08\n\x04HOME\x10\x01\x12\x08\n\x04WORK\x10\x02\"/\n\x0b\x41\x64\x64ressBook\x12 \n\x06person\x18\x01 \x03(\x0b\x32\x10.tutorial.Person";
+    return std::string(data, sizeof(data) - 1);
+}
+
+// random binary of given size with n descriptors at known offsets
+inline std::vector<unsigned char> binary(size_t size, unsigned descriptors, std::vector<size_t> * offsets = NULL) {
+    Random rnd;
+    std::vector<unsigned char> data(size);
+    for (size_t i = 0; i < size; ++i) data[i] = static_cast<unsigned char>(rnd.next());
+    const std::string descriptor = addressBookDescriptor();
+    const size_t step = size / (descriptors + 1);
+    for (unsigned i = 1; i <= descriptors; ++i) {
+        const size_t offset = i * step;
+        data[offset - 1] = 0;
+        std::copy(descriptor.begin(), descriptor.end(), data.begin() + offset);
+        data[offset + descriptor.size()] = 0;
+        if (offsets) offsets->push_back(offset);
+    }
+    data.push_back(0);
+    data.push_back(0);
+    return data;
+}
+
+} // namespace corpus
+
+// /////////////////////////////////////////////////////////////////// //
+
+static void setRates(benchmark::State & state, size_t bytes, size_t fields) {
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * bytes));
+    if (!fields) return;
+    state.counters["fields/s"] = benchmark::Counter(
+        static_cast<double>(state.iterations() * fields), benchmark::Counter::kIsRate);
+}
+
+static void BM_findSerializedPB(benchmark::State & state) {
+    const std::vector<unsigned char> data = corpus::binary(state.range(0) << 20, state.range(1));
+    size_t found = 0;
+    for (auto _ : state) {
+        const unsigned char * ptr = data.data(), * end = data.data() + data.size(), * ept = end;
+        for (found = 0; ptr < ept; ptr = ept + 1, ept = end) {
+            ptr = Serialized_pb::findSerializedPB(ptr, ept);
+            if (!ptr) break;
+            ++found;
+        }
+        benchmark::DoNotOptimize(found);
+    }
+    state.counters["found"] = found;
+    setRates(state, data.size(), 0);
+}
+BENCHMARK(BM_findSerializedPB)->Args({4, 16})->Args({16, 256})->Unit(benchmark::kMillisecond);
+
+static void runParse(benchmark::State & state, const corpus::Writer & msg) {
+    const std::vector<unsigned char> & data = msg.data();
+    RawMessage raw;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(raw.parse(data.data(), data.data() + data.size()));
+    }
+    setRates(state, data.size(), msg.fields());
+}
+
+static void BM_ParseAddressBook(benchmark::State & state) {
+    runParse(state, corpus::addressBook(state.range(0)));
+}
+BENCHMARK(BM_ParseAddressBook)->Arg(100)->Arg(10000);
+
+// same with byte ranges of every field recorded
+static void BM_ParseWithOffsets(benchmark::State & state) {
+    const corpus::Writer msg = corpus::addressBook(state.range(0));
+    OffsetIndex index;
+    for (auto _ : state) {
+        RawMessage raw;
+        raw.parse(msg.data().data(), msg.data().data() + msg.data().size(), &index);
+        benchmark::DoNotOptimize(index);
+    }
+    setRates(state, msg.data().size(), msg.fields());
+}
+BENCHMARK(BM_ParseWithOffsets)->Arg(100)->Arg(10000);
+
+static void BM_ParseDeep(benchmark::State & state) {
+    runParse(state, corpus::deep(state.range(0)));
+}
+BENCHMARK(BM_ParseDeep)->Arg(16)->Arg(256);
+
+static void BM_ParseWide(benchmark::State & state) {
+    runParse(state, corpus::wide(state.range(0)));
+}
+BENCHMARK(BM_ParseWide)->Arg(1000)->Arg(100000);
+
+static void BM_ParsePacked(benchmark::State & state) {
+    runParse(state, corpus::packed(state.range(0)));
+}
+BENCHMARK(BM_ParsePacked)->Arg(1000)->Arg(1000000);
+
+static void BM_ParseHugeStrings(benchmark::State & state) {
+    runParse(state, corpus::hugeStrings(4, state.range(0)));
+}
+BENCHMARK(BM_ParseHugeStrings)->Arg(1 << 16)->Arg(1 << 24);
+
+static void BM_SchemaPrint(benchmark::State & state) {
+    const corpus::Writer msg = corpus::addressBook(state.range(0));
+    RawMessage raw;
+    raw.parse(msg.data().data(), msg.data().data() + msg.data().size());
+    for (auto _ : state) {
+        std::stringstream ss;
+        Schema::print(raw, ss);
+        benchmark::DoNotOptimize(ss);
+    }
+    setRates(state, msg.data().size(), msg.fields());
+}
+BENCHMARK(BM_SchemaPrint)->Arg(100)->Arg(10000);
+
+static void BM_PrintMessage(benchmark::State & state) {
+    const corpus::Writer msg = corpus::addressBook(state.range(0));
+    RawMessage raw;
+    raw.parse(msg.data().data(), msg.data().data() + msg.data().size());
+    for (auto _ : state) {
+        std::stringstream ss;
+        raw.print(ss);
+        benchmark::DoNotOptimize(ss);
+    }
+    setRates(state, msg.data().size(), msg.fields());
+}
+BENCHMARK(BM_PrintMessage)->Arg(100)->Arg(10000);
+
+static void BM_DecodeWithTables(benchmark::State & state) {
+    const corpus::Writer msg = corpus::addressBook(state.range(0));
+    const std::string descriptor = corpus::addressBookDescriptor();
+    RawMessage raw;
+    raw.parse((const unsigned char *) descriptor.data(), (const unsigned char *) descriptor.data() + descriptor.size());
+    DescriptorTables tables;
+    tables.loadSerialized(raw);
+    tables.compile();
+    const int type = tables.findMessage("AddressBook");
+    for (auto _ : state) {
+        std::stringstream ss;
+        tables.decode(type, msg.data().data(), msg.data().data() + msg.data().size(), ss);
+        benchmark::DoNotOptimize(ss);
+    }
+    setRates(state, msg.data().size(), msg.fields());
+}
+BENCHMARK(BM_DecodeWithTables)->Arg(100)->Arg(10000);
+
+// two fields of every person instead of the full parse
+static void BM_SelectFields(benchmark::State & state) {
+    const corpus::Writer msg = corpus::addressBook(state.range(0));
+    FieldSelector selector;
+    selector.add("1.2");
+    selector.add("1.4.2");
+    for (auto _ : state) {
+        std::stringstream ss;
+        selector.select(msg.data().data(), msg.data().data() + msg.data().size(), ss);
+        benchmark::DoNotOptimize(ss);
+    }
+    setRates(state, msg.data().size(), msg.fields());
+}
+BENCHMARK(BM_SelectFields)->Arg(100)->Arg(10000);
+
+BENCHMARK_MAIN();
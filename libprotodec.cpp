@@ -0,0 +1,220 @@
+// ///////////////////////////////////////////////////////////////////////// //
+//                                                                           //
+//   Copyright (C) 2014-2018 by Oleg Polivets                                //
+//   jsbot@ya.ru                                                             //
+//                                                                           //
+//   This program is free software; you can redistribute it and/or modify    //
+//   it under the terms of the GNU General Public License as published by    //
+//   the Free Software Foundation; either version 2 of the License, or       //
+//   (at your option) any later version.                                     //
+//                                                                           //
+//   This program is distributed in the hope that it will be useful,         //
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of          //
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           //
+//   GNU General Public License for more details.                            //
+//                                                                           //
+// ///////////////////////////////////////////////////////////////////////// //
+
+#include <sstream>
+#include <string>
+
+#include "protodec.h"
+#include "protoraw.hpp"
+#include "version.h"
+
+// parser state kept between calls
+struct protodec_context {
+    RawMessage message;
+    DescriptorTables tables;
+    std::ostringstream text;
+    std::string error;
+};
+
+namespace {
+
+protodec_status fail(protodec_context * ctx, protodec_status status, const std::string & error) {
+    ctx->error = error;
+    return status;
+}
+
+// copy rendered text of the context to caller buffer
+protodec_status output(protodec_context * ctx, char * out, size_t out_size, size_t * out_len) {
+    const std::string text = ctx->text.str();
+    ctx->text.str(std::string());
+    if (out_len) {
+        *out_len = text.length();
+    }
+    if (!out || out_size <= text.length()) {
+        return fail(ctx, PROTODEC_ERROR_BUFFER_TOO_SMALL, "output buffer is too small");
+    }
+    memcpy(out, text.data(), text.length());
+    out[text.length()] = '\0';
+    return PROTODEC_OK;
+}
+
+bool parse(protodec_context * ctx, const unsigned char * data, size_t size) {
+    if (!ctx->message.parse(data, data + size)) {
+        ctx->error = ctx->message.errorString();
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+extern "C" {
+
+const char * protodec_version(void) {
+    return _VERSION_;
+}
+
+protodec_context * protodec_context_new(void) {
+    try {
+        return new protodec_context();
+    } catch (...) {
+        return NULL;
+    }
+}
+
+void protodec_context_free(protodec_context * ctx) {
+    delete ctx;
+}
+
+const char * protodec_last_error(const protodec_context * ctx) {
+    return ctx ? ctx->error.c_str() : "";
+}
+
+protodec_status protodec_scan(
+    protodec_context * ctx,
+    const unsigned char * data, size_t size,
+    protodec_descriptor_cb callback, void * user,
+    size_t * found
+) {
+    if (!ctx || (!data && size)) {
+        return PROTODEC_ERROR_INVALID_ARGUMENT;
+    }
+    ctx->error.clear();
+    try {
+        const unsigned count = Serialized_pb::scan(data, data + size,
+            [&](const RawMessage & msg, const unsigned char * b, const unsigned char * e) {
+                return !callback || !callback(user, msg.view().getString(1).c_str(), b - data, b, e - b);
+            });
+        if (found) {
+            *found = count;
+        }
+        return PROTODEC_OK;
+    } catch (const std::exception & ex) {
+        return fail(ctx, PROTODEC_ERROR_PARSE, ex.what());
+    }
+}
+
+protodec_status protodec_print(
+    protodec_context * ctx,
+    const unsigned char * data, size_t size,
+    char * out, size_t out_size, size_t * out_len
+) {
+    if (!ctx || !data) {
+        return PROTODEC_ERROR_INVALID_ARGUMENT;
+    }
+    ctx->error.clear();
+    try {
+        if (!parse(ctx, data, size)) {
+            return PROTODEC_ERROR_PARSE;
+        }
+        ctx->message.print(ctx->text);
+        return output(ctx, out, out_size, out_len);
+    } catch (const std::exception & ex) {
+        return fail(ctx, PROTODEC_ERROR_PARSE, ex.what());
+    }
+}
+
+protodec_status protodec_schema(
+    protodec_context * ctx,
+    const unsigned char * data, size_t size,
+    char * out, size_t out_size, size_t * out_len
+) {
+    if (!ctx || !data) {
+        return PROTODEC_ERROR_INVALID_ARGUMENT;
+    }
+    ctx->error.clear();
+    try {
+        if (!parse(ctx, data, size)) {
+            return PROTODEC_ERROR_PARSE;
+        }
+        Schema::print(ctx->message, ctx->text);
+        return output(ctx, out, out_size, out_len);
+    } catch (const std::exception & ex) {
+        return fail(ctx, PROTODEC_ERROR_PARSE, ex.what());
+    }
+}
+
+protodec_status protodec_render_descriptor(
+    protodec_context * ctx,
+    const unsigned char * data, size_t size,
+    char * out, size_t out_size, size_t * out_len
+) {
+    if (!ctx || !data) {
+        return PROTODEC_ERROR_INVALID_ARGUMENT;
+    }
+    ctx->error.clear();
+    try {
+        if (!parse(ctx, data, size)) {
+            return PROTODEC_ERROR_PARSE;
+        }
+        Serialized_pb::printMessagesFromSerialized(ctx->message, ctx->text, true);
+        return output(ctx, out, out_size, out_len);
+    } catch (const std::exception & ex) {
+        return fail(ctx, PROTODEC_ERROR_PARSE, ex.what());
+    }
+}
+
+protodec_status protodec_load_descriptor(
+    protodec_context * ctx,
+    const unsigned char * data, size_t size
+) {
+    if (!ctx || !data) {
+        return PROTODEC_ERROR_INVALID_ARGUMENT;
+    }
+    ctx->error.clear();
+    try {
+        if (!parse(ctx, data, size)) {
+            return PROTODEC_ERROR_PARSE;
+        }
+        if (!ctx->tables.loadSerialized(ctx->message)) {
+            return fail(ctx, PROTODEC_ERROR_PARSE, ctx->tables.errorString());
+        }
+        return PROTODEC_OK;
+    } catch (const std::exception & ex) {
+        return fail(ctx, PROTODEC_ERROR_PARSE, ex.what());
+    }
+}
+
+protodec_status protodec_decode(
+    protodec_context * ctx,
+    const char * type_name,
+    const unsigned char * data, size_t size,
+    char * out, size_t out_size, size_t * out_len
+) {
+    if (!ctx || !type_name || !data) {
+        return PROTODEC_ERROR_INVALID_ARGUMENT;
+    }
+    ctx->error.clear();
+    try {
+        if (!ctx->tables.compile()) {
+            return fail(ctx, PROTODEC_ERROR_PARSE, ctx->tables.errorString());
+        }
+        const int type = ctx->tables.findMessage(type_name);
+        if (type < 0) {
+            return fail(ctx, PROTODEC_ERROR_NOT_FOUND, std::string("message type ") + type_name + " is not found");
+        }
+        if (!ctx->tables.decode(type, data, data + size, ctx->text)) {
+            ctx->text.str(std::string());
+            return fail(ctx, PROTODEC_ERROR_PARSE, ctx->tables.errorString());
+        }
+        return output(ctx, out, out_size, out_len);
+    } catch (const std::exception & ex) {
+        return fail(ctx, PROTODEC_ERROR_PARSE, ex.what());
+    }
+}
+
+} // extern "C"
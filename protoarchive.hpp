@@ -0,0 +1,785 @@
+// ///////////////////////////////////////////////////////////////////////// //
+//                                                                           //
+//   Copyright (C) 2014-2018 by Oleg Polivets                                //
+//   jsbot@ya.ru                                                             //
+//                                                                           //
+//   This program is free software; you can redistribute it and/or modify    //
+//   it under the terms of the GNU General Public License as published by    //
+//   the Free Software Foundation; either version 2 of the License, or       //
+//   (at your option) any later version.                                     //
+//                                                                           //
+//   This program is distributed in the hope that it will be useful,         //
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of          //
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           //
+//   GNU General Public License for more details.                            //
+//                                                                           //
+// ///////////////////////////////////////////////////////////////////////// //
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <climits>
+#include <zlib.h>
+
+#include "protoraw.hpp"
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Modified UTF-8 used by Java class and DEX files. Descriptors are stored
+// there as strings with one character per byte, so only characters up to
+// U+00FF can be turned back into bytes.
+class Mutf8 {
+public:
+    // false when data is malformed or has characters above U+00FF
+    static bool decodeBytes(
+        const unsigned char * p,
+        const unsigned char * e,
+        std::string & out
+    ) {
+        out.clear();
+        out.reserve(e - p);
+        while (p < e) {
+            // runs of ASCII are copied by 8 bytes
+            if (e - p >= 8) {
+                uint64_t word;
+                memcpy(&word, p, 8);
+                const uint64_t kHigh = 0x8080808080808080ull;
+                const uint64_t kLow  = 0x0101010101010101ull;
+                if (!(word & kHigh) && !((word - kLow) & ~word & kHigh)) {
+                    out.append((const char *) p, 8);
+                    p += 8;
+                    continue;
+                }
+            }
+            const unsigned char ch = *p++;
+            if (ch < 0x80) {
+                if (!ch) return false; // zero is always encoded by two bytes
+                out.push_back((char) ch);
+            } else if ((ch & 0xe0) == 0xc0) {
+                if (p >= e || (*p & 0xc0) != 0x80) return false;
+                const unsigned value = ((ch & 0x1f) << 6) | (*p++ & 0x3f);
+                if (value > 0xff) return false;
+                out.push_back((char) value);
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+}; // Mutf8
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Strings of a compiled Java class which may hold serialized descriptors.
+// protoc splits descriptor of generated class into several string
+// constants written one after another into the constant pool, so pieces
+// are joined back until they make up the longest valid descriptor.
+class JavaClass {
+public:
+    static bool isClass(const unsigned char * p, const unsigned char * e) {
+        return e - p >= 10 && p[0] == 0xca && p[1] == 0xfe && p[2] == 0xba && p[3] == 0xbe;
+    }
+
+    // descriptors each followed by '\0' to be found by Serialized_pb::scan()
+    static bool descriptorData(
+        const unsigned char * p,
+        const unsigned char * e,
+        std::vector<unsigned char> & out
+    ) {
+        std::vector<std::string> strings;
+        std::vector<bool> decoded;
+        if (!constantStrings(p, e, strings, decoded)) {
+            return false;
+        }
+        out.clear();
+        RawMessage msg;
+        for (size_t i = 0; i < strings.size(); ++i) {
+            if (!decoded[i] || strings[i].empty() || strings[i][0] != 0x0a) {
+                continue;
+            }
+            std::string data, best;
+            size_t last = i;
+            for (size_t j = i; j < strings.size() && j < i + kMaxPieces && decoded[j]; ++j) {
+                data += strings[j];
+                const unsigned char * b = (const unsigned char *) data.data();
+                if (msg.parse(b, b + data.size()) && Serialized_pb::isSerializedMessages(msg)) {
+                    best = data;
+                    last = j;
+                }
+            }
+            if (!best.empty()) {
+                out.insert(out.end(), best.begin(), best.end());
+                out.push_back('\0');
+                out.push_back('\0');
+                i = last;
+            }
+        }
+        return true;
+    }
+
+private:
+    enum {
+        kMaxPieces = 256
+    };
+
+    enum TAG {
+        tUtf8 = 1, tInteger = 3, tFloat = 4, tLong = 5, tDouble = 6,
+        tClass = 7, tString = 8, tFieldref = 9, tMethodref = 10,
+        tInterfaceMethodref = 11, tNameAndType = 12, tMethodHandle = 15,
+        tMethodType = 16, tDynamic = 17, tInvokeDynamic = 18,
+        tModule = 19, tPackage = 20
+    };
+
+    // Utf8 constants in pool order, decoded[i] if they are bytes
+    static bool constantStrings(
+        const unsigned char * p,
+        const unsigned char * e,
+        std::vector<std::string> & strings,
+        std::vector<bool> & decoded
+    ) {
+        if (!isClass(p, e)) {
+            return false;
+        }
+        const unsigned count = (p[8] << 8) | p[9];
+        p += 10;
+        for (unsigned i = 1; i < count; ++i) {
+            if (p >= e) return false;
+            size_t size;
+            switch (*p++) {
+            case tUtf8: {
+                if (e - p < 2) return false;
+                const size_t length = (p[0] << 8) | p[1];
+                p += 2;
+                if ((size_t) (e - p) < length) return false;
+                strings.push_back(std::string());
+                decoded.push_back(Mutf8::decodeBytes(p, p + length, strings.back()));
+                size = length;
+                break;
+            }
+            case tClass: case tString: case tMethodType: case tModule: case tPackage:
+                size = 2;
+                break;
+            case tMethodHandle:
+                size = 3;
+                break;
+            case tInteger: case tFloat: case tFieldref: case tMethodref:
+            case tInterfaceMethodref: case tNameAndType: case tDynamic: case tInvokeDynamic:
+                size = 4;
+                break;
+            case tLong: case tDouble:
+                size = 8;
+                ++i; // takes two entries
+                break;
+            default:
+                return false;
+            }
+            if ((size_t) (e - p) < size) return false;
+            p += size;
+        }
+        return true;
+    }
+}; // JavaClass
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Strings of Android DEX file which may hold serialized descriptors. Only
+// string_ids are walked: strings starting with descriptor filename field
+// are decoded from modified UTF-8. The pool is sorted, so when protoc
+// split a large descriptor into parts, the following parts are picked by
+// how far they let the descriptor be read.
+class DexFile {
+public:
+    static bool isDex(const unsigned char * p, const unsigned char * e) {
+        return e - p >= 0x70 && !memcmp(p, "dex\n", 4) && !p[7];
+    }
+
+    // descriptors each followed by '\0' to be found by Serialized_pb::scan()
+    static bool descriptorData(
+        const unsigned char * p,
+        const unsigned char * e,
+        std::vector<unsigned char> & out
+    ) {
+        if (!isDex(p, e)) {
+            return false;
+        }
+        const uint32_t count = get32(p + 56);
+        const uint32_t offset = get32(p + 60);
+        if (offset > (size_t) (e - p) || count > (size_t) (e - p - offset) / 4) {
+            return false;
+        }
+
+        // first parts of descriptors and other strings as possible
+        // continuations, decoded only if some descriptor has several parts
+        std::vector<std::string> heads;
+        std::vector< std::pair<const unsigned char *, const unsigned char *> > others;
+        std::string str;
+        for (uint32_t i = 0; i < count; ++i) {
+            const uint32_t dataOffset = get32(p + offset + 4 * i);
+            if (dataOffset >= (size_t) (e - p)) {
+                continue;
+            }
+            const unsigned char * b = p + dataOffset;
+            int64_t length = 0;
+            b = RawMessage::readVarint(b, e, length);
+            if (b >= e || length < kMinLength) {
+                continue;
+            }
+            const unsigned char * end = b;
+            for (; end < e && *end; ++end);
+            if (!looksLikeHead(b, end)) {
+                others.push_back(std::make_pair(b, end));
+            } else if (Mutf8::decodeBytes(b, end, str) && (int64_t) str.length() == length) {
+                heads.push_back(str);
+            }
+        }
+
+        out.clear();
+        RawMessage msg;
+        std::vector<std::string> parts;
+        for (size_t i = 0; i < heads.size(); ++i) {
+            std::string data = heads[i];
+            if (data.length() % kPartSize == 0 && parts.empty()) {
+                for (size_t j = 0; j < others.size(); ++j) {
+                    if (Mutf8::decodeBytes(others[j].first, others[j].second, str)) {
+                        parts.push_back(str);
+                    }
+                }
+            }
+            const unsigned char * b = (const unsigned char *) data.data();
+            size_t size = readableSize(b, b + data.size());
+            while (data.length() % kPartSize == 0) {
+                size_t best = parts.size(), bestSize = size;
+                for (size_t j = 0; j < parts.size(); ++j) {
+                    const size_t next = readableSize(data, size, parts[j]);
+                    if (next > bestSize) {
+                        best = j;
+                        bestSize = next;
+                    }
+                }
+                if (best == parts.size()) {
+                    break;
+                }
+                data += parts[best];
+                size = bestSize;
+                parts.erase(parts.begin() + best);
+            }
+            b = (const unsigned char *) data.data();
+            if (msg.parse(b, b + data.size()) && Serialized_pb::isSerializedMessages(msg)) {
+                out.insert(out.end(), data.begin(), data.end());
+                out.push_back('\0');
+                out.push_back('\0');
+            }
+        }
+        return true;
+    }
+
+private:
+    enum {
+        kMinLength = 8,
+        // bytes in every string of descriptorData but the last one (protoc)
+        kPartSize = 40 * 400,
+        // key and length varints
+        kMaxHeader = 20
+    };
+
+    // 0a:VARINT:filename where filename is ASCII; values below 0x80 are
+    // stored by MUTF-8 as they are, so raw bytes are checked
+    static bool looksLikeHead(const unsigned char * p, const unsigned char * e) {
+        if (e - p < 3 || p[0] != 0x0a || p[1] == 0 || p[1] >= 0x80) {
+            return false;
+        }
+        return e - p > 2 + p[1] && RawMessage::itsAsciiString(p + 2, p + 2 + p[1]);
+    }
+
+    // size of the top level field at p if it is complete within available
+    // bytes, its header being read from [p, e); 0 otherwise, so a varint
+    // cut by the end of a part is never taken as complete
+    static size_t fieldSize(const unsigned char * p, const unsigned char * e, size_t available) {
+        const unsigned char * b = p;
+        int64_t key = 0, value = 0;
+        bool ok = false;
+        p = RawMessage::readVarint(p, e, key, &ok);
+        if (!ok || p >= e) {
+            return 0;
+        }
+        switch (key & 7) {
+        case 0:
+        case 2:
+            ok = false;
+            p = RawMessage::readVarint(p, e, value, &ok);
+            value = (key & 7) == 2 ? value : 0;
+            break;
+        case 1: value = 8; break;
+        case 5: value = 4; break;
+        default: return 0;
+        }
+        const size_t header = p - b;
+        if (!ok || value < 0 || (uint64_t) value > available - header) {
+            return 0;
+        }
+        return header + value;
+    }
+
+    // length of data made of complete top level fields
+    static size_t readableSize(const unsigned char * b, const unsigned char * e) {
+        const unsigned char * p = b;
+        for (size_t n; p < e && (n = fieldSize(p, e, e - p)) != 0; p += n);
+        return p - b;
+    }
+
+    // readableSize() of data + part where data is readable up to size:
+    // only the field cut by the end of data is read across the join
+    static size_t readableSize(const std::string & data, size_t size, const std::string & part) {
+        const size_t rest = data.size() - size;
+        std::string header = data.substr(size, kMaxHeader);
+        header += part.substr(0, kMaxHeader - header.size());
+        const unsigned char * h = (const unsigned char *) header.data();
+        const size_t field = fieldSize(h, h + header.size(), rest + part.size());
+        if (field <= rest) {
+            return size;
+        }
+        const unsigned char * p = (const unsigned char *) part.data() + (field - rest);
+        return data.size() + (field - rest) + readableSize(p, (const unsigned char *) part.data() + part.size());
+    }
+
+    static uint32_t get32(const unsigned char * p) {
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+    }
+}; // DexFile
+
+// /////////////////////////////////////////////////////////////////// //
+
+// ZIP (APK, JAR) archive in memory. Entries are listed from the central
+// directory; stored ones are used in place, deflated ones are inflated
+// into a buffer reused by the caller, nothing is extracted to disk.
+class ZipArchive {
+public:
+    struct Entry {
+        std::string name;
+        unsigned method;
+        unsigned flags;
+        uint64_t compressedSize;
+        uint64_t size;
+        uint64_t offset; // of local header
+    };
+
+    // inflate state and output buffer reused for many entries
+    class Inflater {
+    public:
+        Inflater() : mReady(false), mEnded(false) {
+            memset(&mStream, 0, sizeof(mStream));
+        }
+        ~Inflater() {
+            if (mReady) inflateEnd(&mStream);
+        }
+
+        // inflate of [p, e) is started, output is taken by next()
+        bool start(const unsigned char * p, const unsigned char * e) {
+            if (!mReady) {
+                if (inflateInit2(&mStream, -MAX_WBITS) != Z_OK) return false;
+                mReady = true;
+            } else if (inflateReset(&mStream) != Z_OK) {
+                return false;
+            }
+            mStream.next_in = (Bytef *) p;
+            mStream.avail_in = (uInt) std::min<uint64_t>(e - p, UINT_MAX);
+            mEnded = false;
+            return true;
+        }
+
+        // append up to max bytes to out, false if data is corrupted or
+        // truncated
+        bool next(std::vector<unsigned char> & out, size_t max) {
+            size_t done = out.size();
+            out.resize(done + max);
+            while (!mEnded && done < out.size()) {
+                mStream.next_out = &out[done];
+                mStream.avail_out = (uInt) std::min<size_t>(out.size() - done, UINT_MAX);
+                const int rc = ::inflate(&mStream, Z_NO_FLUSH);
+                done = out.size() - mStream.avail_out;
+                if (rc == Z_STREAM_END) {
+                    mEnded = true;
+                } else if ((rc != Z_OK && rc != Z_BUF_ERROR) || mStream.avail_out) {
+                    out.resize(done);
+                    return false; // input is corrupted or truncated
+                }
+            }
+            out.resize(done);
+            return true;
+        }
+
+        bool ended() const {
+            return mEnded;
+        }
+
+        // whole data followed by two zero bytes; size of central directory
+        // is a hint only, so the buffer grows as data comes. Output over
+        // budget of Limits is cut and the entry is scanned partially
+        bool inflate(const unsigned char * p, const unsigned char * e, uint64_t size, std::vector<unsigned char> & out) {
+            out.clear();
+            if (!start(p, e)) {
+                return false;
+            }
+            const uint64_t maxBytes = Limits::budget().bytes;
+            uint64_t step = std::min<uint64_t>(std::min<uint64_t>(size, (e - p) * 4), kMaxStep);
+            step = std::max<uint64_t>(step, kMinStep);
+            while (!mEnded) {
+                if (maxBytes && out.size() >= maxBytes) {
+                    Limits::exceed(Limits::lkBytes);
+                    break;
+                }
+                if (!next(out, maxBytes ? std::min<uint64_t>(step, maxBytes - out.size()) : step)) {
+                    return false;
+                }
+                step = std::min<uint64_t>(step * 2, kMaxStep);
+            }
+            out.push_back('\0');
+            out.push_back('\0');
+            return true;
+        }
+
+    private:
+        static const uint64_t kMinStep = 64 << 10;
+        static const uint64_t kMaxStep = 64 << 20;
+        z_stream mStream;
+        bool mReady;
+        bool mEnded;
+    }; // Inflater
+
+    static bool isArchive(const unsigned char * p, const unsigned char * e) {
+        return e - p >= 4 && get32(p) == kLocalHeader;
+    }
+
+    bool open(const unsigned char * p, const unsigned char * e) {
+        mBegin = p;
+        mEnd = e;
+        mEntries.clear();
+        mError.clear();
+
+        // end of central directory record is followed by comment up to 64K
+        const unsigned char * eocd = NULL;
+        for (const unsigned char * q = e - 22; e - p >= 22 && q >= p && e - q <= 22 + 0xffff; --q) {
+            if (get32(q) == kEndOfDirectory) {
+                eocd = q;
+                break;
+            }
+        }
+        if (!eocd) {
+            mError = "end of central directory is not found";
+            return false;
+        }
+        uint64_t entries = get16(eocd + 10);
+        uint64_t offset = get32(eocd + 16);
+        if (eocd - p >= 20 && get32(eocd - 20) == kZip64Locator) {
+            const uint64_t record = get64(eocd - 20 + 8);
+            if (e - p < 56 || record > (uint64_t) (e - p) - 56 || get32(p + record) != kZip64EndOfDirectory) {
+                mError = "bad zip64 end of central directory";
+                return false;
+            }
+            entries = get64(p + record + 32);
+            offset = get64(p + record + 48);
+        }
+
+        const unsigned char * q = p + std::min<uint64_t>(offset, e - p);
+        for (uint64_t i = 0; i < entries; ++i) {
+            if (e - q < 46 || get32(q) != kDirectoryHeader) {
+                mError = "central directory is corrupted";
+                return false;
+            }
+            Entry entry;
+            entry.flags = get16(q + 8);
+            entry.method = get16(q + 10);
+            entry.compressedSize = get32(q + 20);
+            entry.size = get32(q + 24);
+            entry.offset = get32(q + 42);
+            const unsigned nameLength = get16(q + 28);
+            const unsigned extraLength = get16(q + 30);
+            const unsigned commentLength = get16(q + 32);
+            if ((size_t) (e - q) < 46u + nameLength + extraLength + commentLength) {
+                mError = "central directory is corrupted";
+                return false;
+            }
+            entry.name.assign((const char *) q + 46, nameLength);
+            readZip64(q + 46 + nameLength, q + 46 + nameLength + extraLength, entry);
+            mEntries.push_back(entry);
+            q += 46 + nameLength + extraLength + commentLength;
+        }
+        return true;
+    }
+
+    const std::vector<Entry> & entries() const {
+        return mEntries;
+    }
+
+    // [b, e) is entry data followed by two zero bytes; stored entries are
+    // used in place when they are followed by zeros already
+    bool read(const Entry & entry, Inflater & inflater, std::vector<unsigned char> & buffer,
+              const unsigned char *& b, const unsigned char *& e) const {
+        const unsigned char * data, * end;
+        if (!compressed(entry, data, end)) {
+            return false;
+        }
+        if (entry.method == kStored) {
+            if (mEnd - end >= 2 && !end[0] && !end[1]) {
+                b = data;
+                e = end + 2;
+                return true;
+            }
+            buffer.assign(data, end);
+            buffer.push_back('\0');
+            buffer.push_back('\0');
+        } else if (entry.method == kDeflated) {
+            if (!inflater.inflate(data, end, entry.size, buffer)) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+        b = buffer.data();
+        e = b + buffer.size();
+        return true;
+    }
+
+    bool isDeflated(const Entry & entry) const {
+        return entry.method == kDeflated;
+    }
+
+    // deflated entry is passed to f(b, e, reported, last) window by window
+    // without inflating it whole: [b, e) is followed by two zero bytes and
+    // bytes after b + reported start the next window, so at most window +
+    // overlap bytes are in memory. Scanning stops when f returns false
+    template <class F>
+    bool readWindows(const Entry & entry, Inflater & inflater, std::vector<unsigned char> & buffer,
+                     size_t window, size_t overlap, F f) const {
+        const unsigned char * data, * end;
+        if (!isDeflated(entry) || !compressed(entry, data, end) || !inflater.start(data, end)) {
+            return false;
+        }
+        const uint64_t maxBytes = Limits::budget().bytes;
+        uint64_t total = 0;
+        buffer.clear();
+        for (;;) {
+            const size_t before = buffer.size();
+            if (!inflater.next(buffer, maxBytes ? std::min<uint64_t>(window, maxBytes - total) : window)) {
+                return false;
+            }
+            total += buffer.size() - before;
+            bool last = inflater.ended();
+            if (!last && maxBytes && total >= maxBytes) {
+                Limits::exceed(Limits::lkBytes);
+                last = true;
+            }
+            const size_t size = buffer.size();
+            const size_t reported = last || size <= overlap ? size : size - overlap;
+            buffer.push_back('\0');
+            buffer.push_back('\0');
+            if (!f((const unsigned char *) buffer.data(), (const unsigned char *) buffer.data() + buffer.size(), reported, last) || last) {
+                return true;
+            }
+            buffer.resize(size);
+            buffer.erase(buffer.begin(), buffer.begin() + reported);
+        }
+    }
+
+    const std::string & errorString() const {
+        return mError;
+    }
+
+private:
+    enum {
+        kStored   = 0,
+        kDeflated = 8
+    };
+    static const uint32_t kLocalHeader          = 0x04034b50;
+    static const uint32_t kDirectoryHeader      = 0x02014b50;
+    static const uint32_t kEndOfDirectory       = 0x06054b50;
+    static const uint32_t kZip64Locator         = 0x07064b50;
+    static const uint32_t kZip64EndOfDirectory  = 0x06064b50;
+
+    // [b, e) is data of entry as it's stored in the archive
+    bool compressed(const Entry & entry, const unsigned char *& b, const unsigned char *& e) const {
+        if (entry.flags & 1) {
+            return false; // encrypted
+        }
+        const uint64_t size = mEnd - mBegin;
+        if (size < 30 || entry.offset > size - 30) {
+            return false;
+        }
+        const unsigned char * header = mBegin + entry.offset;
+        if (get32(header) != kLocalHeader) {
+            return false;
+        }
+        const size_t skip = 30 + get16(header + 26) + get16(header + 28);
+        if (skip > (uint64_t) (mEnd - header) || entry.compressedSize > (uint64_t) (mEnd - header) - skip) {
+            return false;
+        }
+        b = header + skip;
+        e = b + entry.compressedSize;
+        return true;
+    }
+
+    // values stored as 0xffffffff are in zip64 extra field in this order
+    static void readZip64(const unsigned char * p, const unsigned char * e, Entry & entry) {
+        while (e - p >= 4) {
+            const unsigned id = get16(p), size = get16(p + 2);
+            p += 4;
+            if ((unsigned) (e - p) < size) return;
+            if (id == 1) {
+                const unsigned char * q = p, * end = p + size;
+                uint64_t * fields[] = { &entry.size, &entry.compressedSize, &entry.offset };
+                for (size_t i = 0; i < 3; ++i) {
+                    if (*fields[i] == 0xffffffff && end - q >= 8) {
+                        *fields[i] = get64(q);
+                        q += 8;
+                    }
+                }
+                return;
+            }
+            p += size;
+        }
+    }
+
+    static unsigned get16(const unsigned char * p) {
+        return p[0] | (p[1] << 8);
+    }
+    static uint32_t get32(const unsigned char * p) {
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+    }
+    static uint64_t get64(const unsigned char * p) {
+        return get32(p) | ((uint64_t) get32(p + 4) << 32);
+    }
+
+    const unsigned char * mBegin;
+    const unsigned char * mEnd;
+    std::vector<Entry> mEntries;
+    std::string mError;
+}; // ZipArchive
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Descriptors of every archive entry, scanned by a pool of threads. Found
+// descriptors are returned in the order of entries and attributed to
+// "archive!entry".
+class ArchiveScanner {
+public:
+    static bool collect(
+        const unsigned char * p,
+        const unsigned char * e,
+        const std::string & archiveName,
+        std::vector< Serialized_pb::Found > & found,
+        std::string & error,
+        unsigned threads = 0
+    ) {
+        ZipArchive archive;
+        if (!archive.open(p, e)) {
+            error = archive.errorString();
+            return false;
+        }
+        const std::vector<ZipArchive::Entry> & entries = archive.entries();
+        std::vector< std::vector< Serialized_pb::Found > > results(entries.size());
+        std::atomic<size_t> next(0);
+
+        const Limits::Request request = Limits::request();
+        auto work = [&]() {
+            Limits::Scope scope(request);
+            ZipArchive::Inflater inflater;
+            std::vector<unsigned char> buffer, strings;
+            for (size_t i; (i = next++) < entries.size(); ) {
+                const ZipArchive::Entry & entry = entries[i];
+                if (!entry.size) {
+                    continue;
+                }
+                const std::string origin = archiveName + "!" + entry.name;
+                if (archive.isDeflated(entry) && !isClassName(entry.name) &&
+                    scanWindows(archive, entry, inflater, buffer, strings, results[i], origin)) {
+                    continue;
+                }
+                const unsigned char * b, * end;
+                if (!archive.read(entry, inflater, buffer, b, end)) {
+                    continue;
+                }
+                if ((isClassName(entry.name) && JavaClass::descriptorData(b, end, strings)) ||
+                    DexFile::descriptorData(b, end, strings)) {
+                    Serialized_pb::collect(strings.data(), strings.data() + strings.size(), results[i], origin);
+                } else {
+                    Serialized_pb::collect(b, end, results[i], origin);
+                }
+            }
+        };
+
+        if (!threads) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        threads = (unsigned) std::min<size_t>(threads, entries.size());
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threads; ++i) {
+            workers.push_back(std::thread(work));
+        }
+        work();
+        for (size_t i = 0; i < workers.size(); ++i) {
+            workers[i].join();
+        }
+
+        for (size_t i = 0; i < results.size(); ++i) {
+            found.insert(found.end(), results[i].begin(), results[i].end());
+        }
+        return true;
+    }
+
+private:
+    static const size_t kWindow  = 8 << 20;
+    static const size_t kOverlap = 1 << 20;
+
+    // large deflated entries are scanned in windows of kWindow bytes, a
+    // descriptor starting in the last kOverlap bytes of a window is found
+    // in the next one. Returns false when entry should be read whole (dex)
+    static bool scanWindows(
+        const ZipArchive & archive,
+        const ZipArchive::Entry & entry,
+        ZipArchive::Inflater & inflater,
+        std::vector<unsigned char> & buffer,
+        std::vector<unsigned char> & strings,
+        std::vector< Serialized_pb::Found > & found,
+        const std::string & origin
+    ) {
+        bool first = true, whole = false;
+        size_t skip = 0;
+        archive.readWindows(entry, inflater, buffer, kWindow, kOverlap,
+            [&](const unsigned char * b, const unsigned char * e, size_t reported, bool last) {
+                if (first && DexFile::isDex(b, e - 2)) {
+                    if (!last) {
+                        whole = true;
+                        return false;
+                    }
+                    if (DexFile::descriptorData(b, e, strings)) {
+                        Serialized_pb::collect(strings.data(), strings.data() + strings.size(), found, origin);
+                        return false;
+                    }
+                }
+                first = false;
+                const unsigned char * next = b + reported;
+                const unsigned char * stop = next;
+                Serialized_pb::scan(b + std::min(skip, reported), e, [&](const RawMessage & msg, const unsigned char * mb, const unsigned char * me) {
+                    if (mb >= next) {
+                        return false;
+                    }
+                    found.push_back(Serialized_pb::Found());
+                    found.back().message = msg;
+                    found.back().data.assign(mb, me);
+                    found.back().origin = origin;
+                    stop = std::max(stop, me);
+                    return true;
+                });
+                skip = stop - next;
+                return true;
+            });
+        return !whole;
+    }
+
+    static bool isClassName(const std::string & name) {
+        return name.length() > 6 && !name.compare(name.length() - 6, 6, ".class");
+    }
+}; // ArchiveScanner
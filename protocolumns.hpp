@@ -0,0 +1,607 @@
+// ///////////////////////////////////////////////////////////////////////// //
+//                                                                           //
+//   Copyright (C) 2014-2018 by Oleg Polivets                                //
+//   jsbot@ya.ru                                                             //
+//                                                                           //
+//   This program is free software; you can redistribute it and/or modify    //
+//   it under the terms of the GNU General Public License as published by    //
+//   the Free Software Foundation; either version 2 of the License, or       //
+//   (at your option) any later version.                                     //
+//                                                                           //
+//   This program is distributed in the hope that it will be useful,         //
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of          //
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           //
+//   GNU General Public License for more details.                            //
+//                                                                           //
+// ///////////////////////////////////////////////////////////////////////// //
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <iomanip>
+#include <limits>
+#include <ostream>
+#include <algorithm>
+#include <cstring>
+
+#include "protoraw.hpp"
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Records to export: messages of a length delimited stream (as written
+// by writeDelimitedTo) or elements of repeated field at a field number
+// path inside a single message.
+class RecordReader {
+public:
+    typedef std::pair<const unsigned char *, const unsigned char *> Record;
+
+    // f(record) for every record, false when data is malformed
+    template <class F>
+    static bool delimited(const unsigned char * p, const unsigned char * e, F f) {
+        while (p < e) {
+            int64_t size = 0;
+            bool ok = false;
+            p = RawMessage::readVarint(p, e, size, &ok);
+            if (!ok || size < 0 || size > e - p) {
+                return false;
+            }
+            f(Record(p, p + size));
+            p += size;
+        }
+        return true;
+    }
+
+    template <class F>
+    static bool repeated(const unsigned char * p, const unsigned char * e, const std::vector<unsigned> & path, F f) {
+        if (path.empty() || !RawMessage::isValidMessage(p, e)) {
+            return false;
+        }
+        // fields on the path are entered, all others are skipped
+        std::vector<Record> stack(1, Record(p, e));
+        while (!stack.empty()) {
+            Record & frame = stack.back();
+            if (frame.first >= frame.second) {
+                stack.pop_back();
+                continue;
+            }
+            const size_t depth = stack.size() - 1;
+            int64_t key = 0, size = 0;
+            frame.first = RawMessage::readVarint(frame.first, frame.second, key);
+            switch (key & 7) {
+            case 0: frame.first = RawMessage::readVarint(frame.first, frame.second, size); break;
+            case 1: frame.first += sizeof(double); break;
+            case 5: frame.first += sizeof(float); break;
+            case 2: {
+                frame.first = RawMessage::readVarint(frame.first, frame.second, size);
+                const Record content(frame.first, frame.first + size);
+                frame.first += size;
+                if ((key >> 3) != path[depth]) {
+                    break;
+                }
+                if (depth + 1 == path.size()) {
+                    f(content);
+                } else if (RawMessage::isValidMessage(content.first, content.second)) {
+                    stack.push_back(content);
+                }
+                break;
+            }
+            }
+        }
+        return true;
+    }
+}; // RecordReader
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Flattens records into typed columns, one value per column and record
+// (the first one for repeated fields), missing values are nulls. Values
+// are decoded straight from wire data into column buffers which are
+// written every kBatchRows records, so memory doesn't grow with input.
+//
+// Binary format (little endian, every buffer is u64 size, data and zero
+// padding to 8 bytes):
+//   "PDCOLS1\n", u32 columns, per column: u8 type, u16 name size, name,
+//            zero padding to 8 bytes
+//   batches: u64 rows, per column: validity bitmap buffer, then values
+//            buffer (int64 or double), or u32 offsets and bytes buffers
+//   u64 0 ends the stream
+class ColumnWriter {
+public:
+    enum FORMAT {
+        fmtCsv,
+        fmtBinary
+    };
+
+    enum TYPE {
+        ctInt64  = 0,
+        ctDouble = 1,
+        ctString = 2
+    };
+
+    // how the wire value is turned into the column value
+    enum DECODE {
+        dVarint,
+        dZigzag,
+        dFloat,
+        dDouble,
+        dFixed32,
+        dSfixed32,
+        dFixed64,
+        dSfixed64,
+        dBytes
+    };
+
+    struct Column {
+        std::string name;
+        std::vector<unsigned> path;
+        DECODE decode;
+    };
+
+    static const size_t kBatchRows = 1 << 16;
+    static const size_t kSampleRecords = 1000;
+
+    // ///////////////////////////////////////////////////////////////// //
+
+    // scalar and string fields of the message type and its submessages
+    // (first element of repeated ones) named by field names; recursive
+    // types are entered once per path
+    static void columns(const DescriptorTables & tables, int type, std::vector<Column> & result) {
+        struct Frame {
+            std::vector<int> types;
+            std::vector<unsigned> path;
+            std::string name;
+        };
+        std::vector<Frame> stack(1);
+        stack[0].types.push_back(type);
+        const size_t first = result.size();
+        while (!stack.empty()) {
+            const Frame frame = stack.back();
+            stack.pop_back();
+            const DescriptorTables::Message & message = tables.messages()[frame.types.back()];
+            for (size_t i = 0; i < message.fields.size(); ++i) {
+                const DescriptorTables::Field & field = message.fields[i];
+                Column column;
+                column.path = frame.path;
+                column.path.push_back(field.number);
+                column.name = frame.name + field.name;
+                if (field.handler == DescriptorTables::hMessage) {
+                    if (field.index >= 0 && column.path.size() < kMaxDepth &&
+                        std::find(frame.types.begin(), frame.types.end(), field.index) == frame.types.end()) {
+                        Frame child = { frame.types, column.path, column.name + "." };
+                        child.types.push_back(field.index);
+                        stack.push_back(child);
+                    }
+                } else if (decodeOf(field.handler, column.decode)) {
+                    result.push_back(column);
+                }
+            }
+        }
+        std::stable_sort(result.begin() + first, result.end(), [](const Column & a, const Column & b) {
+            return a.path < b.path;
+        });
+    }
+
+    // columns predicted by Schema from sample records, named by numbers
+    static void columns(const std::vector<RecordReader::Record> & sample, std::vector<Column> & result) {
+        std::map< std::vector<unsigned>, Schema::FieldStats > scalars;
+        std::map< std::vector<unsigned>, bool > strings;
+        const size_t first = result.size();
+        RawMessage msg;
+        for (size_t i = 0; i < sample.size(); ++i) {
+            if (!msg.parse(sample[i].first, sample[i].second)) {
+                continue;
+            }
+            std::vector< std::pair<RawMessage::VariantPtr, std::vector<unsigned> > > stack;
+            stack.push_back(std::make_pair(msg.rootItem(), std::vector<unsigned>()));
+            while (!stack.empty()) {
+                const RawMessage::VariantPtr node = stack.back().first;
+                const std::vector<unsigned> path = stack.back().second;
+                stack.pop_back();
+                const RawMessage::KeyValueMap & items = node->asMap();
+                for (RawMessage::KeyValueMap::const_iterator it = items.begin(); it != items.end(); ++it) {
+                    std::vector<unsigned> child(path);
+                    child.push_back(it->first);
+                    RawMessage::VariantPtr value = it->second;
+                    if (value->isRepeated()) {
+                        value = value->asMap().begin()->second;
+                    }
+                    if (value->isMap()) {
+                        if (child.size() < kMaxDepth) {
+                            stack.push_back(std::make_pair(value, child));
+                        }
+                    } else if (value->isString()) {
+                        strings[child] = true;
+                    } else {
+                        scalars[child].add(*value);
+                    }
+                }
+            }
+        }
+        for (std::map< std::vector<unsigned>, bool >::const_iterator it = strings.begin(); it != strings.end(); ++it) {
+            Column column = { pathName(it->first), it->first, dBytes };
+            result.push_back(column);
+        }
+        for (std::map< std::vector<unsigned>, Schema::FieldStats >::iterator it = scalars.begin(); it != scalars.end(); ++it) {
+            Column column = { pathName(it->first), it->first, decodeOf(it->second.predict()) };
+            result.push_back(column);
+        }
+        std::stable_sort(result.begin() + first, result.end(), [](const Column & a, const Column & b) {
+            return a.path < b.path;
+        });
+    }
+
+    static std::string pathName(const std::vector<unsigned> & path) {
+        std::stringstream ss;
+        for (size_t i = 0; i < path.size(); ++i) {
+            ss << (i ? "." : "") << path[i];
+        }
+        return ss.str();
+    }
+
+    // ///////////////////////////////////////////////////////////////// //
+
+    ColumnWriter(std::ostream & os, FORMAT format, const std::vector<Column> & columns, size_t batchRows = kBatchRows)
+        : mOs(os)
+        , mFormat(format)
+        , mColumns(columns)
+        , mBuffers(columns.size())
+        , mBatchRows(batchRows)
+        , mRows(0)
+        , mTotalRows(0)
+    {
+        // path trie, node 0 is the record itself
+        mNodes.push_back(Node());
+        for (size_t i = 0; i < mColumns.size(); ++i) {
+            size_t node = 0;
+            for (size_t j = 0; j < mColumns[i].path.size(); ++j) {
+                std::map<unsigned, size_t>::iterator it = mNodes[node].children.find(mColumns[i].path[j]);
+                if (it == mNodes[node].children.end()) {
+                    mNodes.push_back(Node());
+                    it = mNodes[node].children.insert(std::make_pair(mColumns[i].path[j], mNodes.size() - 1)).first;
+                }
+                node = it->second;
+            }
+            mNodes[node].column = i;
+            mBuffers[i].type = typeOf(mColumns[i].decode);
+        }
+        writeHeader();
+    }
+
+    // decode one record into the current row
+    void append(const unsigned char * p, const unsigned char * e) {
+        std::vector<Frame> & stack = mStack;
+        stack.clear();
+        Frame root = { p, e, 0 };
+        stack.push_back(root);
+        while (!stack.empty()) {
+            Frame & frame = stack.back();
+            if (frame.p >= frame.e) {
+                stack.pop_back();
+                continue;
+            }
+            int64_t key = 0, value = 0;
+            bool ok = false;
+            frame.p = RawMessage::readVarint(frame.p, frame.e, key, &ok);
+            const unsigned char * b = frame.p;
+            switch (key & 7) {
+            case 0: frame.p = RawMessage::readVarint(frame.p, frame.e, value, &ok); break;
+            case 1: frame.p += 8; break;
+            case 5: frame.p += 4; break;
+            case 2:
+                frame.p = RawMessage::readVarint(frame.p, frame.e, value, &ok);
+                b = frame.p;
+                if (value < 0 || value > frame.e - frame.p) {
+                    ok = false; // length of a negative or past the end
+                    break;
+                }
+                frame.p += value;
+                break;
+            default: ok = false; break;
+            }
+            if (!ok || frame.p > frame.e) {
+                stack.pop_back(); // not a message, rest of it is ignored
+                continue;
+            }
+            const Node & parent = mNodes[frame.node];
+            std::map<unsigned, size_t>::const_iterator it = parent.children.find((unsigned) (key >> 3));
+            if (it == parent.children.end()) {
+                continue;
+            }
+            const Node & node = mNodes[it->second];
+            if (node.column != Node::kNone) {
+                set(node.column, (int) (key & 7), value, b, frame.p);
+            }
+            if (!node.children.empty() && (key & 7) == 2) {
+                Frame child = { b, frame.p, it->second };
+                stack.push_back(child);
+            }
+        }
+        endRow();
+    }
+
+    // flush remaining rows and end the stream
+    void finish() {
+        flush();
+        if (mFormat == fmtBinary) {
+            put64(0);
+        }
+        mOs.flush();
+    }
+
+    size_t rows() const {
+        return mTotalRows;
+    }
+
+private:
+    enum {
+        kMaxDepth = 16
+    };
+
+    struct Node {
+        static const size_t kNone = (size_t) -1;
+        size_t column;
+        std::map<unsigned, size_t> children;
+        Node() : column(kNone) {}
+    };
+
+    struct Frame {
+        const unsigned char * p;
+        const unsigned char * e;
+        size_t node;
+    };
+
+    // values of the current batch
+    struct Buffer {
+        TYPE type;
+        std::vector<int64_t> ints;
+        std::vector<double> doubles;
+        std::vector<uint32_t> offsets;
+        std::string bytes;
+        std::vector<uint8_t> valid;
+    };
+
+    static bool decodeOf(DescriptorTables::HANDLER handler, DECODE & decode) {
+        switch (handler) {
+        case DescriptorTables::hDouble:   decode = dDouble;   return true;
+        case DescriptorTables::hFloat:    decode = dFloat;    return true;
+        case DescriptorTables::hFixed64:  decode = dFixed64;  return true;
+        case DescriptorTables::hFixed32:  decode = dFixed32;  return true;
+        case DescriptorTables::hSfixed32: decode = dSfixed32; return true;
+        case DescriptorTables::hSfixed64: decode = dSfixed64; return true;
+        case DescriptorTables::hSint32:
+        case DescriptorTables::hSint64:   decode = dZigzag;   return true;
+        case DescriptorTables::hString:
+        case DescriptorTables::hBytes:    decode = dBytes;    return true;
+        case DescriptorTables::hInt64:
+        case DescriptorTables::hUint64:
+        case DescriptorTables::hInt32:
+        case DescriptorTables::hUint32:
+        case DescriptorTables::hBool:
+        case DescriptorTables::hEnum:     decode = dVarint;   return true;
+        default:                          return false;
+        }
+    }
+
+    // predicted varints keep stored values: zigzag is never certain from
+    // values alone and would change them, fixed width ones keep their bits
+    static DECODE decodeOf(Schema::FieldStats::TYPE type) {
+        switch (type) {
+        case Schema::FieldStats::stFloat:    return dFloat;
+        case Schema::FieldStats::stFixed32:  return dFixed32;
+        case Schema::FieldStats::stSfixed32: return dSfixed32;
+        case Schema::FieldStats::stDouble:   return dDouble;
+        case Schema::FieldStats::stFixed64:  return dFixed64;
+        case Schema::FieldStats::stSfixed64: return dSfixed64;
+        default:                             return dVarint;
+        }
+    }
+
+    static TYPE typeOf(DECODE decode) {
+        return decode == dBytes ? ctString :
+               decode == dFloat || decode == dDouble ? ctDouble : ctInt64;
+    }
+
+    // first value of the column in the row wins, wire type must fit
+    void set(size_t column, int wireType, int64_t value, const unsigned char * b, const unsigned char * e) {
+        Buffer & buffer = mBuffers[column];
+        if (buffer.valid.size() > mRows) {
+            return;
+        }
+        const DECODE decode = mColumns[column].decode;
+        if (wireType == 2 && decode != dBytes) {
+            // packed repeated field, its first element is taken
+            bool ok = false;
+            wireType = decode == dVarint || decode == dZigzag ? 0 :
+                       decode == dFloat || decode == dFixed32 || decode == dSfixed32 ? 5 : 1;
+            if (wireType == 0) {
+                RawMessage::readVarint(b, e, value, &ok);
+            } else {
+                ok = e - b >= (wireType == 5 ? 4 : 8);
+            }
+            if (!ok) return;
+        }
+        switch (decode) {
+        case dVarint:
+        case dZigzag:
+            if (wireType != 0) return;
+            buffer.ints.push_back(decode == dZigzag ? (int64_t) ((uint64_t) value >> 1) ^ -(value & 1) : value);
+            break;
+        case dFloat:
+        case dFixed32:
+        case dSfixed32: {
+            if (wireType != 5) return;
+            uint32_t bits;
+            memcpy(&bits, b, 4);
+            float f;
+            memcpy(&f, &bits, 4);
+            if (decode == dFloat) buffer.doubles.push_back(f);
+            else buffer.ints.push_back(decode == dFixed32 ? (int64_t) bits : (int64_t) (int32_t) bits);
+            break;
+        }
+        case dDouble:
+        case dFixed64:
+        case dSfixed64: {
+            if (wireType != 1) return;
+            uint64_t bits;
+            memcpy(&bits, b, 8);
+            double d;
+            memcpy(&d, &bits, 8);
+            if (decode == dDouble) buffer.doubles.push_back(d);
+            else buffer.ints.push_back((int64_t) bits);
+            break;
+        }
+        case dBytes:
+            if (wireType != 2) return;
+            if (buffer.offsets.empty()) buffer.offsets.push_back(0);
+            buffer.bytes.append((const char *) b, e - b);
+            buffer.offsets.push_back((uint32_t) buffer.bytes.size());
+            break;
+        }
+        buffer.valid.push_back(1);
+    }
+
+    void endRow() {
+        mRows += 1;
+        for (size_t i = 0; i < mBuffers.size(); ++i) {
+            Buffer & buffer = mBuffers[i];
+            if (buffer.valid.size() == mRows) {
+                continue;
+            }
+            buffer.valid.push_back(0);
+            if (buffer.type == ctString) {
+                if (buffer.offsets.empty()) buffer.offsets.push_back(0);
+                buffer.offsets.push_back((uint32_t) buffer.bytes.size());
+            } else if (buffer.type == ctDouble) {
+                buffer.doubles.push_back(0);
+            } else {
+                buffer.ints.push_back(0);
+            }
+        }
+        if (mRows == mBatchRows) {
+            flush();
+        }
+    }
+
+    void writeHeader() {
+        if (mFormat == fmtCsv) {
+            for (size_t i = 0; i < mColumns.size(); ++i) {
+                mOs << (i ? "," : "") << mColumns[i].name;
+            }
+            mOs << "\n";
+            return;
+        }
+        mOs.write("PDCOLS1\n", 8);
+        put32((uint32_t) mColumns.size());
+        size_t headerSize = 12;
+        for (size_t i = 0; i < mColumns.size(); ++i) {
+            const std::string & name = mColumns[i].name;
+            mOs.put((char) mBuffers[i].type);
+            mOs.put((char) name.size());
+            mOs.put((char) (name.size() >> 8));
+            mOs.write(name.data(), name.size());
+            headerSize += 3 + name.size();
+        }
+        static const char zeros[8] = { 0 };
+        mOs.write(zeros, (8 - headerSize % 8) % 8);
+    }
+
+    void flush() {
+        if (!mRows) {
+            return;
+        }
+        Stats::Timer timer(Stats::phWrite);
+        if (mFormat == fmtCsv) {
+            flushCsv();
+        } else {
+            flushBinary();
+        }
+        mTotalRows += mRows;
+        mRows = 0;
+        for (size_t i = 0; i < mBuffers.size(); ++i) {
+            Buffer & buffer = mBuffers[i];
+            buffer.ints.clear();
+            buffer.doubles.clear();
+            buffer.offsets.clear();
+            buffer.bytes.clear();
+            buffer.valid.clear();
+        }
+    }
+
+    void flushCsv() {
+        // enough digits for doubles to read back exactly
+        const std::streamsize precision = mOs.precision(std::numeric_limits<double>::max_digits10);
+        for (size_t row = 0; row < mRows; ++row) {
+            for (size_t i = 0; i < mBuffers.size(); ++i) {
+                const Buffer & buffer = mBuffers[i];
+                if (i) mOs << ',';
+                if (!buffer.valid[row]) {
+                    continue;
+                }
+                if (buffer.type == ctInt64) {
+                    mOs << buffer.ints[row];
+                } else if (buffer.type == ctDouble) {
+                    mOs << buffer.doubles[row];
+                } else {
+                    mOs << '"';
+                    for (uint32_t j = buffer.offsets[row]; j < buffer.offsets[row + 1]; ++j) {
+                        if (buffer.bytes[j] == '"') mOs << '"';
+                        mOs << buffer.bytes[j];
+                    }
+                    mOs << '"';
+                }
+            }
+            mOs << "\n";
+        }
+        mOs.precision(precision);
+    }
+
+    void flushBinary() {
+        put64(mRows);
+        std::vector<uint8_t> bitmap;
+        for (size_t i = 0; i < mBuffers.size(); ++i) {
+            const Buffer & buffer = mBuffers[i];
+            bitmap.assign((mRows + 7) / 8, 0);
+            for (size_t row = 0; row < mRows; ++row) {
+                bitmap[row / 8] |= buffer.valid[row] << (row % 8);
+            }
+            putBuffer(bitmap.data(), bitmap.size());
+            if (buffer.type == ctInt64) {
+                putBuffer(buffer.ints.data(), buffer.ints.size() * sizeof(int64_t));
+            } else if (buffer.type == ctDouble) {
+                putBuffer(buffer.doubles.data(), buffer.doubles.size() * sizeof(double));
+            } else {
+                putBuffer(buffer.offsets.data(), buffer.offsets.size() * sizeof(uint32_t));
+                putBuffer(buffer.bytes.data(), buffer.bytes.size());
+            }
+        }
+    }
+
+    // data is written as it's in memory, so only little endian hosts
+    void putBuffer(const void * data, size_t size) {
+        static const char zeros[8] = { 0 };
+        put64(size);
+        mOs.write((const char *) data, size);
+        mOs.write(zeros, (8 - size % 8) % 8);
+    }
+
+    void put32(uint32_t value) {
+        for (int i = 0; i < 4; ++i) mOs.put((char) (value >> (8 * i)));
+    }
+
+    void put64(uint64_t value) {
+        for (int i = 0; i < 8; ++i) mOs.put((char) (value >> (8 * i)));
+    }
+
+    std::ostream & mOs;
+    FORMAT mFormat;
+    std::vector<Column> mColumns;
+    std::vector<Buffer> mBuffers;
+    std::vector<Node> mNodes;
+    size_t mBatchRows;
+    size_t mRows;
+    size_t mTotalRows;
+    std::vector<Frame> mStack;
+}; // ColumnWriter
@@ -20,10 +20,23 @@
 #include <vector>
 #include <cstring>
 #include <iterator>
+#include <iomanip>
+#include <functional>
 
 #include "protoraw.hpp"
+#include "protoserve.hpp"
+#include "protoarchive.hpp"
+#include "protoprocess.hpp"
+#include "protocolumns.hpp"
+#include "protodiff.hpp"
+#include "protowatch.hpp"
 #include "version.h"
 
+#if !defined(_WIN32)
+#include <csignal>
+#include <cstdlib>
+#endif
+
 void readFile(
     std::vector<unsigned char> & data,
     const char * filename
@@ -47,14 +60,65 @@ void readFile(
     file.read((char*)&data[0], fileSize);
 }
 
+// load message types from .proto sources or grabbed descriptors
+
+bool loadDescriptorTables(
+    DescriptorTables & tables,
+    const std::vector<const char *> & paths
+) {
+    for (size_t i = 0; i < paths.size(); ++i) {
+        std::vector<unsigned char> data;
+        readFile(data, paths[i]);
+        if (data.empty()) {
+            std::cerr << "ERROR: file '" << paths[i] << "' is empty or not found." << std::endl;
+            return false;
+        }
+        const size_t len = strlen(paths[i]);
+        bool loaded;
+        if (len > 6 && !strcmp(paths[i] + len - 6, ".proto")) {
+            loaded = tables.loadProto((const char *) &data[0], (const char *) &data[0] + data.size());
+        } else {
+            RawMessage msg;
+            loaded = msg.parse(&data[0], &data[0] + data.size()) && tables.loadSerialized(msg);
+        }
+        if (!loaded) {
+            std::cerr << "ERROR: can't load '" << paths[i] << "' "
+                      << tables.errorString() << "." << std::endl;
+            return false;
+        }
+    }
+    if (!tables.compile()) {
+        std::cerr << "ERROR: " << tables.errorString() << "." << std::endl;
+        return false;
+    }
+    return true;
+}
+
 // handling command options
 
 struct CommandOptions {
     const char * mFilePath;
     bool         mPrint;
+    bool         mFindMessages;
+    bool         mAnnotate;
     bool         mSchema;
     bool         mShowUsage;
     bool         mJava;
+    bool         mCpp;
+    bool         mStats;
+    const char * mTypeName;
+    const char * mSetPath;
+    const char * mSocketPath;
+    const char * mWatchPath;
+    const char * mColumnsPath;
+    const char * mRecordsPath;
+    const char * mDiffPath;
+    const char * mAtOffset;
+    unsigned     mThreads;
+    int          mPid;
+    Limits::Budget mLimits;
+    std::vector<const char *> mProtoPaths;
+    std::vector<const char *> mSelect;
 
     void usage() {
         std::cout
@@ -65,10 +129,63 @@ struct CommandOptions {
             << "\n"
             << "OPTIONS:\n"
             << "--grab   - find and grab FileDescriptor data with meta information about\n"
-            << "           .proto files from executable module .EXE or .DLL (.elf or .so).\n"
+            << "           .proto files from executable module .EXE or .DLL (.elf or .so)\n"
+            << "           or from every entry of ZIP, APK or JAR archive, strings of\n"
+            << "           Java .class and Android .dex files are decoded.\n"
             << "--schema - preddict and print of the schema of given raw message.\n"
             << "--print  - print text reprisentation of single message.\n"
             << "--java   - decrypt Java descriptor.\n"
+            << "--select PATH - print only values at field number path like 4.2.3\n"
+            << "           of given message, * matches any field (may be repeated).\n"
+            << "--diff A B - print differences between messages A and B by field\n"
+            << "           path, exit code is 0 if they are equal and 1 otherwise.\n"
+            << "--annotate - print hexdump of given message with every field\n"
+            << "           labelled by its path and value.\n"
+            << "--at OFFSET - print path and byte range of the field holding\n"
+            << "           byte at OFFSET of given message (0x for hex).\n"
+            << "--find-messages - list regions of given file which look like\n"
+            << "           serialized messages of any type with their confidence,\n"
+            << "           with --print every message is printed too.\n"
+            << "--columns OUT - export fields of many records into typed columns,\n"
+            << "           CSV if OUT ends with .csv or binary column batches\n"
+            << "           otherwise; records are length delimited messages of\n"
+            << "           given file, columns are fields of --proto type or\n"
+            << "           predicted from the first records.\n"
+            << "--records PATH - with --columns records are elements of repeated\n"
+            << "           field at field number path like 4.2 of given message.\n"
+            << "--proto PATH - decode --print with message types from .proto file or\n"
+            << "           grabbed descriptor instead of guessing (may be repeated).\n"
+            << "--type NAME  - message type for --proto (default is the first one).\n"
+            << "--cpp    - write C++ decoders instead of .proto files while grabbing\n"
+            << "           or print them for types loaded with --proto.\n"
+            << "--pid N  - grab descriptors from memory of running process N\n"
+            << "           instead of a file (Linux).\n"
+            << "--descriptor-set OUT - while grabbing store raw descriptors into single\n"
+            << "           FileDescriptorSet file OUT instead of .proto files.\n"
+            << "--serve SOCKET - answer grab, print, schema and decode requests on\n"
+            << "           Unix domain socket SOCKET until interrupted, types loaded\n"
+            << "           with --proto are available for decoding.\n"
+            << "--watch DIR - grab descriptors of all files under directory DIR\n"
+            << "           into --descriptor-set OUT and keep it up to date until\n"
+            << "           interrupted: only changed parts of written files are\n"
+            << "           scanned again and OUT is replaced at once (Linux).\n"
+            << "--threads N - number of threads handling --serve requests,\n"
+            << "           archive entries or memory regions and rendering of\n"
+            << "           descriptors while grabbing,\n"
+            << "           chunks of files for --watch and\n"
+            << "           data chunks for --find-messages\n"
+            << "           (default is the number of CPUs).\n"
+            << "--max-depth N, --max-nodes N, --max-bytes N - limits of one parsed\n"
+            << "           message from untrusted input: nesting, number of values\n"
+            << "           and their memory; --max-bytes limits inflated archive\n"
+            << "           entries too.\n"
+            << "--max-steps N - limit of fields read to check one candidate.\n"
+            << "--timeout MS - time limit of the run or of every --serve request\n"
+            << "           or --watch update.\n"
+            << "           When a limit is hit the output is partial, a warning is\n"
+            << "           printed and exit code is 3.\n"
+            << "--stats  - print counters and time spent in every phase as JSON\n"
+            << "           to stderr after the run.\n"
             << "--help   - this output.\n"
             << std::endl;
     }
@@ -76,9 +193,23 @@ struct CommandOptions {
     CommandOptions(int argc, char ** argv)
         : mFilePath(NULL)
         , mPrint(false)
+        , mFindMessages(false)
+        , mAnnotate(false)
         , mSchema(false)
         , mShowUsage(false)
         , mJava(false)
+        , mCpp(false)
+        , mStats(false)
+        , mTypeName(NULL)
+        , mSetPath(NULL)
+        , mSocketPath(NULL)
+        , mWatchPath(NULL)
+        , mColumnsPath(NULL)
+        , mRecordsPath(NULL)
+        , mDiffPath(NULL)
+        , mAtOffset(NULL)
+        , mThreads(0)
+        , mPid(0)
     {
         for (int i = 1; i < argc; ++i) {
             if (!strcmp(argv[i], "--help")) {
@@ -87,17 +218,74 @@ struct CommandOptions {
                 mSchema = true;
             } else if (!strcmp(argv[i], "--print")) {
                 mPrint = true;
+            } else if (!strcmp(argv[i], "--select")) {
+                if (++i < argc) mSelect.push_back(argv[i]);
+            } else if (!strcmp(argv[i], "--columns")) {
+                ++i;
+                mColumnsPath = (i < argc ? argv[i] : NULL);
+            } else if (!strcmp(argv[i], "--records")) {
+                ++i;
+                mRecordsPath = (i < argc ? argv[i] : NULL);
+            } else if (!strcmp(argv[i], "--diff")) {
+                ++i;
+                mDiffPath = (i < argc ? argv[i] : NULL);
+            } else if (!strcmp(argv[i], "--annotate")) {
+                mAnnotate = true;
+            } else if (!strcmp(argv[i], "--at")) {
+                ++i;
+                mAtOffset = (i < argc ? argv[i] : NULL);
+            } else if (!strcmp(argv[i], "--find-messages")) {
+                mFindMessages = true;
             } else if (!strcmp(argv[i], "--grab")) {
                 ++i;
                 mFilePath = (i < argc ? argv[i] : NULL);
             } else if (!strcmp(argv[i], "--java")) {
                 mJava = true;
+            } else if (!strcmp(argv[i], "--stats")) {
+                mStats = true;
+            } else if (!strcmp(argv[i], "--cpp")) {
+                mCpp = true;
+            } else if (!strcmp(argv[i], "--proto")) {
+                if (++i < argc) mProtoPaths.push_back(argv[i]);
+            } else if (!strcmp(argv[i], "--descriptor-set")) {
+                ++i;
+                mSetPath = (i < argc ? argv[i] : NULL);
+            } else if (!strcmp(argv[i], "--serve")) {
+                ++i;
+                mSocketPath = (i < argc ? argv[i] : NULL);
+            } else if (!strcmp(argv[i], "--watch")) {
+                ++i;
+                mWatchPath = (i < argc ? argv[i] : NULL);
+            } else if (!strcmp(argv[i], "--pid")) {
+                ++i;
+                mPid = (i < argc ? atoi(argv[i]) : 0);
+            } else if (!strcmp(argv[i], "--threads")) {
+                ++i;
+                mThreads = (i < argc ? (unsigned) atoi(argv[i]) : 0);
+            } else if (!strcmp(argv[i], "--max-depth")) {
+                ++i;
+                mLimits.depth = (i < argc ? strtoull(argv[i], NULL, 0) : 0);
+            } else if (!strcmp(argv[i], "--max-nodes")) {
+                ++i;
+                mLimits.nodes = (i < argc ? strtoull(argv[i], NULL, 0) : 0);
+            } else if (!strcmp(argv[i], "--max-bytes")) {
+                ++i;
+                mLimits.bytes = (i < argc ? strtoull(argv[i], NULL, 0) : 0);
+            } else if (!strcmp(argv[i], "--max-steps")) {
+                ++i;
+                mLimits.steps = (i < argc ? strtoull(argv[i], NULL, 0) : 0);
+            } else if (!strcmp(argv[i], "--timeout")) {
+                ++i;
+                mLimits.timeMs = (i < argc ? strtoull(argv[i], NULL, 0) : 0);
+            } else if (!strcmp(argv[i], "--type")) {
+                ++i;
+                mTypeName = (i < argc ? argv[i] : NULL);
             } else {
                 mFilePath = argv[i];
             }
         }
         // if grab or print or schema command selected then not show usage
-        mShowUsage = !(mFilePath || mPrint || mSchema);
+        mShowUsage = !(mFilePath || mDiffPath || mPrint || mSchema || !mSelect.empty() || mSocketPath || mWatchPath || mPid || (mCpp && !mProtoPaths.empty()));
     }
 
     ~CommandOptions() {
@@ -124,11 +312,238 @@ unsigned char xdigit(unsigned char ch) {
 
 // /////////////////////////////////////////////////////////////////// //
 
-int main(int argc, char ** argv) {
-    CommandOptions cmdOptions(argc, argv);
-    if (cmdOptions.mFilePath) {
+#if !defined(_WIN32)
+static Server * gServer = NULL;
+
+static void stopServer(int) {
+    if (gServer) gServer->stop();
+}
+
+int serve(const CommandOptions & cmdOptions) {
+    Server server(cmdOptions.mSocketPath, cmdOptions.mThreads);
+    std::string error;
+    if (!cmdOptions.mProtoPaths.empty()) {
+        DescriptorTables tables;
+        if (!loadDescriptorTables(tables, cmdOptions.mProtoPaths)) {
+            return EXIT_FAILURE;
+        }
+        if (!server.load(tables, error)) {
+            std::cerr << "ERROR: can't load message types for --serve " << error << "." << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if (!server.listen(error)) {
+        std::cerr << "ERROR: can't listen '" << cmdOptions.mSocketPath << "' " << error << "." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    gServer = &server;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopServer;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    server.serve();
+    gServer = NULL;
+    return EXIT_SUCCESS;
+}
+#endif
+
+#if defined(__linux__)
+static Watcher * gWatcher = NULL;
+
+static void stopWatcher(int) {
+    if (gWatcher) gWatcher->stop();
+}
+
+int watch(const CommandOptions & cmdOptions) {
+    if (!cmdOptions.mSetPath) {
+        std::cerr << "ERROR: --watch needs --descriptor-set OUT for the catalogue." << std::endl;
+        return EXIT_FAILURE;
+    }
+    Watcher watcher(cmdOptions.mWatchPath, cmdOptions.mSetPath, cmdOptions.mThreads);
+    std::string error;
+    if (!watcher.start(error)) {
+        std::cerr << "ERROR: " << error << "." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    gWatcher = &watcher;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopWatcher;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    const bool ok = watcher.watch(error);
+    gWatcher = NULL;
+    if (!ok) {
+        std::cerr << "ERROR: " << error << "." << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+#endif
+
+Serialized_pb::OUTPUT grabOutput(const CommandOptions & cmdOptions) {
+    return cmdOptions.mSetPath ? Serialized_pb::outDescriptorSet :
+           cmdOptions.mCpp     ? Serialized_pb::outCpp :
+                                 Serialized_pb::outProto;
+}
+
+int diffFiles(const CommandOptions & cmdOptions) {
+    const char * paths[2] = { cmdOptions.mDiffPath, cmdOptions.mFilePath };
+    if (!paths[1]) {
+        std::cerr << "ERROR: second file for --diff is not given." << std::endl;
+        return 2;
+    }
+    std::vector<unsigned char> data[2];
+    RawMessage msg[2];
+    bool parsed[2];
+    // messages are read and parsed in parallel
+    const Limits::Request request = Limits::request();
+    auto load = [&](int i) {
+        Limits::Scope scope(request);
+        {
+            Stats::Timer timer(Stats::phRead);
+            readFile(data[i], paths[i]);
+        }
+        parsed[i] = !data[i].empty() && msg[i].parse(data[i].data(), data[i].data() + data[i].size() - 2);
+    };
+    std::thread second(load, 1);
+    load(0);
+    second.join();
+    for (int i = 0; i < 2; ++i) {
+        if (data[i].empty()) {
+            std::cerr << "ERROR: file '" << paths[i] << "' is empty or not found." << std::endl;
+            return 2;
+        }
+        if (!parsed[i]) {
+            std::cerr << "ERROR: parsing of '" << paths[i] << "' failed " << msg[i].errorString() << "." << std::endl;
+            return 2;
+        }
+    }
+    return MessageDiff::diff(msg[0], msg[1], std::cout) ? 1 : 0;
+}
+
+int exportColumns(const CommandOptions & cmdOptions, const unsigned char * pB, const unsigned char * pE) {
+    std::vector<unsigned> path;
+    for (const char * p = cmdOptions.mRecordsPath; p && *p; ) {
+        char * next;
+        path.push_back((unsigned) strtoul(p, &next, 10));
+        if (next == p || (*next && *next != '.') || !path.back()) {
+            std::cerr << "ERROR: bad records path '" << cmdOptions.mRecordsPath << "'." << std::endl;
+            return EXIT_FAILURE;
+        }
+        p = *next ? next + 1 : next;
+    }
+    // records are walked twice: for column prediction and for export
+    auto forEachRecord = [&](std::function<void (const RecordReader::Record &)> f) {
+        if (!path.empty()) {
+            if (!RecordReader::repeated(pB, pE, path, f)) {
+                std::cerr << "ERROR: given file is not a message." << std::endl;
+                return false;
+            }
+        } else if (!RecordReader::delimited(pB, pE, f)) {
+            std::cerr << "ERROR: given file is not a length delimited stream." << std::endl;
+            return false;
+        }
+        return true;
+    };
+
+    std::vector<ColumnWriter::Column> columns;
+    if (!cmdOptions.mProtoPaths.empty()) {
+        DescriptorTables tables;
+        if (!loadDescriptorTables(tables, cmdOptions.mProtoPaths)) {
+            return EXIT_FAILURE;
+        }
+        int type = cmdOptions.mTypeName ? tables.findMessage(cmdOptions.mTypeName)
+                                        : (tables.messages().empty() ? -1 : 0);
+        if (type < 0) {
+            std::cerr << "ERROR: message type '"
+                      << (cmdOptions.mTypeName ? cmdOptions.mTypeName : "")
+                      << "' is not found." << std::endl;
+            return EXIT_FAILURE;
+        }
+        ColumnWriter::columns(tables, type, columns);
+    } else {
+        std::vector<RecordReader::Record> sample;
+        const bool ok = forEachRecord([&](const RecordReader::Record & record) {
+            if (sample.size() < ColumnWriter::kSampleRecords) {
+                sample.push_back(record);
+            }
+        });
+        if (!ok) {
+            return EXIT_FAILURE;
+        }
+        ColumnWriter::columns(sample, columns);
+    }
+    if (columns.empty()) {
+        std::cerr << "ERROR: no columns." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const std::string outPath(cmdOptions.mColumnsPath);
+    const bool csv = outPath.size() > 4 && outPath.compare(outPath.size() - 4, 4, ".csv") == 0;
+    std::ofstream out(cmdOptions.mColumnsPath, std::ios::out | std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "ERROR: can't create '" << cmdOptions.mColumnsPath << "'." << std::endl;
+        return EXIT_FAILURE;
+    }
+    ColumnWriter writer(out, csv ? ColumnWriter::fmtCsv : ColumnWriter::fmtBinary, columns);
+    const bool ok = forEachRecord([&](const RecordReader::Record & record) {
+        writer.append(record.first, record.second);
+    });
+    writer.finish();
+    if (!ok) {
+        return EXIT_FAILURE;
+    }
+    if (!out) {
+        std::cerr << "ERROR: can't write '" << cmdOptions.mColumnsPath << "'." << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << writer.rows() << " records, " << columns.size() << " columns" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+int run(const CommandOptions & cmdOptions) {
+    if (cmdOptions.mSocketPath) {
+#if !defined(_WIN32)
+        return serve(cmdOptions);
+#else
+        std::cerr << "ERROR: --serve is not supported on this platform." << std::endl;
+        return EXIT_FAILURE;
+#endif
+    } else if (cmdOptions.mWatchPath) {
+#if defined(__linux__)
+        return watch(cmdOptions);
+#else
+        std::cerr << "ERROR: --watch is not supported on this platform." << std::endl;
+        return EXIT_FAILURE;
+#endif
+    } else if (cmdOptions.mPid) {
+#if defined(__linux__)
+        std::vector< Serialized_pb::Found > found;
+        std::string error;
+        if (!ProcessScanner::collect(cmdOptions.mPid, found, error, cmdOptions.mThreads)) {
+            std::cerr << "ERROR: " << error << "." << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (!Serialized_pb::write(found, grabOutput(cmdOptions), cmdOptions.mSetPath, cmdOptions.mThreads, &error)) {
+            std::cerr << "ERROR: " << (error.empty() ? "nothing is found" : error) << "." << std::endl;
+            return EXIT_FAILURE;
+        }
+#else
+        std::cerr << "ERROR: --pid is not supported on this platform." << std::endl;
+        return EXIT_FAILURE;
+#endif
+    } else if (cmdOptions.mDiffPath) {
+        return diffFiles(cmdOptions);
+    } else if (cmdOptions.mFilePath) {
         std::vector<unsigned char> data;
-        readFile(data, cmdOptions.mFilePath);
+        {
+            Stats::Timer timer(Stats::phRead);
+            readFile(data, cmdOptions.mFilePath);
+        }
         if (data.empty()) {
             std::cerr << "ERROR: file '" << cmdOptions.mFilePath << "' "
                       << "is empty or not found."
@@ -198,25 +613,156 @@ int main(int argc, char ** argv) {
         data.push_back('\0');
 
         const unsigned char *pB = &data[0], *pE = pB + data.size();
-        if (!cmdOptions.mPrint && !cmdOptions.mSchema) {
-            // trying to find and parse serialized_pb
-            if (!Serialized_pb::grab(pB, pE)) {
+        if (cmdOptions.mAnnotate || cmdOptions.mAtOffset) {
+            // without zeroes added by readFile and above
+            pE -= 4;
+            OffsetIndex index;
+            RawMessage msg;
+            if (!msg.parse(pB, pE, &index) && !msg.isPartial()) {
+                std::cerr << "ERROR: parsing failed " << msg.errorString() << "." << std::endl;
+                return EXIT_FAILURE;
+            }
+            Stats::Timer timer(Stats::phRender);
+            if (cmdOptions.mAnnotate) {
+                Annotator::print(pB, pE, index, std::cout);
+            }
+            if (cmdOptions.mAtOffset) {
+                const uint32_t i = index.find(strtoull(cmdOptions.mAtOffset, NULL, 0));
+                if (i == OffsetIndex::kNone) {
+                    std::cerr << "ERROR: no field at offset " << cmdOptions.mAtOffset << "." << std::endl;
+                    return EXIT_FAILURE;
+                }
+                const OffsetIndex::Field & field = index.fields()[i];
+                std::cout << index.path(i) << std::hex
+                          << " 0x" << field.start << "-0x" << field.end
+                          << std::dec << std::endl;
+            }
+        } else if (cmdOptions.mColumnsPath) {
+            // without zeroes added by readFile and above
+            return exportColumns(cmdOptions, pB, pE - 4);
+        } else if (!cmdOptions.mSelect.empty()) {
+            FieldSelector selector;
+            for (size_t i = 0; i < cmdOptions.mSelect.size(); ++i) {
+                if (!selector.add(cmdOptions.mSelect[i])) {
+                    std::cerr << "ERROR: " << selector.errorString() << "." << std::endl;
+                    return EXIT_FAILURE;
+                }
+            }
+            Stats::Timer timer(Stats::phRender);
+            if (!selector.select(pB, pE - 2, std::cout)) {
+                std::cerr << "ERROR: " << selector.errorString() << "." << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else if (cmdOptions.mFindMessages) {
+            const std::vector<MessageFinder::Region> regions =
+                MessageFinder::find(pB, pE - 2, cmdOptions.mThreads);
+            for (size_t i = 0; i < regions.size(); ++i) {
+                const MessageFinder::Region & region = regions[i];
+                std::cout << "0x" << std::hex << std::setw(8) << std::setfill('0') << region.offset
+                          << std::dec << std::setfill(' ')
+                          << " size " << region.size
+                          << " fields " << region.fields
+                          << " confidence " << std::fixed << std::setprecision(2) << region.confidence
+                          << std::endl;
+                RawMessage msg;
+                if (cmdOptions.mPrint && msg.parse(pB + region.offset, pB + region.offset + region.size)) {
+                    msg.print(std::cout);
+                }
+            }
+            if (regions.empty()) {
                 std::cerr << "ERROR: nothing is found." << std::endl;
                 return EXIT_FAILURE;
             }
+        } else if (!cmdOptions.mPrint && !cmdOptions.mSchema) {
+            // trying to find and parse serialized_pb
+            const Serialized_pb::OUTPUT output = grabOutput(cmdOptions);
+            unsigned count;
+            std::string error;
+            if (ZipArchive::isArchive(pB, pE)) {
+                std::vector< Serialized_pb::Found > found;
+                if (!ArchiveScanner::collect(pB, pE, cmdOptions.mFilePath, found, error, cmdOptions.mThreads)) {
+                    std::cerr << "ERROR: can't read archive " << error << "." << std::endl;
+                    return EXIT_FAILURE;
+                }
+                count = Serialized_pb::write(found, output, cmdOptions.mSetPath, cmdOptions.mThreads, &error);
+            } else if (DexFile::isDex(pB, pE)) {
+                std::vector<unsigned char> strings;
+                DexFile::descriptorData(pB, pE, strings);
+                count = Serialized_pb::grab(strings.data(), strings.data() + strings.size(), output, cmdOptions.mSetPath, cmdOptions.mThreads, &error);
+            } else {
+                count = Serialized_pb::grab(pB, pE, output, cmdOptions.mSetPath, cmdOptions.mThreads, &error);
+            }
+            if (!count) {
+                std::cerr << "ERROR: " << (error.empty() ? "nothing is found" : error) << "." << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else if (!cmdOptions.mProtoPaths.empty()) {
+            // decode with known message types
+            DescriptorTables tables;
+            if (!loadDescriptorTables(tables, cmdOptions.mProtoPaths)) {
+                return EXIT_FAILURE;
+            }
+            int type = cmdOptions.mTypeName ? tables.findMessage(cmdOptions.mTypeName)
+                                            : (tables.messages().empty() ? -1 : 0);
+            if (type < 0) {
+                std::cerr << "ERROR: message type '"
+                          << (cmdOptions.mTypeName ? cmdOptions.mTypeName : "")
+                          << "' is not found." << std::endl;
+                return EXIT_FAILURE;
+            }
+            Stats::Timer timer(Stats::phRender);
+            if (!tables.decode(type, pB, pE, std::cout)) {
+                std::cerr << "ERROR: decoding failed " << tables.errorString() << "." << std::endl;
+                return EXIT_FAILURE;
+            }
         } else {
             RawMessage msg;
-            if (msg.parse(pB, pE)) {
+            if (msg.parse(pB, pE) || msg.isPartial()) {
+                Stats::Timer timer(Stats::phRender);
                 if (cmdOptions.mPrint)
                     msg.print(std::cout);
                 else
                     Schema::print(msg, std::cout);
             }
-            if (msg.isError()) {
+            if (msg.isError() && !msg.isPartial()) {
                 std::cerr << "ERROR: parsing failed " << msg.errorString() << "." << std::endl;
                 return EXIT_FAILURE;
             }
         }
+    } else if (cmdOptions.mCpp && !cmdOptions.mProtoPaths.empty()) {
+        // C++ decoders for known message types
+        DescriptorTables tables;
+        if (!loadDescriptorTables(tables, cmdOptions.mProtoPaths)) {
+            return EXIT_FAILURE;
+        }
+        CppDecoders::print(tables, std::cout, cmdOptions.mProtoPaths.back());
     }
     return EXIT_SUCCESS;
 }
+
+int main(int argc, char ** argv) {
+    CommandOptions cmdOptions(argc, argv);
+    if (cmdOptions.mStats) {
+        Stats::enable();
+    }
+    // limits are set before any thread is started
+    Limits::defaults() = cmdOptions.mLimits;
+    int rc;
+    {
+        Limits::Scope scope;
+        rc = run(cmdOptions);
+        if (Stats::total().counter(Stats::scLimitsExceeded)) {
+            const Limits::KIND kind = Limits::exceeded();
+            std::cerr << "WARNING: "
+                      << (kind != Limits::lkNone ? std::string("limit of ") + Limits::name(kind) + " is" : "limits are")
+                      << " exceeded, output is partial." << std::endl;
+            if (rc == EXIT_SUCCESS) {
+                rc = 3;
+            }
+        }
+    }
+    if (cmdOptions.mStats) {
+        Stats::printJson(std::cerr);
+    }
+    return rc;
+}
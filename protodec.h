@@ -0,0 +1,117 @@
+/* ///////////////////////////////////////////////////////////////////////// */
+/*                                                                           */
+/*   Copyright (C) 2014-2018 by Oleg Polivets                                */
+/*   jsbot@ya.ru                                                             */
+/*                                                                           */
+/*   This program is free software; you can redistribute it and/or modify    */
+/*   it under the terms of the GNU General Public License as published by    */
+/*   the Free Software Foundation; either version 2 of the License, or       */
+/*   (at your option) any later version.                                     */
+/*                                                                           */
+/*   This program is distributed in the hope that it will be useful,         */
+/*   but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/*   GNU General Public License for more details.                            */
+/*                                                                           */
+/* ///////////////////////////////////////////////////////////////////////// */
+
+/* C interface of protodec library. Functions work on caller provided
+ * buffers only: nothing is read from or written to files or stdout.
+ * A context may be reused for any number of calls but not concurrently. */
+
+#ifndef PROTODEC_H
+#define PROTODEC_H
+
+#include <stddef.h>
+
+#if defined(_WIN32)
+#  if defined(PROTODEC_BUILD)
+#    define PROTODEC_API __declspec(dllexport)
+#  elif defined(PROTODEC_SHARED)
+#    define PROTODEC_API __declspec(dllimport)
+#  else
+#    define PROTODEC_API
+#  endif
+#else
+#  define PROTODEC_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum protodec_status {
+    PROTODEC_OK = 0,
+    PROTODEC_ERROR_INVALID_ARGUMENT,
+    PROTODEC_ERROR_PARSE,
+    PROTODEC_ERROR_NOT_FOUND,
+    PROTODEC_ERROR_BUFFER_TOO_SMALL
+} protodec_status;
+
+typedef struct protodec_context protodec_context;
+
+/* Called for every FileDescriptorProto found by protodec_scan(). Data
+ * points into the scanned buffer. Return non-zero to stop scanning. */
+typedef int (*protodec_descriptor_cb)(
+    void * user,
+    const char * filename,
+    size_t offset,
+    const unsigned char * data,
+    size_t size);
+
+PROTODEC_API const char * protodec_version(void);
+
+PROTODEC_API protodec_context * protodec_context_new(void);
+PROTODEC_API void protodec_context_free(protodec_context * ctx);
+
+/* text of the last error, empty string if none */
+PROTODEC_API const char * protodec_last_error(const protodec_context * ctx);
+
+/* Find serialized FileDescriptorProto data in the buffer. A descriptor is
+ * recognized only when it's followed by '\0' inside the buffer. */
+PROTODEC_API protodec_status protodec_scan(
+    protodec_context * ctx,
+    const unsigned char * data, size_t size,
+    protodec_descriptor_cb callback, void * user,
+    size_t * found);
+
+/* Functions below write NUL terminated text into out. When out_size is
+ * not enough PROTODEC_ERROR_BUFFER_TOO_SMALL is returned and out_len is
+ * set to the required length without the terminator. */
+
+/* text representation of raw message, same as --print */
+PROTODEC_API protodec_status protodec_print(
+    protodec_context * ctx,
+    const unsigned char * data, size_t size,
+    char * out, size_t out_size, size_t * out_len);
+
+/* predicted schema of raw message, same as --schema */
+PROTODEC_API protodec_status protodec_schema(
+    protodec_context * ctx,
+    const unsigned char * data, size_t size,
+    char * out, size_t out_size, size_t * out_len);
+
+/* .proto text of serialized FileDescriptorProto */
+PROTODEC_API protodec_status protodec_render_descriptor(
+    protodec_context * ctx,
+    const unsigned char * data, size_t size,
+    char * out, size_t out_size, size_t * out_len);
+
+/* add message types of FileDescriptorProto or FileDescriptorSet to the
+ * context for protodec_decode() */
+PROTODEC_API protodec_status protodec_load_descriptor(
+    protodec_context * ctx,
+    const unsigned char * data, size_t size);
+
+/* decode message of known type loaded by protodec_load_descriptor() */
+PROTODEC_API protodec_status protodec_decode(
+    protodec_context * ctx,
+    const char * type_name,
+    const unsigned char * data, size_t size,
+    char * out, size_t out_size, size_t * out_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PROTODEC_H */
@@ -3,14 +3,33 @@ CONFIG += console
 CONFIG += c++11
 #DEFINES += DEBUG
 #CONFIG  += unittest
+#CONFIG  += benchmark
+#CONFIG  += library
+#CONFIG  += sharedlib
 CONFIG  -= app_bundle
 CONFIG  -= qt
 win32 {
 RC_FILE += winres.rc
 }
 CONFIG(unittest) {
-  SOURCES += tests.cpp
-  LIBS += -lgtest -lpthread
+  SOURCES += tests.cpp libprotodec.cpp
+  LIBS += -lgtest -lpthread -lz
+} else:CONFIG(benchmark) {
+  SOURCES += benchmark.cpp
+  LIBS += -lbenchmark -lpthread
+} else:CONFIG(library) {
+  TEMPLATE = lib
+  TARGET = protodec
+  DEFINES += PROTODEC_BUILD
+  CONFIG(sharedlib) {
+    # export the C interface only, everything else stays internal
+    QMAKE_CXXFLAGS += -fvisibility=hidden -fvisibility-inlines-hidden
+  } else {
+    CONFIG += staticlib
+  }
+  SOURCES += libprotodec.cpp
+  HEADERS += protodec.h
 } else {
   SOURCES += protodec.cpp
+  LIBS += -lz -lpthread
 }
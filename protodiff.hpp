@@ -0,0 +1,497 @@
+// ///////////////////////////////////////////////////////////////////////// //
+//                                                                           //
+//   Copyright (C) 2014-2018 by Oleg Polivets                                //
+//   jsbot@ya.ru                                                             //
+//                                                                           //
+//   This program is free software; you can redistribute it and/or modify    //
+//   it under the terms of the GNU General Public License as published by    //
+//   the Free Software Foundation; either version 2 of the License, or       //
+//   (at your option) any later version.                                     //
+//                                                                           //
+//   This program is distributed in the hope that it will be useful,         //
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of          //
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           //
+//   GNU General Public License for more details.                            //
+//                                                                           //
+// ///////////////////////////////////////////////////////////////////////// //
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+
+#include "protoraw.hpp"
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Structural diff of two raw messages. Subtrees are compared by hashes
+// computed bottom-up once for every node, so equal subtrees are skipped
+// without output and only differing ones are entered. Elements of
+// repeated fields are aligned by the longest common subsequence of their
+// hashes; changed elements between aligned ones are paired by
+// similarity. Output is one line per difference:
+//   ~ 1[2].3: "old" -> "new"    changed value
+//   - 1[4] {...}                removed field or element (index in first)
+//   + 4: 17                     added field or element (index in second)
+class MessageDiff {
+public:
+    typedef RawMessage::VariantPtr VariantPtr;
+
+    // true if messages differ
+    static bool diff(const RawMessage & a, const RawMessage & b, std::ostream & os) {
+        Stats::Timer timer(Stats::phRender);
+        MessageDiff d(os);
+        if (d.hashTree(a.rootItem()) && d.hashTree(b.rootItem())) {
+            d.run(a.rootItem(), b.rootItem());
+        }
+        return d.mDiffers;
+    }
+
+private:
+    // alignment tables larger than this are not built
+    static const size_t kMaxLcsCells = 1 << 22;
+
+    typedef std::vector< std::pair<size_t, size_t> > Pairs;
+
+    static const size_t kRoot = (size_t) -1;
+
+    struct Frame {
+        const RawMessage::Variant * node;
+        RawMessage::KeyValueMap::const_iterator it;
+        uint64_t hash;
+    };
+
+    enum TASK { tCompare, tChange, tRemove, tAdd };
+
+    struct Task {
+        Task() : kind(tCompare), path(kRoot) {}
+        Task(TASK k, const VariantPtr & x, const VariantPtr & y, size_t p)
+            : kind(k), a(x), b(y), path(p) {}
+        TASK kind;
+        VariantPtr a, b;
+        size_t path; // last Segment
+    };
+
+    // path is a chain of segments from the last one to the root, it's
+    // made a string only when reported
+    struct Segment {
+        size_t parent;
+        size_t key;   // field number or index of element
+        bool index;
+    };
+
+    explicit MessageDiff(std::ostream & os)
+        : mOs(os)
+        , mDiffers(false)
+    {
+    }
+
+    static uint64_t mix(uint64_t h, uint64_t v) {
+        h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    static uint64_t hashBytes(const std::string & str) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        size_t i = 0;
+        for (; i + 8 <= str.size(); i += 8) {
+            uint64_t v;
+            memcpy(&v, str.data() + i, 8);
+            h = (h ^ v) * 0x100000001b3ULL;
+        }
+        for (; i < str.size(); ++i) {
+            h = (h ^ (unsigned char) str[i]) * 0x100000001b3ULL;
+        }
+        return mix(h, str.size());
+    }
+
+    static uint64_t hashValue(const RawMessage::Variant & var) {
+        if (var.isInt()) {
+            return mix(1, (uint64_t) var.asInt());
+        } else if (var.isDouble()) {
+            const double d = var.asDouble();
+            uint64_t bits;
+            memcpy(&bits, &d, 8);
+            return mix(2, bits);
+        } else if (var.isFloat()) {
+            const float f = var.asFloat();
+            uint32_t bits;
+            memcpy(&bits, &f, 4);
+            return mix(3, bits);
+        }
+        return mix(4, hashBytes(var.asString()));
+    }
+
+    // hashes of all messages and repeated fields of the tree by one
+    // post-order walk with explicit stack, children are hashed first;
+    // false when time is over
+    bool hashTree(const VariantPtr & var) {
+        if (isScalar(var)) {
+            return true;
+        }
+        // repeated elements are hashed by position, fields by number
+        Frame root = { var.get(), var->asMap().begin(), var->isMap() ? 5u : 6u };
+        mStack.assign(1, root);
+        while (!mStack.empty()) {
+            if (Limits::expired()) {
+                return false;
+            }
+            Frame & frame = mStack.back();
+            if (frame.it == frame.node->asMap().end()) {
+                const uint64_t hash = frame.hash;
+                mHashes[frame.node] = hash;
+                mStack.pop_back();
+                if (!mStack.empty()) {
+                    Frame & parent = mStack.back();
+                    parent.hash = mix(mix(parent.hash, parent.it->first), hash);
+                    ++parent.it;
+                }
+                continue;
+            }
+            const RawMessage::Variant * child = frame.it->second.get();
+            if (!child->isMap() && !child->isRepeated()) {
+                frame.hash = mix(mix(frame.hash, frame.it->first), hashValue(*child));
+                ++frame.it;
+            } else {
+                Frame next = { child, child->asMap().begin(), child->isMap() ? 5u : 6u };
+                mStack.push_back(next);
+            }
+        }
+        return true;
+    }
+
+    uint64_t hashOf(const VariantPtr & var) const {
+        if (isScalar(var)) {
+            return hashValue(*var);
+        }
+        return mHashes.find(var.get())->second;
+    }
+
+    static bool isScalar(const VariantPtr & var) {
+        return !var->isMap() && !var->isRepeated();
+    }
+
+    // single value is treated as repeated field of one element
+    static void elements(const VariantPtr & var, std::vector<VariantPtr> & result) {
+        if (var->isRepeated()) {
+            const RawMessage::KeyValueMap & items = var->asMap();
+            for (RawMessage::KeyValueMap::const_iterator it = items.begin(); it != items.end(); ++it) {
+                result.push_back(it->second);
+            }
+        } else {
+            result.push_back(var);
+        }
+    }
+
+    // differences are found by tasks on explicit stack, so nesting depth
+    // of messages doesn't use call stack; a task expands into tasks for
+    // its fields which are pushed in reverse to be reported in order
+    void run(const VariantPtr & a, const VariantPtr & b) {
+        mTasks.push_back(Task(tCompare, a, b, kRoot));
+        std::vector<Task> expanded;
+        while (!mTasks.empty() && !Limits::expired()) {
+            Task task;
+            std::swap(task, mTasks.back());
+            mTasks.pop_back();
+            switch (task.kind) {
+            case tCompare:
+                expanded.clear();
+                compare(task.a, task.b, task.path, expanded);
+                mTasks.insert(mTasks.end(), expanded.rbegin(), expanded.rend());
+                break;
+            case tChange:
+                compareElement(task.a, task.b, task.path);
+                break;
+            case tRemove:
+                report('-', task.path, task.a);
+                break;
+            case tAdd:
+                report('+', task.path, task.b);
+                break;
+            }
+        }
+    }
+
+    void compare(const VariantPtr & a, const VariantPtr & b, size_t base, std::vector<Task> & out) {
+        const RawMessage::KeyValueMap & as = a->asMap();
+        const RawMessage::KeyValueMap & bs = b->asMap();
+        RawMessage::KeyValueMap::const_iterator i = as.begin(), j = bs.begin();
+        while (i != as.end() || j != bs.end()) {
+            if (j == bs.end() || (i != as.end() && i->first < j->first)) {
+                out.push_back(Task(tRemove, i->second, VariantPtr(), segment(base, i->first, false)));
+                ++i;
+            } else if (i == as.end() || j->first < i->first) {
+                out.push_back(Task(tAdd, VariantPtr(), j->second, segment(base, j->first, false)));
+                ++j;
+            } else {
+                const size_t path = segment(base, i->first, false);
+                if (i->second->isRepeated() || j->second->isRepeated()) {
+                    compareField(i->second, j->second, path, out);
+                } else if (hashOf(i->second) != hashOf(j->second)) {
+                    out.push_back(Task(tChange, i->second, j->second, path));
+                }
+                ++i;
+                ++j;
+            }
+        }
+    }
+
+    void compareField(const VariantPtr & a, const VariantPtr & b, size_t path, std::vector<Task> & out) {
+        std::vector<VariantPtr> as, bs;
+        elements(a, as);
+        elements(b, bs);
+        std::vector<uint64_t> ah(as.size()), bh(bs.size());
+        for (size_t i = 0; i < as.size(); ++i) ah[i] = hashOf(as[i]);
+        for (size_t j = 0; j < bs.size(); ++j) bh[j] = hashOf(bs[j]);
+
+        // common prefix and suffix are cut before alignment
+        size_t begin = 0, aEnd = as.size(), bEnd = bs.size();
+        while (begin < aEnd && begin < bEnd && ah[begin] == bh[begin]) {
+            ++begin;
+        }
+        while (aEnd > begin && bEnd > begin && ah[aEnd - 1] == bh[bEnd - 1]) {
+            --aEnd;
+            --bEnd;
+        }
+
+        // matched pairs of the middle, then a sentinel at both ends
+        Pairs matches;
+        align(ah, bh, begin, aEnd, begin, bEnd, matches);
+        matches.push_back(std::make_pair(aEnd, bEnd));
+
+        size_t ai = begin, bi = begin;
+        Pairs pairs;
+        for (size_t m = 0; m < matches.size(); ++m) {
+            // unmatched runs between matches: similar elements are compared
+            // as changed, others are removed or added
+            pairs.clear();
+            pair(as, bs, ai, matches[m].first, bi, matches[m].second, pairs);
+            pairs.push_back(matches[m]);
+            for (size_t p = 0; p < pairs.size(); ++p) {
+                for (; ai < pairs[p].first; ++ai) {
+                    out.push_back(Task(tRemove, as[ai], VariantPtr(), segment(path, ai, true)));
+                }
+                for (; bi < pairs[p].second; ++bi) {
+                    out.push_back(Task(tAdd, VariantPtr(), bs[bi], segment(path, bi, true)));
+                }
+                if (p + 1 < pairs.size() && ah[ai] != bh[bi]) {
+                    out.push_back(Task(tChange, as[ai], bs[bi], segment(path, ai, true)));
+                }
+                ++ai;
+                ++bi;
+            }
+        }
+    }
+
+    // a and b have different hashes
+    void compareElement(const VariantPtr & a, const VariantPtr & b, size_t path) {
+        if (a->isMap() && b->isMap()) {
+            mTasks.push_back(Task(tCompare, a, b, path));
+        } else if (isScalar(a) && isScalar(b)) {
+            mDiffers = true;
+            mOs << "~ " << pathOf(path) << ": " << *a << " -> " << *b << "\n";
+        } else {
+            report('-', path, a);
+            report('+', path, b);
+        }
+    }
+
+    // longest common subsequence of element hashes by Myers' O((N+M)D)
+    // algorithm, cost grows with number of edits D rather than with the
+    // product of lengths; when edits are too many for the kept trace the
+    // quadratic table is tried
+    void align(
+        const std::vector<uint64_t> & ah,
+        const std::vector<uint64_t> & bh,
+        size_t a0, size_t a1,
+        size_t b0, size_t b1,
+        Pairs & matches
+    ) const {
+        const long n = (long) (a1 - a0), m = (long) (b1 - b0);
+        if (!n || !m) {
+            return;
+        }
+        const uint64_t * ap = &ah[a0];
+        const uint64_t * bp = &bh[b0];
+
+        // v[k] is the furthest x on diagonal k = x - y, trace[d] keeps
+        // v[-d-1..d+1] before step d for backtracking
+        const long max = n + m;
+        std::vector<long> v(2 * max + 3, 0);
+        const long offset = max + 1;
+        std::vector< std::vector<long> > trace;
+        size_t cells = 0;
+        long d = 0;
+        for (bool done = false; !done; ++d) {
+            cells += 2 * d + 3;
+            if (cells > kMaxLcsCells) {
+                table(a0, a1, b0, b1, matches, [&](size_t i, size_t j) {
+                    return ah[i] == bh[j] ? 1 : 0;
+                });
+                return;
+            }
+            trace.push_back(std::vector<long>(v.begin() + offset - d - 1, v.begin() + offset + d + 2));
+            for (long k = -d; k <= d && !done; k += 2) {
+                long x = (k == -d || (k != d && v[offset + k - 1] < v[offset + k + 1])) ?
+                    v[offset + k + 1] : v[offset + k - 1] + 1;
+                long y = x - k;
+                while (x < n && y < m && ap[x] == bp[y]) {
+                    ++x;
+                    ++y;
+                }
+                v[offset + k] = x;
+                done = x >= n && y >= m;
+            }
+        }
+
+        const size_t first = matches.size();
+        long x = n, y = m;
+        while (d-- > 0) {
+            // w[i] is v[i - d - 1] before step d
+            const std::vector<long> & w = trace[d];
+            const long k = x - y;
+            const long prev = (k == -d || (k != d && w[k + d] < w[k + d + 2])) ? k + 1 : k - 1;
+            const long px = w[prev + d + 1], py = px - prev;
+            while (x > px && y > py) {
+                --x;
+                --y;
+                matches.push_back(std::make_pair(a0 + x, b0 + y));
+            }
+            x = px;
+            y = py;
+        }
+        std::reverse(matches.begin() + first, matches.end());
+    }
+
+    // order preserving pairs of similar elements with the largest total
+    // similarity: number of equal fields of messages, scalars of one type
+    // are alike
+    void pair(
+        const std::vector<VariantPtr> & as,
+        const std::vector<VariantPtr> & bs,
+        size_t a0, size_t a1,
+        size_t b0, size_t b1,
+        Pairs & pairs
+    ) {
+        if (a0 == a1 || b0 == b1 || (a1 - a0 + 1) * (b1 - b0 + 1) > kMaxLcsCells) {
+            return;
+        }
+        // field hashes of every element are computed once
+        typedef std::vector< std::pair<unsigned, uint64_t> > Fields;
+        std::vector<Fields> af(a1 - a0), bf(b1 - b0);
+        auto fields = [&](const VariantPtr & var, Fields & result) {
+            if (var->isMap()) {
+                const RawMessage::KeyValueMap & items = var->asMap();
+                for (RawMessage::KeyValueMap::const_iterator it = items.begin(); it != items.end(); ++it) {
+                    result.push_back(std::make_pair(it->first, hashOf(it->second)));
+                }
+            }
+        };
+        for (size_t i = a0; i < a1; ++i) fields(as[i], af[i - a0]);
+        for (size_t j = b0; j < b1; ++j) fields(bs[j], bf[j - b0]);
+
+        table(a0, a1, b0, b1, pairs, [&](size_t i, size_t j) {
+            const VariantPtr & a = as[i];
+            const VariantPtr & b = bs[j];
+            if (isScalar(a) || isScalar(b)) {
+                return isScalar(a) && isScalar(b) && a->isString() == b->isString() &&
+                       a->isInt() == b->isInt() ? 1 : 0;
+            }
+            const Fields & x = af[i - a0];
+            const Fields & y = bf[j - b0];
+            int result = 0;
+            for (size_t k = 0, l = 0; k < x.size() && l < y.size(); ) {
+                if (x[k].first < y[l].first) {
+                    ++k;
+                } else if (y[l].first < x[k].first) {
+                    ++l;
+                } else {
+                    result += x[k++].second == y[l++].second;
+                }
+            }
+            return result;
+        });
+    }
+
+    // table of best total scores of suffixes, so result is read in forward
+    // order; ranges too large for the table are left unmatched
+    template <class F>
+    static void table(size_t a0, size_t a1, size_t b0, size_t b1, Pairs & result, F score) {
+        const size_t n = a1 - a0, m = b1 - b0;
+        if (!n || !m || (n + 1) * (m + 1) > kMaxLcsCells) {
+            return;
+        }
+        std::vector<int> scores(n * m);
+        std::vector<uint32_t> best((n + 1) * (m + 1), 0);
+        for (size_t i = n; i-- > 0; ) {
+            for (size_t j = m; j-- > 0; ) {
+                const int s = scores[i * m + j] = score(a0 + i, b0 + j);
+                best[i * (m + 1) + j] = std::max(
+                    s ? best[(i + 1) * (m + 1) + j + 1] + s : 0,
+                    std::max(best[(i + 1) * (m + 1) + j], best[i * (m + 1) + j + 1]));
+            }
+        }
+        for (size_t i = 0, j = 0; i < n && j < m; ) {
+            const int s = scores[i * m + j];
+            if (s && best[i * (m + 1) + j] == best[(i + 1) * (m + 1) + j + 1] + s) {
+                result.push_back(std::make_pair(a0 + i, b0 + j));
+                ++i;
+                ++j;
+            } else if (best[(i + 1) * (m + 1) + j] >= best[i * (m + 1) + j + 1]) {
+                ++i;
+            } else {
+                ++j;
+            }
+        }
+    }
+
+    void report(char sign, size_t path, const VariantPtr & var) {
+        mDiffers = true;
+        if (isScalar(var)) {
+            mOs << sign << ' ' << pathOf(path) << ": " << *var << "\n";
+            return;
+        }
+        mOs << sign << ' ' << pathOf(path) << (var->isMap() ? " {\n" : " [\n");
+        RawMessage::printMessageInternal(var->asMap(), mOs, 1);
+        mOs << (var->isMap() ? "}\n" : "]\n");
+    }
+
+    size_t segment(size_t parent, size_t key, bool index) {
+        const Segment segment = { parent, key, index };
+        mSegments.push_back(segment);
+        return mSegments.size() - 1;
+    }
+
+    // like 1[2].3
+    std::string pathOf(size_t last) const {
+        std::vector<const Segment *> chain;
+        for (size_t i = last; i != kRoot; i = mSegments[i].parent) {
+            chain.push_back(&mSegments[i]);
+        }
+        std::string path;
+        char buffer[24];
+        for (size_t i = chain.size(); i-- > 0; ) {
+            if (chain[i]->index) {
+                snprintf(buffer, sizeof(buffer), "[%zu]", chain[i]->key);
+            } else {
+                snprintf(buffer, sizeof(buffer), path.empty() ? "%zu" : ".%zu", chain[i]->key);
+            }
+            path += buffer;
+        }
+        return path;
+    }
+
+    std::ostream & mOs;
+    bool mDiffers;
+    std::vector<Frame> mStack;
+    std::vector<Task> mTasks;
+    std::vector<Segment> mSegments;
+    std::unordered_map<const RawMessage::Variant *, uint64_t> mHashes;
+}; // MessageDiff
@@ -0,0 +1,199 @@
+// ///////////////////////////////////////////////////////////////////////// //
+//                                                                           //
+//   Copyright (C) 2014-2018 by Oleg Polivets                                //
+//   jsbot@ya.ru                                                             //
+//                                                                           //
+//   This program is free software; you can redistribute it and/or modify    //
+//   it under the terms of the GNU General Public License as published by    //
+//   the Free Software Foundation; either version 2 of the License, or       //
+//   (at your option) any later version.                                     //
+//                                                                           //
+//   This program is distributed in the hope that it will be useful,         //
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of          //
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           //
+//   GNU General Public License for more details.                            //
+//                                                                           //
+// ///////////////////////////////////////////////////////////////////////// //
+
+#pragma once
+
+#if defined(__linux__)
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "protoraw.hpp"
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Descriptors in memory of a running process (--pid). Readable regions
+// listed in /proc/PID/maps are copied by chunks with process_vm_readv, so
+// the process is neither stopped nor traced and only one chunk per thread
+// is in memory. Chunks overlap by kOverlap bytes: descriptor is reported
+// by the chunk it starts in, and descriptors longer than the overlap may
+// be missed at chunk boundaries.
+class ProcessScanner {
+public:
+    struct Region {
+        uint64_t begin;
+        uint64_t end;
+        std::string name;
+    };
+
+    static bool regions(pid_t pid, std::vector<Region> & result, std::string & error) {
+        std::stringstream path;
+        path << "/proc/" << pid << "/maps";
+        std::ifstream maps(path.str().c_str());
+        if (!maps.is_open()) {
+            error = "can't open " + path.str();
+            return false;
+        }
+        std::string line;
+        while (std::getline(maps, line)) {
+            // begin-end perms offset dev inode [name]
+            std::istringstream ss(line);
+            std::string range, perms, offset, dev, inode, name;
+            ss >> range >> perms >> offset >> dev >> inode;
+            std::getline(ss >> std::ws, name);
+            const size_t dash = range.find('-');
+            if (perms.empty() || perms[0] != 'r' || dash == std::string::npos) {
+                continue;
+            }
+            // kernel pages and device memory are not data of the process
+            if (name == "[vvar]" || name == "[vsyscall]" || name == "[vdso]" ||
+                !name.compare(0, 5, "/dev/")) {
+                continue;
+            }
+            Region region;
+            region.begin = strtoull(range.c_str(), NULL, 16);
+            region.end = strtoull(range.c_str() + dash + 1, NULL, 16);
+            region.name = name;
+            if (region.begin < region.end) {
+                result.push_back(region);
+            }
+        }
+        return true;
+    }
+
+    static bool collect(
+        pid_t pid,
+        std::vector< Serialized_pb::Found > & found,
+        std::string & error,
+        unsigned threads = 0
+    ) {
+        std::vector<Region> mapped;
+        if (!regions(pid, mapped, error)) {
+            return false;
+        }
+
+        // chunks are scanned in parallel, results are kept in their order
+        struct Chunk {
+            size_t region;
+            uint64_t begin;
+            uint64_t end; // of data to report, reading goes on to overlap
+        };
+        std::vector<Chunk> chunks;
+        for (size_t i = 0; i < mapped.size(); ++i) {
+            for (uint64_t b = mapped[i].begin; b < mapped[i].end; b += kChunkSize) {
+                Chunk chunk = { i, b, std::min<uint64_t>(b + kChunkSize, mapped[i].end) };
+                chunks.push_back(chunk);
+            }
+        }
+        std::vector< std::vector< Serialized_pb::Found > > results(chunks.size());
+        std::atomic<size_t> next(0);
+        std::atomic<uint64_t> readBytes(0);
+
+        const Limits::Request request = Limits::request();
+        auto work = [&]() {
+            Limits::Scope scope(request);
+            std::vector<unsigned char> buffer;
+            for (size_t i; (i = next++) < chunks.size(); ) {
+                const Chunk & chunk = chunks[i];
+                const Region & region = mapped[chunk.region];
+                const uint64_t end = std::min<uint64_t>(chunk.end + kOverlap, region.end);
+                const size_t size = read(pid, chunk.begin, end, buffer);
+                if (!size) {
+                    continue;
+                }
+                readBytes += size;
+                const unsigned char * b = buffer.data();
+                const unsigned char * reportEnd = b + (chunk.end - chunk.begin);
+                Serialized_pb::scan(b, b + buffer.size(),
+                    [&](const RawMessage & msg, const unsigned char * p, const unsigned char * e) {
+                        if (p >= reportEnd) {
+                            return false; // next chunk reports it
+                        }
+                        std::stringstream origin;
+                        origin << "pid " << pid << " 0x" << std::hex << (chunk.begin + (p - b));
+                        if (!region.name.empty()) {
+                            origin << " " << region.name;
+                        }
+                        results[i].push_back(Serialized_pb::Found());
+                        results[i].back().message = msg;
+                        results[i].back().data.assign(p, e);
+                        results[i].back().origin = origin.str();
+                        return true;
+                    });
+            }
+        };
+
+        if (!threads) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        threads = (unsigned) std::max<size_t>(1, std::min<size_t>(threads, chunks.size()));
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threads; ++i) {
+            workers.push_back(std::thread(work));
+        }
+        work();
+        for (size_t i = 0; i < workers.size(); ++i) {
+            workers[i].join();
+        }
+
+        if (!readBytes) {
+            error = "can't read memory of the process";
+            return false;
+        }
+        for (size_t i = 0; i < results.size(); ++i) {
+            found.insert(found.end(), results[i].begin(), results[i].end());
+        }
+        return true;
+    }
+
+private:
+    static const uint64_t kChunkSize = 8 << 20;
+    static const uint64_t kOverlap   = 1 << 20;
+    static const uint64_t kPageSize  = 4096;
+
+    // copy [begin, end) into buffer followed by two zero bytes; pages which
+    // can't be read are left zero, returns number of bytes read
+    static size_t read(pid_t pid, uint64_t begin, uint64_t end, std::vector<unsigned char> & buffer) {
+        buffer.assign(end - begin + 2, 0);
+        size_t done = 0, total = 0;
+        while (begin + done < end) {
+            iovec local  = { &buffer[done], (size_t) (end - begin - done) };
+            iovec remote = { (void *) (uintptr_t) (begin + done), (size_t) (end - begin - done) };
+            const ssize_t n = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+            if (n > 0) {
+                done += n;
+                total += n;
+            } else if (n < 0 && errno == EFAULT) {
+                // skip unreadable page
+                done = std::min<uint64_t>((begin + done + kPageSize) / kPageSize * kPageSize - begin, end - begin);
+            } else {
+                break;
+            }
+        }
+        return total;
+    }
+}; // ProcessScanner
+
+#endif // __linux__
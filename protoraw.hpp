@@ -18,23 +18,685 @@
 #pragma once
 
 #include <iostream>
+#include <fstream>
 #include <map>
+#include <deque>
+#include <vector>
 #include <stack>
+#include <functional>
 #include <memory>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
 #include <sstream>
 #include <algorithm>
 #include <stdexcept>
+#include <unordered_map>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <mutex>
+#include <thread>
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Counters of the work done by the current thread. Counting is a plain
+// increment of thread local memory, so counters are always enabled; phase
+// timers read clocks only after enable() is called (--stats).
+class Stats {
+public:
+    enum COUNTER {
+        scBytesScanned,
+        scCandidatesProbed,
+        scValidationsAttempted,
+        scValidationsPassed,
+        scParseAttempted,
+        scParseFailedEmpty,
+        scParseFailedTruncated,
+        scParseFailedWireType,
+        scParseFailedLength,
+        scNodesAllocated,
+        scNodesRecycled,
+        scFilesWritten,
+        scLimitsExceeded,
+        scChunksScanned,
+        scChunksReused,
+        scCount
+    };
+
+    enum PHASE {
+        phOther,
+        phRead,
+        phScan,    // candidates are counted only, timing each would
+                   // cost more than probing it
+        phParse,
+        phRender,
+        phWrite,
+        phCount
+    };
+
+    // switches phase of the current thread for the scope
+    class Timer {
+    public:
+        explicit Timer(PHASE phase)
+            : mPrevious(local().switchTo(phase))
+        {
+        }
+        ~Timer() {
+            local().switchTo(mPrevious);
+        }
+    private:
+        PHASE mPrevious;
+    };
+
+    static void count(COUNTER counter, uint64_t value = 1) {
+        add(local().mCounters[counter], value);
+    }
+
+    static void enable() {
+        enabled() = true;
+        local().switchTo(local().mPhase);
+    }
+
+    static Stats & local() {
+        thread_local Stats stats;
+        return stats;
+    }
+
+    // counters and phase times of all threads, living and finished
+    static Stats total() {
+        Stats result(false);
+        local().switchTo(local().mPhase);
+        Registry & registry = getRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        result.merge(*registry.retired);
+        for (size_t i = 0; i < registry.threads.size(); ++i) {
+            result.merge(*registry.threads[i]);
+        }
+        return result;
+    }
+
+    Stats(const Stats & other)
+        : mPhase(other.mPhase)
+        , mLastWall(0)
+        , mLastCpu(0)
+        , mRegistered(false)
+    {
+        clear();
+        merge(other);
+    }
+
+    uint64_t counter(COUNTER counter) const {
+        return mCounters[counter].load(std::memory_order_relaxed);
+    }
+
+    static void printJson(std::ostream & os) {
+        static const char * counters[] = {
+            "bytes_scanned", "candidates_probed", "validations_attempted",
+            "validations_passed", "parse_attempted", "parse_failed_empty",
+            "parse_failed_truncated", "parse_failed_wire_type",
+            "parse_failed_length", "nodes_allocated", "nodes_recycled",
+            "files_written", "limits_exceeded", "chunks_scanned", "chunks_reused"
+        };
+        static const char * phases[] = {
+            "other", "read", "scan", "parse", "render", "write"
+        };
+        const Stats stats = total();
+        double wall = 0, cpu = 0;
+        os << "{\n  \"counters\": {";
+        for (int i = 0; i < scCount; ++i) {
+            os << (i ? "," : "") << "\n    \"" << counters[i] << "\": " << stats.mCounters[i];
+        }
+        os << "\n  },\n  \"phases\": {";
+        for (int i = 0; i < phCount; ++i) {
+            os << (i ? "," : "") << "\n    \"" << phases[i] << "\": { \"wall_ms\": "
+               << stats.mWall[i] * 1e-6 << ", \"cpu_ms\": " << stats.mCpu[i] * 1e-6 << " }";
+            wall += stats.mWall[i] * 1e-6;
+            cpu  += stats.mCpu[i] * 1e-6;
+        }
+        os << "\n  },\n"
+           << "  \"wall_ms\": " << wall << ",\n"
+           << "  \"cpu_ms\": " << cpu << ",\n"
+           << "  \"peak_rss_kb\": " << peakRss() << "\n"
+           << "}" << std::endl;
+    }
+
+    ~Stats() {
+        if (!mRegistered) {
+            return;
+        }
+        switchTo(mPhase);
+        Registry & registry = getRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.retired->merge(*this);
+        registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), this));
+    }
+
+private:
+    struct Registry {
+        std::mutex mutex;
+        std::vector< Stats * > threads;
+        std::unique_ptr< Stats > retired; // counters of finished threads
+        Registry() : retired(new Stats(false)) {}
+    };
+
+    static Registry & getRegistry() {
+        static Registry registry;
+        return registry;
+    }
+
+    static std::atomic<bool> & enabled() {
+        static std::atomic<bool> flag(false);
+        return flag;
+    }
+
+    explicit Stats(bool registered = true)
+        : mPhase(phOther)
+        , mLastWall(0)
+        , mLastCpu(0)
+        , mRegistered(registered)
+    {
+        clear();
+        if (mRegistered) {
+            Registry & registry = getRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.threads.push_back(this);
+        }
+    }
+
+    // values are changed by their own thread only (retired ones under the
+    // registry lock) and read by total() from any thread
+    typedef std::atomic<uint64_t> Value;
+
+    static void add(Value & value, uint64_t delta) {
+        value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    void clear() {
+        for (int i = 0; i < scCount; ++i) mCounters[i].store(0, std::memory_order_relaxed);
+        for (int i = 0; i < phCount; ++i) mWall[i].store(0, std::memory_order_relaxed);
+        for (int i = 0; i < phCount; ++i) mCpu[i].store(0, std::memory_order_relaxed);
+    }
+
+    void merge(const Stats & other) {
+        for (int i = 0; i < scCount; ++i) add(mCounters[i], other.mCounters[i].load(std::memory_order_relaxed));
+        for (int i = 0; i < phCount; ++i) add(mWall[i], other.mWall[i].load(std::memory_order_relaxed));
+        for (int i = 0; i < phCount; ++i) add(mCpu[i], other.mCpu[i].load(std::memory_order_relaxed));
+    }
+
+    // charge time since previous switch to the current phase
+    PHASE switchTo(PHASE phase) {
+        const PHASE previous = mPhase;
+        if (enabled().load(std::memory_order_relaxed)) {
+            const uint64_t wall = wallNow(), cpu = cpuNow();
+            if (mLastWall) {
+                add(mWall[mPhase], wall - mLastWall);
+                add(mCpu[mPhase], cpu - mLastCpu);
+            }
+            mLastWall = wall;
+            mLastCpu  = cpu;
+        }
+        mPhase = phase;
+        return previous;
+    }
+
+    // nanoseconds
+    static uint64_t wallNow() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static uint64_t cpuNow() {
+#if defined(_WIN32)
+        return static_cast<uint64_t>(std::clock()) * (1000000000 / CLOCKS_PER_SEC);
+#else
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+    }
+
+    static long peakRss() {
+#if defined(_WIN32)
+        return 0;
+#else
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+#endif
+    }
+
+    Value mCounters[scCount];
+    Value mWall[phCount];
+    Value mCpu[phCount];
+    PHASE mPhase;
+    uint64_t mLastWall;
+    uint64_t mLastCpu;
+    bool mRegistered;
+}; // Stats
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Budgets for decoding of untrusted input (--max-depth, --max-nodes,
+// --max-bytes, --max-steps, --timeout). Hot loops check them with plain
+// counters of the current thread, the clock is read once per kClockStride
+// checks. Work which runs out of budget stops and keeps what was decoded
+// so far; exceeded() tells which limit was hit. Zero means no limit.
+class Limits {
+public:
+    enum KIND {
+        lkNone,
+        lkDepth,
+        lkNodes,
+        lkBytes,
+        lkSteps,
+        lkTime
+    };
+
+    struct Budget {
+        Budget()
+            : depth(0)
+            , nodes(0)
+            , bytes(0)
+            , steps(0)
+            , timeMs(0)
+        {
+        }
+
+        size_t depth;    // nesting of messages in one parse
+        size_t nodes;    // values decoded by one parse
+        size_t bytes;    // memory of values decoded by one parse, and
+                         // of one inflated archive entry
+        size_t steps;    // fields read while validating one candidate
+        uint64_t timeMs; // wall time of request, see Scope
+    };
+
+    // budget of threads and requests, set before they are started
+    static Budget & defaults() {
+        static Budget budget;
+        return budget;
+    }
+
+    // budget and deadline of request, may be passed to worker threads
+    struct Request {
+        Budget budget;
+        uint64_t deadline; // steady clock nanoseconds, 0 is none
+    };
+
+    // request handled by the current thread for the scope; deadline starts
+    // when it's made from a budget
+    class Scope {
+    public:
+        explicit Scope(const Budget & budget = defaults())
+            : mPrevious(Limits::request())
+            , mExceeded(exceeded())
+        {
+            Request request = { budget, budget.timeMs ? now() + budget.timeMs * 1000000 : 0 };
+            start(request);
+        }
+        explicit Scope(const Request & request)
+            : mPrevious(Limits::request())
+            , mExceeded(exceeded())
+        {
+            start(request);
+        }
+        ~Scope() {
+            // limit hit inside is seen by the enclosing request too
+            const KIND kind = exceeded();
+            start(mPrevious);
+            state().exceeded = mExceeded != lkNone ? mExceeded : kind;
+        }
+    private:
+        static void start(const Request & request) {
+            State & s = state();
+            s.request = request;
+            s.exceeded = lkNone;
+            s.countdown = kClockStride;
+        }
+
+        Request mPrevious;
+        KIND mExceeded;
+    };
+
+    static const Budget & budget() {
+        return state().request.budget;
+    }
+    static Request request() {
+        return state().request;
+    }
+
+    // deadline of request has passed
+    static bool expired() {
+        State & s = state();
+        if (!s.request.deadline) {
+            return false;
+        }
+        if (s.exceeded == lkTime) {
+            return true;
+        }
+        if (--s.countdown) {
+            return false;
+        }
+        s.countdown = kClockStride;
+        if (now() < s.request.deadline) {
+            return false;
+        }
+        exceed(lkTime);
+        return true;
+    }
+
+    static void exceed(KIND kind) {
+        State & s = state();
+        if (s.exceeded == lkNone) {
+            s.exceeded = kind;
+        }
+        Stats::count(Stats::scLimitsExceeded);
+    }
+
+    // first limit hit by the current request
+    static KIND exceeded() {
+        return state().exceeded;
+    }
+
+    static const char * name(KIND kind) {
+        static const char * names[] = {
+            "", "nesting depth", "number of values", "memory", "validation steps", "time"
+        };
+        return names[kind];
+    }
+
+private:
+    enum { kClockStride = 1024 };
+
+    struct State {
+        explicit State(const Budget & budget)
+            : exceeded(lkNone)
+            , countdown(kClockStride)
+        {
+            request.budget = budget;
+            request.deadline = 0;
+        }
+
+        Request request;
+        KIND exceeded;
+        unsigned countdown;
+    };
+
+    static State & state() {
+        thread_local State s(defaults());
+        return s;
+    }
+
+    static uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+}; // Limits
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Byte ranges of decoded fields, filled by RawMessage::parse on request.
+// Fields are kept in the order of their tags, so the field holding an
+// offset is found by binary search and a walk up to the enclosing field.
+class OffsetIndex {
+public:
+    enum : uint32_t { kNone = ~0u };
+
+    enum KIND {
+        fkValue,    // varint, fixed32 or fixed64
+        fkString,
+        fkMessage,
+        fkPacked
+    };
+
+    struct Field {
+        uint64_t start;      // of the tag
+        uint64_t value;      // after tag and length
+        uint64_t end;
+        uint32_t parent;     // enclosing message field or kNone
+        uint32_t number;
+        uint32_t occurrence; // of the number in enclosing message
+        uint8_t  kind;
+        uint8_t  type;       // wire type
+        uint8_t  repeated;
+    };
+
+    void clear() {
+        mFields.clear();
+    }
+
+    const std::vector<Field> & fields() const {
+        return mFields;
+    }
+
+    // innermost field holding the byte at offset, kNone if there is none
+    uint32_t find(uint64_t offset) const {
+        std::vector<Field>::const_iterator it = std::upper_bound(mFields.begin(), mFields.end(), offset,
+            [](uint64_t value, const Field & field) {
+                return value < field.start;
+            });
+        if (it == mFields.begin()) {
+            return kNone;
+        }
+        uint32_t i = (uint32_t) (it - mFields.begin() - 1);
+        while (i != kNone && mFields[i].end <= offset) {
+            i = mFields[i].parent;
+        }
+        return i;
+    }
+
+    // field numbers from the root like 1[2].4, index is shown for
+    // repeated fields
+    std::string path(uint32_t i) const {
+        std::vector<uint32_t> chain;
+        for (; i != kNone; i = mFields[i].parent) {
+            chain.push_back(i);
+        }
+        std::stringstream ss;
+        for (size_t j = chain.size(); j-- > 0; ) {
+            const Field & field = mFields[chain[j]];
+            ss << field.number;
+            if (field.repeated) {
+                ss << '[' << field.occurrence << ']';
+            }
+            if (j) {
+                ss << '.';
+            }
+        }
+        return ss.str();
+    }
+
+    size_t depth(uint32_t i) const {
+        size_t result = 0;
+        for (i = mFields[i].parent; i != kNone; i = mFields[i].parent) {
+            ++result;
+        }
+        return result;
+    }
+
+private:
+    friend class RawMessage;
+
+    std::vector<Field> mFields;
+}; // OffsetIndex
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Free lists of small blocks, one set per thread. Nodes of decoded trees,
+// their reference counts and map entries are taken from here, so a thread
+// which decodes message after message reuses the blocks of previous trees
+// instead of calling malloc and free. Block freed by other thread than the
+// one which took it joins the lists of the freeing thread.
+class NodePool {
+public:
+    static void * allocate(size_t size) {
+        const size_t c = sizeClass(size);
+        if (c < kClasses && !finished()) {
+            Lists & lists = local();
+            lists.taken += blockSize(c);
+            if (void * block = lists.heads[c]) {
+                lists.heads[c] = *static_cast<void **>(block);
+                lists.cached -= blockSize(c);
+                return block;
+            }
+            return ::operator new(blockSize(c));
+        }
+        return ::operator new(size);
+    }
+
+    static void deallocate(void * block, size_t size) {
+        const size_t c = sizeClass(size);
+        if (c < kClasses && !finished()) {
+            Lists & lists = local();
+            if (lists.cached + blockSize(c) <= kMaxCached) {
+                *static_cast<void **>(block) = lists.heads[c];
+                lists.heads[c] = block;
+                lists.cached += blockSize(c);
+                return;
+            }
+        }
+        ::operator delete(block);
+    }
+
+    // Blocks taken since the previous mark are what one parse used. The
+    // lists keep no more than the largest use of the last kWindow parses,
+    // so memory kept after a large message goes back to the heap once
+    // kWindow smaller ones are parsed.
+    static void mark() {
+        if (finished()) {
+            return;
+        }
+        Lists & lists = local();
+        lists.used[lists.next] = lists.taken;
+        lists.next = (lists.next + 1) % kWindow;
+        lists.taken = 0;
+        trim(lists, *std::max_element(lists.used, lists.used + kWindow));
+    }
+
+    // all free blocks of the thread go back to the heap
+    static void release() {
+        if (finished()) {
+            return;
+        }
+        Lists & lists = local();
+        memset(lists.used, 0, sizeof(lists.used));
+        lists.taken = 0;
+        trim(lists, 0);
+    }
+
+private:
+    // blocks are multiples of kAlign up to kAlign * kClasses bytes, memory
+    // kept by the lists of one thread is limited by kMaxCached
+    enum { kAlign = 16, kClasses = 16, kWindow = 16 };
+    static const size_t kMaxCached = 64 << 20;
+
+    struct Lists {
+        Lists()
+            : cached(0)
+            , taken(0)
+            , next(0)
+        {
+            memset(heads, 0, sizeof(heads));
+            memset(used, 0, sizeof(used));
+        }
+        ~Lists() {
+            finished() = true;
+            for (size_t c = 0; c < kClasses; ++c) {
+                while (void * block = heads[c]) {
+                    heads[c] = *static_cast<void **>(block);
+                    ::operator delete(block);
+                }
+            }
+        }
+        void * heads[kClasses];
+        size_t cached;
+        size_t taken;          // bytes taken since the last mark()
+        size_t used[kWindow];  // taken by the last parses
+        size_t next;
+    };
+
+    static void trim(Lists & lists, size_t keep) {
+        for (size_t c = kClasses; c-- > 0 && lists.cached > keep; ) {
+            while (lists.cached > keep && lists.heads[c]) {
+                void * block = lists.heads[c];
+                lists.heads[c] = *static_cast<void **>(block);
+                lists.cached -= blockSize(c);
+                ::operator delete(block);
+            }
+        }
+    }
+
+    static size_t sizeClass(size_t size) {
+        return size ? (size - 1) / kAlign : 0;
+    }
+    static size_t blockSize(size_t c) {
+        return (c + 1) * kAlign;
+    }
+
+    static Lists & local() {
+        thread_local Lists lists;
+        return lists;
+    }
+
+    // lists of exiting thread are gone, its blocks go back to the heap
+    static bool & finished() {
+        thread_local bool flag = false;
+        return flag;
+    }
+}; // NodePool
+
+// Stateless allocator of single objects from NodePool.
+template <class T>
+class PoolAllocator {
+public:
+    typedef T value_type;
+
+    template <class U>
+    struct rebind {
+        typedef PoolAllocator<U> other;
+    };
+
+    PoolAllocator() {}
+    template <class U>
+    PoolAllocator(const PoolAllocator<U> &) {}
+
+    T * allocate(size_t n) {
+        return static_cast<T *>(NodePool::allocate(n * sizeof(T)));
+    }
+    void deallocate(T * p, size_t n) {
+        NodePool::deallocate(p, n * sizeof(T));
+    }
+
+    template <class U>
+    bool operator==(const PoolAllocator<U> &) const {
+        return true;
+    }
+    template <class U>
+    bool operator!=(const PoolAllocator<U> &) const {
+        return false;
+    }
+}; // PoolAllocator
+
+// /////////////////////////////////////////////////////////////////// //
 
 class RawMessage {
 public:
 
     class Variant;
+    class View;
     typedef std::shared_ptr<Variant> VariantPtr;
-    typedef std::map<unsigned, VariantPtr> KeyValueMap;
+    typedef std::map<
+        unsigned,
+        VariantPtr,
+        std::less<unsigned>,
+        PoolAllocator< std::pair<const unsigned, VariantPtr> >
+    > KeyValueMap;
     friend std::ostream& operator<<(std::ostream & os, const Variant & var);
 
-    static const VariantPtr At(const KeyValueMap & map, unsigned k) {
+    static const VariantPtr & At(const KeyValueMap & map, unsigned k) {
         KeyValueMap::const_iterator it = map.find(k);
         if (it != map.end()) {
             return it->second;
@@ -44,16 +706,34 @@ public:
         throw std::logic_error(ss.str());
     }
 
-    VariantPtr rootItem() const {
+    // call f for the single value or every repeated value of field k
+    template <class F>
+    static void forEach(const KeyValueMap & map, unsigned k, F f) {
+        KeyValueMap::const_iterator it = map.find(k);
+        if (it == map.end()) {
+            return;
+        }
+        if (!it->second->isRepeated()) {
+            f(it->second);
+        } else {
+            const KeyValueMap & items = it->second->asMap();
+            for (KeyValueMap::const_iterator jt = items.begin(); jt != items.end(); ++jt) {
+                f(jt->second);
+            }
+        }
+    }
+
+    const VariantPtr & rootItem() const {
         assert( mRoot );
         return mRoot;
     }
-    KeyValueMap items() const {
+    const KeyValueMap & items() const {
         assert(mRoot && !mRoot->asMap().empty() );
         return mRoot->asMap();
     }
+    View view() const;
 
-    const VariantPtr operator[] (unsigned idx) const {
+    const VariantPtr & operator[] (unsigned idx) const {
         assert( !mRoot->asMap().empty() );
         KeyValueMap::const_iterator it = mRoot->asMap().find(idx);
         assert(it != mRoot->asMap().end());
@@ -141,6 +821,7 @@ public:
         case vtInteger: type = proto2Varint; break;
         case vtDouble:  type = proto2Double; break;
         case vtString:  type = proto2Buffer; break;
+        case vtNode:    type = proto2Buffer; break; // nested message
         case vtFloat:   type = proto2Float;  break;
         default: assert(!"unknown type");
         }
@@ -180,21 +861,50 @@ public:
         return mNodes[idx];
     }
 
+    // Recycled nodes are kept as NodePool keeps blocks: no more than
+    // the largest number made by one of the last kWindow parses
+    static void markRecycled() {
+        if (Recycled::finished()) {
+            return;
+        }
+        Recycled & recycled = Recycled::local();
+        recycled.used[recycled.next] = recycled.taken;
+        recycled.next = (recycled.next + 1) % kWindow;
+        recycled.taken = 0;
+        recycled.trim(*std::max_element(recycled.used, recycled.used + kWindow));
+    }
+
+    static void releaseRecycled() {
+        if (Recycled::finished()) {
+            return;
+        }
+        Recycled & recycled = Recycled::local();
+        memset(recycled.used, 0, sizeof(recycled.used));
+        recycled.taken = 0;
+        recycled.trim(0);
+        std::vector<Variant *>().swap(recycled.nodes);
+    }
+
+    // nodes are recycled per thread, see Recycler
     static VariantPtr make() {
-        return VariantPtr(new Variant());
+        return pooled(acquire(vtEmpty));
     }
     static VariantPtr makeMap() {
-        return VariantPtr(new Variant(vtNode));
+        return pooled(acquire(vtNode));
     }
     static VariantPtr makeRepeated() {
-        return VariantPtr(new Variant(vtRepeated));
+        return pooled(acquire(vtRepeated));
     }
     static VariantPtr make(const char * data, unsigned lenght) {
-        return VariantPtr(new Variant(data, lenght));
+        Variant * var = acquire(vtString);
+        var->mString.assign(data, lenght);
+        return pooled(var);
     }
     template <class T>
     static VariantPtr make(T value) {
-        return VariantPtr(new Variant(value));
+        Variant * var = acquire(vtEmpty);
+        var->assign(value);
+        return pooled(var);
     }
 
     bool isRepeated() const {
@@ -296,43 +1006,337 @@ private:
     KeyValueMap mNodes;  // subnodes for vtRepeated or vtMap data type
     unsigned mIndex;     // index of this field in root message
     unsigned mNumber;    // number of message in global instance
-};
 
-// ///////////////////////////////////////////////////////////////////////// //
+    enum { kMaxRecycled = 1 << 20, kMaxKeptString = 1024, kWindow = 16 };
 
-    template<class T>
-    static bool itsAsciiString(const T * beg, const T * end) {
-        for (; beg < end; ++beg) {
-            if (!*beg || !isprint(*beg)) {
-                return false;
+    // Deleter of nodes made by make(): released node goes to the list of
+    // the thread with its string buffer, so the next parse takes it with
+    // no allocation. Long buffers and nodes over the limit are freed.
+    struct Recycler {
+        void operator()(Variant * var) const {
+            if (Recycled::finished() || Recycled::local().nodes.size() >= kMaxRecycled) {
+                delete var;
+                return;
             }
+            var->mNodes.clear();
+            if (var->mString.capacity() > kMaxKeptString) {
+                std::string().swap(var->mString);
+            }
+            Recycled::local().nodes.push_back(var);
         }
-        return true;
-    }
+    };
 
-    template<class T>
-    static const T * readVarint(const T * beg, const T * end, int64_t & value, bool * ok = nullptr) {
-        int64_t temp = 0, cnt = 0;
-        for (value = 0; beg < end && cnt < 64; ++beg, cnt += 7) {
-            //assert(cnt < 16);
-            temp += static_cast<int64_t>(*beg & 0x7f) << cnt;
-            if (!(*beg & 0x80)) {
-                if (ok) {
-                    *ok = true;
-                }
-                ++beg;
-                break;
+    struct Recycled {
+        Recycled()
+            : taken(0)
+            , next(0)
+        {
+            memset(used, 0, sizeof(used));
+        }
+        ~Recycled() {
+            finished() = true;
+            trim(0);
+        }
+        void trim(size_t keep) {
+            while (nodes.size() > keep) {
+                delete nodes.back();
+                nodes.pop_back();
             }
         }
-#if DEBUG
-//        std::cerr << "readVarint() " << temp << std::endl;
-#endif
-        value = temp;
-        return beg;
+        static Recycled & local() {
+            thread_local Recycled recycled;
+            return recycled;
+        }
+        static bool & finished() {
+            thread_local bool flag = false;
+            return flag;
+        }
+        std::vector<Variant *> nodes;
+        size_t taken;          // nodes made since the last markRecycled()
+        size_t used[kWindow];  // made by the last parses
+        size_t next;
+    };
+
+    static Variant * acquire(TYPE type) {
+        Stats::count(Stats::scNodesAllocated);
+        Variant * var;
+        if (!Recycled::finished()) {
+            Recycled::local().taken += 1;
+        }
+        if (!Recycled::finished() && !Recycled::local().nodes.empty()) {
+            Stats::count(Stats::scNodesRecycled);
+            var = Recycled::local().nodes.back();
+            Recycled::local().nodes.pop_back();
+            var->mString.clear();
+        } else {
+            var = new Variant();
+        }
+        var->mDataType = type;
+        var->mSubNodesSize = 0;
+        var->mData.i = 0;
+        var->mIndex = 0;
+        var->mNumber = 0;
+        return var;
     }
 
-    template<class T>
-    static T * writeVarint(int64_t value, T * beg, T * end) {
+    static VariantPtr pooled(Variant * var) {
+        return VariantPtr(var, Recycler(), PoolAllocator<Variant>());
+    }
+
+    void assign(int64_t value) {
+        mDataType = vtInteger;
+        mData.i = value;
+    }
+    void assign(double value) {
+        mDataType = vtDouble;
+        mData.d = value;
+    }
+    void assign(float value) {
+        mDataType = vtFloat;
+        mData.f = value;
+    }
+};
+
+// ///////////////////////////////////////////////////////////////////////// //
+
+// Depth-first walk over decoded tree without recursion. The stack of
+// frames lives on the heap and is kept per thread, so walks don't grow
+// the thread stack with nesting and don't allocate once it has grown;
+// walks may be nested, every walk uses frames above the ones it found.
+//
+// Visitor gets Item of every field or element of the walked message:
+//   bool enter(const Item &) - message or repeated field, returns true to
+//                              walk its items
+//   void leave(const Item &) - after items of entered one
+//   void value(const Item &) - scalar value
+class Walker {
+public:
+    struct Item {
+        unsigned key;           // field number or index in repeated field
+        const VariantPtr & var;
+        size_t depth;           // 0 for items of the walked message
+        bool element;           // item of repeated field
+    };
+
+    template <class Visitor>
+    static void walk(const KeyValueMap & root, Visitor & visitor) {
+        std::vector<Frame> & stack = frames();
+        const size_t base = stack.size();
+        stack.push_back(Frame(root, false));
+        // frames are addressed by index: a nested walk in the visitor may
+        // reallocate the stack
+        while (stack.size() > base) {
+            const size_t top = stack.size() - 1;
+            if (stack[top].it == stack[top].end) {
+                stack.pop_back();
+                if (top > base) {
+                    const Frame & parent = stack[top - 1];
+                    const Item item = { parent.it->first, parent.it->second, top - base - 1, parent.repeated };
+                    visitor.leave(item);
+                    ++stack[top - 1].it;
+                }
+                continue;
+            }
+            const Frame & frame = stack[top];
+            const VariantPtr & var = frame.it->second;
+            const Item item = { frame.it->first, var, top - base, frame.repeated };
+            if (var->isMap() || var->isRepeated()) {
+                if (visitor.enter(item)) {
+                    stack.push_back(Frame(var->asMap(), var->isRepeated()));
+                    continue;
+                }
+            } else {
+                visitor.value(item);
+            }
+            ++stack[top].it;
+        }
+    }
+
+private:
+    struct Frame {
+        Frame(const KeyValueMap & map, bool isRepeated)
+            : it(map.begin())
+            , end(map.end())
+            , repeated(isRepeated)
+        {
+        }
+
+        KeyValueMap::const_iterator it;
+        KeyValueMap::const_iterator end;
+        bool repeated;
+    };
+
+    static std::vector<Frame> & frames() {
+        thread_local std::vector<Frame> stack;
+        return stack;
+    }
+}; // Walker
+
+// ///////////////////////////////////////////////////////////////////////// //
+
+// Read-only handle of decoded value. It doesn't own the node and is valid
+// while the message is alive; lookups neither copy maps nor touch reference
+// counts, so reading never allocates and a parsed tree may be read by many
+// threads at once. Missing field gives invalid view instead of exception.
+class View {
+public:
+    View()
+        : mVar(NULL)
+    {
+    }
+    View(const VariantPtr & var)
+        : mVar(var.get())
+    {
+    }
+    explicit View(const Variant * var)
+        : mVar(var)
+    {
+    }
+
+    bool valid() const {
+        return mVar != NULL;
+    }
+    const Variant & operator*() const {
+        assert(mVar);
+        return *mVar;
+    }
+    const Variant * operator->() const {
+        assert(mVar);
+        return mVar;
+    }
+
+    bool isMessage() const {
+        return mVar && mVar->isMap();
+    }
+    bool isRepeated() const {
+        return mVar && mVar->isRepeated();
+    }
+    bool isString() const {
+        return mVar && mVar->isString();
+    }
+    bool isInt() const {
+        return mVar && mVar->isInt();
+    }
+
+    const std::string & asString() const {
+        return (*this)->asString();
+    }
+    int64_t asInt() const {
+        return (*this)->asInt();
+    }
+    float asFloat() const {
+        return (*this)->asFloat();
+    }
+    double asDouble() const {
+        return (*this)->asDouble();
+    }
+
+    // fields of message or elements of repeated field
+    const KeyValueMap & fields() const {
+        return (*this)->asMap();
+    }
+    size_t size() const {
+        return fields().size();
+    }
+
+    bool has(unsigned k) const {
+        return field(k).valid();
+    }
+    View field(unsigned k) const {
+        const KeyValueMap & map = fields();
+        KeyValueMap::const_iterator it = map.find(k);
+        return it != map.end() ? View(it->second.get()) : View();
+    }
+    // field which has to be there
+    View at(unsigned k) const {
+        return View(At(fields(), k).get());
+    }
+
+    // typed values of field k, empty string or fallback when there is no
+    // such field; these don't throw
+    const std::string & getString(unsigned k) const {
+        static const std::string empty;
+        const View v = field(k);
+        return v.isString() ? v.asString() : empty;
+    }
+    int64_t getInt(unsigned k, int64_t fallback = 0) const {
+        const View v = field(k);
+        return v.isInt() ? v.asInt() : fallback;
+    }
+
+    // call f with view of the single value or every repeated value of field k
+    template <class F>
+    void forEach(unsigned k, F f) const {
+        const View v = field(k);
+        if (!v.valid()) {
+            return;
+        }
+        if (!v.isRepeated()) {
+            f(v);
+        } else {
+            const KeyValueMap & items = v.fields();
+            for (KeyValueMap::const_iterator it = items.begin(); it != items.end(); ++it) {
+                f(View(it->second.get()));
+            }
+        }
+    }
+
+private:
+    const Variant * mVar;
+}; // View
+
+// ///////////////////////////////////////////////////////////////////////// //
+
+    template<class T>
+    static bool itsAsciiString(const T * beg, const T * end) {
+        for (; beg < end; ++beg) {
+            if (!*beg || !isprint(*beg)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // quoted string with escaped non printable characters
+    static void printString(std::ostream & os, const char * str, size_t length) {
+        os << '"';
+        for (size_t i = 0; i < length; ++i) {
+            unsigned char ch = (unsigned char) str[i];
+            if (isascii(ch) && ch != 5 && ch != 00) {
+                os << str[i];
+            } else {
+                os << '\\';
+                if (ch < 100) os << '0';
+                if (ch <  99) os << '0';
+                os << (int)ch;
+            }
+        }
+        os << '"';
+    }
+
+    template<class T>
+    static const T * readVarint(const T * beg, const T * end, int64_t & value, bool * ok = nullptr) {
+        int64_t temp = 0, cnt = 0;
+        for (value = 0; beg < end && cnt < 64; ++beg, cnt += 7) {
+            //assert(cnt < 16);
+            temp += static_cast<int64_t>(*beg & 0x7f) << cnt;
+            if (!(*beg & 0x80)) {
+                if (ok) {
+                    *ok = true;
+                }
+                ++beg;
+                break;
+            }
+        }
+#if DEBUG
+//        std::cerr << "readVarint() " << temp << std::endl;
+#endif
+        value = temp;
+        return beg;
+    }
+
+    template<class T>
+    static T * writeVarint(int64_t value, T * beg, T * end) {
         while (beg < end) {
             if (value > 0x7f) {
                 *beg++ = (0x80 | (value & 0x7f));
@@ -365,10 +1369,20 @@ private:
                   <<   " end=0x" << std::hex << (std::ptrdiff_t) (e-p)
                   << std::endl;
 #endif
+        Stats::count(Stats::scValidationsAttempted);
+        if (Limits::expired()) {
+            return false;
+        }
+        const size_t maxSteps = Limits::budget().steps;
+        size_t steps = 0;
         int prevIdx = -1;
         int64_t intValue;
         for (;;) {
             if (p < e) {
+                if (maxSteps && ++steps > maxSteps) {
+                    Limits::exceed(Limits::lkSteps);
+                    return false;
+                }
                 // read field and data type
                 p = readVarint(p, e, intValue);
                 if (intValue == 0) {
@@ -426,10 +1440,14 @@ private:
 
                 // sub message or buffer contents
                 if (type == 2) {
+                    if (intValue < 0 || intValue > e - p) {
+                        break;
+                    }
                     p += intValue;
                 }
             }
             if (p == e) {
+                Stats::count(Stats::scValidationsPassed);
                 return true;
             } else if (p > e) {
 #if DEBUG
@@ -443,7 +1461,16 @@ private:
         return false;
     }
 
-    void mapInsert(unsigned idx, KeyValueMap & map, VariantPtr pVariant) {
+    // parse is stopped by exceeded limit
+    bool stop(Limits::KIND limit, uint64_t offset, int type, int idx) {
+        if (limit != Limits::lkTime) {
+            Limits::exceed(limit); // expired() counts time itself
+        }
+        mError = Error(Error::ecLimit, offset, type, idx, limit);
+        return false;
+    }
+
+    void mapInsert(unsigned idx, KeyValueMap & map, const VariantPtr & pVariant) {
         // set index
         pVariant->setIndex(idx);
 
@@ -464,11 +1491,15 @@ private:
         pBase->asMap()[pBase->asMap().size()+1] = pVariant;
     }
 
+    // index, when given, gets byte range of every field
     bool parse(
         const unsigned char * start,
-        const unsigned char * e
+        const unsigned char * e,
+        OffsetIndex * index = NULL
     ) {
-        mError = "data corrupted";
+        Stats::Timer timer(Stats::phParse);
+        Stats::count(Stats::scParseAttempted);
+        mError = Error();
 #if DEBUG
         std::cerr << __FUNCTION__
                   << " start=0x" << std::hex << (std::ptrdiff_t) (start-0)
@@ -476,29 +1507,71 @@ private:
                   << std::endl;
 #endif
         if (start >= e) {
+            Stats::count(Stats::scParseFailedEmpty);
+            mError = Error(Error::ecEmpty);
             return false;
         }
 
         const unsigned char * p = start;
-        std::stack< const unsigned char* > tails;
-        std::stack< KeyValueMap* > messages;
+        const Limits::Budget & budget = Limits::budget();
+        size_t nodes = 0, bytes = 0;
+        ParseContext & context = ParseContext::local();
+        context.clear();
+        std::vector< const unsigned char* > & tails = context.tails;
+        std::vector< KeyValueMap* > & messages = context.messages;
         KeyValueMap * currentMap = 0;
 
-        mRoot.reset();
+        release(mRoot);
+        markCaches();
         mRoot = Variant::makeMap();
-        tails.push(e);
-        messages.push(&mRoot->asMap());
+        tails.push_back(e);
+        messages.push_back(&mRoot->asMap());
+
+        // enclosing message field and previous field of every level
+        std::vector<uint32_t> & parents = context.parents;
+        std::vector<uint32_t> & previous = context.previous;
+        if (index) {
+            index->clear();
+            parents.push_back(OffsetIndex::kNone);
+            previous.push_back(OffsetIndex::kNone);
+        }
+        // called before the field is inserted into current message
+        auto record = [&](unsigned idx, OffsetIndex::KIND kind,
+                          const unsigned char * b, const unsigned char * v, const unsigned char * end) {
+            std::vector<OffsetIndex::Field> & fields = index->mFields;
+            OffsetIndex::Field field;
+            field.start = b - start;
+            field.value = v - start;
+            field.end = end - start;
+            field.parent = parents.back();
+            field.number = idx;
+            KeyValueMap::const_iterator it = currentMap->find(idx);
+            field.occurrence = it == currentMap->end() ? 0 :
+                               it->second->isRepeated() ? (uint32_t) it->second->asMap().size() : 1;
+            field.kind = (uint8_t) kind;
+            int64_t tag = 0;
+            readVarint(b, v, tag);
+            field.type = (uint8_t) (tag & 7);
+            field.repeated = field.occurrence > 0;
+            if (field.repeated && previous.back() != OffsetIndex::kNone && fields[previous.back()].number == idx) {
+                fields[previous.back()].repeated = 1;
+            }
+            previous.back() = (uint32_t) fields.size();
+            fields.push_back(field);
+        };
 
         while (!tails.empty()) {
-            e = tails.top();
-            currentMap = messages.top();
+            e = tails.back();
+            currentMap = messages.back();
             int64_t intValue;
             double dblValue;
             float fltValue;
             for (;;) {
                 if (p < e) {
                     // read field and data type
+                    const unsigned char * fieldStart = p;
                     p = readVarint(p, e, intValue);
+                    const unsigned char * tagEnd = p;
 
                     if (intValue == 0) {
                         continue;
@@ -509,12 +1582,21 @@ private:
 #if DEBUG
                     std::cerr << type << ":" << idx << std::endl;
 #endif
+                    // tree decoded so far is kept when a limit is hit
+                    if (Limits::expired()) {
+                        return stop(Limits::lkTime, fieldStart - start, type, idx);
+                    }
+                    if (budget.nodes && ++nodes > budget.nodes) {
+                        return stop(Limits::lkNodes, fieldStart - start, type, idx);
+                    }
+                    if (budget.bytes && (bytes += sizeof(Variant)) > budget.bytes) {
+                        return stop(Limits::lkBytes, fieldStart - start, type, idx);
+                    }
                     if (p>=e) {
-                        std::stringstream ss;
-                        ss << "offset 0x" << std::hex << (p - start);
-                        mError = ss.str();
+                        Stats::count(Stats::scParseFailedTruncated);
+                        mError = Error(Error::ecTruncated, p - start, type, idx);
 #if DEBUG
-                        std::cerr << mError << std::endl;
+                        std::cerr << mError.text() << std::endl;
 #endif
                         return false;
                     }
@@ -527,14 +1609,10 @@ private:
                     } else if (type == 1) {
                         p = readValue(p, e, dblValue);
                     } else {
-                        std::stringstream ss;
-                        ss << "unknown data type" << std::endl
-                           << "offset 0x" << std::hex << (p - start) << std::endl
-                           << "type = " << type << std::endl
-                           << "idx  = " << idx;
-                        mError = ss.str();
+                        Stats::count(Stats::scParseFailedWireType);
+                        mError = Error(Error::ecWireType, p - start, type, idx);
 #if DEBUG
-                        std::cerr << mError << std::endl;
+                        std::cerr << mError.text() << std::endl;
 #endif
                         //assert(!"unknown data type");
                         return false;
@@ -546,10 +1624,14 @@ private:
                             type == 0 ? Variant::make(intValue) :
                             type == 1 ? Variant::make(dblValue) :
                                         Variant::make(fltValue));
+                        if (index) {
+                            record(idx, OffsetIndex::fkValue, fieldStart, tagEnd, p);
+                        }
                         mapInsert(idx, *currentMap, newNode);
                     } else if (type == 2) {
-                        assert(p+intValue <= e);
-                        if (p+intValue > e) {
+                        if (intValue < 0 || intValue > e - p) {
+                            Stats::count(Stats::scParseFailedLength);
+                            mError = Error(Error::ecLength, p - start, type, idx);
                             return false;
                         }
 
@@ -557,7 +1639,8 @@ private:
                         if (isString || !isValidMessage(p, p + intValue)) {
                             if (!isString) {
                                 // is it possible that this is a packed repeated items: lets check this out
-                                std::vector<int64_t> packed_items;
+                                std::vector<int64_t> & packed_items = context.packed;
+                                packed_items.clear();
                                 bool ok = false;
                                 auto prev_p = p;
                                 while (p < e) {
@@ -574,22 +1657,39 @@ private:
                                     p = prev_p;
                                 } else {
                                     // this is actualy looks like repeated field
+                                    nodes += packed_items.size();
+                                    bytes += packed_items.size() * sizeof(Variant);
+                                    if (budget.nodes && nodes > budget.nodes) {
+                                        return stop(Limits::lkNodes, fieldStart - start, type, idx);
+                                    }
+                                    if (budget.bytes && bytes > budget.bytes) {
+                                        return stop(Limits::lkBytes, fieldStart - start, type, idx);
+                                    }
                                     auto pRepeated = Variant::makeRepeated();
                                     auto & ref_map = pRepeated->asMap();
                                     size_t counter{};
                                     for (auto temp : packed_items) {
                                         ref_map[++counter] = Variant::make(temp);
                                     }
+                                    if (index) {
+                                        record(idx, OffsetIndex::fkPacked, fieldStart, prev_p, p);
+                                    }
                                     mapInsert(idx, *currentMap,  pRepeated);
                                     continue;
                                 }
                             }
 
                             // ascii string or buffer
+                            if (budget.bytes && (bytes += intValue) > budget.bytes) {
+                                return stop(Limits::lkBytes, fieldStart - start, type, idx);
+                            }
                             VariantPtr newString(Variant::make((char*)p, intValue));
 #if DEBUG
                             std::cerr << idx << ": " << newString->asString().c_str() << std::endl;
 #endif
+                            if (index) {
+                                record(idx, OffsetIndex::fkString, fieldStart, p, p + intValue);
+                            }
                             mapInsert(idx, *currentMap, newString);
                             p += intValue;
                         } else {
@@ -602,8 +1702,16 @@ private:
                                       << " end 0x"   << std::hex << (p + intValue - start)
                                       << std::endl;
 #endif
-                            tails.push(p + intValue);
-                            messages.push(&(newNode->asMap()));
+                            if (index) {
+                                record(idx, OffsetIndex::fkMessage, fieldStart, p, p + intValue);
+                                parents.push_back(previous.back());
+                                previous.push_back(OffsetIndex::kNone);
+                            }
+                            if (budget.depth && tails.size() > budget.depth) {
+                                return stop(Limits::lkDepth, fieldStart - start, type, idx);
+                            }
+                            tails.push_back(p + intValue);
+                            messages.push_back(&(newNode->asMap()));
                             mapInsert(idx, *currentMap, newNode);
                             break;
                         }
@@ -620,44 +1728,50 @@ private:
                               << " end 0x"   << std::hex << (e - start)
                               << std::endl;
 #endif
-                    tails.pop();
-                    messages.pop();
+                    tails.pop_back();
+                    messages.pop_back();
+                    if (index) {
+                        parents.pop_back();
+                        previous.pop_back();
+                    }
                     break;
                 }
             }
         }
-        mError.clear();
         return true;
     }
 
     // /////////////////////////////////////////////////////////////////// //
 
+    // text of message items, indent is for the items of the message
     static void printMessageInternal(
         const RawMessage::KeyValueMap & map,
         std::ostream & os,
         int indent = 0
     ) {
-        for (RawMessage::KeyValueMap::const_iterator it = map.begin(); it != map.end(); ++it) {
-            const RawMessage::VariantPtr & var = it->second;
-            if (var->isMap()) {
-                assert(!var->asMap().empty());
-                for (int i = 0; i < indent; ++i) os << '\t';
-                os << it->first << " {\n";
-                printMessageInternal(var->asMap(), os, indent+1);
-                for (int i = 0; i < indent; ++i) os << '\t';
-                os << "}\n";
-            } else if (var->isRepeated()) {
-                assert(!var->asMap().empty());
-                for (int i = 0; i < indent; ++i) os << '\t';
-                os << it->first << " [\n";
-                printMessageInternal(var->asMap(), os, indent+1);
-                for (int i = 0; i < indent; ++i) os << '\t';
-                os << "]\n";
-            } else {
-                for (int i = 0; i < indent; ++i) os << '\t';
-                os << it->first << ": " << *var << std::endl;
+        struct Printer {
+            std::ostream & os;
+            int indent;
+
+            void tabs(const Walker::Item & item) {
+                for (size_t i = 0; i < (size_t) indent + item.depth; ++i) os << '\t';
             }
-        }
+            bool enter(const Walker::Item & item) {
+                assert(item.var->isMap() || !item.var->asMap().empty()); // partial tree may end with empty message
+                tabs(item);
+                os << item.key << (item.var->isMap() ? " {\n" : " [\n");
+                return true;
+            }
+            void leave(const Walker::Item & item) {
+                tabs(item);
+                os << (item.var->isMap() ? "}\n" : "]\n");
+            }
+            void value(const Walker::Item & item) {
+                tabs(item);
+                os << item.key << ": " << *item.var << std::endl;
+            }
+        } printer = { os, indent };
+        Walker::walk(map, printer);
     }
 
     void print(std::ostream & os, int indent = 0) const {
@@ -675,94 +1789,575 @@ private:
 
     // calculate size in bytes of given message
     size_t getSizeInBytes(const KeyValueMap & map) {
-        size_t retValue = 0, t;
-        for (KeyValueMap::const_iterator it = map.begin(); it != map.end(); ++it) {
-            const VariantPtr & var = it->second;
-            if (var->isMap()) {
-                assert(!var->asMap().empty());
-                t  = getSizeInBytes(var->asMap());
-                t += bytes7bit(t);
-                t += bytes7bit(var->getFieldValue());
-                retValue += t;
-            } else if (var->isRepeated()) {
-                assert(!var->asMap().empty());
-                t  = getSizeInBytes(var->asMap());
-                retValue += t;
-            } else if (var->isInt()) {
-                t  = bytes7bit(var->asInt());
-                t += bytes7bit(var->getFieldValue());
-                retValue += t;
-            } else if (var->isFloat()) {
-                t  = sizeof(float);
-                t += bytes7bit(var->getFieldValue());
-                retValue += t;
-            } else if (var->isDouble()) {
-                t  = sizeof(double);
-                t += bytes7bit(var->getFieldValue());
-                retValue += t;
-            } else if (var->isString()) {
-                t  = var->asString().length();
-                t += bytes7bit(t);
-                t += bytes7bit(var->getFieldValue());
-                retValue += t;
-            } else {
-                assert(!"This shouldn't happen.");
+        // size of items of every entered message or repeated field
+        struct Sizes {
+            RawMessage & msg;
+            std::vector<size_t> sizes;
+
+            bool enter(const Walker::Item & item) {
+                assert(item.var->isMap() || !item.var->asMap().empty());
+                sizes.push_back(0);
+                return true;
             }
-        }
-        return retValue;
+            void leave(const Walker::Item & item) {
+                size_t t = sizes.back();
+                sizes.pop_back();
+                if (item.var->isMap()) {
+                    t += msg.bytes7bit(t);
+                    t += msg.bytes7bit(item.var->getFieldValue());
+                }
+                sizes.back() += t;
+            }
+            void value(const Walker::Item & item) {
+                const VariantPtr & var = item.var;
+                size_t t;
+                if (var->isInt()) {
+                    t  = msg.bytes7bit(var->asInt());
+                } else if (var->isFloat()) {
+                    t  = sizeof(float);
+                } else if (var->isDouble()) {
+                    t  = sizeof(double);
+                } else if (var->isString()) {
+                    t  = var->asString().length();
+                    t += msg.bytes7bit(t);
+                } else {
+                    assert(!"This shouldn't happen.");
+                    return;
+                }
+                t += msg.bytes7bit(var->getFieldValue());
+                sizes.back() += t;
+            }
+        } sizes = { *this, std::vector<size_t>(1, 0) };
+        Walker::walk(map, sizes);
+        return sizes.sizes.back();
     }
 
 public:
 
+    // Why the last parse failed. Failures of speculative parses are
+    // frequent, so they are recorded as plain values and the text is
+    // made only when asked for.
+    struct Error {
+        enum CODE {
+            ecNone,
+            ecEmpty,      // no data
+            ecTruncated,  // data ends after the tag
+            ecWireType,   // wire type is not one of 0, 1, 2 or 5
+            ecLength,     // length of field goes past the end of data
+            ecLimit       // budget of Limits is exceeded, result is partial
+        };
+
+        explicit Error(CODE c = ecNone, uint64_t o = 0, int t = 0, int f = 0, Limits::KIND l = Limits::lkNone)
+            : code(c)
+            , offset(o)
+            , wireType(t)
+            , field(f)
+            , limit(l)
+        {
+        }
+
+        std::string text() const {
+            std::stringstream ss;
+            switch (code) {
+            case ecNone:
+                break;
+            case ecTruncated:
+                ss << "offset 0x" << std::hex << offset;
+                break;
+            case ecWireType:
+                ss << "unknown data type" << std::endl
+                   << "offset 0x" << std::hex << offset << std::endl
+                   << std::dec
+                   << "type = " << wireType << std::endl
+                   << "idx  = " << field;
+                break;
+            case ecLimit:
+                ss << "limit of " << Limits::name(limit) << " is exceeded at offset 0x"
+                   << std::hex << offset;
+                break;
+            default:
+                ss << "data corrupted";
+            }
+            return ss.str();
+        }
+
+        CODE code;
+        uint64_t offset; // of the failed field from the start of data
+        int wireType;
+        int field;
+        Limits::KIND limit;
+    };
+
+    // parse stopped by Limits, tree decoded before that is kept
+    bool isPartial() const {
+        return mError.code == Error::ecLimit;
+    }
+
     bool isError() const {
-        return !mError.empty();
+        return mError.code != Error::ecNone;
     }
-    const std::string & errorString() const {
+    const Error & error() const {
         return mError;
     }
+    std::string errorString() const {
+        return mError.text();
+    }
+
+    RawMessage() {}
+    RawMessage(const RawMessage & other)
+        : mRoot(other.mRoot)
+        , mError(other.mError)
+    {
+    }
+    RawMessage & operator=(const RawMessage & other) {
+        if (this != &other) {
+            VariantPtr root(other.mRoot);
+            release(mRoot);
+            mRoot = root;
+            mError = other.mError;
+        }
+        return *this;
+    }
+    ~RawMessage() {
+        release(mRoot);
+    }
+
+    // Nodes, blocks and scratch buffers are kept by every thread for the
+    // next parse, at most as many as the largest of its last 16 parses
+    // took (and no more than 1M nodes and 64 MB of blocks); parse() cuts
+    // them down when it starts.
+    static void markCaches() {
+        Variant::markRecycled();
+        NodePool::mark();
+    }
+
+    // caches of the thread go back to the heap, for a thread which is
+    // going to wait, as a server worker after a request
+    static void releaseCaches() {
+        Variant::releaseRecycled();
+        NodePool::release();
+        ParseContext & context = ParseContext::local();
+        ParseContext().swap(context);
+    }
+
+    // frees tree without recursion of destructors, nodes shared with
+    // other trees are left to them
+    static void release(VariantPtr & root) {
+        std::vector<VariantPtr> & pending = ParseContext::local().pending;
+        const size_t base = pending.size();
+        pending.push_back(VariantPtr());
+        pending.back().swap(root);
+        while (pending.size() > base) {
+            VariantPtr node;
+            node.swap(pending.back());
+            pending.pop_back();
+            if (node && node.use_count() == 1 && (node->isMap() || node->isRepeated())) {
+                KeyValueMap & items = node->asMap();
+                for (KeyValueMap::iterator it = items.begin(); it != items.end(); ++it) {
+                    pending.push_back(VariantPtr());
+                    pending.back().swap(it->second);
+                }
+                items.clear();
+            }
+        }
+    }
 
 private:
+    // scratch buffers of parse() and release(), kept by every thread
+    // between calls and emptied without giving memory back
+    struct ParseContext {
+        std::vector< const unsigned char* > tails;
+        std::vector< KeyValueMap* > messages;
+        std::vector<uint32_t> parents;
+        std::vector<uint32_t> previous;
+        std::vector<int64_t> packed;
+        std::vector<VariantPtr> pending;
+
+        void clear() {
+            tails.clear();
+            messages.clear();
+            parents.clear();
+            previous.clear();
+        }
+
+        void swap(ParseContext & other) {
+            tails.swap(other.tails);
+            messages.swap(other.messages);
+            parents.swap(other.parents);
+            previous.swap(other.previous);
+            packed.swap(other.packed);
+            pending.swap(other.pending);
+        }
+
+        static ParseContext & local() {
+            thread_local ParseContext context;
+            return context;
+        }
+    };
+
     VariantPtr mRoot;
-    std::string mError;
+    Error mError;
 }; // RawMessage
 
+inline RawMessage::View RawMessage::view() const {
+    assert( mRoot );
+    return View(mRoot.get());
+}
+
 // /////////////////////////////////////////////////////////////////// //
 
-class Serialized_pb {
+// Fully qualified names of messages, enums and enum values declared by
+// grabbed descriptors. The index is built once per run across every
+// grabbed file, so references between files are resolved by one lookup.
+class SymbolIndex {
+public:
+    enum KIND {
+        skFile,
+        skMessage,
+        skEnum,
+        skEnumValue
+    };
 
-    static void printField(
-        const RawMessage::KeyValueMap & vit,
-        std::ostream & os,
-        int indent = 0
-    ) {
-        // data type
-        static std::string types[] = {
-            "double",
-            "float",
-            "int64",
-            "uint64",
-            "int32",
-            "fixed64",
-            "fixed32",
-            "bool",
-            "string",
-            "group",
-            "message",
-            "bytes",
-            "uint32",
-            "enum",
-            "sfixed32",
-            "sfixed64",
-            "sint32",
-            "sint64"
-        };
+    struct Symbol {
+        KIND kind;
+        const RawMessage::Variant * node; // descriptor of the symbol
+        unsigned file;                    // index of declaring file
+    };
+
+    // reference which can't be resolved by the index
+    struct Reference {
+        unsigned file;
+        std::string name;
+        std::string from; // field or file which refers to the name
+    };
+
+    // index declarations of FileDescriptorProto; returns id of the file
+    unsigned add(const RawMessage::VariantPtr & file) {
+        const unsigned id = mFiles.size();
+        mFiles.push_back(file);
+        const RawMessage::KeyValueMap & map = file->asMap();
+
+        std::string scope;
+        RawMessage::KeyValueMap::const_iterator it = map.find(1);
+        if (it != map.end() && it->second->isString()) {
+            insert(it->second->asString(), skFile, file.get(), id);
+        }
+        it = map.find(2);
+        if (it != map.end() && it->second->isString()) {
+            scope = "." + it->second->asString();
+        }
+
+        std::vector< std::pair< const RawMessage::Variant *, std::string > > stack;
+        RawMessage::forEach(map, 5, [&](const RawMessage::VariantPtr & item) {
+            addEnum(*item, scope, id);
+        });
+        RawMessage::forEach(map, 4, [&](const RawMessage::VariantPtr & item) {
+            stack.push_back(std::make_pair(item.get(), scope));
+        });
+        while (!stack.empty()) {
+            const RawMessage::Variant * var = stack.back().first;
+            const std::string parent = stack.back().second;
+            stack.pop_back();
+            if (!var->isMap() || !var->hasField(1)) {
+                continue;
+            }
+            const RawMessage::KeyValueMap & message = var->asMap();
+            const std::string name = parent + "." + message.find(1)->second->asString();
+            insert(name, skMessage, var, id);
+            RawMessage::forEach(message, 4, [&](const RawMessage::VariantPtr & item) {
+                addEnum(*item, name, id);
+            });
+            RawMessage::forEach(message, 3, [&](const RawMessage::VariantPtr & item) {
+                stack.push_back(std::make_pair(item.get(), name));
+            });
+        }
+        return id;
+    }
+
+    const Symbol * find(const std::string & name) const {
+        std::unordered_map< std::string, Symbol >::const_iterator it = mSymbols.find(name);
+        return it == mSymbols.end() ? NULL : &it->second;
+    }
+
+    size_t size() const {
+        return mSymbols.size();
+    }
+
+    // check type names, enum defaults and imports of every indexed file
+    const std::vector< Reference > & resolve() {
+        mUnresolved.clear();
+        for (unsigned id = 0; id < mFiles.size(); ++id) {
+            const RawMessage::KeyValueMap & map = mFiles[id]->asMap();
+            RawMessage::forEach(map, 3, [&](const RawMessage::VariantPtr & item) {
+                if (item->isString() && !find(item->asString())) {
+                    Reference ref = { id, item->asString(), "import" };
+                    mUnresolved.push_back(ref);
+                }
+            });
+        }
+        for (std::unordered_map< std::string, Symbol >::const_iterator it = mSymbols.begin(); it != mSymbols.end(); ++it) {
+            if (it->second.kind != skMessage) {
+                continue;
+            }
+            RawMessage::forEach(it->second.node->asMap(), 2, [&](const RawMessage::VariantPtr & item) {
+                if (!item->isMap() || !item->hasField(6)) {
+                    return;
+                }
+                const RawMessage::KeyValueMap & field = item->asMap();
+                const std::string & typeName = field.find(6)->second->asString();
+                const std::string from = it->first + "." +
+                    (field.count(1) ? field.find(1)->second->asString() : std::string());
+                const Symbol * type = find(typeName);
+                if (!type) {
+                    Reference ref = { it->second.file, typeName, from };
+                    mUnresolved.push_back(ref);
+                } else if (type->kind == skEnum && field.count(7) &&
+                           !find(typeName + "." + field.find(7)->second->asString())) {
+                    Reference ref = { it->second.file, typeName + "." + field.find(7)->second->asString(), from };
+                    mUnresolved.push_back(ref);
+                }
+            });
+        }
+        std::sort(mUnresolved.begin(), mUnresolved.end(), [](const Reference & a, const Reference & b) {
+            return a.file != b.file ? a.file < b.file :
+                   a.from != b.from ? a.from < b.from : a.name < b.name;
+        });
+        return mUnresolved;
+    }
+
+    const std::vector< Reference > & unresolved() const {
+        return mUnresolved;
+    }
+
+private:
+    void insert(const std::string & name, KIND kind, const RawMessage::Variant * node, unsigned file) {
+        Symbol symbol = { kind, node, file };
+        mSymbols.insert(std::make_pair(name, symbol));
+    }
+
+    void addEnum(const RawMessage::Variant & var, const std::string & scope, unsigned file) {
+        if (!var.isMap() || !var.hasField(1)) {
+            return;
+        }
+        const RawMessage::KeyValueMap & map = var.asMap();
+        const std::string name = scope + "." + map.find(1)->second->asString();
+        insert(name, skEnum, &var, file);
+        RawMessage::forEach(map, 2, [&](const RawMessage::VariantPtr & item) {
+            if (item->isMap() && item->hasField(1)) {
+                insert(name + "." + item->asMap().find(1)->second->asString(), skEnumValue, item.get(), file);
+            }
+        });
+    }
+
+    std::vector< RawMessage::VariantPtr > mFiles; // keeps indexed trees alive
+    std::unordered_map< std::string, Symbol > mSymbols;
+    std::vector< Reference > mUnresolved;
+}; // SymbolIndex
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Bounded queue between one producer and one consumer thread. Values are
+// handed over by release stores of the head and tail counters without any
+// lock; a side which has to wait spins, yields and then sleeps a little,
+// so idle stages don't take CPU from busy ones.
+template <class T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity)
+        : mSlots(roundUp(capacity))
+        , mMask(mSlots.size() - 1)
+        , mHead(0)
+        , mTail(0)
+        , mClosed(false)
+    {
+    }
+
+    // producer side, value is taken when it returns true
+    bool tryPush(T & value) {
+        const size_t tail = mTail.load(std::memory_order_relaxed);
+        if (tail - mHead.load(std::memory_order_acquire) > mMask) {
+            return false;
+        }
+        std::swap(mSlots[tail & mMask], value);
+        mTail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    void push(T value) {
+        for (unsigned spins = 0; !tryPush(value); ) {
+            backoff(spins);
+        }
+    }
+
+    // nothing is pushed after it
+    void close() {
+        mClosed.store(true, std::memory_order_release);
+    }
+
+    // consumer side
+    bool tryPop(T & value) {
+        const size_t head = mHead.load(std::memory_order_relaxed);
+        if (head == mTail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        value = std::move(mSlots[head & mMask]);
+        mSlots[head & mMask] = T();
+        mHead.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // false when the queue is closed and empty
+    bool pop(T & value) {
+        for (unsigned spins = 0; ; backoff(spins)) {
+            const bool closed = isClosed();
+            if (tryPop(value)) {
+                return true;
+            }
+            if (closed) {
+                return false;
+            }
+        }
+    }
+
+    bool isClosed() const {
+        return mClosed.load(std::memory_order_acquire);
+    }
+
+    static void backoff(unsigned & spins) {
+        if (++spins < 64) {
+            return;
+        }
+        if (spins < 96) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+
+private:
+    static size_t roundUp(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        return size;
+    }
+
+    std::vector<T> mSlots;
+    const size_t mMask;
+    // counters of each side are kept on their own cache lines
+    char mPad0[64];
+    std::atomic<size_t> mHead;
+    char mPad1[64];
+    std::atomic<size_t> mTail;
+    char mPad2[64];
+    std::atomic<bool> mClosed;
+}; // SpscQueue
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Appends serialized FileDescriptorProto data to a single FileDescriptorSet
+// file. Every descriptor becomes length-delimited field 1 of the set and
+// is collected in a large buffer, so the file is written sequentially.
+class DescriptorSetWriter {
+public:
+    explicit DescriptorSetWriter(const char * path, size_t bufferSize = 1 << 20)
+        : mFile(path, std::ios::binary)
+        , mBufferSize(bufferSize)
+    {
+        mBuffer.reserve(mBufferSize);
+    }
+
+    ~DescriptorSetWriter() {
+        if (mFile.is_open()) {
+            flush();
+        }
+    }
+
+    bool isOpen() const {
+        return mFile.is_open();
+    }
+
+    void append(const unsigned char * p, const unsigned char * e) {
+        unsigned char header[11], *h = header;
+        *h++ = 0x0a;
+        h = RawMessage::writeVarint(e - p, h, header + sizeof(header));
+        if (mBuffer.size() + (h - header) + (e - p) > mBufferSize) {
+            flush();
+        }
+        mBuffer.insert(mBuffer.end(), header, h);
+        if (static_cast<size_t>(e - p) >= mBufferSize) {
+            // too large to be buffered
+            flush();
+            mFile.write((const char *) p, e - p);
+        } else {
+            mBuffer.insert(mBuffer.end(), p, e);
+        }
+    }
+
+    void flush() {
+        if (!mBuffer.empty()) {
+            mFile.write(&mBuffer[0], mBuffer.size());
+            mBuffer.clear();
+        }
+        mFile.flush();
+    }
+
+    // false if anything was not written
+    bool close() {
+        flush();
+        mFile.close();
+        return !mFile.fail();
+    }
+
+private:
+    std::ofstream mFile;
+    std::vector<char> mBuffer;
+    size_t mBufferSize;
+};
+
+// /////////////////////////////////////////////////////////////////// //
+
+class Serialized_pb {
+
+    static void printField(
+        const RawMessage::View & vit,
+        std::ostream & os,
+        int indent = 0,
+        const SymbolIndex * index = NULL
+    ) {
+        // data type
+        static std::string types[] = {
+            "double",
+            "float",
+            "int64",
+            "uint64",
+            "int32",
+            "fixed64",
+            "fixed32",
+            "bool",
+            "string",
+            "group",
+            "message",
+            "bytes",
+            "uint32",
+            "enum",
+            "sfixed32",
+            "sfixed64",
+            "sint32",
+            "sint64"
+        };
         static unsigned typesCount = sizeof(types) / sizeof(*types);
 
-        unsigned dataType = RawMessage::At(vit, 5)->asInt();
-        assert( dataType > 0 && dataType < typesCount );
+        // type of field may be omitted when type name is given
+        const SymbolIndex::Symbol * symbol = (index && vit.has(6))
+            ? index->find(vit.getString(6)) : NULL;
+        unsigned dataType = (unsigned) vit.getInt(5,
+            symbol && symbol->kind == SymbolIndex::skEnum ? 14 : 11);
+        if (!dataType || dataType > typesCount) {
+            dataType = 12; // bytes
+        }
         const bool isComplexType = (dataType == 11 || dataType == 14);
         const std::string & strDataType = isComplexType
-            ? RawMessage::At(vit,6)->asString() : types[dataType-1];
+            ? vit.getString(6) : types[dataType-1];
 
         // label of current field
         static std::string labels[] = {
@@ -772,128 +2367,235 @@ class Serialized_pb {
         };
         static unsigned labelsCount = sizeof(labels) / sizeof(*labels);
 
-        int label = RawMessage::At(vit,4)->asInt()-1;
-        assert(label < labelsCount);
+        unsigned label = (unsigned) vit.getInt(4, 1) - 1;
+        if (label >= labelsCount) {
+            label = 0;
+        }
         const std::string & strLabel = labels[label];
 
         std::string strDefault;
-        if (vit.count(7)) {
+        if (vit.has(7)) {
             strDefault.append(" [default = ");
-                        strDefault.append(RawMessage::At(vit,7)->asString());
+                        strDefault.append(vit.getString(7));
                         strDefault.append("]");
         }
 
         for (int i = 0; i < indent; ++i) os << '\t';
         os << strLabel.c_str()              << " "
            << strDataType.c_str()           << " "
-           << RawMessage::At(vit,1)->asString().c_str() << " = "
-           << RawMessage::At(vit,3)->asInt()
-           << strDefault.c_str()            << ";"
-           << std::endl;
+           << vit.getString(1).c_str() << " = "
+           << vit.getInt(3)
+           << strDefault.c_str()            << ";";
+        if (index && isComplexType && !symbol) {
+            os << " // unresolved type";
+        }
+        os << std::endl;
     }
 
     static void printEnum(
-        const RawMessage::KeyValueMap & map,
+        const RawMessage::View & map,
         std::ostream & os,
         int indent = 0
     ) {
         for (int i = 0; i < indent; ++i) os << '\t';
-        os << "enum " << RawMessage::At(map,1)->asString().c_str() << " {" << std::endl;
+        os << "enum " << map.getString(1).c_str() << " {" << std::endl;
 
         // values
-        const RawMessage::VariantPtr vaItem = RawMessage::At(map,2);
-        if (!vaItem->isRepeated()) {
+        map.forEach(2, [&](const RawMessage::View & vit) {
             for (int i = 0; i <= indent; ++i) os << '\t';
-            const RawMessage::KeyValueMap vit = vaItem->asMap();
-            os << RawMessage::At(vit,1)->asString().c_str() << " = "
-               << RawMessage::At(vit,2)->asInt()            << ";"
+            os << vit.getString(1).c_str() << " = "
+               << vit.getInt(2)            << ";"
                << std::endl;
-        } else {
-            const RawMessage::KeyValueMap & v = vaItem->asMap();
-            for (RawMessage::KeyValueMap::const_iterator it = v.begin(); it != v.end(); ++it) {
-                const RawMessage::KeyValueMap & vit = it->second->asMap();
-                for (int i = 0; i <= indent; ++i) os << '\t';
-                os << RawMessage::At(vit,1)->asString().c_str() << " = "
-                   << RawMessage::At(vit,2)->asInt()            << ";"
-                   << std::endl;
-
-            }
-        }
+        });
         for (int i = 0; i < indent; ++i) os << '\t';
         os << '}' << std::endl;
     }
 
+    // message with nested types, nesting is walked without recursion
     static void printMessage(
-        const RawMessage::VariantPtr & var,
+        const RawMessage::View & var,
         std::ostream & os,
-        int indent = 0
+        int indent = 0,
+        const SymbolIndex * index = NULL
     ) {
-        assert(var->isMap());
-        const RawMessage::KeyValueMap & map = var->asMap();
-
-        for (int i = 0; i < indent; ++i) os << '\t';
-        os << "message " << RawMessage::At(map,1)->asString().c_str() << " {" << std::endl;
+        // nested types are field 3 of DescriptorProto, single or repeated
+        struct Printer {
+            std::ostream & os;
+            int indent;
+            const SymbolIndex * index;
 
-        // enums
-        if (var->hasField(4)) {
-            const RawMessage::VariantPtr vaItem = RawMessage::At(map,4);
-            if (vaItem->isMap()) {
-                printEnum(vaItem->asMap(), os, indent + 1);
-            } else {
-                const RawMessage::KeyValueMap & m = vaItem->asMap();
-                for (RawMessage::KeyValueMap::const_iterator it = m.begin(); it != m.end(); ++it) {
-                    printEnum(it->second->asMap(), os, indent + 1);
+            bool enter(const RawMessage::Walker::Item & item) {
+                if (!item.element && item.key != 3) {
+                    return false;
+                }
+                if (item.var->isRepeated()) {
+                    return !item.element;
                 }
+                printMessageBegin(item.var, os, ++indent);
+                return true;
             }
-        }
-
-        // sub messages
-        if (var->hasField(3)) {
-            const RawMessage::VariantPtr vaItem = RawMessage::At(map,3);
-            if (vaItem->isMap()) {
-                printMessage(vaItem, os, indent + 1);
-            } else {
-                const RawMessage::KeyValueMap & m = vaItem->asMap();
-                for (RawMessage::KeyValueMap::const_iterator it = m.begin(); it != m.end(); ++it) {
-                    printMessage(it->second, os, indent + 1);
+            void leave(const RawMessage::Walker::Item & item) {
+                if (item.var->isMap()) {
+                    printMessageEnd(item.var, os, indent--, index);
                 }
             }
-        }
+            void value(const RawMessage::Walker::Item &) {
+            }
+        } printer = { os, indent, index };
+
+        assert(var.isMessage());
+        printMessageBegin(var, os, indent);
+        RawMessage::Walker::walk(var.fields(), printer);
+        printMessageEnd(var, os, indent, index);
+    }
 
+    // header and enums of message
+    static void printMessageBegin(
+        const RawMessage::View & var,
+        std::ostream & os,
+        int indent
+    ) {
+        for (int i = 0; i < indent; ++i) os << '\t';
+        os << "message " << var.getString(1).c_str() << " {" << std::endl;
+
+        // enums
+        var.forEach(4, [&](const RawMessage::View & item) {
+            printEnum(item, os, indent + 1);
+        });
+    }
+
+    // items of message after its nested types
+    static void printMessageEnd(
+        const RawMessage::View & var,
+        std::ostream & os,
+        int indent,
+        const SymbolIndex * index
+    ) {
         // items of current message
-        if (var->hasField(2)) {
-            const RawMessage::VariantPtr vaItem = RawMessage::At(map,2);
-            if (vaItem->isMap()) {
-                printField(vaItem->asMap(), os, indent + 1);
-            } else {
-                const RawMessage::KeyValueMap & m = vaItem->asMap();
-                for (RawMessage::KeyValueMap::const_iterator it = m.begin(); it != m.end(); ++it) {
-                    printField(it->second->asMap(), os, indent + 1);
-                }
-            }
-        }
+        var.forEach(2, [&](const RawMessage::View & item) {
+            printField(item, os, indent + 1, index);
+        });
 
         for (int i = 0; i < indent; ++i) os << '\t';
         os << '}' << std::endl;
     }
 
+public:
     static bool isSerializedMessages(const RawMessage & msg) {
-        RawMessage::KeyValueMap & items = msg.rootItem()->asMap();
-        bool f = items.count(1) &&
-                 items.count(2) &&
-                 items.count(4);
-        if (f) {
-            f = items[1]->isString() &&
-                items[2]->isString() &&
-                (items[4]->isMap() || items[4]->isRepeated());
-        }
-        return f;
+        const RawMessage::View items = msg.view();
+        return items.field(1).isString() &&
+               items.field(2).isString() &&
+               (items.field(4).isMessage() || items.field(4).isRepeated());
     }
 
-public:
+    // format of files written by grab()
+    enum OUTPUT {
+        outProto,
+        outCpp,
+        outDescriptorSet
+    };
+
+    // descriptor found by scan() and where it was found
+    struct Found {
+        RawMessage message;
+        std::vector<unsigned char> data;
+        std::string origin; // archive!entry, empty for the input itself
+    };
+
+    // for outDescriptorSet all descriptors are written to file setPath,
+    // error gets why it can't be and 0 is returned then.
+    // [ptr, ept) is scanned by the calling thread while candidates are
+    // parsed by another one and rendered by a pool of threads, see Renderer
     static unsigned grab(
         const unsigned char * ptr,
-        const unsigned char * ept
+        const unsigned char * ept,
+        OUTPUT output = outProto,
+        const char * setPath = NULL,
+        unsigned threads = 0,
+        std::string * error = NULL
+    ) {
+        Renderer renderer(output, setPath, threads);
+        if (!renderer.isOpen()) {
+            return renderer.wait(error);
+        }
+        struct Candidate {
+            const unsigned char * begin;
+            const unsigned char * end;
+        };
+        SpscQueue<Candidate> candidates(kQueueSize);
+        const Limits::Request request = Limits::request();
+        std::thread parser([&]() {
+            Limits::Scope scope(request);
+            RawMessage msg;
+            for (Candidate candidate; candidates.pop(candidate); ) {
+                if (msg.parse(candidate.begin, candidate.end) && isSerializedMessages(msg)) {
+                    renderer.add(msg, candidate.begin, candidate.end);
+                }
+            }
+            renderer.finish();
+        });
+        // as scan() does, the search goes on after the end of a candidate
+        // whether it's parsed or not
+        while (ptr < ept) {
+            const unsigned char * end = ept;
+            const unsigned char * begin = findSerializedPB(ptr, end);
+            if (!begin) break;
+            Candidate candidate = { begin, end };
+            candidates.push(candidate);
+            ptr = end + 1;
+        }
+        candidates.close();
+        parser.join();
+        return renderer.wait(error);
+    }
+
+    // append descriptors found in [ptr, ept) to found
+    static unsigned collect(
+        const unsigned char * ptr,
+        const unsigned char * ept,
+        std::vector< Found > & found,
+        const std::string & origin = std::string()
+    ) {
+        return scan(ptr, ept, [&](const RawMessage & msg, const unsigned char * b, const unsigned char * e) {
+            found.push_back(Found());
+            found.back().message = msg;
+            found.back().data.assign(b, e);
+            found.back().origin = origin;
+            return true;
+        });
+    }
+
+    // write .proto (or C++) files of found descriptors, types are resolved
+    // across all of them; setPath and error are as for grab()
+    static unsigned write(
+        const std::vector< Found > & found,
+        OUTPUT output,
+        const char * setPath = NULL,
+        unsigned threads = 0,
+        std::string * error = NULL
+    ) {
+        Renderer renderer(output, setPath, threads);
+        if (!renderer.isOpen()) {
+            return renderer.wait(error);
+        }
+        for (size_t i = 0; i < found.size(); ++i) {
+            renderer.add(found[i]);
+        }
+        renderer.finish();
+        return renderer.wait(error);
+    }
+
+    static std::string origin(const Found & found) {
+        return found.origin.empty() ? std::string() : " from " + found.origin;
+    }
+
+    // pass every descriptor found in [ptr, ept) to f(msg, begin, end) without
+    // any output; scanning stops when f returns false
+    template <class F>
+    static unsigned scan(
+        const unsigned char * ptr,
+        const unsigned char * ept,
+        F f
     ) {
         RawMessage msg;
         const unsigned char * ptrBegin = ptr;
@@ -912,91 +2614,77 @@ public:
 #if DEBUG
                 msg.print(std::cerr);
 #endif
-                std::string filename(msg.items()[1]->asString());
-#if WIN32
-                std::replace(filename.begin(), filename.end(), '/', '\\');
-#endif
-                std::ofstream file(filename.c_str(), std::ios::binary);
-                if (!file.is_open()) {
-                    std::cout << " [-] " << filename.c_str()
-                              << " ERROR: can't create file path!"
-                              << std::endl;
-                } else {
-                    printMessagesFromSerialized(msg, file);
-                    std::cout << " [+] " << filename.c_str() << std::endl;
-                    count += 1;
-                }
+                count += 1;
+                if (!f(msg, ptr, ept)) break;
             }
             ptr = ept + 1;
             ept = ptrEnd;
         }
+        (void) ptrBegin;
         return count;
     }
 
-    static void printMessagesFromSerialized(const RawMessage & msg, std::ostream & os, bool force = false) {
+    // C++ decoders of the messages, see CppDecoders
+    static void printCppFromSerialized(const RawMessage & msg, std::ostream & os);
+
+    static void printMessagesFromSerialized(
+        const RawMessage & msg,
+        std::ostream & os,
+        bool force = false,
+        const SymbolIndex * index = NULL
+    ) {
         if (!force && !isSerializedMessages(msg)) {
             return;
         }
+        const RawMessage::View file = msg.view();
         // package name
-        if (msg.rootItem()->asMap().count(2)) {
-            std::string packageName(msg.rootItem()->asMap()[2]->asString());
-            os << "package " << packageName.c_str() << ";" << std::endl;
+        if (file.has(2)) {
+            os << "package " << file.getString(2).c_str() << ";" << std::endl;
         }
         // imports
-        if (msg.rootItem()->asMap().count(3)) {
-            const RawMessage::VariantPtr vaItem = msg.rootItem()->asMap()[3];
-            if (!vaItem->isRepeated()) {
-                os << "import \"" << vaItem->asString().c_str() << "\";\n";
-            } else {
-                const RawMessage::KeyValueMap & m = vaItem->asMap();
-                for (RawMessage::KeyValueMap::const_iterator it = m.begin(); it != m.end(); ++it) {
-                    os << "import \"" << it->second->asString().c_str() << "\";\n";
-                }
-            }
-        }
+        file.forEach(3, [&](const RawMessage::View & item) {
+            os << "import \"" << item.asString().c_str() << "\";\n";
+        });
         // enums
-        if (msg.rootItem()->asMap().count(5)) {
-            const RawMessage::VariantPtr vaItem = msg.rootItem()->asMap()[5];
-            if (vaItem->isMap()) {
-                printEnum(vaItem->asMap(), os, 0);
-            } else {
-                const RawMessage::KeyValueMap & m = vaItem->asMap();
-                for (RawMessage::KeyValueMap::const_iterator it = m.begin(); it != m.end(); ++it) {
-                    printEnum(it->second->asMap(), os, 0);
-                }
-            }
-        }
+        file.forEach(5, [&](const RawMessage::View & item) {
+            printEnum(item, os, 0);
+        });
         // messages
-        if (msg.rootItem()->asMap().count(4)) {
-            const RawMessage::VariantPtr vaItem = msg.rootItem()->asMap()[4];
-            if (vaItem->isMap()) {
-                printMessage(vaItem, os);
-            } else {
-                const RawMessage::KeyValueMap & m = vaItem->asMap();
-                for (RawMessage::KeyValueMap::const_iterator it = m.begin(); it != m.end(); ++it) {
-                    printMessage(it->second, os);
-                }
-            }
-        }
+        file.forEach(4, [&](const RawMessage::View & item) {
+            printMessage(item, os, 0, index);
+        });
     }
 
     static const unsigned char * findSerializedPB(
         const unsigned char * p,
         const unsigned char *& e
     ) {
+        Stats::Timer timer(Stats::phScan);
         const unsigned char * b, *start = p, *endPtr;
+        // zeros after the candidate found so far, every byte is searched
+        // for zero once however dense candidates are
+        std::vector<const unsigned char *> zeros;
+        size_t firstZero = 0;
+        const unsigned char * searched = p;
         for (;;) {
             // 0a:VARINT:STRING
             // find first field
             for (; p < e && *p != 0x0a; ++p);
             if (p >= e) break;
+            if (Limits::expired()) break;
 
-            endPtr = p+1;
+            Stats::count(Stats::scCandidatesProbed);
+            for (; firstZero < zeros.size() && zeros[firstZero] <= p; ++firstZero);
+            searched = std::max(searched, p + 1);
             bool isValid = false;
-            for (int tr = 0; tr < 10; ++tr, ++endPtr) {
+            for (size_t tr = 0; tr < 10; ++tr) {
                 // find next '\0' after protobuf message
-                for (; endPtr < e-1 && *endPtr; ++endPtr);
-                if (endPtr >= e-1) break;
+                if (firstZero + tr == zeros.size()) {
+                    for (; searched < e-1 && *searched; ++searched);
+                    if (searched >= e-1) break;
+                    zeros.push_back(searched++);
+                }
+                endPtr = zeros[firstZero + tr];
 
                 // filename field
 #if DEBUG
@@ -1004,7 +2692,7 @@ public:
 #endif
                 int64_t v = 0;
                 b = RawMessage::readVarint(p+1, endPtr, v);
-                if (b >= endPtr || b+v >= endPtr) {
+                if (b >= endPtr || v >= endPtr - b) {
 #if DEBUG
                     //std::cerr << "(1) NOPE " << std::hex << (e - b) << " " << (b - start) << std::endl;
 #endif
@@ -1022,7 +2710,7 @@ public:
                 std::cerr << "(2) " << std::hex << (p - start) << std::endl;
 #endif
                 b = RawMessage::readVarint(b+v+1, endPtr, v);
-                if (b >= endPtr || b+v >= endPtr) {
+                if (b >= endPtr || v >= endPtr - b) {
 #if DEBUG
                     std::cerr << "(2) NOPE" << std::endl;
 #endif
@@ -1048,69 +2736,2359 @@ public:
 #if DEBUG
             std::cerr << "FOUND" << std::endl;
 #endif
+            Stats::count(Stats::scBytesScanned, endPtr - start);
             e = endPtr;
             return p;
         }
+        Stats::count(Stats::scBytesScanned, p - start);
         return NULL;
     }
-};
 
-// /////////////////////////////////////////////////////////////////// //
+private:
+    static const size_t kQueueSize = 1024;
 
-class Schema {
-public:
-    static void print(const RawMessage & message, std::ostream & os) {
-        std::vector< RawMessage::VariantPtr > messages;
-        std::map< std::string, unsigned > lookupContext;
-        fillSchemasInternal(message.rootItem(), messages, lookupContext);
-        os << "package ProtodecMessages;\n";
-        for (unsigned i = 0; i < messages.size(); ++i) {
-            os << "\nmessage MSG" << (i+1) << " {\n";
-            os << messages[i]->asString();
-            os << "}\n";
+    // Last stage of grab() and write(). Descriptors added in order by one
+    // thread are rendered by a pool of threads, each creating its own
+    // files, and reported in the order they were added by a thread of its
+    // own, so neither formatting nor the file system holds up the stages
+    // before it. Descriptors of the same file name go to the same thread
+    // and the last one is left as before. .proto files are started by
+    // finish() since types are resolved across all descriptors, C++
+    // decoders and entries of the descriptor set are started at once.
+    class Renderer {
+    public:
+        Renderer(OUTPUT output, const char * setPath, unsigned threads)
+            : mOutput(output)
+            , mFinished(false)
+            , mCount(0)
+        {
+            if (output == outDescriptorSet) {
+                mSetPath = setPath;
+                mSet.reset(new DescriptorSetWriter(setPath));
+                if (!mSet->isOpen()) {
+                    std::cout << " [-] " << setPath << " ERROR: can't create file path!" << std::endl;
+                    mError = "can't create " + mSetPath;
+                    mSet.reset();
+                    return;
+                }
+                Stats::count(Stats::scFilesWritten);
+                // the set is written in order
+                threads = 1;
+            }
+            if (!threads) {
+                threads = std::max(1u, std::thread::hardware_concurrency());
+            }
+            const Limits::Request request = Limits::request();
+            for (unsigned i = 0; i < threads; ++i) {
+                mWorkers.push_back(std::unique_ptr<Worker>(new Worker()));
+            }
+            for (unsigned i = 0; i < threads; ++i) {
+                mWorkers[i]->thread = std::thread(&Renderer::render, this, mWorkers[i].get(), request);
+            }
+            mReporter = std::thread(&Renderer::report, this);
         }
-    }
 
-private:
-    static void fillSchemasInternal(
-        const RawMessage::VariantPtr & message,
-        std::vector< RawMessage::VariantPtr > & messages,
-        std::map< std::string, unsigned > & lookupContext
-    ) {
-        std::stringstream ss;
-        const RawMessage::KeyValueMap & map = message->asMap();
-        for (RawMessage::KeyValueMap::const_iterator it = map.begin(); it != map.end(); ++it) {
-            ss << "\t";
-            const RawMessage::VariantPtr & var = it->second;
-            if (!var->isRepeated()) {
-                if (var->isMap()) {
-                    assert(!var->asMap().empty());
-                    fillSchemasInternal(var, messages, lookupContext);
-                }
-                ss << "required " << var->dataType();
-            } else {
-                assert(!var->asMap().empty());
-                const RawMessage::VariantPtr & subVar = (var->asMap().begin())->second;
-                if (subVar->isMap() || subVar->isRepeated()) {
-                    fillSchemasInternal(subVar, messages, lookupContext);
-                }
-                ss << "repeated " << subVar->dataType();
+        ~Renderer() {
+            finish();
+            wait();
+        }
+
+        bool isOpen() const {
+            return !mWorkers.empty();
+        }
+
+        // next descriptor, kept by caller until wait()
+        void add(const Found & found) {
+            mFound.push_back(&found);
+            if (mOutput != outProto) {
+                dispatch(mFound.size() - 1);
             }
-            ss << " fld" << (it->first) << " = " << (it->first) << ";\n";
         }
-        // store key and current message in lookupContext for next matches
-        message->asString() = ss.str();
-        if (lookupContext.count(message->asString()) != 0) {
-            message->setGlobalId(lookupContext[message->asString()]);
-        } else {
-            messages.push_back(message);
-            message->setGlobalId(messages.size());
-            lookupContext[message->asString()] = messages.size();
+
+        void add(const RawMessage & msg, const unsigned char * b, const unsigned char * e) {
+            mOwned.push_back(Found());
+            mOwned.back().message = msg;
+            mOwned.back().data.assign(b, e);
+            add(mOwned.back());
         }
-    }
-}; // Schema
 
-// /////////////////////////////////////////////////////////////////// //
+        // nothing is added after it, from the thread which added
+        void finish() {
+            if (mFinished || !isOpen()) {
+                return;
+            }
+            mFinished = true;
+            if (mOutput == outProto) {
+                for (size_t i = 0; i < mFound.size(); ++i) {
+                    mIndex.add(mFound[i]->message.rootItem());
+                }
+                mUnresolved = mIndex.resolve();
+                for (size_t i = 0; i < mFound.size(); ++i) {
+                    dispatch(i);
+                }
+            }
+            for (size_t i = 0; i < mWorkers.size(); ++i) {
+                mWorkers[i]->jobs.close();
+            }
+        }
+
+        // number of written files (descriptors of the set) after finish(),
+        // 0 if the set isn't written completely and error gets why
+        unsigned wait(std::string * error = NULL) {
+            for (size_t i = 0; i < mWorkers.size(); ++i) {
+                if (mWorkers[i]->thread.joinable()) {
+                    mWorkers[i]->thread.join();
+                }
+            }
+            if (mReporter.joinable()) {
+                mReporter.join();
+                for (size_t i = 0; i < mUnresolved.size(); ++i) {
+                    std::cout << " [?] " << mFound[mUnresolved[i].file]->message.view().getString(1).c_str()
+                              << " unresolved " << mUnresolved[i].name.c_str()
+                              << " (" << mUnresolved[i].from.c_str() << ")"
+                              << std::endl;
+                }
+                if (mSet) {
+                    Stats::Timer write(Stats::phWrite);
+                    if (!mSet->close()) {
+                        std::cout << " [-] " << mSetPath << " ERROR: can't write file!" << std::endl;
+                        mError = "can't write " + mSetPath;
+                        mCount = 0;
+                    }
+                    mSet.reset();
+                }
+            }
+            if (error) {
+                *error = mError;
+            }
+            return mCount;
+        }
+
+    private:
+        struct Job {
+            size_t seq;
+            const Found * found;
+        };
+
+        struct Result {
+            size_t seq;
+            bool written;
+            std::string line;
+        };
+
+        struct Worker {
+            Worker()
+                : jobs(kQueueSize)
+                , results(kQueueSize)
+            {
+            }
+
+            SpscQueue<Job> jobs;
+            SpscQueue<Result> results;
+            std::thread thread;
+        };
+
+        static std::string filename(const Found & found, OUTPUT output) {
+            std::string filename(found.message.view().getString(1));
+            if (output == outCpp) {
+                const size_t ext = filename.rfind(".proto");
+                if (ext != std::string::npos && ext + 6 == filename.length()) {
+                    filename.erase(ext);
+                }
+                filename.append(".protodec.h");
+            }
+#if WIN32
+            std::replace(filename.begin(), filename.end(), '/', '\\');
+#endif
+            return filename;
+        }
+
+        void dispatch(size_t seq) {
+            const Found * found = mFound[seq];
+            const size_t worker = std::hash<std::string>()(found->message.view().getString(1)) % mWorkers.size();
+            Job job = { seq, found };
+            mWorkers[worker]->jobs.push(job);
+        }
+
+        void render(Worker * worker, Limits::Request request) {
+            Limits::Scope scope(request);
+            for (Job job; worker->jobs.pop(job); ) {
+                const Found & found = *job.found;
+                Result result = { job.seq, false, std::string() };
+                if (mSet) {
+                    Stats::Timer write(Stats::phWrite);
+                    mSet->append(found.data.data(), found.data.data() + found.data.size());
+                    result.written = true;
+                    result.line = std::string(" [+] ") + found.message.view().getString(1).c_str() + origin(found);
+                    worker->results.push(result);
+                    continue;
+                }
+                const std::string name = filename(found, mOutput);
+                Stats::Timer write(Stats::phWrite);
+                std::ofstream file(name.c_str(), std::ios::binary);
+                if (!file.is_open()) {
+                    result.line = std::string(" [-] ") + name.c_str() + " ERROR: can't create file path!";
+                    worker->results.push(result);
+                    continue;
+                }
+                {
+                    Stats::Timer render(Stats::phRender);
+                    if (mOutput == outCpp) {
+                        printCppFromSerialized(found.message, file);
+                    } else {
+                        printMessagesFromSerialized(found.message, file, false, &mIndex);
+                    }
+                }
+                Stats::count(Stats::scFilesWritten);
+                result.written = true;
+                result.line = std::string(" [+] ") + name.c_str() + origin(found);
+                worker->results.push(result);
+            }
+            worker->results.close();
+        }
+
+        // results come from workers in their own order and are printed in
+        // the order descriptors were added
+        void report() {
+            std::map<size_t, Result> pending;
+            std::vector<bool> drained(mWorkers.size(), false);
+            size_t next = 0, open = mWorkers.size();
+            unsigned spins = 0;
+            while (open) {
+                bool popped = false;
+                for (size_t i = 0; i < mWorkers.size(); ++i) {
+                    if (drained[i]) {
+                        continue;
+                    }
+                    const bool closed = mWorkers[i]->results.isClosed();
+                    Result result;
+                    if (mWorkers[i]->results.tryPop(result)) {
+                        pending[result.seq] = result;
+                        popped = true;
+                    } else if (closed) {
+                        drained[i] = true;
+                        --open;
+                    }
+                }
+                for (std::map<size_t, Result>::iterator it; (it = pending.find(next)) != pending.end(); ++next) {
+                    std::cout << it->second.line << std::endl;
+                    mCount += it->second.written;
+                    pending.erase(it);
+                }
+                if (popped) {
+                    spins = 0;
+                } else {
+                    SpscQueue<Result>::backoff(spins);
+                }
+            }
+        }
+
+        const OUTPUT mOutput;
+        std::string mSetPath;
+        std::unique_ptr<DescriptorSetWriter> mSet;
+        std::vector< std::unique_ptr<Worker> > mWorkers;
+        std::thread mReporter;
+        std::vector<const Found *> mFound; // in order of add()
+        std::deque<Found> mOwned;          // added by grab()
+        SymbolIndex mIndex;
+        std::vector< SymbolIndex::Reference > mUnresolved;
+        bool mFinished;
+        unsigned mCount;
+        std::string mError;
+    }; // Renderer
+};
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Serialized messages of any type inside arbitrary data (--find-messages).
+// Every offset which may start a field is scored by walking top level
+// fields: numbers must grow as serializers write them and be dense,
+// values must be encoded canonically, length delimited values should be
+// text or messages themselves. Work per candidate is limited by
+// kMaxFields, so a longer message is reported as several adjacent
+// regions, by kMaxPlainFields until fields look structured and by
+// kMaxWrappers for messages wrapping single message.
+class MessageFinder {
+public:
+    struct Region {
+        size_t offset;
+        size_t size;
+        unsigned fields;
+        double confidence;
+    };
+
+    static constexpr double kMinConfidence = 0.8;
+
+    // non-overlapping regions in order, chunks are scanned in parallel
+    static std::vector<Region> find(
+        const unsigned char * p,
+        const unsigned char * e,
+        unsigned threads = 0,
+        double minConfidence = kMinConfidence
+    ) {
+        const size_t size = e - p;
+        if (!threads) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        threads = (unsigned) std::max<size_t>(1, std::min<size_t>(threads, size / kMinChunk));
+        const size_t chunk = (size + threads - 1) / threads;
+
+        std::vector< std::vector<Region> > results(threads);
+        std::vector<std::thread> workers;
+        const Limits::Request request = Limits::request();
+        for (unsigned i = 1; i < threads; ++i) {
+            workers.push_back(std::thread([&, i]() {
+                Limits::Scope scope(request);
+                scan(p, i * chunk, std::min(size, (i + 1) * chunk), size, minConfidence, results[i]);
+            }));
+        }
+        scan(p, 0, std::min(size, chunk), size, minConfidence, results[0]);
+        for (size_t i = 0; i < workers.size(); ++i) {
+            workers[i].join();
+        }
+
+        // region of a chunk may run into the next one; what the next chunk
+        // found there is dropped and that part is scanned again from the
+        // end of the region, as a single thread would do
+        std::vector<Region> regions;
+        size_t pos = 0;
+        for (size_t i = 0; i < results.size(); ++i) {
+            for (size_t j = 0; j < results[i].size(); ++j) {
+                const Region & region = results[i][j];
+                if (region.offset >= pos) {
+                    regions.push_back(region);
+                    pos = region.offset + region.size;
+                } else if (pos < region.offset + region.size) {
+                    pos = scan(p, pos, region.offset + region.size, size, minConfidence, regions);
+                }
+            }
+        }
+        return regions;
+    }
+
+    // score message starting at p, size is 0 when it isn't one
+    static Region score(const unsigned char * p, const unsigned char * e) {
+        Chain chain;
+        walk(p, e, chain);
+        return evaluate(chain, 0);
+    }
+
+private:
+    enum {
+        kMaxFields        = 1024,
+        kMaxPlainFields   = 32,
+        kChains           = 16,
+        kMinChain         = 8,
+        kMaxNestedFields  = 64,
+        kMinFields        = 2,
+        kMinSize          = 8,
+        kMinContent       = 4,
+        kMaxDepth         = 3,
+        kMaxWrappers      = 16,
+        kMinChunk         = 1 << 16
+    };
+    static const int64_t kMaxFieldNumber = (1 << 29) - 1;
+
+    // top level fields walked from one offset. Every field boundary
+    // starts a shorter walk over the same fields, which ends where this
+    // one does, so its score is computed from sums over fields before it
+    struct Chain {
+        Chain() : size(0), nested(NULL), nestedEnd(NULL), next(0), used(0) {}
+
+        struct Field {
+            const unsigned char * begin;
+            int64_t number;
+            double weight;      // sums over the fields before this one
+            unsigned changes;   // of field number
+            size_t content;     // bytes of verified text or messages
+        };
+        std::vector<Field> fields; // preallocated for the longest walk
+        size_t size;               // the last one marks end of the walk
+        const unsigned char * nested, * nestedEnd; // last length delimited
+        size_t next; // field compared with scanned offset
+        size_t used; // offset it was last looked up at
+    };
+
+    static void walk(const unsigned char * p, const unsigned char * e, Chain & chain) {
+        chain.fields.resize(kMaxFields + 1);
+        chain.size = 0;
+        chain.nested = chain.nestedEnd = NULL;
+        chain.next = 0;
+        const unsigned char * q = p, * last = p;
+        double weights = 0.0;
+        unsigned changes = 0;
+        size_t content = 0;
+        int64_t prev = 0;
+        // repeated scalars of text or filler never stop growing, walk
+        // is short until there is content or several field numbers
+        size_t limit = kMaxPlainFields;
+        while (q < e && chain.size < limit) {
+            int64_t key = 0, value = 0;
+            const unsigned char * b = q;
+            if (!readCanonical(q, e, key)) break;
+            const int64_t number = key >> 3;
+            if (number < prev || number == 0 || number > kMaxFieldNumber) break;
+            double weight = 0.0;
+            size_t verified = 0;
+            const unsigned char * nested = NULL;
+            switch (key & 7) {
+            case 0:
+                if (!readCanonical(q, e, value)) { q = NULL; break; }
+                weight = (value >= 0 && value <= 0xffffffff) ? 1.0 : 0.5;
+                break;
+            case 1:
+                if (e - q < 8) { q = NULL; break; }
+                q += 8;
+                weight = 0.5;
+                break;
+            case 5:
+                if (e - q < 4) { q = NULL; break; }
+                q += 4;
+                weight = 0.5;
+                break;
+            case 2:
+                if (!readCanonical(q, e, value) || value > e - q) { q = NULL; break; }
+                // short values match by chance too often
+                weight = value < kMinContent ? 0.5 :
+                         RawMessage::itsAsciiString(q, q + value) || isMessage(q, q + value) ? 1.0 : 0.25;
+                verified = (weight == 1.0 ? value : 0);
+                nested = q;
+                q += value;
+                break;
+            default:
+                q = NULL;
+                break;
+            }
+            if (!q || q == b) break;
+            const Chain::Field field = { b, number, weights, changes, content };
+            chain.fields[chain.size++] = field;
+            if (nested) {
+                chain.nested = nested;
+                chain.nestedEnd = q;
+            }
+            changes += (chain.size > 1 && number != prev);
+            weights += weight;
+            content += verified;
+            prev = number;
+            last = q;
+            if (content || changes >= 2) {
+                limit = kMaxFields;
+            }
+        }
+        const Chain::Field end = { last, 0, weights, changes, content };
+        chain.fields[chain.size++] = end;
+    }
+
+    // score of message made of chain's fields from k-th one
+    static Region evaluate(const Chain & chain, size_t k) {
+        const size_t n = chain.size - 1;
+        const Chain::Field & first = chain.fields[k], & end = chain.fields[n];
+        Region region = { 0, 0, (unsigned) (n - k), end.weight - first.weight };
+        if (region.fields == 1 && chain.nested && chain.nestedEnd == end.begin) {
+            // message wrapping single message is as good as the inner one
+            const Region inner = unwrap(chain.nested, chain.nestedEnd);
+            if (inner.size == (size_t) (chain.nestedEnd - chain.nested)) {
+                region.size = end.begin - first.begin;
+                region.confidence = inner.confidence;
+            }
+            return region;
+        }
+        if (region.fields < kMinFields || end.begin - first.begin < kMinSize) {
+            return region;
+        }
+        region.size = end.begin - first.begin;
+        const unsigned distinct = 1 + end.changes - chain.fields[k + 1].changes;
+        // scalars only look like random data, verified content makes
+        // the difference
+        region.confidence = 0.3 * region.confidence / region.fields
+                          + 0.2 * distinct / chain.fields[n - 1].number
+                          + 0.2 * std::min(1.0, (region.fields - 1) / 3.0)
+                          + 0.3 * (end.content - first.content) / region.size;
+        return region;
+    }
+
+    // score of [p, e) seen through messages wrapping single message, they
+    // are walked in a loop up to kMaxWrappers deep: every offset of deeper
+    // wrapper headers is a candidate, so the work per candidate is bound
+    // and such region is found starting from an inner wrapper
+    static Region unwrap(const unsigned char * p, const unsigned char * e) {
+        thread_local Chain chain;
+        for (unsigned depth = 0; ; ++depth) {
+            if (depth == kMaxWrappers) {
+                const Region region = { 0, 0, 1, 0.0 };
+                return region;
+            }
+            walk(p, e, chain);
+            const size_t n = chain.size - 1;
+            if (n != 1 || !chain.nested || chain.nestedEnd != chain.fields[n].begin) {
+                return evaluate(chain, 0);
+            }
+            if (chain.fields[n].begin != e) {
+                const Region region = { 0, 0, 1, 0.0 };
+                return region; // wrapper doesn't cover [p, e)
+            }
+            p = chain.nested;
+        }
+    }
+
+    // regions starting in [from, to) of p[0, size), returns end of the last.
+    // Offsets at field boundaries of recently rejected walks are scored
+    // from them, so runs of fields aren't walked again from every field
+    static size_t scan(
+        const unsigned char * p,
+        size_t from,
+        size_t to,
+        size_t size,
+        double minConfidence,
+        std::vector<Region> & regions
+    ) {
+        std::vector<Chain> chains(kChains);
+        Chain scratch;
+        const unsigned char * nearest = p; // boundary of a chain to look up
+        size_t pos = from;
+        while (pos < to) {
+            const unsigned char ch = p[pos];
+            const unsigned type = ch & 7;
+            if (ch < 8 || (type != 0 && type != 1 && type != 2 && type != 5)) {
+                ++pos;
+                continue;
+            }
+            if (Limits::expired()) {
+                return to;
+            }
+            Chain * cached = NULL;
+            if (p + pos >= nearest) {
+                nearest = p + size;
+                for (size_t i = 0; i < chains.size(); ++i) {
+                    Chain & chain = chains[i];
+                    while (chain.next + 1 < chain.size && chain.fields[chain.next].begin < p + pos) {
+                        ++chain.next;
+                    }
+                    if (chain.next + 1 < chain.size) {
+                        if (!cached && chain.fields[chain.next].begin == p + pos) {
+                            cached = &chain;
+                        } else {
+                            nearest = std::min(nearest, chain.fields[chain.next].begin);
+                        }
+                    }
+                }
+            }
+            if (!cached) {
+                walk(p + pos, p + size, scratch);
+                cached = &scratch;
+                if (scratch.size > kMinChain) {
+                    // short ones are cheaper to walk again, the one
+                    // unused for longest is replaced
+                    size_t oldest = 0;
+                    for (size_t i = 1; i < chains.size(); ++i) {
+                        if (chains[i].used < chains[oldest].used) oldest = i;
+                    }
+                    std::swap(chains[oldest], scratch);
+                    cached = &chains[oldest];
+                }
+            }
+            cached->used = pos;
+            if (cached->next + 2 < cached->size) {
+                nearest = std::min(nearest, cached->fields[cached->next + 1].begin);
+            }
+            Region region = evaluate(*cached, cached->next);
+            if (region.size && region.confidence >= minConfidence) {
+                region.offset = pos;
+                regions.push_back(region);
+                pos += region.size;
+            } else {
+                ++pos;
+            }
+        }
+        return pos;
+    }
+
+    // varint without redundant trailing zero groups
+    static bool readCanonical(const unsigned char *& p, const unsigned char * e, int64_t & value) {
+        const unsigned char * b = p;
+        bool ok = false;
+        p = RawMessage::readVarint(p, e, value, &ok);
+        return ok && (p - b == 1 || p[-1] != 0);
+    }
+
+    // content is made of complete fields with growing numbers, length
+    // delimited ones are text or messages too
+    static bool isMessage(const unsigned char * p, const unsigned char * e, int depth = kMaxDepth) {
+        int64_t prev = 0;
+        for (unsigned i = 0; i < kMaxNestedFields && p < e; ++i) {
+            int64_t key = 0, value = 0;
+            if (!readCanonical(p, e, key) || (key >> 3) < prev || !(key >> 3)) return false;
+            prev = key >> 3;
+            switch (key & 7) {
+            case 0: if (!readCanonical(p, e, value)) return false; break;
+            case 1: p += 8; break;
+            case 5: p += 4; break;
+            case 2:
+                if (!readCanonical(p, e, value) || value > e - p) return false;
+                if (value >= kMinContent && !RawMessage::itsAsciiString(p, p + value) &&
+                    (!depth || !isMessage(p, p + value, depth - 1))) {
+                    return false;
+                }
+                p += value;
+                break;
+            default: return false;
+            }
+        }
+        return p == e;
+    }
+}; // MessageFinder
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Values at field number paths like "4.2.3" (--select), "*" matches any
+// field number and every element of repeated field is selected. Wire data
+// is walked without building the tree: fields not on any path are skipped
+// by their length, only values selected as a whole message are parsed.
+class FieldSelector {
+public:
+    // false when path is malformed
+    bool add(const std::string & path) {
+        std::vector<unsigned> numbers;
+        std::stringstream ss(path);
+        std::string item;
+        while (std::getline(ss, item, '.')) {
+            char * end = NULL;
+            const unsigned long number = strtoul(item.c_str(), &end, 10);
+            if (item == "*") {
+                numbers.push_back(kAny);
+            } else if (!item.empty() && !*end && number > 0 && number <= kMaxFieldNumber) {
+                numbers.push_back((unsigned) number);
+            } else {
+                mError = "bad field path '" + path + "'";
+                return false;
+            }
+        }
+        if (numbers.empty() || mPaths.size() == kMaxPaths) {
+            mError = numbers.empty() ? "empty field path" : "too many field paths";
+            return false;
+        }
+        mPaths.push_back(numbers);
+        return true;
+    }
+
+    // print "path: value" for every selected value
+    bool select(const unsigned char * p, const unsigned char * e, std::ostream & os) {
+        mError.clear();
+        if (!RawMessage::isValidMessage(p, e)) {
+            mError = "data is not a message";
+            return false;
+        }
+        std::vector<Frame> stack;
+        Frame root = { p, e, (uint64_t(1) << (mPaths.size() - 1) << 1) - 1 };
+        stack.push_back(root);
+        std::vector<unsigned> path;
+        while (!stack.empty()) {
+            Frame & frame = stack.back();
+            path.resize(stack.size() - 1);
+            if (frame.p >= frame.e) {
+                stack.pop_back();
+                continue;
+            }
+            int64_t key = 0, value = 0;
+            frame.p = RawMessage::readVarint(frame.p, frame.e, key);
+            if (!key) {
+                continue;
+            }
+            const unsigned number = (unsigned) (key >> 3);
+            const unsigned char * b = frame.p;
+            switch (key & 7) {
+            case 0: frame.p = RawMessage::readVarint(frame.p, frame.e, value); break;
+            case 1: frame.p += sizeof(double); break;
+            case 5: frame.p += sizeof(float); break;
+            case 2:
+                frame.p = RawMessage::readVarint(frame.p, frame.e, value);
+                b = frame.p;
+                frame.p += value;
+                break;
+            }
+            const unsigned depth = stack.size() - 1;
+            uint64_t matched = 0, deeper = 0;
+            for (size_t i = 0; i < mPaths.size(); ++i) {
+                const std::vector<unsigned> & numbers = mPaths[i];
+                if ((frame.mask >> i & 1) && (numbers[depth] == kAny || numbers[depth] == number)) {
+                    (numbers.size() == depth + 1 ? matched : deeper) |= uint64_t(1) << i;
+                }
+            }
+            if (!matched && !deeper) {
+                continue;
+            }
+            path.push_back(number);
+            if (matched) {
+                printValue(os, path, key & 7, value, b, frame.p);
+            }
+            if (deeper && (key & 7) == 2 && RawMessage::isValidMessage(b, b + value)) {
+                Frame child = { b, b + value, deeper };
+                stack.push_back(child);
+            }
+        }
+        return true;
+    }
+
+    const std::string & errorString() const {
+        return mError;
+    }
+
+private:
+    enum {
+        kAny      = 0,
+        kMaxPaths = 64
+    };
+    static const unsigned long kMaxFieldNumber = (1 << 29) - 1;
+
+    struct Frame {
+        const unsigned char * p;
+        const unsigned char * e;
+        uint64_t mask; // paths matching so far
+    };
+
+    static void printValue(
+        std::ostream & os,
+        const std::vector<unsigned> & path,
+        int type,
+        int64_t value,
+        const unsigned char * b,
+        const unsigned char * e
+    ) {
+        for (size_t i = 0; i < path.size(); ++i) {
+            os << (i ? "." : "") << path[i];
+        }
+        if (type == 0) {
+            os << ": " << value << std::endl;
+        } else if (type == 1) {
+            double d;
+            RawMessage::readValue(b, e, d);
+            os << ": " << d << std::endl;
+        } else if (type == 5) {
+            float f;
+            RawMessage::readValue(b, e, f);
+            os << ": " << f << std::endl;
+        } else if (!RawMessage::itsAsciiString(b, e) && RawMessage::isValidMessage(b, e) && b != e) {
+            RawMessage msg;
+            os << " {" << std::endl;
+            if (msg.parse(b, e)) {
+                msg.print(os, 1);
+            }
+            os << "}" << std::endl;
+        } else {
+            os << ": ";
+            RawMessage::printString(os, (const char *) b, e - b);
+            os << std::endl;
+        }
+    }
+
+    std::vector< std::vector<unsigned> > mPaths;
+    std::string mError;
+}; // FieldSelector
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Hexdump of a message with field boundaries (--annotate): every field
+// starts a new row labelled by its path and value, bytes not belonging to
+// any field are labelled as skipped.
+class Annotator {
+public:
+    static void print(
+        const unsigned char * p,
+        const unsigned char * e,
+        const OffsetIndex & index,
+        std::ostream & os
+    ) {
+        const std::vector<OffsetIndex::Field> & fields = index.fields();
+        uint64_t cursor = 0;
+        for (uint32_t i = 0; i < fields.size(); ++i) {
+            const OffsetIndex::Field & field = fields[i];
+            if (field.start > cursor) {
+                dump(p, cursor, field.start, "(skipped)", os);
+            }
+            std::stringstream label;
+            label << std::string(2 * index.depth(i), ' ') << index.path(i);
+            value(p + field.value, p + field.end, field, label);
+            cursor = field.kind == OffsetIndex::fkMessage ? field.value : field.end;
+            dump(p, field.start, cursor, label.str(), os);
+        }
+        if (p + cursor < e) {
+            dump(p, cursor, e - p, "(skipped)", os);
+        }
+    }
+
+private:
+    static const size_t kRowSize = 16;
+    static const size_t kMaxString = 40;
+
+    static void value(const unsigned char * b, const unsigned char * e, const OffsetIndex::Field & field, std::ostream & os) {
+        switch (field.kind) {
+        case OffsetIndex::fkMessage:
+            os << " {";
+            break;
+        case OffsetIndex::fkString:
+            os << ": ";
+            RawMessage::printString(os, (const char *) b, std::min<size_t>(e - b, kMaxString));
+            if ((size_t) (e - b) > kMaxString) {
+                os << "...";
+            }
+            break;
+        case OffsetIndex::fkPacked: {
+            size_t count = 0;
+            for (int64_t temp; b < e; ++count) {
+                b = RawMessage::readVarint(b, e, temp);
+            }
+            os << ": [" << count << " packed]";
+            break;
+        }
+        default:
+            os << ": ";
+            if (field.type == 1) {
+                double d;
+                memcpy(&d, b, sizeof(d));
+                os << d;
+            } else if (field.type == 5) {
+                float f;
+                memcpy(&f, b, sizeof(f));
+                os << f;
+            } else {
+                int64_t v;
+                RawMessage::readVarint(b, e, v);
+                os << v;
+            }
+            break;
+        }
+    }
+
+    static void dump(const unsigned char * p, uint64_t b, uint64_t e, const std::string & label, std::ostream & os) {
+        static const char digits[] = "0123456789abcdef";
+        for (uint64_t row = b; row < e || row == b; row += kRowSize) {
+            char line[16 + 3 * kRowSize];
+            snprintf(line, sizeof(line), "%08llx  ", (unsigned long long) row);
+            os << line;
+            const uint64_t end = std::min<uint64_t>(row + kRowSize, e);
+            for (uint64_t i = row; i < end; ++i) {
+                os << digits[p[i] >> 4] << digits[p[i] & 15] << ' ';
+            }
+            // label is on the first row only
+            if (row == b) {
+                os << std::string(3 * (row + kRowSize - end), ' ') << ' ' << label;
+            }
+            os << '\n';
+            if (end == e) {
+                break;
+            }
+        }
+    }
+}; // Annotator
+
+// /////////////////////////////////////////////////////////////////// //
+
+class Schema {
+public:
+    // Statistics of the values observed for a single scalar field across
+    // all instances of a message. Values are kept as raw bits in one column
+    // so that the type prediction is a single pass over a flat array.
+    class FieldStats {
+    public:
+        enum TYPE {
+            stUnknown,
+            stBool,
+            stEnum,
+            stInt32,
+            stInt64,
+            stSint32,
+            stSint64,
+            stFloat,
+            stFixed32,
+            stSfixed32,
+            stDouble,
+            stFixed64,
+            stSfixed64
+        };
+
+        FieldStats()
+            : mWireType(-1)
+        {
+        }
+
+        // values of other wire type than the first one are skipped
+        void add(const RawMessage::Variant & var) {
+            uint64_t bits = 0;
+            int wireType;
+            if (var.isInt()) {
+                wireType = RawMessage::Variant::proto2Varint;
+                bits = static_cast<uint64_t>(var.asInt());
+            } else if (var.isFloat()) {
+                wireType = RawMessage::Variant::proto2Float;
+                float value = var.asFloat();
+                uint32_t temp;
+                memcpy(&temp, &value, sizeof(temp));
+                bits = temp;
+            } else if (var.isDouble()) {
+                wireType = RawMessage::Variant::proto2Double;
+                double value = var.asDouble();
+                memcpy(&bits, &value, sizeof(bits));
+            } else {
+                return;
+            }
+            if (mWireType != -1 && mWireType != wireType) {
+                return;
+            }
+            mWireType = wireType;
+            mValues.push_back(bits);
+        }
+
+        size_t count() const {
+            return mValues.size();
+        }
+
+        // distinct values seen in the column, sorted; filled by predict()
+        const std::vector<uint64_t> & distinct() const {
+            return mDistinct;
+        }
+
+        TYPE predict() {
+            switch (mWireType) {
+            case RawMessage::Variant::proto2Varint: return predictVarint();
+            case RawMessage::Variant::proto2Float:  return predictFixed32();
+            case RawMessage::Variant::proto2Double: return predictFixed64();
+            default: return stUnknown;
+            }
+        }
+
+        static const char * typeName(TYPE type) {
+            static const char * names[] = {
+                "", "bool", "enum", "int32", "int64", "sint32", "sint64",
+                "float", "fixed32", "sfixed32", "double", "fixed64", "sfixed64"
+            };
+            return names[type];
+        }
+
+    private:
+        // minimal number of samples for guesses which can't be made
+        // from a single value
+        enum {
+            kMinSamples       = 2,
+            kMinEnumSamples   = 4,
+            kMaxEnumValues    = 16,
+            kMaxEnumValue     = 1024,
+            kMinZigzagSamples = 16,
+            // max / median of zigzag values centered at zero
+            kMinZigzagSpread  = 8
+        };
+
+        TYPE predictVarint() {
+            const size_t n = mValues.size();
+            uint64_t maxValue = 0, maxPositive = 0, maxOdd = 0, maxEven = 0;
+            size_t negative = 0, negative32 = 0, odd = 0;
+            for (size_t i = 0; i < n; ++i) {
+                const uint64_t v = mValues[i];
+                const int64_t sv = static_cast<int64_t>(v);
+                negative   += (sv < 0);
+                negative32 += (sv < 0 && sv >= INT32_MIN);
+                odd        += (v & 1);
+                maxValue    = std::max(maxValue, v);
+                maxPositive = std::max(maxPositive, sv < 0 ? 0 : v);
+                if (v & 1) maxOdd  = std::max(maxOdd, v);
+                else       maxEven = std::max(maxEven, v);
+            }
+
+            // sign bit is set only for negative int32/int64 values
+            if (negative) {
+                return negative == negative32 && maxPositive <= INT32_MAX
+                    ? stInt32 : stInt64;
+            }
+
+            if (n >= kMinSamples && maxValue <= 1) {
+                return stBool;
+            }
+
+            if (n >= kMinEnumSamples && maxValue < kMaxEnumValue) {
+                fillDistinct();
+                if (mDistinct.size() <= kMaxEnumValues && mDistinct.size() * 2 <= n) {
+                    return stEnum;
+                }
+            }
+
+            // zigzag encoding interleaves negative and positive values:
+            // the odd ones are negatives and both halves have equal spread.
+            // That alone fits any evenly spread column (counters, ids,
+            // timestamps), so signed values must also cluster near zero
+            if (n >= kMinZigzagSamples && odd * 3 >= n && odd * 3 <= n * 2 &&
+                maxOdd / 4 <= maxEven && maxEven / 4 <= maxOdd &&
+                median() <= maxValue / kMinZigzagSpread) {
+                return (maxValue >> 32) == 0 ? stSint32 : stSint64;
+            }
+            return stInt64;
+        }
+
+        uint64_t median() const {
+            std::vector<uint64_t> values(mValues);
+            std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+            return values[values.size() / 2];
+        }
+
+        TYPE predictFixed32() {
+            size_t nonZero = 0, implausible = 0, negative = 0;
+            for (size_t i = 0; i < mValues.size(); ++i) {
+                const uint32_t v = static_cast<uint32_t>(mValues[i]);
+                const uint32_t exponent = (v >> 23) & 0xff;
+                const bool zero = (v & 0x7fffffff) == 0;
+                nonZero     += !zero;
+                // NaN/Inf, denormals and values out of 1e-12..1e12
+                implausible += !zero && (exponent == 0xff || exponent < 127 - 40 || exponent > 127 + 40);
+                negative    += !zero && (v & 0x80000000) && static_cast<int32_t>(v) > -(1 << 24);
+            }
+            if (!nonZero || implausible * 2 <= nonZero) {
+                return stFloat;
+            }
+            return negative ? stSfixed32 : stFixed32;
+        }
+
+        TYPE predictFixed64() {
+            size_t nonZero = 0, implausible = 0, negative = 0;
+            for (size_t i = 0; i < mValues.size(); ++i) {
+                const uint64_t v = mValues[i];
+                const uint64_t exponent = (v >> 52) & 0x7ff;
+                const bool zero = (v & 0x7fffffffffffffffULL) == 0;
+                nonZero     += !zero;
+                // NaN/Inf, denormals and values out of 1e-30..1e30
+                implausible += !zero && (exponent == 0x7ff || exponent < 1023 - 100 || exponent > 1023 + 100);
+                negative    += !zero && (v >> 63) && static_cast<int64_t>(v) > -(1LL << 48);
+            }
+            if (!nonZero || implausible * 2 <= nonZero) {
+                return stDouble;
+            }
+            return negative ? stSfixed64 : stFixed64;
+        }
+
+        void fillDistinct() {
+            mDistinct = mValues;
+            std::sort(mDistinct.begin(), mDistinct.end());
+            mDistinct.erase(std::unique(mDistinct.begin(), mDistinct.end()), mDistinct.end());
+        }
+
+        int mWireType;
+        std::vector<uint64_t> mValues;
+        std::vector<uint64_t> mDistinct;
+    };
+
+    typedef std::map< unsigned, FieldStats > MessageStats;
+
+    static void print(const RawMessage & message, std::ostream & os) {
+        Context context;
+        fillSchemasInternal(message.view(), context);
+        os << "package ProtodecMessages;\n";
+        for (unsigned i = 0; i < context.messages.size(); ++i) {
+            os << "\nmessage MSG" << (i+1) << " {\n";
+            printFields(context.messages[i], context.stats[i], context, os);
+            os << "}\n";
+        }
+    }
+
+private:
+    // schemas found so far; ids are kept aside of the tree, so the message
+    // is only read and may be shared with other threads
+    struct Context {
+        std::vector< RawMessage::View > messages;
+        std::vector< MessageStats > stats;
+        std::map< std::string, unsigned > lookup; // fields of schema to id
+        std::unordered_map< const RawMessage::Variant *, unsigned > ids;
+    };
+
+    static std::string typeName(const RawMessage::View & var, const Context & context) {
+        if (!var.isMessage()) {
+            return var->dataType();
+        }
+        std::unordered_map< const RawMessage::Variant *, unsigned >::const_iterator it = context.ids.find(&*var);
+        assert(it != context.ids.end());
+        std::stringstream ss;
+        ss << "MSG" << it->second;
+        return ss.str();
+    }
+
+    static void printFields(
+        const RawMessage::View & message,
+        MessageStats & stats,
+        const Context & context,
+        std::ostream & os
+    ) {
+        std::stringstream ssEnums, ssFields;
+        const unsigned id = context.ids.find(&*message)->second;
+        const RawMessage::KeyValueMap & map = message.fields();
+        for (RawMessage::KeyValueMap::const_iterator it = map.begin(); it != map.end(); ++it) {
+            const RawMessage::View var = it->second;
+            const bool repeated = var.isRepeated();
+            const RawMessage::View subVar = repeated ? var.fields().begin()->second : var;
+
+            std::string type = typeName(subVar, context);
+            FieldStats & fieldStats = stats[it->first];
+            // a single value keeps the wire-level type
+            FieldStats::TYPE predicted = fieldStats.count() > 1 ? fieldStats.predict() : FieldStats::stUnknown;
+            if (predicted == FieldStats::stEnum) {
+                std::stringstream ss;
+                ss << "ENUM" << it->first;
+                type = ss.str();
+                ssEnums << "\tenum " << type << " {\n";
+                const std::vector<uint64_t> & values = fieldStats.distinct();
+                for (size_t i = 0; i < values.size(); ++i) {
+                    ssEnums << "\t\tMSG" << id << "_FLD" << it->first
+                            << "_" << values[i] << " = " << values[i] << ";\n";
+                }
+                ssEnums << "\t}\n";
+            } else if (predicted != FieldStats::stUnknown) {
+                type = FieldStats::typeName(predicted);
+            }
+
+            ssFields << "\t" << (repeated ? "repeated " : "required ") << type
+                     << " fld" << (it->first) << " = " << (it->first) << ";\n";
+        }
+        os << ssEnums.str() << ssFields.str();
+    }
+
+    // schemas of message and its submessages, submessages get their ids
+    // before the message which refers to them by MSG<id>
+    static void fillSchemasInternal(const RawMessage::View & message, Context & context) {
+        // only the first element of repeated field is described, nested
+        // repeated field is described as a message; scalar values of the
+        // other elements are added to statistics of the first one, which
+        // is left right before the next element is entered
+        struct Collector {
+            Context & context;
+            unsigned first;
+
+            bool enter(const RawMessage::Walker::Item & item) {
+                assert(item.var->isMap() || !item.var->asMap().empty());
+                if (!item.element || item.key == 1) {
+                    return true;
+                }
+                if (item.var->isMap() && first) {
+                    addStats(item.var->asMap(), context.stats[first - 1]);
+                }
+                return false;
+            }
+            void leave(const RawMessage::Walker::Item & item) {
+                if (item.var->isMap() || item.element) {
+                    addSchema(item.var, context);
+                }
+                if (item.element && item.key == 1) {
+                    first = item.var->isMap() ? context.ids[&*item.var] : 0;
+                }
+            }
+            void value(const RawMessage::Walker::Item &) {
+            }
+        } collector = { context, 0 };
+        RawMessage::Walker::walk(message.fields(), collector);
+        addSchema(message, context);
+    }
+
+    static void addSchema(const RawMessage::View & message, Context & context) {
+        std::stringstream ss;
+        const RawMessage::KeyValueMap & map = message.fields();
+        for (RawMessage::KeyValueMap::const_iterator it = map.begin(); it != map.end(); ++it) {
+            ss << "\t";
+            const RawMessage::View var = it->second;
+            if (!var.isRepeated()) {
+                ss << "required " << typeName(var, context);
+            } else {
+                assert(var.size());
+                ss << "repeated " << typeName(var.fields().begin()->second, context);
+            }
+            ss << " fld" << (it->first) << " = " << (it->first) << ";\n";
+        }
+        // same fields are the same schema
+        const std::string key = ss.str();
+        std::map< std::string, unsigned >::const_iterator found = context.lookup.find(key);
+        unsigned id;
+        if (found != context.lookup.end()) {
+            id = found->second;
+        } else {
+            context.messages.push_back(message);
+            context.stats.push_back(MessageStats());
+            id = (unsigned) context.messages.size();
+            context.lookup[key] = id;
+        }
+        context.ids[&*message] = id;
+        addStats(map, context.stats[id - 1]);
+    }
+
+    // collect values of scalar fields of every instance of the message
+    static void addStats(const RawMessage::KeyValueMap & map, MessageStats & messageStats) {
+        for (RawMessage::KeyValueMap::const_iterator it = map.begin(); it != map.end(); ++it) {
+            const RawMessage::VariantPtr & var = it->second;
+            FieldStats & fieldStats = messageStats[it->first];
+            if (!var->isRepeated()) {
+                fieldStats.add(*var);
+            } else {
+                const RawMessage::KeyValueMap & items = var->asMap();
+                for (RawMessage::KeyValueMap::const_iterator jt = items.begin(); jt != items.end(); ++jt) {
+                    fieldStats.add(*jt->second);
+                }
+            }
+        }
+    }
+}; // Schema
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Messages and enums of known .proto files compiled into lookup tables
+// indexed by field number. Decoding with the tables never guesses whether
+// a length-delimited field is a string, a submessage or a packed array.
+class DescriptorTables {
+public:
+    // how a value is decoded; numbers match FieldDescriptorProto.Type
+    enum HANDLER {
+        hUnknown  = 0,
+        hDouble   = 1,
+        hFloat    = 2,
+        hInt64    = 3,
+        hUint64   = 4,
+        hInt32    = 5,
+        hFixed64  = 6,
+        hFixed32  = 7,
+        hBool     = 8,
+        hString   = 9,
+        hGroup    = 10,
+        hMessage  = 11,
+        hBytes    = 12,
+        hUint32   = 13,
+        hEnum     = 14,
+        hSfixed32 = 15,
+        hSfixed64 = 16,
+        hSint32   = 17,
+        hSint64   = 18
+    };
+
+    struct Field {
+        std::string name;
+        unsigned    number;
+        HANDLER     handler;
+        bool        repeated;
+        bool        packed;
+        std::string typeName; // message or enum type as written in source
+        int         index;    // resolved message or enum index, -1 if none
+        std::string scope;    // full name of the declaring message
+    };
+
+    struct Enum {
+        std::string name;     // fully qualified name with leading dot
+        std::string package;
+        std::map< int64_t, std::string > values;
+    };
+
+    struct Message {
+        std::string name;     // fully qualified name with leading dot
+        std::string package;
+        std::vector< Field > fields;
+        std::vector< int > lookup;         // field number -> index in fields
+        std::map< unsigned, int > sparse;  // numbers out of lookup range
+
+        const Field * field(unsigned number) const {
+            if (number < lookup.size()) {
+                return lookup[number] < 0 ? NULL : &fields[lookup[number]];
+            }
+            std::map< unsigned, int >::const_iterator it = sparse.find(number);
+            return it == sparse.end() ? NULL : &fields[it->second];
+        }
+    };
+
+    DescriptorTables()
+        : mCompiled(true)
+    {
+    }
+
+    const std::vector< Message > & messages() const {
+        return mMessages;
+    }
+    const std::vector< Enum > & enums() const {
+        return mEnums;
+    }
+
+    // load FileDescriptorProto grabbed from a binary or FileDescriptorSet
+    bool loadSerialized(const RawMessage & msg) {
+        const RawMessage::KeyValueMap & root = msg.rootItem()->asMap();
+        RawMessage::KeyValueMap::const_iterator it = root.find(1);
+        if (it != root.end() && !it->second->isString()) {
+            // files of descriptor set
+            RawMessage::forEach(root, 1, [&](const RawMessage::VariantPtr & item) {
+                if (!isError() && item->isMap()) {
+                    loadSerializedFile(item->asMap());
+                }
+            });
+            mCompiled = false;
+            return !isError();
+        }
+        return loadSerializedFile(root);
+    }
+
+    bool loadSerializedFile(const RawMessage::KeyValueMap & file) {
+        std::string scope;
+        RawMessage::KeyValueMap::const_iterator it = file.find(2);
+        mPackage.clear();
+        if (it != file.end() && it->second->isString()) {
+            mPackage = it->second->asString();
+            scope = "." + mPackage;
+        }
+
+        std::vector< std::pair< RawMessage::VariantPtr, std::string > > stack;
+        RawMessage::forEach(file, 5, [&](const RawMessage::VariantPtr & item) {
+            addSerializedEnum(item, scope);
+        });
+        RawMessage::forEach(file, 4, [&](const RawMessage::VariantPtr & item) {
+            stack.push_back(std::make_pair(item, scope));
+        });
+        // keep declaration order of messages
+        std::reverse(stack.begin(), stack.end());
+
+        while (!stack.empty()) {
+            RawMessage::VariantPtr var = stack.back().first;
+            std::string parent = stack.back().second;
+            stack.pop_back();
+            if (!var->isMap() || !var->hasField(1) || !var->asMap().find(1)->second->isString()) {
+                mError = "malformed descriptor";
+                return false;
+            }
+
+            const RawMessage::KeyValueMap & map = var->asMap();
+            mMessages.push_back(Message());
+            mMessages.back().name = parent + "." + map.find(1)->second->asString();
+            mMessages.back().package = mPackage;
+            const std::string & name = mMessages.back().name;
+            RawMessage::forEach(map, 2, [&](const RawMessage::VariantPtr & item) {
+                addSerializedField(item, name);
+            });
+            RawMessage::forEach(map, 4, [&](const RawMessage::VariantPtr & item) {
+                addSerializedEnum(item, name);
+            });
+            const size_t nested = stack.size();
+            RawMessage::forEach(map, 3, [&](const RawMessage::VariantPtr & item) {
+                stack.push_back(std::make_pair(item, name));
+            });
+            std::reverse(stack.begin() + nested, stack.end());
+        }
+        mCompiled = false;
+        return !isError();
+    }
+
+    // load text of .proto file
+    bool loadProto(const char * text, const char * end) {
+        ProtoParser parser(*this, text, end);
+        mCompiled = false;
+        mPackage.clear();
+        if (!parser.parseFile()) {
+            mError = parser.error();
+            return false;
+        }
+        return true;
+    }
+
+    // resolve type names and build lookup tables of every message; when not
+    // strict unresolved messages are kept as bytes and enums as int32
+    bool compile(bool strict = true) {
+        if (mCompiled) {
+            return !isError();
+        }
+        mMessageIndex.clear();
+        mEnumIndex.clear();
+        for (size_t i = 0; i < mMessages.size(); ++i) {
+            mMessageIndex[mMessages[i].name] = i;
+        }
+        for (size_t i = 0; i < mEnums.size(); ++i) {
+            mEnumIndex[mEnums[i].name] = i;
+        }
+
+        for (size_t i = 0; i < mMessages.size(); ++i) {
+            Message & message = mMessages[i];
+            unsigned maxNumber = 0;
+            for (size_t j = 0; j < message.fields.size(); ++j) {
+                Field & field = message.fields[j];
+                if (!field.typeName.empty() && field.handler != hGroup && !resolve(field)) {
+                    if (strict) {
+                        mError = "unresolved type " + field.typeName + " of " + message.name + "." + field.name;
+                        return false;
+                    }
+                    field.handler = (field.handler == hEnum ? hInt32 : hBytes);
+                }
+                maxNumber = std::max(maxNumber, field.number);
+            }
+
+            // dense table unless field numbers are too sparse
+            const size_t denseSize = std::min<size_t>(maxNumber + 1, message.fields.size() * 4 + 64);
+            message.lookup.assign(denseSize, -1);
+            message.sparse.clear();
+            for (size_t j = 0; j < message.fields.size(); ++j) {
+                const unsigned number = message.fields[j].number;
+                if (number < message.lookup.size()) {
+                    message.lookup[number] = j;
+                } else {
+                    message.sparse[number] = j;
+                }
+            }
+        }
+        mCompiled = true;
+        return true;
+    }
+
+    // index of the message with given full or short name, -1 if not found
+    int findMessage(const std::string & name) const {
+        std::string full = (!name.empty() && name[0] == '.') ? name : "." + name;
+        std::map< std::string, int >::const_iterator it = mMessageIndex.find(full);
+        if (it != mMessageIndex.end()) {
+            return it->second;
+        }
+        int found = -1;
+        for (it = mMessageIndex.begin(); it != mMessageIndex.end(); ++it) {
+            const std::string & n = it->first;
+            if (n.length() > full.length() &&
+                n.compare(n.length() - full.length(), full.length(), full) == 0) {
+                if (found >= 0) return -1; // ambiguous
+                found = it->second;
+            }
+        }
+        return found;
+    }
+
+    // print message decoded by the tables
+    bool decode(
+        int message,
+        const unsigned char * start,
+        const unsigned char * e,
+        std::ostream & os
+    ) {
+        mError.clear();
+        if (!compile()) {
+            return false;
+        }
+        assert(message >= 0 && message < (int) mMessages.size());
+
+        struct Frame {
+            int message;
+            const unsigned char * end;
+        };
+        std::vector< Frame > frames;
+        Frame root = { message, e };
+        frames.push_back(root);
+
+        const unsigned char * p = start;
+        while (!frames.empty()) {
+            const Frame & frame = frames.back();
+            const Message & msg = mMessages[frame.message];
+            e = frame.end;
+            const int indent = frames.size() - 1;
+
+            if (p >= e) {
+                frames.pop_back();
+                if (!frames.empty()) {
+                    for (int i = 0; i < indent - 1; ++i) os << '\t';
+                    os << "}\n";
+                }
+                continue;
+            }
+
+            int64_t tag;
+            p = RawMessage::readVarint(p, e, tag);
+            if (tag == 0) {
+                continue;
+            }
+            const int type = (tag & 7);
+            const unsigned number = (tag >> 3);
+            const Field * field = msg.field(number);
+            if (field && wireType(field->handler) != type &&
+                !(type == RawMessage::Variant::proto2Buffer && isPackable(field->handler))) {
+                field = NULL; // wire type doesn't match the declaration
+            }
+
+            uint64_t value = 0;
+            if (type == RawMessage::Variant::proto2Varint) {
+                int64_t temp;
+                p = RawMessage::readVarint(p, e, temp);
+                value = temp;
+            } else if (type == RawMessage::Variant::proto2Double || type == RawMessage::Variant::proto2Float) {
+                const size_t size = (type == RawMessage::Variant::proto2Double ? 8 : 4);
+                if (p + size > e) {
+                    setError("truncated value", p - start);
+                    return false;
+                }
+                for (size_t i = 0; i < size; ++i) {
+                    value |= static_cast<uint64_t>(p[i]) << (8 * i);
+                }
+                p += size;
+            } else if (type == RawMessage::Variant::proto2Buffer) {
+                int64_t length;
+                p = RawMessage::readVarint(p, e, length);
+                if (length < 0 || length > e - p) {
+                    setError("length out of message", p - start);
+                    return false;
+                }
+                const unsigned char * end = p + length;
+                if (field && field->handler == hMessage) {
+                    for (int i = 0; i < indent; ++i) os << '\t';
+                    os << field->name << " {\n";
+                    Frame sub = { field->index, end };
+                    frames.push_back(sub);
+                    continue;
+                }
+                if (field && isPackable(field->handler)) {
+                    if (!decodePacked(*field, p, end, indent, os)) {
+                        setError("malformed packed field", p - start);
+                        return false;
+                    }
+                    p = end;
+                    continue;
+                }
+                for (int i = 0; i < indent; ++i) os << '\t';
+                if (field) os << field->name; else os << number;
+                os << ": ";
+                RawMessage::printString(os, (const char *) p, length);
+                os << '\n';
+                p = end;
+                continue;
+            } else {
+                setError("unknown data type", p - start);
+                return false;
+            }
+            if (p > e) {
+                setError("truncated value", e - start);
+                return false;
+            }
+
+            for (int i = 0; i < indent; ++i) os << '\t';
+            if (field) {
+                os << field->name << ": ";
+                printValue(*field, value, os);
+            } else {
+                os << number << ": ";
+                if (type == RawMessage::Variant::proto2Varint) os << static_cast<int64_t>(value);
+                else os << value;
+            }
+            os << '\n';
+        }
+        return true;
+    }
+
+    bool isError() const {
+        return !mError.empty();
+    }
+    const std::string & errorString() const {
+        return mError;
+    }
+
+    // handler of scalar type written in .proto source, hUnknown for names
+    static HANDLER scalarHandler(const std::string & type) {
+        static const char * names[] = {
+            "", "double", "float", "int64", "uint64", "int32", "fixed64",
+            "fixed32", "bool", "string", "group", "", "bytes", "uint32", "",
+            "sfixed32", "sfixed64", "sint32", "sint64"
+        };
+        for (unsigned i = 1; i < sizeof(names) / sizeof(*names); ++i) {
+            if (*names[i] && type == names[i]) {
+                return static_cast<HANDLER>(i);
+            }
+        }
+        return hUnknown;
+    }
+
+    // wire type used for values of the handler
+    static int wireType(HANDLER handler) {
+        switch (handler) {
+        case hDouble: case hFixed64: case hSfixed64:
+            return RawMessage::Variant::proto2Double;
+        case hFloat: case hFixed32: case hSfixed32:
+            return RawMessage::Variant::proto2Float;
+        case hString: case hBytes: case hMessage:
+            return RawMessage::Variant::proto2Buffer;
+        case hUnknown: case hGroup:
+            return -1;
+        default:
+            return RawMessage::Variant::proto2Varint;
+        }
+    }
+
+    static bool isPackable(HANDLER handler) {
+        const int type = wireType(handler);
+        return type == RawMessage::Variant::proto2Varint ||
+               type == RawMessage::Variant::proto2Double ||
+               type == RawMessage::Variant::proto2Float;
+    }
+
+private:
+    void addSerializedEnum(const RawMessage::VariantPtr & var, const std::string & scope) {
+        if (!var->isMap() || !var->hasField(1)) {
+            mError = "malformed enum descriptor";
+            return;
+        }
+        const RawMessage::KeyValueMap & map = var->asMap();
+        mEnums.push_back(Enum());
+        Enum & en = mEnums.back();
+        en.name = scope + "." + map.find(1)->second->asString();
+        en.package = mPackage;
+        RawMessage::forEach(map, 2, [&](const RawMessage::VariantPtr & item) {
+            if (item->isMap() && item->hasField(1)) {
+                const RawMessage::KeyValueMap & value = item->asMap();
+                RawMessage::KeyValueMap::const_iterator number = value.find(2);
+                const int64_t n = (number != value.end() && number->second->isInt()) ? number->second->asInt() : 0;
+                if (!en.values.count(n)) {
+                    en.values[n] = value.find(1)->second->asString();
+                }
+            }
+        });
+    }
+
+    void addSerializedField(const RawMessage::VariantPtr & var, const std::string & scope) {
+        if (!var->isMap() || !var->hasField(1) || !var->hasField(3)) {
+            mError = "malformed field descriptor in " + scope;
+            return;
+        }
+        const RawMessage::KeyValueMap & map = var->asMap();
+        Field field;
+        field.name = map.find(1)->second->asString();
+        field.number = map.find(3)->second->asInt();
+        field.handler = var->hasField(5) ? static_cast<HANDLER>(map.find(5)->second->asInt()) : hUnknown;
+        field.repeated = var->hasField(4) && map.find(4)->second->asInt() == 3;
+        field.packed = false;
+        if (var->hasField(6)) {
+            field.typeName = map.find(6)->second->asString();
+        }
+        if (var->hasField(8) && map.find(8)->second->isMap()) {
+            const RawMessage::VariantPtr & options = map.find(8)->second;
+            field.packed = options->hasField(2) && options->asMap().find(2)->second->isInt() &&
+                           options->asMap().find(2)->second->asInt() != 0;
+        }
+        field.index = -1;
+        field.scope = scope;
+        if (field.handler > hSint64) {
+            field.handler = hUnknown;
+        }
+        mMessages.back().fields.push_back(field);
+    }
+
+    // find type of the field in the scope of declaring message
+    bool resolve(Field & field) {
+        std::vector< std::string > candidates;
+        if (field.typeName[0] == '.') {
+            candidates.push_back(field.typeName);
+        } else {
+            std::string scope = field.scope;
+            for (;;) {
+                candidates.push_back(scope + "." + field.typeName);
+                if (scope.empty()) break;
+                scope.erase(scope.rfind('.'));
+            }
+        }
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            std::map< std::string, int >::const_iterator it;
+            if (field.handler != hEnum && (it = mMessageIndex.find(candidates[i])) != mMessageIndex.end()) {
+                field.handler = hMessage;
+                field.index = it->second;
+                return true;
+            }
+            if (field.handler != hMessage && (it = mEnumIndex.find(candidates[i])) != mEnumIndex.end()) {
+                field.handler = hEnum;
+                field.index = it->second;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool decodePacked(
+        const Field & field,
+        const unsigned char * p,
+        const unsigned char * e,
+        int indent,
+        std::ostream & os
+    ) const {
+        const int type = wireType(field.handler);
+        while (p < e) {
+            uint64_t value = 0;
+            if (type == RawMessage::Variant::proto2Varint) {
+                int64_t temp;
+                bool ok = false;
+                p = RawMessage::readVarint(p, e, temp, &ok);
+                if (!ok) return false;
+                value = temp;
+            } else {
+                const size_t size = (type == RawMessage::Variant::proto2Double ? 8 : 4);
+                if (p + size > e) return false;
+                for (size_t i = 0; i < size; ++i) {
+                    value |= static_cast<uint64_t>(p[i]) << (8 * i);
+                }
+                p += size;
+            }
+            for (int i = 0; i < indent; ++i) os << '\t';
+            os << field.name << ": ";
+            printValue(field, value, os);
+            os << '\n';
+        }
+        return true;
+    }
+
+    void printValue(const Field & field, uint64_t value, std::ostream & os) const {
+        switch (field.handler) {
+        case hInt64:
+        case hSfixed64: os << static_cast<int64_t>(value); break;
+        case hInt32:
+        case hSfixed32: os << static_cast<int32_t>(value); break;
+        case hUint32:
+        case hFixed32:  os << static_cast<uint32_t>(value); break;
+        case hBool:     os << (value ? "true" : "false"); break;
+        case hSint32:
+        case hSint64:   os << static_cast<int64_t>((value >> 1) ^ (~(value & 1) + 1)); break;
+        case hFloat: {
+            const uint32_t bits = static_cast<uint32_t>(value);
+            float f;
+            memcpy(&f, &bits, sizeof(f));
+            os << f;
+            break;
+        }
+        case hDouble: {
+            double d;
+            memcpy(&d, &value, sizeof(d));
+            os << d;
+            break;
+        }
+        case hEnum: {
+            const Enum & en = mEnums[field.index];
+            std::map< int64_t, std::string >::const_iterator it = en.values.find(static_cast<int32_t>(value));
+            if (it != en.values.end()) os << it->second;
+            else os << static_cast<int32_t>(value);
+            break;
+        }
+        default: os << value; break;
+        }
+    }
+
+    void setError(const char * what, std::ptrdiff_t offset) {
+        std::stringstream ss;
+        ss << what << " at offset 0x" << std::hex << offset;
+        mError = ss.str();
+    }
+
+    // recursive descent parser of .proto source
+    class ProtoParser {
+    public:
+        ProtoParser(DescriptorTables & tables, const char * p, const char * e)
+            : mTables(tables)
+            , mP(p)
+            , mE(e)
+            , mLine(1)
+        {
+        }
+
+        bool parseFile() {
+            std::string scope, token;
+            while (next(token)) {
+                if (token == "syntax" || token == "import" || token == "option") {
+                    if (!skipStatement()) return false;
+                } else if (token == "package") {
+                    if (!next(token)) return fail("package name expected");
+                    scope = "." + token;
+                    mTables.mPackage = token;
+                    if (!expect(";")) return false;
+                } else if (token == "message") {
+                    if (!parseMessage(scope)) return false;
+                } else if (token == "enum") {
+                    if (!parseEnum(scope)) return false;
+                } else if (token == "service" || token == "extend") {
+                    if (!skipBlock()) return false;
+                } else if (token != ";") {
+                    return fail("unexpected '" + token + "'");
+                }
+            }
+            return mError.empty();
+        }
+
+        const std::string & error() const {
+            return mError;
+        }
+
+    private:
+        bool parseMessage(const std::string & scope) {
+            std::string name, token;
+            if (!next(name) || !expect("{")) return fail("message name expected");
+            const size_t index = mTables.mMessages.size();
+            mTables.mMessages.push_back(Message());
+            mTables.mMessages[index].name = scope + "." + name;
+            mTables.mMessages[index].package = mTables.mPackage;
+            const std::string full = mTables.mMessages[index].name;
+
+            while (next(token) && token != "}") {
+                if (token == "message") {
+                    if (!parseMessage(full)) return false;
+                } else if (token == "enum") {
+                    if (!parseEnum(full)) return false;
+                } else if (token == "option" || token == "reserved" ||
+                           token == "extensions" || token == "map") {
+                    if (!skipStatement()) return false;
+                } else if (token == "extend") {
+                    if (!skipBlock()) return false;
+                } else if (token == "oneof") {
+                    if (!next(token) || !expect("{")) return fail("oneof name expected");
+                    while (next(token) && token != "}") {
+                        if (token == "option") {
+                            if (!skipStatement()) return false;
+                        } else if (!parseField(index, full, token)) {
+                            return false;
+                        }
+                    }
+                } else if (token != ";") {
+                    if (!parseField(index, full, token)) return false;
+                }
+            }
+            return token == "}" || fail("'}' expected");
+        }
+
+        bool parseField(size_t index, const std::string & scope, std::string token) {
+            Field field;
+            field.repeated = false;
+            field.packed = false;
+            field.index = -1;
+            field.scope = scope;
+            if (token == "optional" || token == "required" || token == "repeated") {
+                field.repeated = (token == "repeated");
+                if (!next(token)) return fail("field type expected");
+            }
+            if (token == "group") {
+                return fail("groups are not supported");
+            }
+            field.handler = scalarHandler(token);
+            if (field.handler == hUnknown) {
+                field.typeName = token;
+            }
+            std::string number;
+            if (!next(field.name) || !expect("=") || !next(number)) {
+                return fail("field declaration expected");
+            }
+            field.number = strtoul(number.c_str(), NULL, 0);
+            if (!next(token)) return fail("';' expected");
+            if (token == "[") {
+                std::string key, value;
+                while (next(token) && token != "]") {
+                    if (token == "=") {
+                        if (!next(value)) break;
+                        if (key == "packed") field.packed = (value == "true");
+                    } else {
+                        key = token;
+                    }
+                }
+                if (!next(token)) return fail("';' expected");
+            }
+            if (token != ";") return fail("';' expected");
+            mTables.mMessages[index].fields.push_back(field);
+            return true;
+        }
+
+        bool parseEnum(const std::string & scope) {
+            std::string name, token, number;
+            if (!next(name) || !expect("{")) return fail("enum name expected");
+            Enum en;
+            en.name = scope + "." + name;
+            en.package = mTables.mPackage;
+            while (next(token) && token != "}") {
+                if (token == "option" || token == "reserved") {
+                    if (!skipStatement()) return false;
+                } else if (token != ";") {
+                    if (!expect("=") || !next(number)) return fail("enum value expected");
+                    const int64_t n = strtoll(number.c_str(), NULL, 0);
+                    if (!en.values.count(n)) en.values[n] = token;
+                    if (!skipStatement()) return false;
+                }
+            }
+            mTables.mEnums.push_back(en);
+            return token == "}" || fail("'}' expected");
+        }
+
+        bool skipStatement() {
+            std::string token;
+            while (next(token)) {
+                if (token == ";") return true;
+                if (token == "{") return skipBlockBody();
+            }
+            return fail("';' expected");
+        }
+
+        bool skipBlock() {
+            std::string token;
+            while (next(token) && token != "{");
+            return skipBlockBody();
+        }
+
+        bool skipBlockBody() {
+            std::string token;
+            for (int depth = 1; depth > 0 && next(token); ) {
+                if (token == "{") ++depth;
+                else if (token == "}") --depth;
+            }
+            return token == "}" || fail("'}' expected");
+        }
+
+        bool expect(const char * what) {
+            std::string token;
+            if (!next(token) || token != what) {
+                return fail(std::string("'") + what + "' expected");
+            }
+            return true;
+        }
+
+        bool fail(const std::string & what) {
+            if (mError.empty()) {
+                std::stringstream ss;
+                ss << what << " at line " << mLine;
+                mError = ss.str();
+            }
+            return false;
+        }
+
+        // next identifier, number, string literal or punctuation
+        bool next(std::string & token) {
+            token.clear();
+            for (;;) {
+                while (mP < mE && isspace((unsigned char) *mP)) {
+                    if (*mP++ == '\n') ++mLine;
+                }
+                if (mE - mP >= 2 && mP[0] == '/' && mP[1] == '/') {
+                    while (mP < mE && *mP != '\n') ++mP;
+                } else if (mE - mP >= 2 && mP[0] == '/' && mP[1] == '*') {
+                    for (mP += 2; mP < mE && !(mP[0] == '*' && mP + 1 < mE && mP[1] == '/'); ++mP) {
+                        if (*mP == '\n') ++mLine;
+                    }
+                    mP = std::min(mP + 2, mE);
+                } else {
+                    break;
+                }
+            }
+            if (mP >= mE || !*mP) {
+                return false;
+            }
+            if (*mP == '"' || *mP == '\'') {
+                const char quote = *mP++;
+                for (; mP < mE && *mP != quote; ++mP) {
+                    if (*mP == '\\' && mP + 1 < mE) ++mP;
+                    token += *mP;
+                }
+                ++mP;
+                return true;
+            }
+            const char * b = mP;
+            while (mP < mE && (isalnum((unsigned char) *mP) || *mP == '_' || *mP == '.' ||
+                              (*mP == '-' && mP == b))) {
+                ++mP;
+            }
+            if (mP == b) {
+                ++mP;
+            }
+            token.assign(b, mP);
+            return true;
+        }
+
+        DescriptorTables & mTables;
+        const char * mP;
+        const char * mE;
+        std::string mError;
+        unsigned mLine;
+    };
+
+    std::vector< Message > mMessages;
+    std::vector< Enum > mEnums;
+    std::map< std::string, int > mMessageIndex;
+    std::map< std::string, int > mEnumIndex;
+    std::string mError;
+    std::string mPackage; // package of the file being loaded
+    bool mCompiled;
+}; // DescriptorTables
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Emits self-contained C++ header with a decoder for every message of the
+// tables: a struct of fields and a switch on precomputed tag constants.
+class CppDecoders {
+public:
+    static void print(const DescriptorTables & tables, std::ostream & os, const std::string & source) {
+        const std::vector< DescriptorTables::Message > & messages = tables.messages();
+        const std::vector< DescriptorTables::Enum > & enums = tables.enums();
+
+        os << "// Generated by protodec from " << source << ". Do not edit.\n"
+           << "#pragma once\n"
+           << "#include <cstdint>\n"
+           << "#include <cstring>\n"
+           << "#include <memory>\n"
+           << "#include <string>\n"
+           << "#include <vector>\n"
+           << "\n";
+        printRuntime(os);
+
+        std::string package;
+        for (size_t i = 0; i < enums.size(); ++i) {
+            const DescriptorTables::Enum & en = enums[i];
+            switchPackage(package, en.package, os);
+            const std::string name = localName(en.name, en.package);
+            os << "enum " << name << " : int32_t {\n";
+            for (std::map< int64_t, std::string >::const_iterator it = en.values.begin(); it != en.values.end(); ++it) {
+                os << "    " << name << "_" << it->second << " = " << it->first << ",\n";
+            }
+            os << "};\n\n";
+        }
+
+        for (size_t i = 0; i < messages.size(); ++i) {
+            switchPackage(package, messages[i].package, os);
+            os << "struct " << localName(messages[i].name, messages[i].package) << ";\n";
+        }
+        os << "\n";
+
+        // structs are defined after the messages they contain by value
+        std::vector< int > order, state(messages.size(), 0);
+        for (size_t i = 0; i < messages.size(); ++i) {
+            sortMessages(messages, i, state, order);
+        }
+        std::vector< size_t > position(messages.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            position[order[i]] = i;
+        }
+        for (size_t i = 0; i < order.size(); ++i) {
+            const DescriptorTables::Message & message = messages[order[i]];
+            switchPackage(package, message.package, os);
+            printStruct(tables, message, position, os);
+        }
+        for (size_t i = 0; i < messages.size(); ++i) {
+            switchPackage(package, messages[i].package, os);
+            printDecode(tables, messages[i], position, os);
+        }
+        switchPackage(package, std::string(), os);
+    }
+
+private:
+    static void printRuntime(std::ostream & os) {
+        os << "#ifndef PROTODEC_DECODER_RUNTIME\n"
+              "#define PROTODEC_DECODER_RUNTIME\n"
+              "namespace protodec_rt {\n"
+              "\n"
+              "inline bool readVarint(const uint8_t *& p, const uint8_t * e, uint64_t & v) {\n"
+              "    v = 0;\n"
+              "    for (unsigned shift = 0; p < e && shift < 64; shift += 7) {\n"
+              "        const uint8_t b = *p++;\n"
+              "        v |= static_cast<uint64_t>(b & 0x7f) << shift;\n"
+              "        if (!(b & 0x80)) return true;\n"
+              "    }\n"
+              "    return false;\n"
+              "}\n"
+              "\n"
+              "inline bool readFixed32(const uint8_t *& p, const uint8_t * e, uint32_t & v) {\n"
+              "    if (e - p < 4) return false;\n"
+              "    v = uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;\n"
+              "    p += 4;\n"
+              "    return true;\n"
+              "}\n"
+              "\n"
+              "inline bool readFixed64(const uint8_t *& p, const uint8_t * e, uint64_t & v) {\n"
+              "    uint32_t lo, hi;\n"
+              "    if (!readFixed32(p, e, lo) || !readFixed32(p, e, hi)) return false;\n"
+              "    v = uint64_t(hi) << 32 | lo;\n"
+              "    return true;\n"
+              "}\n"
+              "\n"
+              "inline bool readLength(const uint8_t *& p, const uint8_t * e, const uint8_t *& b, const uint8_t *& be) {\n"
+              "    uint64_t n;\n"
+              "    if (!readVarint(p, e, n) || n > uint64_t(e - p)) return false;\n"
+              "    b = p;\n"
+              "    be = p = p + n;\n"
+              "    return true;\n"
+              "}\n"
+              "\n"
+              "inline bool skipField(const uint8_t *& p, const uint8_t * e, uint64_t tag) {\n"
+              "    uint64_t v;\n"
+              "    uint32_t v32;\n"
+              "    const uint8_t * b, * be;\n"
+              "    switch (tag & 7) {\n"
+              "    case 0: return readVarint(p, e, v);\n"
+              "    case 1: return readFixed64(p, e, v);\n"
+              "    case 2: return readLength(p, e, b, be);\n"
+              "    case 5: return readFixed32(p, e, v32);\n"
+              "    default: return false;\n"
+              "    }\n"
+              "}\n"
+              "\n"
+              "template <class T, class U> inline T bitCast(U value) {\n"
+              "    T result;\n"
+              "    memcpy(&result, &value, sizeof(result));\n"
+              "    return result;\n"
+              "}\n"
+              "\n"
+              "} // namespace protodec_rt\n"
+              "#endif // PROTODEC_DECODER_RUNTIME\n"
+              "\n";
+    }
+
+    static void switchPackage(std::string & current, const std::string & package, std::ostream & os) {
+        if (current == package) {
+            return;
+        }
+        if (!current.empty()) {
+            for (size_t i = 0; i <= (size_t) std::count(current.begin(), current.end(), '.'); ++i) os << "}";
+            os << " // namespace " << current << "\n\n";
+        }
+        current = package;
+        if (!current.empty()) {
+            std::string name;
+            std::stringstream ss(current);
+            while (std::getline(ss, name, '.')) {
+                os << "namespace " << identifier(name) << " { ";
+            }
+            os << "\n\n";
+        }
+    }
+
+    // C++ name of message or enum inside namespace of its package
+    static std::string localName(const std::string & full, const std::string & package) {
+        std::string name = full.substr(package.empty() ? 1 : package.length() + 2);
+        std::replace(name.begin(), name.end(), '.', '_');
+        return identifier(name);
+    }
+
+    static std::string qualifiedName(const std::string & full, const std::string & package) {
+        std::string name("::");
+        std::string part;
+        std::stringstream ss(package);
+        while (!package.empty() && std::getline(ss, part, '.')) {
+            name += identifier(part) + "::";
+        }
+        return name + localName(full, package);
+    }
+
+    static std::string identifier(const std::string & name) {
+        static const char * keywords[] = {
+            "alignas", "alignof", "and", "asm", "auto", "bool", "break", "case",
+            "catch", "char", "class", "const", "continue", "default", "delete",
+            "do", "double", "else", "enum", "explicit", "export", "extern",
+            "false", "float", "for", "friend", "goto", "if", "inline", "int",
+            "long", "mutable", "namespace", "new", "not", "operator", "or",
+            "private", "protected", "public", "register", "return", "short",
+            "signed", "sizeof", "static", "struct", "switch", "template",
+            "this", "throw", "true", "try", "typedef", "typename", "union",
+            "unsigned", "using", "virtual", "void", "volatile", "while",
+            "decode"
+        };
+        for (unsigned i = 0; i < sizeof(keywords) / sizeof(*keywords); ++i) {
+            if (name == keywords[i]) return name + "_";
+        }
+        return name;
+    }
+
+    static void sortMessages(
+        const std::vector< DescriptorTables::Message > & messages,
+        int index,
+        std::vector< int > & state,
+        std::vector< int > & order
+    ) {
+        // iterative depth first search: 0 - new, 1 - in progress, 2 - done
+        std::vector< std::pair< int, size_t > > stack;
+        if (state[index]) return;
+        state[index] = 1;
+        stack.push_back(std::make_pair(index, 0));
+        while (!stack.empty()) {
+            const DescriptorTables::Message & message = messages[stack.back().first];
+            size_t & next = stack.back().second;
+            if (next < message.fields.size()) {
+                const DescriptorTables::Field & field = message.fields[next++];
+                if (field.handler == DescriptorTables::hMessage && !state[field.index]) {
+                    state[field.index] = 1;
+                    stack.push_back(std::make_pair(field.index, 0));
+                }
+                continue;
+            }
+            state[stack.back().first] = 2;
+            order.push_back(stack.back().first);
+            stack.pop_back();
+        }
+    }
+
+    static std::string cppType(const DescriptorTables & tables, const DescriptorTables::Field & field) {
+        switch (field.handler) {
+        case DescriptorTables::hDouble:   return "double";
+        case DescriptorTables::hFloat:    return "float";
+        case DescriptorTables::hInt64:
+        case DescriptorTables::hSint64:
+        case DescriptorTables::hSfixed64: return "int64_t";
+        case DescriptorTables::hUint64:
+        case DescriptorTables::hFixed64:  return "uint64_t";
+        case DescriptorTables::hUint32:
+        case DescriptorTables::hFixed32:  return "uint32_t";
+        case DescriptorTables::hBool:     return "bool";
+        case DescriptorTables::hString:
+        case DescriptorTables::hBytes:    return "std::string";
+        case DescriptorTables::hEnum: {
+            const DescriptorTables::Enum & en = tables.enums()[field.index];
+            return qualifiedName(en.name, en.package);
+        }
+        case DescriptorTables::hMessage: {
+            const DescriptorTables::Message & msg = tables.messages()[field.index];
+            return qualifiedName(msg.name, msg.package);
+        }
+        default:                          return "int32_t";
+        }
+    }
+
+    // expression converting raw value 'v' read from the wire
+    static std::string conversion(const DescriptorTables::Field & field, const std::string & type) {
+        switch (field.handler) {
+        case DescriptorTables::hDouble:  return "protodec_rt::bitCast<double>(v)";
+        case DescriptorTables::hFloat:   return "protodec_rt::bitCast<float>(v)";
+        case DescriptorTables::hBool:    return "v != 0";
+        case DescriptorTables::hSint32:  return "static_cast<int32_t>((v >> 1) ^ (~(v & 1) + 1))";
+        case DescriptorTables::hSint64:  return "static_cast<int64_t>((v >> 1) ^ (~(v & 1) + 1))";
+        case DescriptorTables::hEnum:    return "static_cast< " + type + " >(static_cast<int32_t>(v))";
+        default:                         return "static_cast< " + type + " >(v)";
+        }
+    }
+
+    static std::string tagName(const DescriptorTables::Field & field) {
+        return "kTag_" + field.name;
+    }
+
+    static void printStruct(
+        const DescriptorTables & tables,
+        const DescriptorTables::Message & message,
+        const std::vector< size_t > & position,
+        std::ostream & os
+    ) {
+        const size_t current = position[&message - &tables.messages()[0]];
+        os << "struct " << localName(message.name, message.package) << " {\n";
+        if (!message.fields.empty()) {
+            os << "    enum : uint32_t {\n";
+            for (size_t i = 0; i < message.fields.size(); ++i) {
+                const DescriptorTables::Field & field = message.fields[i];
+                int type = DescriptorTables::wireType(field.handler);
+                if (type < 0) type = RawMessage::Variant::proto2Buffer;
+                os << "        " << tagName(field) << " = (" << field.number << "u << 3) | " << type << ",\n";
+                if (field.repeated && DescriptorTables::isPackable(field.handler)) {
+                    os << "        " << tagName(field) << "_packed = (" << field.number << "u << 3) | 2,\n";
+                }
+            }
+            os << "    };\n\n";
+        }
+        for (size_t i = 0; i < message.fields.size(); ++i) {
+            const DescriptorTables::Field & field = message.fields[i];
+            const std::string type = cppType(tables, field);
+            const std::string name = identifier(field.name);
+            const bool isMessage = (field.handler == DescriptorTables::hMessage);
+            if (field.repeated) {
+                os << "    std::vector< " << type << " > " << name << ";\n";
+            } else if (isMessage && position[field.index] >= current) {
+                // recursive message can't be a member by value
+                os << "    std::shared_ptr< " << type << " > " << name << ";\n";
+            } else {
+                os << "    " << type << " " << name
+                   << ((isMessage || type == "std::string") ? "" : (" = " + type + "()")) << ";\n";
+                os << "    bool has_" << field.name << " = false;\n";
+            }
+        }
+        os << "\n    bool decode(const uint8_t * p, const uint8_t * e);\n";
+        os << "};\n\n";
+    }
+
+    static void printDecode(
+        const DescriptorTables & tables,
+        const DescriptorTables::Message & message,
+        const std::vector< size_t > & position,
+        std::ostream & os
+    ) {
+        const size_t current = position[&message - &tables.messages()[0]];
+        const std::string structName = localName(message.name, message.package);
+        os << "inline bool " << structName << "::decode(const uint8_t * p, const uint8_t * e) {\n"
+           << "    while (p < e) {\n"
+           << "        uint64_t tag, v;\n"
+           << "        uint32_t v32;\n"
+           << "        const uint8_t * b, * be;\n"
+           << "        (void) v; (void) v32; (void) b; (void) be;\n"
+           << "        if (!protodec_rt::readVarint(p, e, tag)) return false;\n"
+           << "        switch (tag) {\n";
+        for (size_t i = 0; i < message.fields.size(); ++i) {
+            const DescriptorTables::Field & field = message.fields[i];
+            const std::string type = cppType(tables, field);
+            // members are qualified, fields may be named like the locals
+            const std::string name = "this->" + identifier(field.name);
+            const std::string has = "this->has_" + field.name;
+            const int wire = DescriptorTables::wireType(field.handler);
+            if (wire < 0) {
+                continue; // groups are skipped as unknown fields
+            }
+
+            std::string read;
+            if (wire == RawMessage::Variant::proto2Varint) {
+                read = "protodec_rt::readVarint(p, e, v)";
+            } else if (wire == RawMessage::Variant::proto2Double) {
+                read = "protodec_rt::readFixed64(p, e, v)";
+            } else if (wire == RawMessage::Variant::proto2Float) {
+                read = "protodec_rt::readFixed32(p, e, v32)";
+            } else {
+                read = "protodec_rt::readLength(p, e, b, be)";
+            }
+            const std::string widen = (wire == RawMessage::Variant::proto2Float ? "            v = v32;\n" : "");
+            const std::string value = conversion(field, type);
+
+            os << "        case " << tagName(field) << ":\n"
+               << "            if (!" << read << ") return false;\n";
+            if (wire != RawMessage::Variant::proto2Buffer) {
+                os << widen;
+                if (field.repeated) {
+                    os << "            " << name << ".push_back(" << value << ");\n";
+                } else {
+                    os << "            " << name << " = " << value << ";\n"
+                       << "            " << has << " = true;\n";
+                }
+            } else if (field.handler == DescriptorTables::hMessage) {
+                if (field.repeated) {
+                    os << "            " << name << ".resize(" << name << ".size() + 1);\n"
+                       << "            if (!" << name << ".back().decode(b, be)) return false;\n";
+                } else if (position[field.index] >= current) {
+                    os << "            if (!" << name << ") " << name << ".reset(new " << type << "());\n"
+                       << "            if (!" << name << "->decode(b, be)) return false;\n";
+                } else {
+                    os << "            if (!" << name << ".decode(b, be)) return false;\n"
+                       << "            " << has << " = true;\n";
+                }
+            } else if (field.repeated) {
+                os << "            " << name << ".push_back(std::string((const char *) b, be - b));\n";
+            } else {
+                os << "            " << name << ".assign((const char *) b, be - b);\n"
+                   << "            " << has << " = true;\n";
+            }
+            os << "            break;\n";
+
+            if (field.repeated && DescriptorTables::isPackable(field.handler)) {
+                std::string readPacked = (wire == RawMessage::Variant::proto2Varint
+                    ? "protodec_rt::readVarint(b, be, v)"
+                    : wire == RawMessage::Variant::proto2Double
+                    ? "protodec_rt::readFixed64(b, be, v)"
+                    : "protodec_rt::readFixed32(b, be, v32)");
+                os << "        case " << tagName(field) << "_packed:\n"
+                   << "            if (!protodec_rt::readLength(p, e, b, be)) return false;\n"
+                   << "            while (b < be) {\n"
+                   << "                if (!" << readPacked << ") return false;\n"
+                   << (widen.empty() ? "" : "    " + widen)
+                   << "                " << name << ".push_back(" << value << ");\n"
+                   << "            }\n"
+                   << "            break;\n";
+            }
+        }
+        os << "        default:\n"
+           << "            if (!protodec_rt::skipField(p, e, tag)) return false;\n"
+           << "        }\n"
+           << "    }\n"
+           << "    return p == e;\n"
+           << "}\n\n";
+    }
+}; // CppDecoders
+
+inline void Serialized_pb::printCppFromSerialized(const RawMessage & msg, std::ostream & os) {
+    DescriptorTables tables;
+    if (tables.loadSerialized(msg) && tables.compile(false)) {
+        CppDecoders::print(tables, os, msg.view().getString(1));
+    }
+}
+
+
+
+// /////////////////////////////////////////////////////////////////// //
 
 inline std::ostream& operator<<(std::ostream & os, const RawMessage::Variant & var) {
     if (var.isInt()) {
@@ -1120,20 +5098,8 @@ inline std::ostream& operator<<(std::ostream & os, const RawMessage::Variant & v
     } else if (var.isDouble()) {
         os /*<< "double:"*/ << var.asDouble();
     } else if (var.isString()) {
-        os << '"';
         const std::string & str = var.asString();
-        for (unsigned i = 0; i < str.length(); ++i) {
-            unsigned char ch = (unsigned char) str[i];
-            if (isascii(ch) && ch != 5 && ch != 00) {
-                os << str[i];
-            } else {
-                os << '\\';
-                if (ch < 100) os << '0';
-                if (ch <  99) os << '0';
-                os << (int)ch;
-            }
-        }
-        os << '"';
+        RawMessage::printString(os, str.data(), str.length());
     } else {
         assert(!"This shouldn't happen.");
     }
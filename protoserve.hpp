@@ -0,0 +1,531 @@
+// ///////////////////////////////////////////////////////////////////////// //
+//                                                                           //
+//   Copyright (C) 2014-2018 by Oleg Polivets                                //
+//   jsbot@ya.ru                                                             //
+//                                                                           //
+//   This program is free software; you can redistribute it and/or modify    //
+//   it under the terms of the GNU General Public License as published by    //
+//   the Free Software Foundation; either version 2 of the License, or       //
+//   (at your option) any later version.                                     //
+//                                                                           //
+//   This program is distributed in the hope that it will be useful,         //
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of          //
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           //
+//   GNU General Public License for more details.                            //
+//                                                                           //
+// ///////////////////////////////////////////////////////////////////////// //
+
+#pragma once
+
+#if !defined(_WIN32)
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+
+#include "protoraw.hpp"
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Daemon answering framed requests on a Unix domain socket (--serve).
+//
+// Every frame starts with 9 bytes: body length and request id as little
+// endian uint32 followed by the operation (request) or status (response)
+// byte. Clients may send any number of requests without waiting, answers
+// come back as they are ready and are matched by the id.
+//
+// Descriptors loaded with opLoad stay in the server for later opDecode
+// requests; every worker keeps its own parsed message and a copy of the
+// compiled tables, so nothing is shared while a request is handled.
+//
+// Memory is bounded: requests wait for workers in a queue of limited
+// size, answers wait for the client in a limited buffer of connection,
+// and a connection isn't read while either one is full. Answers are sent
+// by one worker at a time per connection, others only add to its buffer.
+// A worker frees its message and node caches before it waits for work,
+// so a large request isn't paid for in memory once it's handled.
+class Server {
+public:
+    enum OPERATION {
+        opGrab   = 'g', // .proto text of descriptors found in the body
+        opPrint  = 'p', // text representation of raw message
+        opSchema = 's', // predicted schema of raw message
+        opLoad   = 'l', // keep FileDescriptorProto/FileDescriptorSet for opDecode
+        opDecode = 'd'  // body is message type name, '\0' and message
+    };
+
+    enum STATUS {
+        stOk = 0,
+        stError,
+        stUnknownOperation,
+        stPartial // limit of Limits is hit, body is what was done before
+    };
+
+    static const size_t kHeaderSize = 9;
+    static const uint32_t kMaxFrameSize = 256 << 20;
+    static const size_t kMaxQueued = 1024;            // requests waiting for workers
+    static const size_t kMaxQueuedBytes = 512 << 20;  // and their bodies
+    static const size_t kMaxUnsent = 64 << 20;        // answers waiting for a client
+    static const unsigned kMaxConnections = 256;
+    static const int kSendTimeout = 30;               // seconds, then client is dropped
+
+    struct Frame {
+        uint32_t id;
+        unsigned char code; // OPERATION or STATUS
+        std::vector<unsigned char> body;
+    };
+
+    Server(const std::string & path, unsigned threads = 0)
+        : mPath(path)
+        , mListen(-1)
+        , mThreads(threads ? threads : std::max(1u, std::thread::hardware_concurrency()))
+        , mStopped(false)
+        , mMaster(new DescriptorTables())
+        , mTables(new DescriptorTables())
+        , mGeneration(0)
+        , mQueuedBytes(0)
+        , mReaders(0)
+        , mDone(false)
+    {}
+
+    ~Server() {
+        if (mListen >= 0) {
+            close(mListen);
+            unlink(mPath.c_str());
+        }
+    }
+
+    // add message types to the tables used by opDecode
+    bool load(const RawMessage & msg, std::string & error) {
+        std::lock_guard<std::mutex> lock(mTablesMutex);
+        std::unique_ptr<DescriptorTables> master(new DescriptorTables(*mMaster));
+        if (!master->loadSerialized(msg)) {
+            error = master->errorString();
+            return false;
+        }
+        return publish(master, error);
+    }
+
+    // replace message types, e.g. by ones loaded with --proto
+    bool load(const DescriptorTables & tables, std::string & error) {
+        std::lock_guard<std::mutex> lock(mTablesMutex);
+        std::unique_ptr<DescriptorTables> master(new DescriptorTables(tables));
+        return publish(master, error);
+    }
+
+    bool listen(std::string & error) {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (mPath.length() >= sizeof(addr.sun_path)) {
+            error = "socket path is too long";
+            return false;
+        }
+        strcpy(addr.sun_path, mPath.c_str());
+        mListen = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (mListen < 0) {
+            error = strerror(errno);
+            return false;
+        }
+        unlink(mPath.c_str());
+        if (bind(mListen, (sockaddr *) &addr, sizeof(addr)) < 0 || ::listen(mListen, SOMAXCONN) < 0) {
+            error = strerror(errno);
+            close(mListen);
+            mListen = -1;
+            return false;
+        }
+        return true;
+    }
+
+    // accept connections until stop() is called
+    void serve() {
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < mThreads; ++i) {
+            workers.push_back(std::thread(&Server::work, this));
+        }
+        std::vector< std::weak_ptr<Connection> > connections;
+        while (!mStopped) {
+            {
+                // stop() can't notify from a signal handler, so it's polled
+                std::unique_lock<std::mutex> lock(mQueueMutex);
+                while (mReaders >= kMaxConnections && !mStopped) {
+                    mQueueReady.wait_for(lock, std::chrono::milliseconds(100));
+                }
+            }
+            const int fd = accept(mListen, NULL, NULL);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                break;
+            }
+            timeval timeout = { kSendTimeout, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            std::shared_ptr<Connection> connection(new Connection(fd));
+            connections.erase(std::remove_if(connections.begin(), connections.end(),
+                [](const std::weak_ptr<Connection> & c) { return c.expired(); }), connections.end());
+            connections.push_back(connection);
+            {
+                std::lock_guard<std::mutex> lock(mQueueMutex);
+                mReaders += 1;
+            }
+            std::thread(&Server::read, this, connection).detach();
+        }
+
+        // unblock readers, let workers finish queued requests
+        for (size_t i = 0; i < connections.size(); ++i) {
+            std::shared_ptr<Connection> connection = connections[i].lock();
+            if (connection) {
+                shutdown(connection->fd, SHUT_RD);
+            }
+        }
+        {
+            std::unique_lock<std::mutex> lock(mQueueMutex);
+            mQueueReady.wait(lock, [this] { return !mReaders; });
+        }
+        {
+            std::lock_guard<std::mutex> lock(mQueueMutex);
+            mDone = true;
+        }
+        mQueueReady.notify_all();
+        for (size_t i = 0; i < workers.size(); ++i) {
+            workers[i].join();
+        }
+    }
+
+    // safe to call from a signal handler
+    void stop() {
+        mStopped = true;
+        if (mListen >= 0) {
+            shutdown(mListen, SHUT_RDWR);
+        }
+    }
+
+    // ///////////////////////////////////////////////////////////////// //
+
+    // false on end of stream or malformed frame
+    static bool readFrame(int fd, Frame & frame) {
+        unsigned char header[kHeaderSize];
+        if (!readAll(fd, header, kHeaderSize)) {
+            return false;
+        }
+        const uint32_t size = get32(header);
+        if (size > kMaxFrameSize) {
+            return false;
+        }
+        frame.id = get32(header + 4);
+        frame.code = header[8];
+        frame.body.resize(size);
+        return !size || readAll(fd, &frame.body[0], size);
+    }
+
+    static bool writeFrame(int fd, uint32_t id, unsigned char code, const char * body, size_t size) {
+        std::string buffer;
+        appendFrame(buffer, id, code, body, size);
+        return sendAll(fd, buffer.data(), buffer.size());
+    }
+
+private:
+    struct Connection {
+        int fd;
+        std::mutex mutex;
+        std::condition_variable drained;
+        std::string outgoing;   // answers not taken by the writer yet
+        size_t unsent;          // bytes of answers not sent yet
+        bool writing;           // a worker is sending outgoing
+        bool broken;
+
+        explicit Connection(int f) : fd(f), unsent(0), writing(false), broken(false) {}
+        ~Connection() { close(fd); }
+    }; // Connection
+
+    struct Request {
+        std::shared_ptr<Connection> connection;
+        Frame frame;
+    }; // Request
+
+    // state reused by all requests handled by one worker thread
+    struct Worker {
+        RawMessage message;
+        DescriptorTables tables;
+        unsigned generation;
+        std::ostringstream text;
+
+        Worker() : generation(0) {}
+    }; // Worker
+
+    // master tables are never compiled, so types which are unresolved now
+    // may be resolved by later loads; workers copy compiled snapshot
+    bool publish(std::unique_ptr<DescriptorTables> & master, std::string & error) {
+        std::shared_ptr<DescriptorTables> tables(new DescriptorTables(*master));
+        if (!tables->compile(false)) {
+            error = tables->errorString();
+            return false;
+        }
+        mMaster.reset(master.release());
+        mTables = tables;
+        mGeneration += 1;
+        return true;
+    }
+
+    void read(std::shared_ptr<Connection> connection) {
+        for (;;) {
+            {
+                // client which doesn't read answers isn't read either
+                std::unique_lock<std::mutex> lock(connection->mutex);
+                connection->drained.wait(lock, [&] { return connection->unsent < kMaxUnsent || connection->broken; });
+                if (connection->broken) {
+                    break;
+                }
+            }
+            Request request;
+            if (!readFrame(connection->fd, request.frame)) {
+                break;
+            }
+            request.connection = connection;
+            {
+                std::unique_lock<std::mutex> lock(mQueueMutex);
+                const size_t size = request.frame.body.size();
+                mQueueSpace.wait(lock, [&] {
+                    return mQueue.empty() || (mQueue.size() < kMaxQueued && mQueuedBytes + size <= kMaxQueuedBytes);
+                });
+                mQueuedBytes += size;
+                mQueue.push_back(std::move(request));
+            }
+            mQueueReady.notify_all();
+        }
+        std::lock_guard<std::mutex> lock(mQueueMutex);
+        mReaders -= 1;
+        mQueueReady.notify_all();
+    }
+
+    void work() {
+        Worker worker;
+        for (;;) {
+            Request request;
+            {
+                std::unique_lock<std::mutex> lock(mQueueMutex);
+                if (mQueue.empty() && !mDone) {
+                    // idle worker keeps nothing of the requests it handled
+                    lock.unlock();
+                    worker.message = RawMessage();
+                    RawMessage::releaseCaches();
+                    lock.lock();
+                }
+                mQueueReady.wait(lock, [this] { return mDone || !mQueue.empty(); });
+                if (mQueue.empty()) {
+                    break;
+                }
+                request = std::move(mQueue.front());
+                mQueue.pop_front();
+                mQueuedBytes -= request.frame.body.size();
+            }
+            mQueueSpace.notify_all();
+            STATUS status;
+            try {
+                // every request gets its own budget and deadline
+                Limits::Scope scope;
+                status = handle(worker, request.frame);
+                if (status == stOk && Limits::exceeded() != Limits::lkNone) {
+                    status = stPartial;
+                }
+            } catch (const std::exception & ex) {
+                worker.text.str(ex.what());
+                status = stError;
+            }
+            const std::string text = worker.text.str();
+            worker.text.str(std::string());
+            reply(*request.connection, request.frame.id, status, text);
+        }
+    }
+
+    // answer is added to outgoing of connection; unless another worker is
+    // sending it already, this one sends until nothing is left
+    static void reply(Connection & connection, uint32_t id, STATUS status, const std::string & text) {
+        std::unique_lock<std::mutex> lock(connection.mutex);
+        if (connection.broken) {
+            return;
+        }
+        const size_t size = connection.outgoing.size();
+        appendFrame(connection.outgoing, id, status, text.data(), text.length());
+        connection.unsent += connection.outgoing.size() - size;
+        if (connection.writing) {
+            return;
+        }
+        connection.writing = true;
+        std::string buffer;
+        while (!connection.outgoing.empty() && !connection.broken) {
+            buffer.swap(connection.outgoing);
+            lock.unlock();
+            const bool sent = sendAll(connection.fd, buffer.data(), buffer.size());
+            lock.lock();
+            connection.unsent -= buffer.size();
+            buffer.clear();
+            if (!sent) {
+                // gone or not reading for kSendTimeout, its reader stops too
+                connection.broken = true;
+                connection.unsent = 0;
+                connection.outgoing.clear();
+                shutdown(connection.fd, SHUT_RDWR);
+            }
+            connection.drained.notify_all();
+        }
+        connection.writing = false;
+    }
+
+    static void appendFrame(std::string & buffer, uint32_t id, unsigned char code, const char * body, size_t size) {
+        char header[kHeaderSize];
+        put32(header, (uint32_t) size);
+        put32(header + 4, id);
+        header[8] = code;
+        buffer.append(header, kHeaderSize);
+        if (size) {
+            buffer.append(body, size);
+        }
+    }
+
+    static bool sendAll(int fd, const char * p, size_t size) {
+        while (size) {
+            const ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    STATUS handle(Worker & worker, Frame & frame) {
+        std::vector<unsigned char> & body = frame.body;
+        const unsigned char * b = body.data();
+        const unsigned char * e = b + body.size();
+        switch (frame.code) {
+        case opGrab: {
+            // descriptor is found only when followed by '\0' inside the buffer
+            body.push_back('\0');
+            body.push_back('\0');
+            b = body.data();
+            e = b + body.size();
+            std::vector< RawMessage > found;
+            SymbolIndex index;
+            Serialized_pb::scan(b, e, [&](const RawMessage & msg, const unsigned char *, const unsigned char *) {
+                found.push_back(msg);
+                index.add(msg.rootItem());
+                return true;
+            });
+            index.resolve();
+            for (size_t i = 0; i < found.size(); ++i) {
+                worker.text << "// " << found[i].view().getString(1).c_str() << std::endl;
+                Serialized_pb::printMessagesFromSerialized(found[i], worker.text, false, &index);
+            }
+            return stOk;
+        }
+        case opPrint:
+        case opSchema:
+            if (!worker.message.parse(b, e) && !worker.message.isPartial()) {
+                worker.text << worker.message.errorString();
+                return stError;
+            }
+            if (frame.code == opPrint) {
+                worker.message.print(worker.text);
+            } else {
+                Schema::print(worker.message, worker.text);
+            }
+            return stOk;
+        case opLoad: {
+            std::string error;
+            if (!worker.message.parse(b, e)) {
+                worker.text << worker.message.errorString();
+                return stError;
+            }
+            if (!load(worker.message, error)) {
+                worker.text << error;
+                return stError;
+            }
+            return stOk;
+        }
+        case opDecode: {
+            const unsigned char * name = b;
+            for (; b < e && *b; ++b);
+            if (b == e) {
+                worker.text << "message type name is expected";
+                return stError;
+            }
+            refresh(worker);
+            const int type = worker.tables.findMessage(std::string((const char *) name, b - name));
+            if (type < 0) {
+                worker.text << "message type " << (const char *) name << " is not found";
+                return stError;
+            }
+            if (!worker.tables.decode(type, b + 1, e, worker.text)) {
+                worker.text.str(worker.tables.errorString());
+                return stError;
+            }
+            return stOk;
+        }
+        default:
+            return stUnknownOperation;
+        }
+    }
+
+    // take the latest compiled tables if something was loaded since
+    void refresh(Worker & worker) {
+        std::lock_guard<std::mutex> lock(mTablesMutex);
+        if (worker.generation != mGeneration) {
+            worker.tables = *mTables;
+            worker.generation = mGeneration;
+        }
+    }
+
+    static bool readAll(int fd, unsigned char * p, size_t size) {
+        while (size) {
+            const ssize_t n = recv(fd, p, size, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    static uint32_t get32(const unsigned char * p) {
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+    }
+
+    static void put32(char * p, uint32_t v) {
+        p[0] = (char) v;
+        p[1] = (char) (v >> 8);
+        p[2] = (char) (v >> 16);
+        p[3] = (char) (v >> 24);
+    }
+
+    std::string mPath;
+    int mListen;
+    unsigned mThreads;
+    std::atomic<bool> mStopped;
+
+    std::mutex mTablesMutex;
+    std::unique_ptr<DescriptorTables> mMaster;
+    std::shared_ptr<DescriptorTables> mTables;
+    unsigned mGeneration;
+
+    std::mutex mQueueMutex;
+    std::condition_variable mQueueReady;
+    std::condition_variable mQueueSpace;
+    std::deque<Request> mQueue;
+    size_t mQueuedBytes;
+    unsigned mReaders;
+    bool mDone;
+}; // Server
+
+#endif // !_WIN32
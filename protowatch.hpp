@@ -0,0 +1,691 @@
+// ///////////////////////////////////////////////////////////////////////// //
+//                                                                           //
+//   Copyright (C) 2014-2018 by Oleg Polivets                                //
+//   jsbot@ya.ru                                                             //
+//                                                                           //
+//   This program is free software; you can redistribute it and/or modify    //
+//   it under the terms of the GNU General Public License as published by    //
+//   the Free Software Foundation; either version 2 of the License, or       //
+//   (at your option) any later version.                                     //
+//                                                                           //
+//   This program is distributed in the hope that it will be useful,         //
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of          //
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           //
+//   GNU General Public License for more details.                            //
+//                                                                           //
+// ///////////////////////////////////////////////////////////////////////// //
+
+#pragma once
+
+#if defined(__linux__)
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <fstream>
+#include <cerrno>
+#include <cstdio>
+#include <climits>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "protoraw.hpp"
+#include "protoarchive.hpp"
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Descriptors of a set of files kept up to date file by file. Files are
+// cut into chunks at content defined boundaries, so bytes inserted or
+// removed move the boundaries after them together with the data, and
+// descriptors found in a chunk are cached by hash of its content. Rescan
+// of a rebuilt file scans only chunks which have changed.
+//
+// Chunk is scanned with kOverlap bytes after it and reports descriptors
+// starting in it, so the hash covers the overlap too; descriptors longer
+// than the overlap may be missed at chunk boundaries. ZIP archives and
+// .dex files are cached as a whole.
+class Catalogue {
+public:
+    static const size_t kMinChunk   = 64 << 10;
+    static const size_t kMaxChunk   = 1 << 20;
+    static const size_t kOverlap    = 256 << 10;
+    static const int    kChunkBits  = 18; // average size is kMinChunk + 256KB
+
+    struct Chunk {
+        uint64_t key;
+        size_t size;
+    };
+
+    // result of update()
+    struct Update {
+        Update()
+            : files(0)
+            , scanned(0)
+            , reused(0)
+            , changed(false)
+            , limit(Limits::lkNone)
+        {
+        }
+
+        size_t files;   // read
+        size_t scanned; // chunks
+        size_t reused;  // chunks
+        bool changed;   // descriptors may differ
+        Limits::KIND limit; // first one hit, such chunks are scanned again
+    };
+
+    explicit Catalogue(unsigned threads = 0)
+        : mThreads(threads ? threads : std::max(1u, std::thread::hardware_concurrency()))
+    {
+    }
+
+    // rescan files at paths, ones which are not regular files any more
+    // are dropped
+    Update update(const std::vector<std::string> & paths) {
+        Update result;
+        // chunks cut short by limits are scanned again
+        std::set<std::string> retry;
+        retry.swap(mRetry);
+        for (std::set<uint64_t>::const_iterator it = mPartial.begin(); it != mPartial.end(); ++it) {
+            mCache.erase(*it);
+        }
+        mPartial.clear();
+        std::vector<std::string> all(paths);
+        all.insert(all.end(), retry.begin(), retry.end());
+        std::sort(all.begin(), all.end());
+        all.erase(std::unique(all.begin(), all.end()), all.end());
+
+        // files are read in batches to bound memory of the first scan
+        size_t i = 0;
+        while (i < all.size()) {
+            std::vector<Job> jobs;
+            std::vector< std::vector<unsigned char> > contents;
+            std::vector<std::string> batch;
+            size_t bytes = 0;
+            for (; i < all.size() && (batch.empty() || bytes < kBatchBytes); ++i) {
+                contents.push_back(std::vector<unsigned char>());
+                if (!read(all[i], contents.back())) {
+                    contents.pop_back();
+                    result.changed |= mFiles.erase(all[i]) > 0;
+                    continue;
+                }
+                batch.push_back(all[i]);
+                bytes += contents.back().size();
+            }
+            std::set<uint64_t> queued;
+            for (size_t f = 0; f < batch.size(); ++f) {
+                File file;
+                split(contents[f], file);
+                std::map<std::string, File>::iterator it = mFiles.find(batch[f]);
+                if (it == mFiles.end() || !same(it->second, file)) {
+                    result.changed = true;
+                }
+                // chunk windows are queued once even when shared by files
+                const unsigned char * p = contents[f].data();
+                const unsigned char * e = p + contents[f].size();
+                for (size_t c = 0; c < file.chunks.size(); ++c) {
+                    const Chunk & chunk = file.chunks[c];
+                    if (mCache.count(chunk.key) || !queued.insert(chunk.key).second) {
+                        result.reused += 1;
+                    } else {
+                        Job job = { chunk.key, p, p + chunk.size, std::min(p + chunk.size + kOverlap, e), file.whole, batch[f] };
+                        jobs.push_back(job);
+                    }
+                    p += chunk.size;
+                }
+                mFiles[batch[f]] = file;
+                result.files += 1;
+            }
+            scan(jobs, result);
+            result.scanned += jobs.size();
+        }
+
+        // chunks of files which are gone or changed are not needed
+        std::set<uint64_t> live;
+        for (std::map<std::string, File>::const_iterator it = mFiles.begin(); it != mFiles.end(); ++it) {
+            for (size_t c = 0; c < it->second.chunks.size(); ++c) {
+                live.insert(it->second.chunks[c].key);
+            }
+        }
+        for (Cache::iterator it = mCache.begin(); it != mCache.end(); ) {
+            it = live.count(it->first) ? ++it : mCache.erase(it);
+        }
+        Stats::count(Stats::scChunksScanned, result.scanned);
+        Stats::count(Stats::scChunksReused, result.reused);
+        return result;
+    }
+
+    // drop path and everything under it, true if anything was dropped
+    bool remove(const std::string & path) {
+        const std::string prefix = path + "/";
+        bool removed = mFiles.erase(path) > 0;
+        std::map<std::string, File>::iterator it = mFiles.lower_bound(prefix);
+        while (it != mFiles.end() && !it->first.compare(0, prefix.length(), prefix)) {
+            mFiles.erase(it++);
+            removed = true;
+        }
+        return removed;
+    }
+
+    // raw descriptors of all files ordered by path and offset, every one
+    // is taken once
+    std::vector< const std::vector<unsigned char> * > descriptors() const {
+        std::vector< const std::vector<unsigned char> * > result;
+        std::unordered_map< uint64_t, std::vector<size_t> > seen;
+        for (std::map<std::string, File>::const_iterator it = mFiles.begin(); it != mFiles.end(); ++it) {
+            const File & file = it->second;
+            size_t offset = 0, covered = 0;
+            for (size_t c = 0; c < file.chunks.size(); ++c) {
+                Cache::const_iterator found = mCache.find(file.chunks[c].key);
+                if (found != mCache.end()) {
+                    for (size_t d = 0; d < found->second.size(); ++d) {
+                        const Descriptor & descriptor = found->second[d];
+                        // the one inside descriptor of previous chunk is not
+                        // reported by the scan of the whole file either
+                        if (!file.whole && offset + descriptor.begin < covered) {
+                            continue;
+                        }
+                        covered = offset + descriptor.end;
+                        const std::vector<unsigned char> & data = descriptor.data;
+                        std::vector<size_t> & same = seen[hash(data.data(), data.data() + data.size())];
+                        bool duplicate = false;
+                        for (size_t s = 0; s < same.size() && !duplicate; ++s) {
+                            duplicate = *result[same[s]] == data;
+                        }
+                        if (!duplicate) {
+                            same.push_back(result.size());
+                            result.push_back(&data);
+                        }
+                    }
+                }
+                offset += file.chunks[c].size;
+            }
+        }
+        return result;
+    }
+
+    // FileDescriptorSet of descriptors() replaces file at path at once
+    bool write(const std::string & path, std::string & error) const {
+        Stats::Timer timer(Stats::phWrite);
+        const std::string temporary = path + ".tmp";
+        {
+            DescriptorSetWriter set(temporary.c_str());
+            if (!set.isOpen()) {
+                error = "can't create " + temporary;
+                return false;
+            }
+            const std::vector< const std::vector<unsigned char> * > found = descriptors();
+            for (size_t i = 0; i < found.size(); ++i) {
+                set.append(found[i]->data(), found[i]->data() + found[i]->size());
+            }
+            if (!set.close()) {
+                error = "can't write " + temporary;
+                ::unlink(temporary.c_str());
+                return false;
+            }
+        }
+        if (::rename(temporary.c_str(), path.c_str()) < 0) {
+            error = "can't replace " + path + " " + strerror(errno);
+            ::unlink(temporary.c_str());
+            return false;
+        }
+        Stats::count(Stats::scFilesWritten);
+        return true;
+    }
+
+    size_t files() const {
+        return mFiles.size();
+    }
+
+    // content defined boundaries of [p, e): gear hash of the last 64 bytes
+    // ends a chunk when its top kChunkBits bits are zero
+    static void split(const unsigned char * p, const unsigned char * e, std::vector<Chunk> & chunks) {
+        const uint64_t * table = gear();
+        const uint64_t mask = ~0ULL << (64 - kChunkBits);
+        const unsigned char * b = p;
+        uint64_t h = 0;
+        for (; p < e; ++p) {
+            h = (h << 1) + table[*p];
+            const size_t size = p + 1 - b;
+            if ((size >= kMinChunk && !(h & mask)) || size >= kMaxChunk) {
+                Chunk chunk = { 0, size };
+                chunks.push_back(chunk);
+                b = p + 1;
+                h = 0;
+            }
+        }
+        if (b < e) {
+            Chunk chunk = { 0, (size_t) (e - b) };
+            chunks.push_back(chunk);
+        }
+    }
+
+    static uint64_t hash(const unsigned char * p, const unsigned char * e, uint64_t h = 0xcbf29ce484222325ULL) {
+        for (; e - p >= 8; p += 8) {
+            uint64_t word;
+            memcpy(&word, p, 8);
+            h = (h ^ word) * 0x100000001b3ULL;
+            h ^= h >> 29;
+        }
+        for (; p < e; ++p) {
+            h = (h ^ *p) * 0x100000001b3ULL;
+        }
+        h ^= h >> 32;
+        h *= 0x9e3779b97f4a7c15ULL;
+        return h ^ (h >> 29);
+    }
+
+private:
+    static const size_t kBatchBytes = 256 << 20;
+
+    // found in chunk, offsets are from its beginning
+    struct Descriptor {
+        size_t begin;
+        size_t end;
+        std::vector<unsigned char> data;
+    };
+
+    struct File {
+        File()
+            : whole(false)
+        {
+        }
+
+        std::vector<Chunk> chunks;
+        bool whole; // archive or .dex scanned at once
+    };
+
+    struct Job {
+        uint64_t key;
+        const unsigned char * begin;
+        const unsigned char * end;    // of chunk
+        const unsigned char * window; // end of bytes to scan
+        bool whole;
+        std::string path;
+    };
+
+    typedef std::unordered_map< uint64_t, std::vector<Descriptor> > Cache;
+
+    // content followed by two zero bytes as readFile() does
+    static bool read(const std::string & path, std::vector<unsigned char> & data) {
+        struct stat st;
+        if (::lstat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
+            return false;
+        }
+        Stats::Timer timer(Stats::phRead);
+        std::ifstream file(path.c_str(), std::ios::binary);
+        if (!file.is_open()) {
+            return false;
+        }
+        data.resize(st.st_size);
+        file.read((char *) data.data(), data.size());
+        data.resize(file.gcount());
+        data.push_back('\0');
+        data.push_back('\0');
+        return true;
+    }
+
+    static void split(const std::vector<unsigned char> & data, File & file) {
+        const unsigned char * p = data.data(), * e = p + data.size();
+        file.whole = ZipArchive::isArchive(p, e) || DexFile::isDex(p, e);
+        if (file.whole) {
+            Chunk chunk = { hash(p, e, kWholeSeed), data.size() };
+            file.chunks.push_back(chunk);
+            return;
+        }
+        split(p, e, file.chunks);
+        for (size_t c = 0; c < file.chunks.size(); ++c) {
+            const unsigned char * window = std::min(p + file.chunks[c].size + kOverlap, e);
+            file.chunks[c].key = hash(p, window);
+            p += file.chunks[c].size;
+        }
+    }
+
+    static bool same(const File & a, const File & b) {
+        if (a.chunks.size() != b.chunks.size()) {
+            return false;
+        }
+        for (size_t c = 0; c < a.chunks.size(); ++c) {
+            if (a.chunks[c].key != b.chunks[c].key) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // jobs are done by a pool of threads, results go to the cache
+    void scan(const std::vector<Job> & jobs, Update & update) {
+        std::vector< std::vector<Descriptor> > results(jobs.size());
+        std::vector<Limits::KIND> limits(jobs.size(), Limits::lkNone);
+        std::atomic<size_t> next(0);
+
+        const Limits::Request request = Limits::request();
+        auto work = [&]() {
+            for (size_t i; (i = next++) < jobs.size(); ) {
+                Limits::Scope scope(request);
+                scan(jobs[i], results[i]);
+                limits[i] = Limits::exceeded();
+            }
+        };
+
+        const unsigned threads = (unsigned) std::max<size_t>(1, std::min<size_t>(mThreads, jobs.size()));
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threads; ++i) {
+            workers.push_back(std::thread(work));
+        }
+        work();
+        for (size_t i = 0; i < workers.size(); ++i) {
+            workers[i].join();
+        }
+
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            mCache[jobs[i].key].swap(results[i]);
+            if (limits[i] != Limits::lkNone) {
+                if (update.limit == Limits::lkNone) {
+                    update.limit = limits[i];
+                }
+                mPartial.insert(jobs[i].key);
+                mRetry.insert(jobs[i].path);
+            }
+        }
+    }
+
+    static void scan(const Job & job, std::vector<Descriptor> & result) {
+        std::vector< Serialized_pb::Found > found;
+        if (job.whole) {
+            std::string error;
+            if (ZipArchive::isArchive(job.begin, job.end)) {
+                ArchiveScanner::collect(job.begin, job.end, job.path, found, error, 1);
+            } else {
+                std::vector<unsigned char> strings;
+                DexFile::descriptorData(job.begin, job.end, strings);
+                Serialized_pb::collect(strings.data(), strings.data() + strings.size(), found);
+            }
+            for (size_t i = 0; i < found.size(); ++i) {
+                result.push_back(Descriptor());
+                result.back().begin = result.back().end = 0;
+                result.back().data.swap(found[i].data);
+            }
+            return;
+        }
+        Serialized_pb::scan(job.begin, job.window,
+            [&](const RawMessage &, const unsigned char * p, const unsigned char * e) {
+                if (p >= job.end) {
+                    return false; // next chunk reports it
+                }
+                result.push_back(Descriptor());
+                result.back().begin = p - job.begin;
+                result.back().end = e - job.begin;
+                result.back().data.assign(p, e);
+                return true;
+            });
+    }
+
+    static const uint64_t * gear() {
+        static struct Table {
+            Table() {
+                // splitmix64
+                uint64_t x = 0;
+                for (int i = 0; i < 256; ++i) {
+                    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+                    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                    values[i] = z ^ (z >> 31);
+                }
+            }
+            uint64_t values[256];
+        } table;
+        return table.values;
+    }
+
+    static const uint64_t kWholeSeed = 0x77686f6c65ULL;
+
+    unsigned mThreads;
+    std::map<std::string, File> mFiles;
+    Cache mCache;
+    std::set<uint64_t> mPartial;
+    std::set<std::string> mRetry;
+}; // Catalogue
+
+// /////////////////////////////////////////////////////////////////// //
+
+// Catalogue of regular files under a directory (--watch). After the first
+// full scan inotify tells which files are written, moved or removed;
+// events are gathered until the tree is quiet for kQuietMs, then only
+// those files are rescanned and the catalogue file is replaced when its
+// descriptors may have changed.
+class Watcher {
+public:
+    Watcher(const std::string & dir, const std::string & output, unsigned threads = 0)
+        : mDir(dir)
+        , mOutput(output)
+        , mCatalogue(threads)
+        , mNotify(-1)
+        , mStopped(false)
+    {
+        mWake[0] = mWake[1] = -1;
+    }
+
+    ~Watcher() {
+        if (mNotify >= 0) close(mNotify);
+        if (mWake[0] >= 0) close(mWake[0]);
+        if (mWake[1] >= 0) close(mWake[1]);
+    }
+
+    // watch the tree and write the catalogue of everything in it
+    bool start(std::string & error) {
+        char resolved[PATH_MAX];
+        if (!realpath(mDir.c_str(), resolved)) {
+            error = "can't open " + mDir + " " + strerror(errno);
+            return false;
+        }
+        mDir = resolved;
+        // the catalogue may be inside the tree, it's not scanned
+        const size_t slash = mOutput.rfind('/');
+        const std::string outDir = slash == std::string::npos ? "." : mOutput.substr(0, slash + !slash);
+        if (realpath(outDir.c_str(), resolved)) {
+            mOutput = std::string(resolved) + (strcmp(resolved, "/") ? "/" : "") +
+                      mOutput.substr(slash == std::string::npos ? 0 : slash + 1);
+        }
+
+        mNotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (mNotify < 0 || pipe2(mWake, O_NONBLOCK | O_CLOEXEC) < 0) {
+            error = strerror(errno);
+            return false;
+        }
+        std::vector<std::string> files;
+        if (!add(mDir, files)) {
+            error = "can't watch " + mDir + " " + strerror(errno);
+            return false;
+        }
+        return update(files, true, error);
+    }
+
+    // handle changes until stop() is called
+    bool watch(std::string & error) {
+        while (!mStopped) {
+            std::set<std::string> changed;
+            bool rescan = false;
+            if (!wait(-1, changed, rescan)) {
+                break;
+            }
+            // gather the rest of a build step
+            const uint64_t until = now() + kMaxDelayMs;
+            while (!mStopped && now() < until && wait(kQuietMs, changed, rescan)) {
+            }
+            std::vector<std::string> files(changed.begin(), changed.end());
+            if (rescan) {
+                // events are lost, the whole tree is walked again
+                mCatalogue.remove(mDir);
+                files.clear();
+                add(mDir, files);
+            }
+            if ((!files.empty() || !mRemoved.empty()) && !update(files, false, error)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // safe to call from a signal handler
+    void stop() {
+        mStopped = true;
+        if (mWake[1] >= 0) {
+            const char byte = 0;
+            ssize_t n = ::write(mWake[1], &byte, 1);
+            (void) n;
+        }
+    }
+
+    const Catalogue & catalogue() const {
+        return mCatalogue;
+    }
+
+private:
+    static const int kQuietMs = 200;
+    static const int kMaxDelayMs = 2000;
+
+    static uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // watch dir and directories under it, regular files are appended
+    bool add(const std::string & dir, std::vector<std::string> & files) {
+        const uint32_t events = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                                IN_CREATE | IN_DELETE | IN_ONLYDIR | IN_EXCL_UNLINK;
+        std::vector<std::string> dirs(1, dir);
+        while (!dirs.empty()) {
+            const std::string path = dirs.back();
+            dirs.pop_back();
+            const int wd = inotify_add_watch(mNotify, path.c_str(), events);
+            if (wd < 0) {
+                if (path == dir) return false;
+                continue;
+            }
+            mWatches[wd] = path;
+            DIR * d = opendir(path.c_str());
+            if (!d) {
+                continue;
+            }
+            while (dirent * entry = readdir(d)) {
+                if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+                    continue;
+                }
+                const std::string child = path + "/" + entry->d_name;
+                struct stat st;
+                if (lstat(child.c_str(), &st) < 0) {
+                    continue;
+                }
+                if (S_ISDIR(st.st_mode)) {
+                    dirs.push_back(child);
+                } else if (S_ISREG(st.st_mode) && !skipped(child)) {
+                    files.push_back(child);
+                }
+            }
+            closedir(d);
+        }
+        return true;
+    }
+
+    bool skipped(const std::string & path) const {
+        return path == mOutput || path == mOutput + ".tmp";
+    }
+
+    // false when stopped or nothing happened for timeout ms
+    bool wait(int timeout, std::set<std::string> & changed, bool & rescan) {
+        pollfd fds[2] = { { mNotify, POLLIN, 0 }, { mWake[0], POLLIN, 0 } };
+        for (;;) {
+            const int n = poll(fds, 2, timeout);
+            if (n < 0 && errno == EINTR) {
+                if (mStopped) return false;
+                continue;
+            }
+            if (n <= 0 || mStopped || (fds[1].revents & POLLIN)) {
+                return false;
+            }
+            break;
+        }
+        alignas(inotify_event) char buffer[64 << 10];
+        for (;;) {
+            const ssize_t size = read(mNotify, buffer, sizeof(buffer));
+            if (size <= 0) {
+                break;
+            }
+            for (char * p = buffer; p < buffer + size; ) {
+                const inotify_event * event = (const inotify_event *) p;
+                p += sizeof(inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    rescan = true;
+                    continue;
+                }
+                if (event->mask & IN_IGNORED) {
+                    mWatches.erase(event->wd);
+                    continue;
+                }
+                std::map<int, std::string>::const_iterator dir = mWatches.find(event->wd);
+                if (dir == mWatches.end() || !event->len) {
+                    continue;
+                }
+                const std::string path = dir->second + "/" + event->name;
+                if (event->mask & IN_ISDIR) {
+                    if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                        std::vector<std::string> files;
+                        add(path, files);
+                        changed.insert(files.begin(), files.end());
+                    } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                        mRemoved.push_back(path);
+                    }
+                } else if (!(event->mask & IN_CREATE) && !skipped(path)) {
+                    // written, moved or removed file is read again
+                    changed.insert(path);
+                }
+            }
+        }
+        return true;
+    }
+
+    bool update(const std::vector<std::string> & files, bool first, std::string & error) {
+        // --timeout is the time limit of every update
+        Limits::Scope scope;
+        bool removed = false;
+        for (size_t i = 0; i < mRemoved.size(); ++i) {
+            removed |= mCatalogue.remove(mRemoved[i]);
+        }
+        mRemoved.clear();
+        const Catalogue::Update result = mCatalogue.update(files);
+        if (!first && !result.changed && !removed) {
+            return true;
+        }
+        if (!mCatalogue.write(mOutput, error)) {
+            return false;
+        }
+        std::cout << " [+] " << mOutput << " " << mCatalogue.descriptors().size() << " descriptors of "
+                  << mCatalogue.files() << " files, " << result.files << " read, "
+                  << result.scanned << " chunks scanned, " << result.reused << " reused";
+        if (result.limit != Limits::lkNone) {
+            std::cout << ", limit of " << Limits::name(result.limit) << " is exceeded";
+        }
+        std::cout << std::endl;
+        return true;
+    }
+
+    std::string mDir;
+    std::string mOutput;
+    Catalogue mCatalogue;
+    int mNotify;
+    int mWake[2];
+    std::atomic<bool> mStopped;
+    std::map<int, std::string> mWatches;
+    std::vector<std::string> mRemoved;
+}; // Watcher
+
+#endif // __linux__
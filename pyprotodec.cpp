@@ -0,0 +1,317 @@
+// ///////////////////////////////////////////////////////////////////////// //
+//                                                                           //
+//   Copyright (C) 2014-2018 by Oleg Polivets                                //
+//   jsbot@ya.ru                                                             //
+//                                                                           //
+//   This program is free software; you can redistribute it and/or modify    //
+//   it under the terms of the GNU General Public License as published by    //
+//   the Free Software Foundation; either version 2 of the License, or       //
+//   (at your option) any later version.                                     //
+//                                                                           //
+//   This program is distributed in the hope that it will be useful,         //
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of          //
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           //
+//   GNU General Public License for more details.                            //
+//                                                                           //
+// ///////////////////////////////////////////////////////////////////////// //
+
+// Python module working on any object supporting buffer protocol (bytes,
+// bytearray, memoryview, mmap) in place. The GIL is released while data
+// is scanned, parsed and rendered; Python objects are built afterwards.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <new>
+#include <stdexcept>
+
+#include "protoraw.hpp"
+#include "version.h"
+
+namespace {
+
+// read-only view of the argument kept for the duration of the call
+class Buffer {
+public:
+    Buffer() : mValid(false) {}
+    ~Buffer() {
+        if (mValid) PyBuffer_Release(&mView);
+    }
+
+    bool get(PyObject * args) {
+        PyObject * obj;
+        if (!PyArg_ParseTuple(args, "O", &obj)) {
+            return false;
+        }
+        mValid = PyObject_GetBuffer(obj, &mView, PyBUF_SIMPLE) == 0;
+        return mValid;
+    }
+
+    const unsigned char * begin() const {
+        return (const unsigned char *) mView.buf;
+    }
+    const unsigned char * end() const {
+        return begin() + mView.len;
+    }
+
+private:
+    Py_buffer mView;
+    bool mValid;
+}; // Buffer
+
+PyObject * scalar(const RawMessage::VariantPtr & var) {
+    if (var->isInt()) {
+        return PyLong_FromLongLong(var->asInt());
+    } else if (var->isFloat()) {
+        return PyFloat_FromDouble(var->asFloat());
+    } else if (var->isDouble()) {
+        return PyFloat_FromDouble(var->asDouble());
+    }
+    const std::string & str = var->asString();
+    return PyBytes_FromStringAndSize(str.data(), str.length());
+}
+
+PyObject * container(const RawMessage::VariantPtr & var) {
+    return var->isRepeated() ? PyList_New(0) : PyDict_New();
+}
+
+// message is dict by field number, repeated field is list. Built by the
+// Walker, so depth of nesting is limited by memory, not by the C stack
+class Builder {
+public:
+    explicit Builder(PyObject * root) : mFailed(false) {
+        mStack.push_back(root);
+    }
+
+    bool failed() const {
+        return mFailed;
+    }
+
+    bool enter(const RawMessage::Walker::Item & item) {
+        PyObject * value = mFailed ? NULL : container(item.var);
+        if (!add(item, value)) {
+            return false;
+        }
+        mStack.push_back(value); // owned by its parent
+        return true;
+    }
+    void leave(const RawMessage::Walker::Item &) {
+        mStack.pop_back();
+    }
+    void value(const RawMessage::Walker::Item & item) {
+        if (!mFailed) {
+            add(item, scalar(item.var));
+        }
+    }
+
+private:
+    bool add(const RawMessage::Walker::Item & item, PyObject * value) {
+        int rc = -1;
+        if (value && item.element) {
+            rc = PyList_Append(mStack.back(), value);
+        } else if (value) {
+            PyObject * key = PyLong_FromUnsignedLong(item.key);
+            rc = key ? PyDict_SetItem(mStack.back(), key, value) : -1;
+            Py_XDECREF(key);
+        }
+        Py_XDECREF(value);
+        mFailed = mFailed || rc < 0;
+        return !mFailed;
+    }
+
+    std::vector<PyObject *> mStack;
+    bool mFailed;
+}; // Builder
+
+PyObject * toPython(const RawMessage::VariantPtr & var) {
+    if (!var->isMap() && !var->isRepeated()) {
+        return scalar(var);
+    }
+    PyObject * result = container(var);
+    if (!result) {
+        return NULL;
+    }
+    Builder builder(result);
+    try {
+        RawMessage::Walker::walk(var->asMap(), builder);
+    } catch (const std::bad_alloc &) {
+        Py_DECREF(result);
+        return PyErr_NoMemory();
+    }
+    if (builder.failed()) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
+}
+
+// runs f with the GIL released; C++ exceptions can't cross into Python,
+// they are raised as MemoryError or ValueError once the GIL is taken back
+template <class F>
+bool withoutGil(F f) {
+    enum { ok, noMemory, failed } status = ok;
+    std::string what;
+    Py_BEGIN_ALLOW_THREADS
+    try {
+        f();
+    } catch (const std::bad_alloc &) {
+        status = noMemory;
+    } catch (const std::exception & e) {
+        status = failed;
+        what = e.what();
+    } catch (...) {
+        status = failed;
+        what = "unknown error";
+    }
+    Py_END_ALLOW_THREADS
+    if (status == noMemory) {
+        PyErr_NoMemory();
+    } else if (status == failed) {
+        PyErr_SetString(PyExc_ValueError, what.c_str());
+    }
+    return status == ok;
+}
+
+PyObject * parseError(const RawMessage & msg) {
+    PyErr_SetString(PyExc_ValueError, ("parsing failed " + msg.errorString()).c_str());
+    return NULL;
+}
+
+// /////////////////////////////////////////////////////////////////// //
+
+PyObject * parse(PyObject *, PyObject * args) {
+    Buffer buffer;
+    if (!buffer.get(args)) {
+        return NULL;
+    }
+    RawMessage msg;
+    bool parsed = false;
+    if (!withoutGil([&]() { parsed = msg.parse(buffer.begin(), buffer.end()); })) {
+        return NULL;
+    }
+    if (!parsed) {
+        return parseError(msg);
+    }
+    return toPython(msg.rootItem());
+}
+
+template <void (*render)(const RawMessage &, std::ostream &)>
+PyObject * text(PyObject *, PyObject * args) {
+    Buffer buffer;
+    if (!buffer.get(args)) {
+        return NULL;
+    }
+    RawMessage msg;
+    std::ostringstream ss;
+    bool parsed = false;
+    std::string str;
+    if (!withoutGil([&]() {
+            parsed = msg.parse(buffer.begin(), buffer.end());
+            if (parsed) {
+                render(msg, ss);
+                str = ss.str();
+            }
+        })) {
+        return NULL;
+    }
+    if (!parsed) {
+        return parseError(msg);
+    }
+    return PyUnicode_DecodeUTF8(str.data(), str.length(), "backslashreplace");
+}
+
+void printMessage(const RawMessage & msg, std::ostream & os) {
+    msg.print(os);
+}
+
+void printSchema(const RawMessage & msg, std::ostream & os) {
+    Schema::print(msg, os);
+}
+
+PyObject * grab(PyObject *, PyObject * args) {
+    Buffer buffer;
+    if (!buffer.get(args)) {
+        return NULL;
+    }
+    struct Found {
+        std::string name;
+        size_t offset;
+        size_t size;
+        std::string proto;
+    };
+    std::vector<Found> found;
+    const bool done = withoutGil([&]() {
+        std::vector< RawMessage > messages;
+        SymbolIndex index;
+        Serialized_pb::scan(buffer.begin(), buffer.end(),
+            [&](const RawMessage & msg, const unsigned char * b, const unsigned char * e) {
+                Found f;
+                f.name = msg.view().getString(1);
+                f.offset = b - buffer.begin();
+                f.size = e - b;
+                found.push_back(f);
+                messages.push_back(msg);
+                index.add(msg.rootItem());
+                return true;
+            });
+        index.resolve();
+        for (size_t i = 0; i < messages.size(); ++i) {
+            std::ostringstream ss;
+            Serialized_pb::printMessagesFromSerialized(messages[i], ss, false, &index);
+            found[i].proto = ss.str();
+        }
+    });
+    if (!done) {
+        return NULL;
+    }
+
+    PyObject * result = PyList_New(0);
+    for (size_t i = 0; result && i < found.size(); ++i) {
+        PyObject * item = Py_BuildValue("{s:s#,s:n,s:n,s:s#}",
+            "name", found[i].name.data(), (Py_ssize_t) found[i].name.length(),
+            "offset", (Py_ssize_t) found[i].offset,
+            "size", (Py_ssize_t) found[i].size,
+            "proto", found[i].proto.data(), (Py_ssize_t) found[i].proto.length());
+        if (!item || PyList_Append(result, item) < 0) {
+            Py_XDECREF(item);
+            Py_CLEAR(result);
+            break;
+        }
+        Py_DECREF(item);
+    }
+    return result;
+}
+
+PyMethodDef methods[] = {
+    {"grab", grab, METH_VARARGS,
+     "grab(buffer) -> list of dicts with name, offset, size and proto text\n"
+     "of FileDescriptorProto data found in buffer (descriptor must be\n"
+     "followed by zero byte)."},
+    {"parse", parse, METH_VARARGS,
+     "parse(buffer) -> dict by field number of raw message; nested messages\n"
+     "are dicts, repeated fields are lists, strings are bytes."},
+    {"print", text<printMessage>, METH_VARARGS,
+     "print(buffer) -> text representation of raw message, same as --print."},
+    {"schema", text<printSchema>, METH_VARARGS,
+     "schema(buffer) -> predicted schema of raw message, same as --schema."},
+    {NULL, NULL, 0, NULL}
+};
+
+PyModuleDef module = {
+    PyModuleDef_HEAD_INIT,
+    "protodec",
+    "protobuf ver2 decompiler working on buffer protocol objects",
+    -1,
+    methods,
+    NULL, NULL, NULL, NULL
+};
+
+} // namespace
+
+PyMODINIT_FUNC PyInit_protodec(void) {
+    PyObject * m = PyModule_Create(&module);
+    if (m) {
+        PyModule_AddStringConstant(m, "__version__", _VERSION_);
+    }
+    return m;
+}
@@ -0,0 +1,17 @@
+# Python module build: python setup.py build_ext --inplace
+from setuptools import setup, Extension
+
+setup(
+    name='protodec',
+    version='1.0',
+    description='protobuf ver2 decompiler',
+    ext_modules=[
+        Extension(
+            'protodec',
+            sources=['pyprotodec.cpp'],
+            depends=['protoraw.hpp', 'version.h'],
+            extra_compile_args=['-std=c++11'],
+            language='c++',
+        ),
+    ],
+)
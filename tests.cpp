@@ -4,6 +4,13 @@
 #include <sstream>
 #include <gtest/gtest.h>
 #include "protoraw.hpp"
+#include "protodec.h"
+#include "protoserve.hpp"
+#include "protoarchive.hpp"
+#include "protoprocess.hpp"
+#include "protocolumns.hpp"
+#include "protodiff.hpp"
+#include "protowatch.hpp"
 
 static void readFile(
     std::vector<unsigned char> & data,
@@ -138,6 +145,73 @@ TEST(RawMessage, parsePacked) {
     }
 }
 
+TEST(RawMessage, errors) {
+    RawMessage msg;
+    ASSERT_FALSE(msg.isError());
+
+    const unsigned char truncated[] = { 0x08, 0x01, 0x10 };
+    ASSERT_FALSE(msg.parse(truncated, truncated + sizeof(truncated)));
+    ASSERT_TRUE(msg.isError());
+    ASSERT_EQ(msg.error().code, RawMessage::Error::ecTruncated);
+    ASSERT_EQ(msg.error().offset, 3u);
+    ASSERT_EQ(msg.error().field, 2);
+    ASSERT_EQ(msg.errorString(), "offset 0x3");
+
+    const unsigned char wireType[] = { 0x08, 0x01, 0x63, 0x01 };
+    ASSERT_FALSE(msg.parse(wireType, wireType + sizeof(wireType)));
+    ASSERT_EQ(msg.error().code, RawMessage::Error::ecWireType);
+    ASSERT_EQ(msg.error().wireType, 3);
+    ASSERT_EQ(msg.error().field, 12);
+    ASSERT_EQ(msg.errorString(), "unknown data type\noffset 0x3\ntype = 3\nidx  = 12");
+
+    const unsigned char length[] = { 0x0a, 0x05, 'a', 'b' };
+    ASSERT_FALSE(msg.parse(length, length + sizeof(length)));
+    ASSERT_EQ(msg.error().code, RawMessage::Error::ecLength);
+    ASSERT_EQ(msg.errorString(), "data corrupted");
+
+    ASSERT_TRUE(msg.parse(truncated, truncated + 2));
+    ASSERT_FALSE(msg.isError());
+    ASSERT_EQ(msg.view().getString(1), "");
+    ASSERT_EQ(msg.view().getInt(1), 1);
+}
+
+TEST(Limits, budgets) {
+    // 1 { 1 { 1 { 1: 1 } } } 2: 2
+    const unsigned char nested[] = { 0x0a, 0x06, 0x0a, 0x04, 0x0a, 0x02, 0x08, 0x01, 0x10, 0x02 };
+    Limits::Scope test; // keeps limits hit here away from other tests
+    RawMessage msg;
+    ASSERT_TRUE(msg.parse(nested, nested + sizeof(nested)));
+    ASSERT_EQ(Limits::exceeded(), Limits::lkNone);
+    {
+        Limits::Budget budget;
+        budget.depth = 2;
+        Limits::Scope scope(budget);
+        ASSERT_FALSE(msg.parse(nested, nested + sizeof(nested)));
+        ASSERT_TRUE(msg.isPartial());
+        ASSERT_EQ(msg.error().code, RawMessage::Error::ecLimit);
+        ASSERT_EQ(msg.error().limit, Limits::lkDepth);
+        ASSERT_EQ(Limits::exceeded(), Limits::lkDepth);
+    }
+    ASSERT_EQ(Limits::exceeded(), Limits::lkDepth);
+    {
+        Limits::Scope reset;
+        Limits::Budget budget;
+        budget.nodes = 2;
+        Limits::Scope scope(budget);
+        ASSERT_FALSE(msg.parse(nested, nested + sizeof(nested)));
+        ASSERT_EQ(msg.error().limit, Limits::lkNodes);
+        ASSERT_FALSE(msg.items().empty());
+    }
+    {
+        Limits::Scope reset;
+        Limits::Budget budget;
+        budget.steps = 1;
+        Limits::Scope scope(budget);
+        ASSERT_FALSE(RawMessage::isValidMessage(nested, nested + sizeof(nested)));
+        ASSERT_EQ(Limits::exceeded(), Limits::lkSteps);
+    }
+}
+
 TEST(RawMessage, sizeInBytes) {
     {
     unsigned char data[] = {
@@ -161,6 +235,64 @@ TEST(RawMessage, sizeInBytes) {
     }
 }
 
+TEST(RawMessage, walkDeep) {
+    // message nested 2000 times around {1: 1}
+    std::vector<unsigned char> data;
+    data.push_back(0x08);
+    data.push_back(0x01);
+    for (int i = 0; i < 2000; ++i) {
+        unsigned char header[16] = { 0x0a };
+        unsigned char * h = RawMessage::writeVarint(data.size(), header + 1, header + sizeof(header));
+        std::vector<unsigned char> outer(header, h);
+        outer.insert(outer.end(), data.begin(), data.end());
+        data.swap(outer);
+    }
+    RawMessage msg;
+    ASSERT_TRUE(msg.parse(data.data(), data.data() + data.size()));
+    ASSERT_EQ(msg.getSizeInBytes(msg.items()), data.size());
+
+    struct Depth {
+        size_t maximum, values;
+        bool enter(const RawMessage::Walker::Item & item) {
+            maximum = std::max(maximum, item.depth);
+            return true;
+        }
+        void leave(const RawMessage::Walker::Item &) {}
+        void value(const RawMessage::Walker::Item & item) {
+            ++values;
+            ASSERT_EQ(item.var->asInt(), 1);
+        }
+    } depth = { 0, 0 };
+    RawMessage::Walker::walk(msg.items(), depth);
+    ASSERT_EQ(depth.maximum, 1999u);
+    ASSERT_EQ(depth.values, 1u);
+
+    // walk from the deepest value grows the stack under the outer walks
+    struct Nested {
+        const RawMessage::KeyValueMap & root;
+        int levels;
+        size_t values;
+        bool enter(const RawMessage::Walker::Item &) {
+            return true;
+        }
+        void leave(const RawMessage::Walker::Item &) {}
+        void value(const RawMessage::Walker::Item &) {
+            ++values;
+            if (levels) {
+                Nested inner = { root, levels - 1, 0 };
+                RawMessage::Walker::walk(root, inner);
+                values += inner.values;
+            }
+        }
+    } nested = { msg.items(), 3, 0 };
+    RawMessage::Walker::walk(msg.items(), nested);
+    ASSERT_EQ(nested.values, 4u);
+
+    std::stringstream ss;
+    RawMessage::printMessageInternal(msg.items(), ss);
+    ASSERT_NE(ss.str().find("1: 1\n"), std::string::npos);
+}
+
 TEST(RawMessage, printing) {
     unsigned char d1[] = {
         0x0a, 0x05, '0', '1', '2', '3', '4',
@@ -274,6 +406,79 @@ TEST(Schema, print) {
     }
 }
 
+TEST(Schema, refineTypes) {
+    unsigned char data[] = {
+        0x08, 0x00, 0x08, 0x01, 0x08, 0x01, 0x08, 0x00,      // bool
+        0x15, 0x05, 0x00, 0x00, 0x00,                        // denormal floats
+        0x15, 0x07, 0x00, 0x00, 0x00,
+        0x19, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xf8, 0x3f,// 1.5
+        0x20, 0xfe, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01, // -2, 1
+        0x20, 0x01,
+        0x28, 0x01, 0x28, 0x02, 0x28, 0x01, 0x28, 0x02,      // enum
+        0x30, 0xfe, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01, // single -2
+        0x3d, 0x05, 0x00, 0x00, 0x00                         // single denormal
+    };
+    std::vector<unsigned char> message(data, data + sizeof(data));
+    unsigned char varint[10];
+    const auto append = [&](unsigned char key, uint64_t value) {
+        message.push_back(key);
+        message.insert(message.end(), varint, RawMessage::writeVarint(value, varint, varint + sizeof(varint)));
+    };
+    for (int i = 0; i < 50; ++i) {
+        append(0x40, i);                                     // counter
+    }
+    for (int i = 0; i < 20; ++i) {
+        append(0x48, 1700000000 + 37 * i);                   // timestamps
+    }
+    const int64_t deltas[] = { 0, 1, -1, 2, -2, 3, -3, 4, -4, 5, -5, 6, -6, 7, -7, 8, -8, 9, -9, 10, -10, 90, -200, 300 };
+    for (size_t i = 0; i < sizeof(deltas) / sizeof(*deltas); ++i) {
+        append(0x50, (deltas[i] << 1) ^ (deltas[i] >> 63)); // zigzag
+    }
+    std::string expected = "package ProtodecMessages;\n"
+                           "\n"
+                           "message MSG1 {\n"
+                           "\tenum ENUM5 {\n"
+                           "\t\tMSG1_FLD5_1 = 1;\n"
+                           "\t\tMSG1_FLD5_2 = 2;\n"
+                           "\t}\n"
+                           "\trepeated bool fld1 = 1;\n"
+                           "\trepeated fixed32 fld2 = 2;\n"
+                           "\trequired double fld3 = 3;\n"
+                           "\trepeated int32 fld4 = 4;\n"
+                           "\trepeated ENUM5 fld5 = 5;\n"
+                           "\trequired int64 fld6 = 6;\n"
+                           "\trequired float fld7 = 7;\n"
+                           "\trepeated int64 fld8 = 8;\n"
+                           "\trepeated int64 fld9 = 9;\n"
+                           "\trepeated sint32 fld10 = 10;\n"
+                           "}\n";
+    RawMessage msg;
+    std::stringstream ss;
+    ASSERT_TRUE(msg.parse(message.data(), message.data() + message.size()));
+    Schema::print(msg, ss);
+    ASSERT_EQ(ss.str(), expected);
+
+    // list of records: the first one is described with values of all
+    std::vector<unsigned char> list;
+    for (int i = 0; i < 20; ++i) {
+        const unsigned char record[] = { 0x0a, 0x04, 0x08, (unsigned char) (i % 2), 0x10, (unsigned char) (i * 5) };
+        list.insert(list.end(), record, record + sizeof(record));
+    }
+    ss.str("");
+    ASSERT_TRUE(msg.parse(list.data(), list.data() + list.size()));
+    Schema::print(msg, ss);
+    ASSERT_EQ(ss.str(), "package ProtodecMessages;\n"
+                        "\n"
+                        "message MSG1 {\n"
+                        "\trequired bool fld1 = 1;\n"
+                        "\trequired int64 fld2 = 2;\n"
+                        "}\n"
+                        "\n"
+                        "message MSG2 {\n"
+                        "\trepeated MSG1 fld1 = 1;\n"
+                        "}\n");
+}
+
 TEST(Serialized_pb, find) {
     char data[] = "BEGINOFGARBIGEGARBIGEGARBIGEGARBIGEGARBIGEGARBIGE"
                   "GARBIGEGARBIGEGARBIGEGARBIGEGARBIGEGARBIGEGARBIGE"
@@ -336,6 +541,1024 @@ TEST(Serialized_pb, grab) {
     }
 }
 
+TEST(Serialized_pb, grabInOrder) {
+    // descriptors of files 0..9 and then of file 3 again in other package
+    const std::string prefix = "/tmp/protodec-tests-" + std::to_string(getpid()) + "-";
+    std::string binary("\x7f" "ELF", 4);
+    for (int i = 0; i < 11; ++i) {
+        const std::string name = prefix + std::to_string(i < 10 ? i : 3) + ".proto";
+        const std::string package = "p" + std::to_string(i);
+        binary += "\n" + std::string(1, (char) name.size()) + name +
+                  "\x12" + std::string(1, (char) package.size()) + package +
+                  std::string("\"\x08\n\x06Record", 10) + std::string("\0garbage", 8);
+    }
+    binary.append(2, '\0');
+    const unsigned char * p = (const unsigned char *) binary.data();
+
+    std::stringstream out;
+    std::streambuf * cout = std::cout.rdbuf(out.rdbuf());
+    const unsigned count = Serialized_pb::grab(p, p + binary.size(), Serialized_pb::outProto, NULL, 4);
+    std::cout.rdbuf(cout);
+    ASSERT_EQ(count, 11u);
+
+    std::string expected;
+    for (int i = 0; i < 11; ++i) {
+        expected += " [+] " + prefix + std::to_string(i < 10 ? i : 3) + ".proto\n";
+    }
+    ASSERT_EQ(out.str(), expected);
+    std::vector<unsigned char> written;
+    readFile(written, (prefix + "3.proto").c_str());
+    ASSERT_EQ(std::string(written.begin(), written.end()), "package p10;\nmessage Record {\n}\n");
+    for (int i = 0; i < 10; ++i) {
+        unlink((prefix + std::to_string(i) + ".proto").c_str());
+    }
+
+    // descriptor set which can't be written is no output
+    std::string error;
+    std::cout.rdbuf(out.rdbuf());
+    const unsigned failed = Serialized_pb::grab(p, p + binary.size(), Serialized_pb::outDescriptorSet, "/dev/full", 1, &error);
+    std::cout.rdbuf(cout);
+    ASSERT_EQ(failed, 0u);
+    ASSERT_EQ(error, "can't write /dev/full");
+}
+
+static const unsigned char addressbook_dat[] = {
+    0x0a, 0x2d, 0x0a, 0x08, 0x4a, 0x6f, 0x68, 0x6e, 0x20, 0x44, 0x6f, 0x65, 0x10, 0xd2, 0x09, 0x1a,
+    0x10, 0x6a, 0x64, 0x6f, 0x65, 0x40, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x2e, 0x63, 0x6f,
+    0x6d, 0x22, 0x0c, 0x0a, 0x08, 0x35, 0x35, 0x35, 0x2d, 0x34, 0x33, 0x32, 0x31, 0x10, 0x01
+};
+
+static const char addressbook_expected[] =
+    "person {\n"
+    "\tname: \"John Doe\"\n"
+    "\tid: 1234\n"
+    "\temail: \"jdoe@example.com\"\n"
+    "\tphone {\n"
+    "\t\tnumber: \"555-4321\"\n"
+    "\t\ttype: HOME\n"
+    "\t}\n"
+    "}\n";
+
+TEST(DescriptorTables, decodeWithProto) {
+    std::vector<unsigned char> proto;
+    readFile(proto, "tests/addressbook.proto");
+    ASSERT_TRUE(proto.size() > 0);
+
+    DescriptorTables tables;
+    ASSERT_TRUE(tables.loadProto((const char *) proto.data(), (const char *) proto.data() + proto.size()));
+    ASSERT_TRUE(tables.compile());
+    int type = tables.findMessage("AddressBook");
+    ASSERT_TRUE(type >= 0);
+
+    std::stringstream ss;
+    ASSERT_TRUE(tables.decode(type, addressbook_dat, addressbook_dat + sizeof(addressbook_dat), ss));
+    ASSERT_EQ(ss.str(), addressbook_expected);
+}
+
+TEST(DescriptorTables, decodeWithGrabbed) {
+    char data[] = "\n\x11\x61\x64\x64ressbook.proto\x12\x08tutorial\"\xda\x01\n\x06Person\x12\x0c\n\x04name\x18\x01 \x02(\t\x12\n\n\x02id\x18\x02 \x02(\x05\x12\r\n\x05\x65mail\x18\x03 \x01(\t\x12+\n\x05phone\x18\x04 \x03(\x0b\x32\x1c.tutorial.Person.PhoneNumber\x1aM\n\x0bPhoneNumber\x12\x0e\n\x06number\x18\x01 \x02(\t\x12.\n\x04type\x18\x02 \x01(\x0e\x32\x1a.tutorial.Person.PhoneType:\x04HOME\"+\n\tPhoneType\x12\n\n\x06MOBILE\x10\x00\x12\x08\n\x04HOME\x10\x01\x12\x08\n\x04WORK\x10\x02\"/\n\x0b\x41\x64\x64ressBook\x12 \n\x06person\x18\x01 \x03(\x0b\x32\x10.tutorial.Person";
+    RawMessage msg;
+    ASSERT_TRUE(msg.parse((unsigned char*) data, (unsigned char*) data + sizeof(data)));
+
+    DescriptorTables tables;
+    ASSERT_TRUE(tables.loadSerialized(msg));
+    ASSERT_TRUE(tables.compile());
+    ASSERT_EQ(tables.messages().size(), 3);
+    ASSERT_EQ(tables.messages()[0].name, ".tutorial.Person");
+    ASSERT_EQ(tables.findMessage("tutorial.AddressBook"), 2);
+
+    std::stringstream ss;
+    ASSERT_TRUE(tables.decode(2, addressbook_dat, addressbook_dat + sizeof(addressbook_dat), ss));
+    ASSERT_EQ(ss.str(), addressbook_expected);
+}
+
+TEST(CppDecoders, print) {
+    std::vector<unsigned char> proto;
+    readFile(proto, "tests/repeated.proto");
+    ASSERT_TRUE(proto.size() > 0);
+
+    DescriptorTables tables;
+    ASSERT_TRUE(tables.loadProto((const char *) proto.data(), (const char *) proto.data() + proto.size()));
+    ASSERT_TRUE(tables.compile());
+
+    std::stringstream ss;
+    CppDecoders::print(tables, ss, "repeated.proto");
+    const std::string & actual = ss.str();
+    ASSERT_NE(actual.find("struct RepeatedPacked {\n"), std::string::npos);
+    ASSERT_NE(actual.find("        kTag_d = (4u << 3) | 0,\n"
+                          "        kTag_d_packed = (4u << 3) | 2,\n"), std::string::npos);
+    ASSERT_NE(actual.find("    std::vector< int32_t > d;\n"), std::string::npos);
+    ASSERT_NE(actual.find("inline bool RepeatedNotPacked::decode(const uint8_t * p, const uint8_t * e) {\n"), std::string::npos);
+}
+
+TEST(CppDecoders, compile) {
+    // fields named like locals of generated decode()
+    const std::string proto =
+        "syntax = \"proto2\";\n"
+        "message Inner { optional int32 v = 1; }\n"
+        "message Locals {\n"
+        "  optional string tag = 1;\n"
+        "  optional int32 p = 2;\n"
+        "  optional int32 e = 3;\n"
+        "  optional float v32 = 4;\n"
+        "  repeated int32 v = 5 [packed=true];\n"
+        "  optional Inner b = 6;\n"
+        "  repeated bytes be = 7;\n"
+        "}\n";
+    DescriptorTables tables;
+    ASSERT_TRUE(tables.loadProto(proto.data(), proto.data() + proto.size()));
+    ASSERT_TRUE(tables.compile());
+
+    const std::string prefix = "/tmp/protodec-tests-" + std::to_string(getpid()) + "-decoders";
+    {
+        std::ofstream header((prefix + ".hpp").c_str());
+        CppDecoders::print(tables, header, "locals.proto");
+        std::ofstream source((prefix + ".cpp").c_str());
+        source << "#include \"" << prefix << ".hpp\"\n"
+               << "int main() {\n"
+               << "    const uint8_t data[] = { 0x0a, 0x01, 'x', 0x10, 0x02, 0x2a, 0x02, 0x03, 0x04, 0x32, 0x02, 0x08, 0x05 };\n"
+               << "    Locals m;\n"
+               << "    return m.decode(data, data + sizeof(data)) && m.tag == \"x\" && m.p == 2 &&\n"
+               << "           m.v.size() == 2 && m.v[1] == 4 && m.b.v == 5 ? 0 : 1;\n"
+               << "}\n";
+    }
+    const std::string command = "c++ -std=c++11 -o " + prefix + " " + prefix + ".cpp && " + prefix;
+    const int rc = system(command.c_str());
+    ::remove((prefix + ".hpp").c_str());
+    ::remove((prefix + ".cpp").c_str());
+    ::remove(prefix.c_str());
+    ASSERT_EQ(rc, 0);
+}
+
+TEST(SymbolIndex, resolve) {
+    char data[] = "\n\x11\x61\x64\x64ressbook.proto\x12\x08tutorial\"\xda\x01\n\x06Person\x12\x0c\n\x04name\x18\x01 \x02(\t\x12\n\n\x02id\x18\x02 \x02(\x05\x12\r\n\x05\x65mail\x18\x03 \x01(\t\x12+\n\x05phone\x18\x04 \x03(\x0b\x32\x1c.tutorial.Person.PhoneNumber\x1aM\n\x0bPhoneNumber\x12\x0e\n\x06number\x18\x01 \x02(\t\x12.\n\x04type\x18\x02 \x01(\x0e\x32\x1a.tutorial.Person.PhoneType:\x04HOME\"+\n\tPhoneType\x12\n\n\x06MOBILE\x10\x00\x12\x08\n\x04HOME\x10\x01\x12\x08\n\x04WORK\x10\x02\"/\n\x0b\x41\x64\x64ressBook\x12 \n\x06person\x18\x01 \x03(\x0b\x32\x10.tutorial.Person";
+    unsigned char other[] = {
+        0x0a, 0x07, 'o', '.', 'p', 'r', 'o', 't', 'o',
+        0x1a, 0x07, 'm', '.', 'p', 'r', 'o', 't', 'o',
+        0x22, 0x15, 0x0a, 0x01, 'O',
+        0x12, 0x10, 0x0a, 0x01, 'f', 0x18, 0x01, 0x20, 0x01,
+                    0x32, 0x07, '.', 'm', '.', 'M', 's', 'g', 's'
+    };
+    RawMessage file1, file2;
+    ASSERT_TRUE(file1.parse((unsigned char*) data, (unsigned char*) data + sizeof(data)));
+    ASSERT_TRUE(file2.parse(other, other + sizeof(other)));
+
+    SymbolIndex index;
+    ASSERT_EQ(index.add(file1.rootItem()), 0);
+    ASSERT_EQ(index.add(file2.rootItem()), 1);
+    ASSERT_TRUE(index.find(".tutorial.Person.PhoneNumber") != NULL);
+    ASSERT_EQ(index.find(".tutorial.Person.PhoneNumber")->kind, SymbolIndex::skMessage);
+    ASSERT_EQ(index.find(".tutorial.Person.PhoneType")->kind, SymbolIndex::skEnum);
+    ASSERT_EQ(index.find(".tutorial.Person.PhoneType.HOME")->kind, SymbolIndex::skEnumValue);
+    ASSERT_EQ(index.find("addressbook.proto")->file, 0);
+
+    const std::vector< SymbolIndex::Reference > & unresolved = index.resolve();
+    ASSERT_EQ(unresolved.size(), 2);
+    ASSERT_EQ(unresolved[0].file, 1);
+    ASSERT_EQ(unresolved[0].name, ".m.Msgs");
+    ASSERT_EQ(unresolved[0].from, ".O.f");
+    ASSERT_EQ(unresolved[1].name, "m.proto");
+
+    std::stringstream ss;
+    Serialized_pb::printMessagesFromSerialized(file2, ss, true, &index);
+    ASSERT_EQ(ss.str(), "import \"m.proto\";\n"
+                        "message O {\n"
+                        "\toptional .m.Msgs f = 1; // unresolved type\n"
+                        "}\n");
+}
+
+TEST(DescriptorSetWriter, append) {
+    const char path[] = "descriptor_set.pb";
+    unsigned char file1[] = { 0x0a, 0x03, 'a', '.', 'b' };
+    std::vector<unsigned char> file2(300, 'x');
+    {
+    DescriptorSetWriter set(path, 16);
+    ASSERT_TRUE(set.isOpen());
+    set.append(file1, file1 + sizeof(file1));
+    set.append(file2.data(), file2.data() + file2.size());
+    }
+    std::vector<unsigned char> actual;
+    readFile(actual, path);
+    ::remove(path);
+    ASSERT_EQ(actual.size(), 2 + sizeof(file1) + 3 + file2.size());
+    ASSERT_EQ(actual[0], 0x0a);
+    ASSERT_EQ(actual[1], sizeof(file1));
+    ASSERT_EQ(actual[7], 0x0a);
+    ASSERT_EQ(actual[8], 0xac); // 300 = ac 02
+    ASSERT_EQ(actual[9], 0x02);
+    ASSERT_EQ(actual.back(), 'x');
+}
+
+TEST(Stats, counters) {
+    unsigned char data[] = { 0x0a, 0x02, 0x08, 0x01, 0x0f, 0x01 };
+    const Stats before = Stats::total();
+    RawMessage msg;
+    ASSERT_FALSE(msg.parse(data, data + sizeof(data)));
+    const Stats after = Stats::total();
+    ASSERT_EQ(after.counter(Stats::scParseAttempted) - before.counter(Stats::scParseAttempted), 1);
+    ASSERT_EQ(after.counter(Stats::scParseFailedWireType) - before.counter(Stats::scParseFailedWireType), 1);
+    ASSERT_EQ(after.counter(Stats::scNodesAllocated) - before.counter(Stats::scNodesAllocated), 3);
+    ASSERT_TRUE(after.counter(Stats::scValidationsPassed) > before.counter(Stats::scValidationsPassed));
+
+    std::stringstream ss;
+    Stats::printJson(ss);
+    ASSERT_NE(ss.str().find("\"parse_failed_wire_type\": "), std::string::npos);
+}
+
+TEST(Stats, concurrent) {
+    // totals are read while another thread is counting
+    const uint64_t before = Stats::total().counter(Stats::scChunksReused);
+    std::atomic<bool> started(false);
+    std::thread worker([&started]() {
+        for (int i = 0; i < 100000; ++i) {
+            Stats::count(Stats::scChunksReused);
+            started = true;
+        }
+    });
+    while (!started);
+    uint64_t previous = before;
+    for (int i = 0; i < 1000; ++i) {
+        const uint64_t current = Stats::total().counter(Stats::scChunksReused);
+        ASSERT_GE(current, previous);
+        previous = current;
+    }
+    worker.join();
+    ASSERT_EQ(Stats::total().counter(Stats::scChunksReused) - before, 100000);
+}
+
+TEST(Library, capi) {
+    const char data[] = "\n\x11\x61\x64\x64ressbook.proto\x12\x08tutorial\"\xda\x01\n\x06Person\x12\x0c\n\x04name\x18\x01 \x02(\t\x12\n\n\x02id\x18\x02 \x02(\x05\x12\r\n\x05\x65mail\x18\x03 \x01(\t\x12+\n\x05phone\x18\x04 \x03(\x0b\x32\x1c.tutorial.Person.PhoneNumber\x1aM\n\x0bPhoneNumber\x12\x0e\n\x06number\x18\x01 \x02(\t\x12.\n\x04type\x18\x02 \x01(\x0e\x32\x1a.tutorial.Person.PhoneType:\x04HOME\"+\n\tPhoneType\x12\n\n\x06MOBILE\x10\x00\x12\x08\n\x04HOME\x10\x01\x12\x08\n\x04WORK\x10\x02\"/\n\x0b\x41\x64\x64ressBook\x12 \n\x06person\x18\x01 \x03(\x0b\x32\x10.tutorial.Person";
+    const unsigned char * bytes = (const unsigned char *) data;
+    protodec_context * ctx = protodec_context_new();
+    ASSERT_TRUE(ctx != NULL);
+
+    struct Found {
+        static int callback(void * user, const char * filename, size_t offset, const unsigned char *, size_t size) {
+            std::stringstream & ss = *(std::stringstream *) user;
+            ss << filename << " " << offset << " " << size;
+            return 0;
+        }
+    };
+    // descriptor embedded into binary data
+    std::vector<unsigned char> binary(4, 0xff);
+    binary.insert(binary.end(), bytes, bytes + sizeof(data));
+    binary.resize(binary.size() + 4, 0xff);
+    std::stringstream found;
+    size_t count = 0;
+    ASSERT_EQ(protodec_scan(ctx, binary.data(), binary.size(), Found::callback, &found, &count), PROTODEC_OK);
+    ASSERT_EQ(count, 1);
+    ASSERT_EQ(found.str(), "addressbook.proto 4 " + std::to_string(sizeof(data) - 1));
+
+    ASSERT_EQ(protodec_load_descriptor(ctx, bytes, sizeof(data) - 1), PROTODEC_OK);
+    size_t length = 0;
+    char small[8];
+    ASSERT_EQ(protodec_decode(ctx, "AddressBook", addressbook_dat, sizeof(addressbook_dat), small, sizeof(small), &length),
+              PROTODEC_ERROR_BUFFER_TOO_SMALL);
+    ASSERT_EQ(length, strlen(addressbook_expected));
+    std::vector<char> out(length + 1);
+    ASSERT_EQ(protodec_decode(ctx, "AddressBook", addressbook_dat, sizeof(addressbook_dat), out.data(), out.size(), &length),
+              PROTODEC_OK);
+    ASSERT_STREQ(out.data(), addressbook_expected);
+
+    ASSERT_EQ(protodec_decode(ctx, "Unknown", addressbook_dat, sizeof(addressbook_dat), out.data(), out.size(), &length),
+              PROTODEC_ERROR_NOT_FOUND);
+    ASSERT_STRNE(protodec_last_error(ctx), "");
+    protodec_context_free(ctx);
+}
+
+TEST(Server, pipelining) {
+    const char descriptor[] = "\n\x11\x61\x64\x64ressbook.proto\x12\x08tutorial\"\xda\x01\n\x06Person\x12\x0c\n\x04name\x18\x01 \x02(\t\x12\n\n\x02id\x18\x02 \x02(\x05\x12\r\n\x05\x65mail\x18\x03 \x01(\t\x12+\n\x05phone\x18\x04 \x03(\x0b\x32\x1c.tutorial.Person.PhoneNumber\x1aM\n\x0bPhoneNumber\x12\x0e\n\x06number\x18\x01 \x02(\t\x12.\n\x04type\x18\x02 \x01(\x0e\x32\x1a.tutorial.Person.PhoneType:\x04HOME\"+\n\tPhoneType\x12\n\n\x06MOBILE\x10\x00\x12\x08\n\x04HOME\x10\x01\x12\x08\n\x04WORK\x10\x02\"/\n\x0b\x41\x64\x64ressBook\x12 \n\x06person\x18\x01 \x03(\x0b\x32\x10.tutorial.Person";
+    const std::string path = "/tmp/protodec-tests-" + std::to_string(getpid()) + ".sock";
+    Server server(path, 2);
+    std::string error;
+    ASSERT_TRUE(server.listen(error)) << error;
+    std::thread thread(&Server::serve, &server);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+    ASSERT_EQ(connect(fd, (sockaddr *) &addr, sizeof(addr)), 0);
+
+    Server::Frame frame;
+    ASSERT_TRUE(Server::writeFrame(fd, 1, Server::opLoad, descriptor, sizeof(descriptor) - 1));
+    ASSERT_TRUE(Server::readFrame(fd, frame));
+    ASSERT_EQ(frame.id, 1);
+    ASSERT_EQ(frame.code, Server::stOk);
+
+    // several requests are sent before reading any response
+    std::string decode("tutorial.AddressBook");
+    decode.push_back('\0');
+    decode.append((const char *) addressbook_dat, sizeof(addressbook_dat));
+    const unsigned kDecodes = 8;
+    for (unsigned i = 0; i < kDecodes; ++i) {
+        ASSERT_TRUE(Server::writeFrame(fd, 100 + i, Server::opDecode, decode.data(), decode.length()));
+    }
+    ASSERT_TRUE(Server::writeFrame(fd, 2, Server::opPrint, "\x08\x96\x01", 3));
+    ASSERT_TRUE(Server::writeFrame(fd, 3, 'x', "", 0));
+
+    std::map<uint32_t, Server::Frame> responses;
+    for (unsigned i = 0; i < kDecodes + 2; ++i) {
+        ASSERT_TRUE(Server::readFrame(fd, frame));
+        responses[frame.id] = frame;
+    }
+    for (unsigned i = 0; i < kDecodes; ++i) {
+        const Server::Frame & response = responses[100 + i];
+        ASSERT_EQ(response.code, Server::stOk);
+        ASSERT_EQ(std::string(response.body.begin(), response.body.end()), addressbook_expected);
+    }
+    ASSERT_EQ(responses[2].code, Server::stOk);
+    ASSERT_EQ(std::string(responses[2].body.begin(), responses[2].body.end()), "1: 150\n");
+    ASSERT_EQ(responses[3].code, Server::stUnknownOperation);
+
+    close(fd);
+    server.stop();
+    thread.join();
+}
+
+TEST(Server, slowClient) {
+    const std::string path = "/tmp/protodec-tests-" + std::to_string(getpid()) + ".sock";
+    Server server(path, 2);
+    std::string error;
+    ASSERT_TRUE(server.listen(error)) << error;
+    std::thread thread(&Server::serve, &server);
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+    const int slow = socket(AF_UNIX, SOCK_STREAM, 0);
+    const int other = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_EQ(connect(slow, (sockaddr *) &addr, sizeof(addr)), 0);
+    ASSERT_EQ(connect(other, (sockaddr *) &addr, sizeof(addr)), 0);
+    timeval timeout = { 10, 0 };
+    setsockopt(other, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // answers to slow client fill its socket buffer, it never reads them
+    std::string big("\x0a\xe0\xa7\x12", 4);
+    big.append(300000, 'x');
+    for (unsigned i = 0; i < 8; ++i) {
+        ASSERT_TRUE(Server::writeFrame(slow, i, Server::opPrint, big.data(), big.length()));
+    }
+    Server::Frame frame;
+    ASSERT_TRUE(Server::writeFrame(other, 1, Server::opPrint, "\x08\x96\x01", 3));
+    ASSERT_TRUE(Server::readFrame(other, frame));
+    ASSERT_EQ(frame.code, Server::stOk);
+    ASSERT_EQ(std::string(frame.body.begin(), frame.body.end()), "1: 150\n");
+
+    close(slow);
+    close(other);
+    server.stop();
+    thread.join();
+}
+
+// minimal ZIP writer for archive tests
+class ZipBuilder {
+public:
+    void add(const std::string & name, const std::string & data, bool deflate) {
+        std::string stored = data;
+        if (deflate) {
+            z_stream zs;
+            memset(&zs, 0, sizeof(zs));
+            deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+            stored.resize(deflateBound(&zs, data.size()));
+            zs.next_in = (Bytef *) data.data();
+            zs.avail_in = data.size();
+            zs.next_out = (Bytef *) &stored[0];
+            zs.avail_out = stored.size();
+            ::deflate(&zs, Z_FINISH);
+            stored.resize(zs.total_out);
+            deflateEnd(&zs);
+        }
+        std::string header;
+        put(header, 0x04034b50, 4); put(header, 20, 2); put(header, 0, 2);
+        put(header, deflate ? 8 : 0, 2); put(header, 0, 4);
+        put(header, crc32(0, (const Bytef *) data.data(), data.size()), 4);
+        put(header, stored.size(), 4); put(header, data.size(), 4);
+        put(header, name.size(), 2); put(header, 0, 2);
+
+        put(mDirectory, 0x02014b50, 4); put(mDirectory, 20, 2);
+        mDirectory.append(header, 4, 26);
+        put(mDirectory, 0, 2); put(mDirectory, 0, 2); put(mDirectory, 0, 2); put(mDirectory, 0, 4);
+        put(mDirectory, mData.size(), 4);
+        mDirectory += name;
+
+        mData += header + name + stored;
+        mEntries += 1;
+    }
+
+    std::string finish() {
+        std::string zip = mData + mDirectory;
+        put(zip, 0x06054b50, 4); put(zip, 0, 2); put(zip, 0, 2);
+        put(zip, mEntries, 2); put(zip, mEntries, 2);
+        put(zip, mDirectory.size(), 4); put(zip, mData.size(), 4); put(zip, 0, 2);
+        return zip;
+    }
+
+private:
+    static void put(std::string & s, uint32_t v, int n) {
+        for (int i = 0; i < n; ++i) s.push_back((char) (v >> (8 * i)));
+    }
+
+    std::string mData;
+    std::string mDirectory;
+    unsigned mEntries = 0;
+};
+
+static std::string javaUtf8(const std::string & bytes) {
+    std::string mutf8;
+    for (size_t i = 0; i < bytes.size(); ++i) {
+        const unsigned char ch = bytes[i];
+        if (ch && ch < 0x80) {
+            mutf8.push_back(ch);
+        } else {
+            mutf8.push_back((char) (0xc0 | (ch >> 6)));
+            mutf8.push_back((char) (0x80 | (ch & 0x3f)));
+        }
+    }
+    std::string constant("\x01", 1);
+    constant.push_back((char) (mutf8.size() >> 8));
+    constant.push_back((char) mutf8.size());
+    return constant + mutf8;
+}
+
+TEST(ArchiveScanner, collect) {
+    const char data[] = "\n\x11\x61\x64\x64ressbook.proto\x12\x08tutorial\"\xda\x01\n\x06Person\x12\x0c\n\x04name\x18\x01 \x02(\t\x12\n\n\x02id\x18\x02 \x02(\x05\x12\r\n\x05\x65mail\x18\x03 \x01(\t\x12+\n\x05phone\x18\x04 \x03(\x0b\x32\x1c.tutorial.Person.PhoneNumber\x1aM\n\x0bPhoneNumber\x12\x0e\n\x06number\x18\x01 \x02(\t\x12.\n\x04type\x18\x02 \x01(\x0e\x32\x1a.tutorial.Person.PhoneType:\x04HOME\"+\n\tPhoneType\x12\n\n\x06MOBILE\x10\x00\x12\x08\n\x04HOME\x10\x01\x12\x08\n\x04WORK\x10\x02\"/\n\x0b\x41\x64\x64ressBook\x12 \n\x06person\x18\x01 \x03(\x0b\x32\x10.tutorial.Person";
+    const std::string descriptor(data, sizeof(data) - 1);
+    const std::string binary = "\x7f" "ELF" + descriptor + std::string(4, '\0');
+
+    // descriptor split into constants of generated class
+    std::string javaClass("\xca\xfe\xba\xbe\x00\x00\x00\x34\x00\x07", 10);
+    javaClass += javaUtf8("AddressBookProtos");
+    javaClass += std::string("\x07\x00\x01", 3);
+    javaClass += javaUtf8(descriptor.substr(0, 100));
+    javaClass += javaUtf8(descriptor.substr(100));
+    javaClass += std::string("\x05\x00\x00\x00\x00\x00\x00\x00\x01", 9);
+    javaClass += javaUtf8("Code");
+
+    ZipBuilder zip;
+    zip.add("lib/armeabi/libstored.so", binary, false);
+    zip.add("res/raw/empty", "", true);
+    zip.add("lib/x86/libdeflated.so", binary, true);
+    zip.add("com/example/AddressBookProtos.class", javaClass, true);
+    const std::string archive = zip.finish();
+    const unsigned char * p = (const unsigned char *) archive.data();
+    ASSERT_TRUE(ZipArchive::isArchive(p, p + archive.size()));
+
+    std::vector< Serialized_pb::Found > found;
+    std::string error;
+    ASSERT_TRUE(ArchiveScanner::collect(p, p + archive.size(), "app.apk", found, error, 2)) << error;
+    ASSERT_EQ(found.size(), 3);
+    ASSERT_EQ(found[0].origin, "app.apk!lib/armeabi/libstored.so");
+    ASSERT_EQ(found[1].origin, "app.apk!lib/x86/libdeflated.so");
+    ASSERT_EQ(found[2].origin, "app.apk!com/example/AddressBookProtos.class");
+    for (size_t i = 0; i < found.size(); ++i) {
+        ASSERT_EQ(found[i].message.view().at(1).asString(), "addressbook.proto");
+        ASSERT_EQ(std::string(found[i].data.begin(), found[i].data.end()), descriptor);
+    }
+}
+
+TEST(ArchiveScanner, largeEntry) {
+    const char data[] = "\n\x11\x61\x64\x64ressbook.proto\x12\x08tutorial\"\x2f\n\x0b\x41\x64\x64ressBook\x12 \n\x06person\x18\x01 \x03(\x0b\x32\x10.tutorial.Person";
+    const std::string descriptor(data, sizeof(data) - 1);
+
+    // around boundaries of 8M windows overlapping by 1M
+    const size_t offsets[] = { 1000, (7 << 20) - 20, (7 << 20) + 100, (8 << 20) - 30, (16 << 20) + 5 };
+    std::string binary(17 << 20, '\0');
+    for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); ++i) {
+        binary.replace(offsets[i], descriptor.size(), descriptor);
+    }
+    ZipBuilder zip;
+    zip.add("lib/x86/libhuge.so", binary, true);
+    const std::string archive = zip.finish();
+    const unsigned char * p = (const unsigned char *) archive.data();
+
+    std::vector< Serialized_pb::Found > found;
+    std::string error;
+    ASSERT_TRUE(ArchiveScanner::collect(p, p + archive.size(), "app.apk", found, error, 1)) << error;
+    ASSERT_EQ(found.size(), sizeof(offsets) / sizeof(offsets[0]));
+    for (size_t i = 0; i < found.size(); ++i) {
+        ASSERT_EQ(std::string(found[i].data.begin(), found[i].data.end()), descriptor);
+    }
+}
+
+TEST(ZipArchive, truncated) {
+    // zip64 locator pointing past the end of a file shorter than its record
+    std::string zip(4, '\0');
+    zip += std::string("PK\x06\x07\0\0\0\0\0\0\0\x10\0\0\0\0\x01\0\0\0", 20);
+    zip += std::string("PK\x05\x06\0\0\0\0\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\0\0", 22);
+    ASSERT_EQ(zip.size(), 46);
+    ZipArchive archive;
+    for (size_t size = 0; size <= zip.size(); ++size) {
+        const unsigned char * p = (const unsigned char *) zip.data();
+        ASSERT_FALSE(archive.open(p + zip.size() - size, p + zip.size()));
+    }
+}
+
+static std::string dexString(const std::string & bytes) {
+    std::string mutf8 = javaUtf8(bytes).substr(3);
+    std::string str;
+    for (size_t size = bytes.size(); ; size >>= 7) {
+        str.push_back((char) ((size & 0x7f) | (size > 0x7f ? 0x80 : 0)));
+        if (size <= 0x7f) break;
+    }
+    return str + mutf8 + std::string(1, '\0');
+}
+
+TEST(DexFile, descriptorData) {
+    const char data[] = "\n\x11\x61\x64\x64ressbook.proto\x12\x08tutorial\"\xda\x01\n\x06Person\x12\x0c\n\x04name\x18\x01 \x02(\t\x12\n\n\x02id\x18\x02 \x02(\x05\x12\r\n\x05\x65mail\x18\x03 \x01(\t\x12+\n\x05phone\x18\x04 \x03(\x0b\x32\x1c.tutorial.Person.PhoneNumber\x1aM\n\x0bPhoneNumber\x12\x0e\n\x06number\x18\x01 \x02(\t\x12.\n\x04type\x18\x02 \x01(\x0e\x32\x1a.tutorial.Person.PhoneType:\x04HOME\"+\n\tPhoneType\x12\n\n\x06MOBILE\x10\x00\x12\x08\n\x04HOME\x10\x01\x12\x08\n\x04WORK\x10\x02\"/\n\x0b\x41\x64\x64ressBook\x12 \n\x06person\x18\x01 \x03(\x0b\x32\x10.tutorial.Person";
+    const std::string small(data, sizeof(data) - 1);
+
+    // large descriptor is split by protoc into parts of 16000 bytes
+    std::string large("\n\x0blarge.proto\x12\x05large", 20);
+    for (unsigned i = 0; large.size() < 40000; ++i) {
+        char name[16];
+        snprintf(name, sizeof(name), "Message%05u", i);
+        large += std::string("\"\x0e\n\x0c", 4) + name;
+    }
+    std::vector<std::string> strings;
+    strings.push_back("Ljava/lang/Object;");
+    strings.push_back(large.substr(32000));
+    strings.push_back(small);
+    strings.push_back(large.substr(16000, 16000));
+    strings.push_back(large.substr(0, 16000));
+
+    std::string dex("dex\n035\0", 8);
+    dex.resize(0x70);
+    const uint32_t count = strings.size(), offset = 0x70;
+    memcpy(&dex[56], &count, 4);
+    memcpy(&dex[60], &offset, 4);
+    std::string pool;
+    for (size_t i = 0; i < strings.size(); ++i) {
+        const uint32_t stringOffset = 0x70 + 4 * count + pool.size();
+        dex.append((const char *) &stringOffset, 4);
+        pool += dexString(strings[i]);
+    }
+    dex += pool;
+
+    const unsigned char * p = (const unsigned char *) dex.data();
+    ASSERT_TRUE(DexFile::isDex(p, p + dex.size()));
+    std::vector<unsigned char> out;
+    ASSERT_TRUE(DexFile::descriptorData(p, p + dex.size(), out));
+    std::vector< Serialized_pb::Found > found;
+    Serialized_pb::collect(out.data(), out.data() + out.size(), found);
+    ASSERT_EQ(found.size(), 2);
+    ASSERT_EQ(std::string(found[0].data.begin(), found[0].data.end()), small);
+    ASSERT_EQ(std::string(found[1].data.begin(), found[1].data.end()), large);
+}
+
+TEST(ProcessScanner, collect) {
+    // descriptor with unique name is built on the heap of this process
+    std::string name("selfscan");
+    name += ".proto";
+    std::string descriptor = "\n" + std::string(1, (char) name.size()) + name +
+                             std::string("\x12\x04test\"\x08\n\x06Record", 16);
+    std::vector<unsigned char> heap(4, 0xff);
+    heap.insert(heap.end(), descriptor.begin(), descriptor.end());
+    heap.resize(heap.size() + 4, 0);
+
+    std::vector< Serialized_pb::Found > found;
+    std::string error;
+    ASSERT_TRUE(ProcessScanner::collect(getpid(), found, error, 4)) << error;
+    const std::string prefix = "pid " + std::to_string(getpid()) + " 0x";
+    bool isFound = false;
+    for (size_t i = 0; i < found.size(); ++i) {
+        ASSERT_EQ(found[i].origin.compare(0, prefix.size(), prefix), 0);
+        // copies followed by other data may be found as well
+        if (std::string(found[i].data.begin(), found[i].data.end()) == descriptor) {
+            isFound = true;
+        }
+    }
+    ASSERT_TRUE(isFound);
+}
+
+TEST(MessageFinder, find) {
+    // messages in pseudo random data
+    std::vector<unsigned char> data(1 << 18);
+    uint32_t x = 2463534242u;
+    for (size_t i = 0; i < data.size(); ++i) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        data[i] = (unsigned char) x;
+    }
+    const size_t offsets[] = { 100, 70000, 200000 };
+    for (size_t i = 0; i < 3; ++i) {
+        // zeros can't be a part of preceding field, so starts are exact
+        data[offsets[i] - 2] = data[offsets[i] - 1] = 0;
+        memcpy(&data[offsets[i]], addressbook_dat, sizeof(addressbook_dat));
+    }
+
+    for (unsigned threads = 1; threads <= 4; threads += 3) {
+        std::vector<MessageFinder::Region> regions = MessageFinder::find(data.data(), data.data() + data.size(), threads);
+        ASSERT_EQ(regions.size(), 3);
+        for (size_t i = 0; i < 3; ++i) {
+            ASSERT_EQ(regions[i].offset, offsets[i]);
+            ASSERT_EQ(regions[i].size, sizeof(addressbook_dat));
+            ASSERT_GE(regions[i].confidence, 0.8);
+        }
+    }
+}
+
+TEST(MessageFinder, filler) {
+    // runs of repeated fields: fixed64 of 'a' and varints of spaces
+    for (char filler = 'a'; filler != ' '; filler = ' ') {
+        std::vector<unsigned char> data(1 << 20, filler);
+        const size_t offset = 600000;
+        data[offset - 2] = data[offset - 1] = 0;
+        memcpy(&data[offset], addressbook_dat, sizeof(addressbook_dat));
+        data[offset + sizeof(addressbook_dat)] = 0;
+        std::vector<MessageFinder::Region> regions = MessageFinder::find(data.data(), data.data() + data.size(), 1);
+        ASSERT_EQ(regions.size(), 1);
+        ASSERT_EQ(regions[0].offset, offset);
+        ASSERT_EQ(regions[0].size, sizeof(addressbook_dat));
+    }
+}
+
+TEST(MessageFinder, wrappers) {
+    // message inside 20000 messages wrapping single message each, every
+    // header is a candidate and wrappers are unwrapped a few levels only
+    std::vector<unsigned char> data;
+    std::vector<std::string> headers; // inside out
+    size_t size = sizeof(addressbook_dat);
+    for (int i = 0; i < 20000; ++i) {
+        unsigned char header[11] = { 0x0a };
+        unsigned char * h = RawMessage::writeVarint(size, header + 1, header + sizeof(header));
+        headers.push_back(std::string(header, h));
+        size += h - header;
+    }
+    for (std::vector<std::string>::reverse_iterator it = headers.rbegin(); it != headers.rend(); ++it) {
+        data.insert(data.end(), it->begin(), it->end());
+    }
+    data.insert(data.end(), addressbook_dat, addressbook_dat + sizeof(addressbook_dat));
+
+    Limits::Budget budget;
+    budget.timeMs = 5000;
+    Limits::Scope scope(budget);
+    std::vector<MessageFinder::Region> regions = MessageFinder::find(data.data(), data.data() + data.size(), 1);
+    ASSERT_EQ(Limits::exceeded(), Limits::lkNone);
+    ASSERT_EQ(regions.size(), 1);
+    ASSERT_EQ(regions[0].offset + regions[0].size, data.size());
+}
+
+TEST(Catalogue, update) {
+    const char descriptor[] = "\n\x11\x61\x64\x64ressbook.proto\x12\x08tutorial\"\xda\x01\n\x06Person\x12\x0c\n\x04name\x18\x01 \x02(\t\x12\n\n\x02id\x18\x02 \x02(\x05\x12\r\n\x05\x65mail\x18\x03 \x01(\t\x12+\n\x05phone\x18\x04 \x03(\x0b\x32\x1c.tutorial.Person.PhoneNumber\x1aM\n\x0bPhoneNumber\x12\x0e\n\x06number\x18\x01 \x02(\t\x12.\n\x04type\x18\x02 \x01(\x0e\x32\x1a.tutorial.Person.PhoneType:\x04HOME\"+\n\tPhoneType\x12\n\n\x06MOBILE\x10\x00\x12\x08\n\x04HOME\x10\x01\x12\x08\n\x04WORK\x10\x02\"/\n\x0b\x41\x64\x64ressBook\x12 \n\x06person\x18\x01 \x03(\x0b\x32\x10.tutorial.Person";
+    // binary of pseudo random bytes with descriptor in the middle
+    std::string binary(3 << 20, '\0');
+    uint32_t x = 2463534242u;
+    for (size_t i = 0; i < binary.size(); ++i) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        binary[i] = (char) x;
+    }
+    binary.replace(2 << 20, sizeof(descriptor) + 1, std::string(descriptor, sizeof(descriptor)).insert(0, 1, '\0'));
+
+    const std::string path = "/tmp/protodec-tests-" + std::to_string(getpid()) + ".so";
+    const std::string set = path + ".pb";
+    std::ofstream(path.c_str(), std::ios::binary) << binary;
+    Catalogue catalogue(2);
+    Catalogue::Update update = catalogue.update(std::vector<std::string>(1, path));
+    ASSERT_TRUE(update.changed);
+    ASSERT_EQ(update.files, 1u);
+    ASSERT_GT(update.scanned, 2u);
+    ASSERT_EQ(catalogue.descriptors().size(), 1u);
+    ASSERT_EQ(*catalogue.descriptors()[0], std::vector<unsigned char>(descriptor, descriptor + sizeof(descriptor) - 1));
+
+    // the same file again and the one relinked with bytes inserted
+    update = catalogue.update(std::vector<std::string>(1, path));
+    ASSERT_FALSE(update.changed);
+    ASSERT_EQ(update.scanned, 0u);
+    binary.insert(1 << 20, 1000, 'x');
+    std::ofstream(path.c_str(), std::ios::binary) << binary;
+    update = catalogue.update(std::vector<std::string>(1, path));
+    ASSERT_TRUE(update.changed);
+    ASSERT_LE(update.scanned, 3u);
+    ASSERT_GT(update.reused, 0u);
+    ASSERT_EQ(catalogue.descriptors().size(), 1u);
+
+    std::string error;
+    ASSERT_TRUE(catalogue.write(set, error)) << error;
+    std::vector<unsigned char> written;
+    readFile(written, set.c_str());
+    ASSERT_EQ(written.size(), sizeof(descriptor) - 1 + 3);
+
+    unlink(path.c_str());
+    update = catalogue.update(std::vector<std::string>(1, path));
+    ASSERT_TRUE(update.changed);
+    ASSERT_TRUE(catalogue.descriptors().empty());
+    unlink(set.c_str());
+}
+
+TEST(FieldSelector, select) {
+    FieldSelector selector;
+    ASSERT_FALSE(selector.add("1.x"));
+    ASSERT_FALSE(selector.add(""));
+    ASSERT_TRUE(selector.add("1.1"));
+    ASSERT_TRUE(selector.add("1.4"));
+    ASSERT_TRUE(selector.add("*.*.2"));
+    ASSERT_TRUE(selector.add("1.3.1"));
+
+    std::stringstream ss;
+    ASSERT_TRUE(selector.select(addressbook_dat, addressbook_dat + sizeof(addressbook_dat), ss));
+    ASSERT_EQ(ss.str(),
+        "1.1: \"John Doe\"\n"
+        "1.4 {\n"
+        "\t1: \"555-4321\"\n"
+        "\t2: 1\n"
+        "}\n"
+        "1.4.2: 1\n");
+}
+
+TEST(ColumnWriter, export) {
+    // two length delimited records: {1: "a\"b", 2: 150, 3 {1: -1 zigzag}} and {2: 7}
+    const unsigned char stream[] = {
+        0x0c, 0x0a, 0x03, 'a', '"', 'b', 0x10, 0x96, 0x01, 0x1a, 0x02, 0x08, 0x01,
+        0x02, 0x10, 0x07
+    };
+    std::vector<RecordReader::Record> records;
+    ASSERT_TRUE(RecordReader::delimited(stream, stream + sizeof(stream), [&](const RecordReader::Record & r) {
+        records.push_back(r);
+    }));
+    ASSERT_EQ(records.size(), 2u);
+    ASSERT_FALSE(RecordReader::delimited(stream, stream + sizeof(stream) - 1, [](const RecordReader::Record &) {}));
+
+    std::vector<ColumnWriter::Column> columns;
+    ColumnWriter::columns(records, columns);
+    ASSERT_EQ(columns.size(), 3u);
+    ASSERT_EQ(columns[2].name, "3.1");
+    columns[2].decode = ColumnWriter::dZigzag;
+
+    std::stringstream csv;
+    ColumnWriter writer(csv, ColumnWriter::fmtCsv, columns);
+    for (size_t i = 0; i < records.size(); ++i) {
+        writer.append(records[i].first, records[i].second);
+    }
+    writer.finish();
+    ASSERT_EQ(writer.rows(), 2u);
+    ASSERT_EQ(csv.str(),
+        "1,2,3.1\n"
+        "\"a\"\"b\",150,-1\n"
+        ",7,\n");
+
+    // batches of one row: header, two batches and the end mark
+    std::stringstream bin;
+    ColumnWriter batches(bin, ColumnWriter::fmtBinary, columns, 1);
+    for (size_t i = 0; i < records.size(); ++i) {
+        batches.append(records[i].first, records[i].second);
+    }
+    batches.finish();
+    const std::string data = bin.str();
+    ASSERT_EQ(data.compare(0, 8, "PDCOLS1\n"), 0);
+    ASSERT_EQ(data[12], (char) ColumnWriter::ctString);
+    ASSERT_EQ(data.size() % 8, 0u);
+    ASSERT_EQ(data.compare(data.size() - 8, 8, std::string(8, '\0')), 0);
+}
+
+TEST(ColumnWriter, unsigned) {
+    // {1: timestamp, 2: counter, 3: small or large} records, field 3 is
+    // predicted as sint by Schema but exported as stored
+    std::vector<unsigned char> stream;
+    unsigned char record[24];
+    for (int i = 0; i < 50; ++i) {
+        unsigned char * p = record;
+        *p++ = 0x08;
+        p = RawMessage::writeVarint(1700000000 + 37 * i, p, record + sizeof(record));
+        *p++ = 0x10;
+        p = RawMessage::writeVarint(i, p, record + sizeof(record));
+        *p++ = 0x18;
+        p = RawMessage::writeVarint(i % 10 == 9 ? 2000 + i / 10 : i % 10, p, record + sizeof(record));
+        stream.push_back((unsigned char) (p - record));
+        stream.insert(stream.end(), record, p);
+    }
+    std::vector<RecordReader::Record> records;
+    ASSERT_TRUE(RecordReader::delimited(stream.data(), stream.data() + stream.size(), [&](const RecordReader::Record & r) {
+        records.push_back(r);
+    }));
+    std::vector<ColumnWriter::Column> columns;
+    ColumnWriter::columns(records, columns);
+    ASSERT_EQ(columns.size(), 3u);
+
+    std::stringstream csv, expected;
+    ColumnWriter writer(csv, ColumnWriter::fmtCsv, columns);
+    expected << "1,2,3\n";
+    for (size_t i = 0; i < records.size(); ++i) {
+        writer.append(records[i].first, records[i].second);
+        expected << 1700000000 + 37 * i << "," << i << "," << (i % 10 == 9 ? 2000 + i / 10 : i % 10) << "\n";
+    }
+    writer.finish();
+    ASSERT_EQ(csv.str(), expected.str());
+}
+
+TEST(ColumnWriter, negative) {
+    // {1: -1, 2: 5, 3: "abc", 4: 0.1 fixed64}
+    const unsigned char stream[] = {
+        0x1b, 0x08, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01,
+        0x10, 0x05, 0x1a, 0x03, 'a', 'b', 'c',
+        0x21, 0x9a, 0x99, 0x99, 0x99, 0x99, 0x99, 0xb9, 0x3f
+    };
+    std::vector<RecordReader::Record> records;
+    ASSERT_TRUE(RecordReader::delimited(stream, stream + sizeof(stream), [&](const RecordReader::Record & r) {
+        records.push_back(r);
+    }));
+    std::vector<ColumnWriter::Column> columns;
+    ColumnWriter::columns(records, columns);
+    ASSERT_EQ(columns.size(), 4u);
+    columns[3].decode = ColumnWriter::dDouble;
+
+    std::stringstream csv;
+    ColumnWriter writer(csv, ColumnWriter::fmtCsv, columns);
+    writer.append(records[0].first, records[0].second);
+    writer.finish();
+    ASSERT_EQ(csv.str(),
+        "1,2,3,4\n"
+        "-1,5,\"abc\",0.10000000000000001\n");
+}
+
+TEST(MessageDiff, diff) {
+    // 1: [{1: "a", 2: 1}, {1: "b", 2: 2}, {1: "c", 2: 3}], 2: 5
+    const unsigned char a[] = {
+        0x0a, 0x05, 0x0a, 0x01, 'a', 0x10, 0x01,
+        0x0a, 0x05, 0x0a, 0x01, 'b', 0x10, 0x02,
+        0x0a, 0x05, 0x0a, 0x01, 'c', 0x10, 0x03,
+        0x10, 0x05
+    };
+    // first element removed, last one changed, 2 changed, 3 added
+    const unsigned char b[] = {
+        0x0a, 0x05, 0x0a, 0x01, 'b', 0x10, 0x02,
+        0x0a, 0x05, 0x0a, 0x01, 'c', 0x10, 0x04,
+        0x10, 0x06,
+        0x18, 0x07
+    };
+    RawMessage ma, mb;
+    ASSERT_TRUE(ma.parse(a, a + sizeof(a)));
+    ASSERT_TRUE(mb.parse(b, b + sizeof(b)));
+
+    std::stringstream ss;
+    ASSERT_FALSE(MessageDiff::diff(ma, ma, ss));
+    ASSERT_TRUE(ss.str().empty());
+
+    ASSERT_TRUE(MessageDiff::diff(ma, mb, ss));
+    ASSERT_EQ(ss.str(),
+        "- 1[0] {\n"
+        "\t1: \"a\"\n"
+        "\t2: 1\n"
+        "}\n"
+        "~ 1[2].2: 3 -> 4\n"
+        "~ 2: 5 -> 6\n"
+        "+ 3: 7\n");
+}
+
+TEST(MessageDiff, deep) {
+    // {1: {1: ... {1: value} ...}} nested 20000 times, values differ
+    std::vector<unsigned char> data[2];
+    for (int i = 0; i < 2; ++i) {
+        data[i].push_back(0x08);
+        data[i].push_back((unsigned char) (i + 1));
+        // headers are collected inside out, reversed and put in front once
+        std::vector<unsigned char> headers;
+        size_t size = data[i].size();
+        for (int level = 0; level < 20000; ++level) {
+            unsigned char header[16] = { 0x0a };
+            unsigned char * h = RawMessage::writeVarint(size, header + 1, header + sizeof(header));
+            headers.insert(headers.end(), std::reverse_iterator<unsigned char *>(h), std::reverse_iterator<unsigned char *>(header));
+            size += h - header;
+        }
+        data[i].insert(data[i].begin(), headers.rbegin(), headers.rend());
+    }
+    RawMessage a, b;
+    ASSERT_TRUE(a.parse(data[0].data(), data[0].data() + data[0].size()));
+    ASSERT_TRUE(b.parse(data[1].data(), data[1].data() + data[1].size()));
+
+    std::stringstream ss;
+    ASSERT_TRUE(MessageDiff::diff(a, b, ss));
+    std::string expected;
+    for (int level = 0; level <= 20000; ++level) {
+        expected += level ? ".1" : "~ 1";
+    }
+    ASSERT_EQ(ss.str(), expected + ": 1 -> 2\n");
+
+    // deadline which has passed stops it
+    Limits::Scope test;
+    const Limits::Request request = { Limits::Budget(), 1 };
+    Limits::Scope scope(request);
+    std::stringstream partial;
+    ASSERT_FALSE(MessageDiff::diff(a, b, partial));
+    ASSERT_EQ(Limits::exceeded(), Limits::lkTime);
+}
+
+TEST(OffsetIndex, find) {
+    RawMessage msg;
+    OffsetIndex index;
+    ASSERT_TRUE(msg.parse(addressbook_dat, addressbook_dat + sizeof(addressbook_dat), &index));
+    ASSERT_EQ(index.fields().size(), 7u);
+
+    const uint32_t email = index.find(0x20);
+    ASSERT_NE(email, (uint32_t) OffsetIndex::kNone);
+    ASSERT_EQ(index.path(email), "1.3");
+    ASSERT_EQ(index.fields()[email].start, 0x0fu);
+    ASSERT_EQ(index.fields()[email].value, 0x11u);
+    ASSERT_EQ(index.fields()[email].end, 0x21u);
+    ASSERT_EQ(index.path(index.find(0x22)), "1.4");
+    ASSERT_EQ(index.path(index.find(0x2e)), "1.4.2");
+    ASSERT_EQ(index.find(sizeof(addressbook_dat)), (uint32_t) OffsetIndex::kNone);
+
+    std::stringstream ss;
+    Annotator::print(addressbook_dat, addressbook_dat + sizeof(addressbook_dat), index, ss);
+    std::string line;
+    std::getline(ss, line);
+    ASSERT_EQ(line, "00000000  0a 2d" + std::string(3 * 14 + 2, ' ') + "1 {");
+    std::getline(ss, line);
+    ASSERT_EQ(line.substr(line.find("  1.1")), "  1.1: \"John Doe\"");
+}
+
+TEST(RawMessage, recycling) {
+    RawMessage msg;
+    ASSERT_TRUE(msg.parse(addressbook_dat, addressbook_dat + sizeof(addressbook_dat)));
+
+    // nodes of the previous tree are taken by the next parse
+    const Stats before = Stats::total();
+    ASSERT_TRUE(msg.parse(addressbook_dat, addressbook_dat + sizeof(addressbook_dat)));
+    const Stats after = Stats::total();
+    const uint64_t made = after.counter(Stats::scNodesAllocated) - before.counter(Stats::scNodesAllocated);
+    ASSERT_EQ(made, 8u);
+    ASSERT_EQ(after.counter(Stats::scNodesRecycled) - before.counter(Stats::scNodesRecycled), made);
+
+    std::stringstream ss;
+    msg.print(ss);
+    ASSERT_EQ(ss.str(), "1 {\n"
+                        "\t1: \"John Doe\"\n"
+                        "\t2: 1234\n"
+                        "\t3: \"jdoe@example.com\"\n"
+                        "\t4 {\n"
+                        "\t\t1: \"555-4321\"\n"
+                        "\t\t2: 1\n"
+                        "\t}\n"
+                        "}\n");
+}
+
+TEST(RawMessage, cacheBound) {
+    std::vector<unsigned char> large;
+    for (int i = 0; i < 50000; ++i) {
+        large.push_back(0x08);
+        large.push_back(0x01);
+    }
+    const unsigned char small[] = { 0x08, 0x01 };
+    const auto recycled = [&large](RawMessage & msg) {
+        const uint64_t before = Stats::total().counter(Stats::scNodesRecycled);
+        EXPECT_TRUE(msg.parse(large.data(), large.data() + large.size()));
+        return Stats::total().counter(Stats::scNodesRecycled) - before;
+    };
+    RawMessage msg;
+    ASSERT_TRUE(msg.parse(large.data(), large.data() + large.size()));
+    ASSERT_GE(recycled(msg), 50000u);
+
+    // nodes of a large tree aren't kept through many small parses
+    for (int i = 0; i < 20; ++i) {
+        ASSERT_TRUE(msg.parse(small, small + sizeof(small)));
+    }
+    ASSERT_LT(recycled(msg), 100u);
+
+    // nor after the caches are released
+    msg = RawMessage();
+    RawMessage::releaseCaches();
+    ASSERT_EQ(recycled(msg), 0u);
+}
+
+TEST(RawMessage, view) {
+    RawMessage msg;
+    ASSERT_TRUE(msg.parse(addressbook_dat, addressbook_dat + sizeof(addressbook_dat)));
+    const RawMessage::View person = msg.view().field(1);
+    ASSERT_TRUE(person.isMessage());
+    ASSERT_EQ(person.getString(1), "John Doe");
+    ASSERT_EQ(person.getInt(2), 1234);
+    ASSERT_EQ(&person.at(1).asString(), &msg[1]->asMap().at(1)->asString());
+    ASSERT_FALSE(person.field(9).valid());
+    ASSERT_EQ(person.getInt(9, -1), -1);
+    ASSERT_THROW(person.at(9), std::logic_error);
+
+    size_t phones = 0;
+    person.forEach(4, [&](const RawMessage::View & phone) {
+        ASSERT_EQ(phone.getString(1), "555-4321");
+        ++phones;
+    });
+    ASSERT_EQ(phones, 1u);
+
+    // schema of shared message is the same from every thread
+    std::string schemas[4];
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) {
+        threads.push_back(std::thread([&msg, &schemas, i]() {
+            std::stringstream ss;
+            Schema::print(msg, ss);
+            schemas[i] = ss.str();
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+    for (int i = 1; i < 4; ++i) {
+        ASSERT_EQ(schemas[i], schemas[0]);
+    }
+}
+
 int main(int argc, char ** argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -0,0 +1,65 @@
+#! /usr/bin/python3
+# Tests of Python module, run after building it in place:
+#   python setup.py build_ext --inplace && python -m unittest tests/test_pyprotodec.py
+import unittest
+
+import protodec
+
+ADDRESSBOOK = (
+	b'\n\x11addressbook.proto\x12\x08tutorial"/\n\x0bAddressBook'
+	b'\x12 \n\x06person\x18\x01 \x03(\x0b2\x10.tutorial.Person'
+)
+
+def varint(value):
+	out = bytearray()
+	while True:
+		out.append((value & 0x7f) | (0x80 if value > 0x7f else 0))
+		value >>= 7
+		if not value:
+			return bytes(out)
+
+def nested(data, depth):
+	# headers are collected inside out and joined once
+	headers = []
+	size = len(data)
+	for _ in range(depth):
+		header = b'\x0a' + varint(size)
+		headers.append(header)
+		size += len(header)
+	return b''.join(reversed(headers)) + data
+
+class TestProtodec(unittest.TestCase):
+	def test_parse(self):
+		# {1: 150, 2: ["abc", "d"], 3: {1: -1}}
+		data = b'\x08\x96\x01\x12\x03abc\x12\x01d\x1a\x0b\x08' + b'\xff' * 9 + b'\x01'
+		self.assertEqual(protodec.parse(data), {1: 150, 2: [b'abc', b'd'], 3: {1: -1}})
+		self.assertEqual(protodec.parse(bytearray(data)), protodec.parse(memoryview(data)))
+
+	def test_parse_deep(self):
+		msg = protodec.parse(nested(b'\x08\x01', 200000))
+		depth = 0
+		while 1 in msg and isinstance(msg[1], dict):
+			msg = msg[1]
+			depth += 1
+		self.assertEqual(depth, 200000)
+		self.assertEqual(msg, {1: 1})
+
+	def test_errors(self):
+		self.assertRaises(ValueError, protodec.parse, b'\x0a\x05ab')
+		self.assertRaises(ValueError, protodec.print, b'\x0a\x05ab')
+		self.assertRaises(TypeError, protodec.parse, 'text')
+
+	def test_text(self):
+		self.assertIn('1: 150', protodec.print(b'\x08\x96\x01'))
+		self.assertIn('int', protodec.schema(b'\x08\x96\x01'))
+
+	def test_grab(self):
+		found = protodec.grab(b'\x7fELF' + ADDRESSBOOK + b'\x00' * 4)
+		self.assertEqual(len(found), 1)
+		self.assertEqual(found[0]['name'], 'addressbook.proto')
+		self.assertEqual(found[0]['offset'], 4)
+		self.assertEqual(found[0]['size'], len(ADDRESSBOOK))
+		self.assertIn('message AddressBook', found[0]['proto'])
+
+if __name__ == '__main__':
+	unittest.main()